@@ -0,0 +1,466 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "closure_cache.h"
+
+#define CLOSURE_CACHE_NAME ".closure_cache"
+#define CLOSURE_CACHE_MAGIC "configer-closure-cache 1"
+#define STAMP_SUFFIX ".stamp"
+#define STAMP_MAGIC "configer-stamp 1"
+#define LD_CACHE_PATH "/etc/ld.so.cache"
+#define LINE_MAX_LEN (PATH_MAX + 256)
+
+static void out_of_memory(void);
+static size_t entry_slot(const ClosureCache *cache, const char *executable);
+static void cache_index_grow(ClosureCache *cache);
+static int read_stamped_line(char *line, const char *prefix, FileStamp *stamp, int *count, const char **path);
+static void write_stamped_line(FILE *fp, const char *prefix, const FileStamp *stamp, int count, const char *path);
+static int stamp_still_valid(const char *path, const FileStamp *stamp);
+static int absolute_path(const char *path, char *buf, size_t size);
+
+static void out_of_memory(void) {
+    fprintf(stderr, "Memory allocation failed\n");
+    exit(EXIT_FAILURE);
+}
+
+/**
+ * Fills stamp with the stat(2) identity of path. A missing file has an all-zero stamp.
+ */
+int file_stamp_get(const char *path, FileStamp *stamp) {
+    struct stat st;
+
+    memset(stamp, 0, sizeof(*stamp));
+    if (stat(path, &st) != 0) {
+        return -1;
+    }
+    stamp->dev = st.st_dev;
+    stamp->ino = st.st_ino;
+    stamp->size = st.st_size;
+    stamp->mtime_sec = st.st_mtim.tv_sec;
+    stamp->mtime_nsec = st.st_mtim.tv_nsec;
+    stamp->ctime_sec = st.st_ctim.tv_sec;
+    stamp->ctime_nsec = st.st_ctim.tv_nsec;
+    return 0;
+}
+
+int file_stamp_equal(const FileStamp *a, const FileStamp *b) {
+    return a->dev == b->dev && a->ino == b->ino && a->size == b->size &&
+           a->mtime_sec == b->mtime_sec && a->mtime_nsec == b->mtime_nsec &&
+           a->ctime_sec == b->ctime_sec && a->ctime_nsec == b->ctime_nsec;
+}
+
+static int stamp_still_valid(const char *path, const FileStamp *stamp) {
+    FileStamp now;
+
+    file_stamp_get(path, &now);
+    return file_stamp_equal(&now, stamp);
+}
+
+/**
+ * Parses "<prefix> <count> <dev> <ino> <size> <mtime> <mtime_ns> <ctime> <ctime_ns> <path>".
+ * count is only present when count is not NULL. The path runs to the end of the line.
+ */
+static int read_stamped_line(char *line, const char *prefix, FileStamp *stamp, int *count, const char **path) {
+    size_t prefix_len = strlen(prefix);
+    int consumed = 0;
+    char *rest;
+
+    if (strncmp(line, prefix, prefix_len) != 0 || line[prefix_len] != ' ') return -1;
+    rest = line + prefix_len + 1;
+    if (count != NULL) {
+        if (sscanf(rest, "%d %n", count, &consumed) != 1 || *count < 0) return -1;
+        rest += consumed;
+    }
+    if (sscanf(rest, "%llu %llu %lld %lld %ld %lld %ld %n", &stamp->dev, &stamp->ino, &stamp->size,
+               &stamp->mtime_sec, &stamp->mtime_nsec, &stamp->ctime_sec, &stamp->ctime_nsec, &consumed) != 7) {
+        return -1;
+    }
+    rest += consumed;
+    rest[strcspn(rest, "\n")] = '\0';
+    if (*rest != '/') return -1;
+    *path = rest;
+    return 0;
+}
+
+static void write_stamped_line(FILE *fp, const char *prefix, const FileStamp *stamp, int count, const char *path) {
+    fprintf(fp, "%s ", prefix);
+    if (count >= 0) fprintf(fp, "%d ", count);
+    fprintf(fp, "%llu %llu %lld %lld %ld %lld %ld %s\n", stamp->dev, stamp->ino, stamp->size,
+            stamp->mtime_sec, stamp->mtime_nsec, stamp->ctime_sec, stamp->ctime_nsec, path);
+}
+
+static size_t entry_slot(const ClosureCache *cache, const char *executable) {
+    size_t mask = cache->slot_count - 1;
+    size_t i = (size_t)(((uint64_t)(uintptr_t)executable * 0x9e3779b97f4a7c15ULL) >> 20) & mask;
+
+    while (cache->slots[i] >= 0 && cache->entries[cache->slots[i]].executable != executable) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+static void cache_index_grow(ClosureCache *cache) {
+    size_t slot_count = cache->slot_count ? cache->slot_count * 2 : 256;
+
+    free(cache->slots);
+    cache->slots = malloc(sizeof(int) * slot_count);
+    if (cache->slots == NULL) out_of_memory();
+    memset(cache->slots, 0xff, sizeof(int) * slot_count);
+    cache->slot_count = slot_count;
+    for (int i = 0; i < cache->count; i++) {
+        cache->slots[entry_slot(cache, cache->entries[i].executable)] = i;
+    }
+}
+
+/**
+ * Loads the closure cache kept in cache_dir. A missing or unreadable cache, or one
+ * resolved against a different ld.so.cache, simply starts empty.
+ */
+void closure_cache_load(ClosureCache *cache, const char *cache_dir, StringArena *arena) {
+    char line[LINE_MAX_LEN];
+    FileStamp ld_cache;
+    ClosureEntry *entry = NULL;
+    int remaining = 0;
+    const char *path;
+    FILE *fp;
+
+    memset(cache, 0, sizeof(*cache));
+    cache->arena = arena;
+    snprintf(cache->path, sizeof(cache->path), "%s/%s", cache_dir, CLOSURE_CACHE_NAME);
+    file_stamp_get(LD_CACHE_PATH, &cache->ld_cache);
+    cache_index_grow(cache);
+
+    fp = fopen(cache->path, "r");
+    if (fp == NULL) return;
+
+    if (fgets(line, sizeof(line), fp) == NULL || strncmp(line, CLOSURE_CACHE_MAGIC "\n", sizeof(line)) != 0 ||
+        fgets(line, sizeof(line), fp) == NULL ||
+        read_stamped_line(line, "ldcache", &ld_cache, NULL, &path) != 0 ||
+        !file_stamp_equal(&ld_cache, &cache->ld_cache)) {
+        // Library search results may differ: every closure has to be resolved again
+        fclose(fp);
+        cache->dirty = 1;
+        return;
+    }
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        FileStamp stamp;
+        int count;
+
+        if (remaining > 0) {
+            if (read_stamped_line(line, "dep", &stamp, NULL, &path) != 0) {
+                cache->dirty = 1;
+                break;
+            }
+            entry->deps[entry->dep_count].path = arena_intern(arena, path);
+            entry->deps[entry->dep_count].stamp = stamp;
+            entry->dep_count++;
+            remaining--;
+            continue;
+        }
+        if (read_stamped_line(line, "exe", &stamp, &count, &path) != 0) {
+            cache->dirty = 1;
+            break;
+        }
+
+        if (cache->count == cache->capacity) {
+            cache->capacity = cache->capacity ? cache->capacity * 2 : 64;
+            cache->entries = realloc(cache->entries, sizeof(ClosureEntry) * cache->capacity);
+            if (cache->entries == NULL) out_of_memory();
+        }
+        entry = &cache->entries[cache->count];
+        entry->executable = arena_intern(arena, path);
+        entry->stamp = stamp;
+        entry->dep_count = 0;
+        entry->deps = malloc(sizeof(StampedPath) * (count > 0 ? count : 1));
+        if (entry->deps == NULL) out_of_memory();
+        remaining = count;
+
+        if ((size_t)(cache->count + 1) * 2 > cache->slot_count) {
+            cache->count++;
+            cache_index_grow(cache);
+        } else {
+            cache->slots[entry_slot(cache, entry->executable)] = cache->count;
+            cache->count++;
+        }
+    }
+    fclose(fp);
+
+    // A truncated last entry is dropped
+    if (remaining > 0) {
+        free(entry->deps);
+        cache->count--;
+        cache_index_grow(cache);
+        cache->dirty = 1;
+    }
+}
+
+/**
+ * Returns the cached closure of executable if neither it nor any of its dependencies changed.
+ * stamp receives the current identity of executable, to be passed to closure_cache_store on a miss.
+ * executable must be interned in the cache arena. The cache is only read, so lookups may run
+ * concurrently as long as nothing is stored meanwhile.
+ */
+const ClosureEntry *closure_cache_lookup(const ClosureCache *cache, const char *executable, FileStamp *stamp) {
+    int index = cache->slots[entry_slot(cache, executable)];
+
+    file_stamp_get(executable, stamp);
+    if (index >= 0 && file_stamp_equal(&cache->entries[index].stamp, stamp)) {
+        const ClosureEntry *entry = &cache->entries[index];
+
+        for (int i = 0; i < entry->dep_count; i++) {
+            if (!stamp_still_valid(entry->deps[i].path, &entry->deps[i].stamp)) return NULL;
+        }
+        return entry;
+    }
+    return NULL;
+}
+
+/**
+ * Records the freshly resolved closure of executable, replacing a stale entry. dep_stamps
+ * holds the identity of each of deps, taken when the closure was resolved.
+ */
+const ClosureEntry *closure_cache_store(ClosureCache *cache, const char *executable, const FileStamp *stamp,
+                                        const ElfDeps *deps, const FileStamp *dep_stamps) {
+    const char *interned = arena_intern(cache->arena, executable);
+    size_t slot;
+    ClosureEntry *entry;
+
+    if ((size_t)(cache->count + 1) * 2 > cache->slot_count) {
+        cache_index_grow(cache);
+    }
+    slot = entry_slot(cache, interned);
+    if (cache->slots[slot] >= 0) {
+        entry = &cache->entries[cache->slots[slot]];
+        free(entry->deps);
+    } else {
+        if (cache->count == cache->capacity) {
+            cache->capacity = cache->capacity ? cache->capacity * 2 : 64;
+            cache->entries = realloc(cache->entries, sizeof(ClosureEntry) * cache->capacity);
+            if (cache->entries == NULL) out_of_memory();
+        }
+        cache->slots[slot] = cache->count;
+        entry = &cache->entries[cache->count++];
+    }
+
+    entry->executable = interned;
+    entry->stamp = *stamp;
+    entry->dep_count = deps->count;
+    entry->deps = malloc(sizeof(StampedPath) * (deps->count > 0 ? deps->count : 1));
+    if (entry->deps == NULL) out_of_memory();
+    for (int i = 0; i < deps->count; i++) {
+        entry->deps[i].path = arena_intern(cache->arena, deps->paths[i]);
+        entry->deps[i].stamp = dep_stamps[i];
+    }
+    cache->dirty = 1;
+    return entry;
+}
+
+/**
+ * Writes the cache back if it changed. The new cache is renamed into place so that a
+ * concurrent configer reads either the old or the new one, never a partial file.
+ */
+void closure_cache_save(ClosureCache *cache) {
+    char tmp_path[PATH_MAX + 32];
+    FILE *fp;
+
+    if (!cache->dirty) return;
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d", cache->path, getpid());
+    fp = fopen(tmp_path, "w");
+    if (fp == NULL) {
+        perror("Warning: cannot write closure cache");
+        return;
+    }
+
+    fprintf(fp, "%s\n", CLOSURE_CACHE_MAGIC);
+    write_stamped_line(fp, "ldcache", &cache->ld_cache, -1, LD_CACHE_PATH);
+    for (int i = 0; i < cache->count; i++) {
+        const ClosureEntry *entry = &cache->entries[i];
+
+        // Paths with newlines cannot be stored in the line-based format
+        if (strchr(entry->executable, '\n') != NULL) continue;
+        write_stamped_line(fp, "exe", &entry->stamp, entry->dep_count, entry->executable);
+        for (int j = 0; j < entry->dep_count; j++) {
+            write_stamped_line(fp, "dep", &entry->deps[j].stamp, -1, entry->deps[j].path);
+        }
+    }
+
+    if (fclose(fp) != 0 || rename(tmp_path, cache->path) != 0) {
+        perror("Warning: cannot write closure cache");
+        unlink(tmp_path);
+    }
+}
+
+void closure_cache_free(ClosureCache *cache) {
+    for (int i = 0; i < cache->count; i++) {
+        free(cache->entries[i].deps);
+    }
+    free(cache->entries);
+    free(cache->slots);
+    memset(cache, 0, sizeof(*cache));
+}
+
+/**
+ * Records a host file the output depends on, with the identity it had when it was read.
+ */
+void input_stamps_add(InputStamps *inputs, StringArena *arena, const char *path, const FileStamp *stamp) {
+    const char *interned = arena_intern(arena, path);
+
+    if (!pair_set_insert(&inputs->index, interned, NULL)) return;
+    if (inputs->count == inputs->capacity) {
+        inputs->capacity = inputs->capacity ? inputs->capacity * 2 : 256;
+        inputs->items = realloc(inputs->items, sizeof(StampedPath) * inputs->capacity);
+        if (inputs->items == NULL) out_of_memory();
+    }
+    inputs->items[inputs->count].path = interned;
+    inputs->items[inputs->count].stamp = *stamp;
+    inputs->count++;
+}
+
+/**
+ * Makes path absolute against the working directory, without resolving symlinks, so a stamp
+ * still finds its files when configer is run from elsewhere. Paths that would not survive
+ * the line-based stamp file are refused.
+ */
+static int absolute_path(const char *path, char *buf, size_t size) {
+    char cwd[PATH_MAX];
+    int len;
+
+    if (strchr(path, '\n') != NULL) return -1;
+    if (path[0] == '/') {
+        len = snprintf(buf, size, "%s", path);
+    } else {
+        if (getcwd(cwd, sizeof(cwd)) == NULL || strchr(cwd, '\n') != NULL) return -1;
+        len = snprintf(buf, size, "%s/%s", cwd, path);
+    }
+    return len < 0 || (size_t)len >= size ? -1 : 0;
+}
+
+/**
+ * Whether output_file, and manifest_file unless it is NULL, were generated from input_file
+ * and no file they were generated from has changed since. Costs one stat(2) per recorded file.
+ */
+int input_stamps_current(const char *input_file, const char *output_file, const char *manifest_file) {
+    char stamp_path[PATH_MAX + sizeof(STAMP_SUFFIX)];
+    char line[LINE_MAX_LEN];
+    char input_abs[PATH_MAX];
+    char output_abs[PATH_MAX];
+    char manifest_abs[PATH_MAX];
+    const char *path;
+    FileStamp stamp;
+    int current = 0;
+    FILE *fp;
+
+    // The stamp records absolute paths
+    if (absolute_path(input_file, input_abs, sizeof(input_abs)) != 0 ||
+        absolute_path(output_file, output_abs, sizeof(output_abs)) != 0 ||
+        (manifest_file != NULL && absolute_path(manifest_file, manifest_abs, sizeof(manifest_abs)) != 0)) {
+        return 0;
+    }
+    input_file = input_abs;
+    output_file = output_abs;
+    if (manifest_file != NULL) manifest_file = manifest_abs;
+
+    snprintf(stamp_path, sizeof(stamp_path), "%s%s", output_file, STAMP_SUFFIX);
+    fp = fopen(stamp_path, "r");
+    if (fp == NULL) return 0;
+
+    // The base config and the output itself come first
+    if (fgets(line, sizeof(line), fp) == NULL || strcmp(line, STAMP_MAGIC "\n") != 0 ||
+        fgets(line, sizeof(line), fp) == NULL || read_stamped_line(line, "input", &stamp, NULL, &path) != 0 ||
+        strcmp(path, input_file) != 0 || !stamp_still_valid(path, &stamp) ||
+        fgets(line, sizeof(line), fp) == NULL || read_stamped_line(line, "output", &stamp, NULL, &path) != 0 ||
+        strcmp(path, output_file) != 0 || !stamp_still_valid(path, &stamp)) {
+        fclose(fp);
+        return 0;
+    }
+    // So does the manifest, if one is wanted; a stamp written without it is stale
+    if (manifest_file != NULL &&
+        (fgets(line, sizeof(line), fp) == NULL || read_stamped_line(line, "manifest", &stamp, NULL, &path) != 0 ||
+         strcmp(path, manifest_file) != 0 || !stamp_still_valid(path, &stamp))) {
+        fclose(fp);
+        return 0;
+    }
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        current = 0;
+        if (strcmp(line, "end\n") == 0) {
+            current = 1;
+            break;
+        }
+        if (read_stamped_line(line, "file", &stamp, NULL, &path) != 0 || !stamp_still_valid(path, &stamp)) {
+            break;
+        }
+    }
+    fclose(fp);
+    return current;
+}
+
+/**
+ * Writes output_file.stamp after a successful generation. input_stamp must have been taken
+ * before input_file was read. Relative paths are recorded against the working directory;
+ * a path that cannot be recorded leaves the output without a stamp, so it always regenerates.
+ */
+void input_stamps_save(const InputStamps *inputs, const char *input_file, const FileStamp *input_stamp,
+                       const char *output_file, const char *manifest_file) {
+    char stamp_path[PATH_MAX + sizeof(STAMP_SUFFIX)];
+    char input_abs[PATH_MAX];
+    char output_abs[PATH_MAX];
+    char manifest_abs[PATH_MAX];
+    char path[PATH_MAX];
+    FileStamp stamp;
+    FILE *fp;
+
+    snprintf(stamp_path, sizeof(stamp_path), "%s%s", output_file, STAMP_SUFFIX);
+    unlink(stamp_path);
+    if (absolute_path(input_file, input_abs, sizeof(input_abs)) != 0 ||
+        absolute_path(output_file, output_abs, sizeof(output_abs)) != 0 ||
+        (manifest_file != NULL && absolute_path(manifest_file, manifest_abs, sizeof(manifest_abs)) != 0)) {
+        fprintf(stderr, "Warning: no config stamp written, cannot record the path of %s, %s or %s\n",
+                input_file, output_file, manifest_file != NULL ? manifest_file : "(no manifest)");
+        return;
+    }
+    for (int i = 0; i < inputs->count; i++) {
+        if (absolute_path(inputs->items[i].path, path, sizeof(path)) != 0) {
+            fprintf(stderr, "Warning: no config stamp written, cannot record the path of %s\n",
+                    inputs->items[i].path);
+            return;
+        }
+    }
+
+    fp = fopen(stamp_path, "w");
+    if (fp == NULL) {
+        perror("Warning: cannot write config stamp");
+        return;
+    }
+    fprintf(fp, "%s\n", STAMP_MAGIC);
+    write_stamped_line(fp, "input", input_stamp, -1, input_abs);
+    file_stamp_get(output_abs, &stamp);
+    write_stamped_line(fp, "output", &stamp, -1, output_abs);
+    if (manifest_file != NULL) {
+        file_stamp_get(manifest_abs, &stamp);
+        write_stamped_line(fp, "manifest", &stamp, -1, manifest_abs);
+    }
+    for (int i = 0; i < inputs->count; i++) {
+        absolute_path(inputs->items[i].path, path, sizeof(path));
+        write_stamped_line(fp, "file", &inputs->items[i].stamp, -1, path);
+    }
+    // A stamp cut short by a crash has no end marker and is never taken as current
+    fprintf(fp, "end\n");
+
+    if (fclose(fp) != 0) {
+        perror("Warning: cannot write config stamp");
+        unlink(stamp_path);
+    }
+}
+
+void input_stamps_free(InputStamps *inputs) {
+    free(inputs->items);
+    pair_set_free(&inputs->index);
+    memset(inputs, 0, sizeof(*inputs));
+}
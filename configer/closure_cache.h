@@ -0,0 +1,69 @@
+#ifndef CLOSURE_CACHE_H
+#define CLOSURE_CACHE_H
+
+#include "elfdeps.h"
+#include "pathtab.h"
+
+// Identity of a file as seen by stat(2); all zero if the file does not exist
+typedef struct {
+    unsigned long long dev;
+    unsigned long long ino;
+    long long size;
+    long long mtime_sec;
+    long mtime_nsec;
+    long long ctime_sec;
+    long ctime_nsec;
+} FileStamp;
+
+// A path together with the identity it had when configer read it
+typedef struct {
+    const char *path;
+    FileStamp stamp;
+} StampedPath;
+
+// Dependency closure of one executable, valid while the executable and every dependency keep their stamps
+typedef struct {
+    const char *executable;
+    FileStamp stamp;
+    StampedPath *deps;
+    int dep_count;
+} ClosureEntry;
+
+// On-disk cache of dependency closures, shared by every full config written to the same directory
+typedef struct {
+    char path[4096];
+    StringArena *arena;
+    FileStamp ld_cache;         // Identity of /etc/ld.so.cache the closures were resolved against
+    ClosureEntry *entries;
+    int count;
+    int capacity;
+    int *slots;                 // Open-addressing index of entries keyed by interned executable path
+    size_t slot_count;
+    int dirty;
+} ClosureCache;
+
+// Every host file a full config was generated from, besides the base config itself
+typedef struct {
+    StampedPath *items;
+    int count;
+    int capacity;
+    PairSet index;
+} InputStamps;
+
+int file_stamp_get(const char *path, FileStamp *stamp);
+int file_stamp_equal(const FileStamp *a, const FileStamp *b);
+
+void closure_cache_load(ClosureCache *cache, const char *cache_dir, StringArena *arena);
+const ClosureEntry *closure_cache_lookup(const ClosureCache *cache, const char *executable, FileStamp *stamp);
+const ClosureEntry *closure_cache_store(ClosureCache *cache, const char *executable, const FileStamp *stamp,
+                                        const ElfDeps *deps, const FileStamp *dep_stamps);
+void closure_cache_save(ClosureCache *cache);
+void closure_cache_free(ClosureCache *cache);
+
+void input_stamps_add(InputStamps *inputs, StringArena *arena, const char *path, const FileStamp *stamp);
+int input_stamps_current(const char *input_file, const char *output_file, const char *manifest_file);
+void input_stamps_save(const InputStamps *inputs, const char *input_file, const FileStamp *input_stamp,
+                       const char *output_file, const char *manifest_file);
+void input_stamps_free(InputStamps *inputs);
+
+#endif
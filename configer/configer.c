@@ -1,178 +1,173 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <ctype.h>
 #include <libconfig.h>
+#include <errno.h>
 #include <limits.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <sys/stat.h>
 
-#define MAX_DIRECTORIES 512
-#define MAX_EXECUTABLES 256
-#define MAX_FILE_COPIES 512
-#define MAX_SYMLINKS 512
-#define PATH_MAX 4096
+#include "../jailor/manifest.h"
+#include "closure_cache.h"
+#include "configer.h"
+#include "elfdeps.h"
+#include "manifest_writer.h"
+#include "pathtab.h"
+#include "trace.h"
 
-// Structure to hold file copy information
-typedef struct {
-    char src[PATH_MAX];
-    char dst[PATH_MAX];
-} FileCopy;
+// Upper bound on the threads resolving dependency closures
+#define MAX_CLOSURE_WORKERS 16
 
-// Structure to hold symlink information
+// Struct to hold the dependency closure of one executable, resolved on a worker thread
+typedef struct {
+    const char *executable;         // Interned
+    FileStamp stamp;
+    const ClosureEntry *cached;     // Valid cache entry, or NULL if deps was resolved
+    ElfDeps deps;
+    FileStamp *dep_stamps;
+} ClosureJob;
+
+// Struct shared by the closure workers
 typedef struct {
-    char sym[PATH_MAX];
-    char dst[PATH_MAX];
-} Symlink;
+    ClosureJob *jobs;
+    int count;
+    int next;
+    const ClosureCache *cache;
+    ElfObjectCache *objects;
+} ClosureQueue;
+
+// Optional jailor settings that are copied verbatim from the base config
+static const char *passthrough_settings[] = {
+    "overlay_lower_dir",
+    "copy_workers",
+    "store_dir",
+    "store_link",
+    "image_cache_dir",
+    "tmpfs_size",
+    "resources",
+    NULL
+};
 
 // Function prototypes
-int add_unique_string(char **array, int *count, const char *new_string, int max_count);
-void add_directory_with_parents(char **directories, int *dir_count, const char *path, int max_count);
-int add_unique_file_copy(FileCopy *file_copies, int *count, const char *src, const char *dst, int max_count);
-int add_unique_symlink(Symlink *symlinks, int *count, const char *sym, const char *dst, int max_count);
-void resolve_paths_in_array(char **array, int count, Symlink *symlinks, int *symlink_count, int max_symlinks,
-                            char **directories, int *dir_count, int max_directories);
-void resolve_paths_in_file_copies(FileCopy *file_copies, int file_copy_count, Symlink *symlinks, int *symlink_count,
-                                  int max_symlinks, char **directories, int *dir_count, int max_directories);
-void get_executable_dependencies(const char *executable, FileCopy *file_copies, int *file_copy_count,
-                                 int max_file_copies, char **directories, int *dir_count, int max_directories);
-void write_output_config(const char *output_file, int sandbox_id, const char *root_dir, const char *root_process,
-                         char **directories, int dir_count, FileCopy *file_copies, int file_copy_count,
-                         Symlink *symlinks, int symlink_count, const config_setting_t *root_process_args,
-                         const config_setting_t *veth_ip_pair);
-void free_string_array(char **array, int count);
-int compare_strings(const void *a, const void *b);
-void remove_duplicate_directories(char **directories, int *size);
-int compare_symlinks(const void *a, const void *b);
-void remove_duplicate_symlinks(Symlink *symlinks, int *size);
-void fix_symlinks(Symlink *symlinks, int *symlink_count);
-int compare_file_copies(const void *a, const void *b);
-void remove_duplicate_filecopies(FileCopy *file_copies, int *size);
-
-int main(int argc, char **argv) {
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s <input_config_file> <output_config_file>\n", argv[0]);
-        exit(EXIT_FAILURE);
-    }
+static int collect_full_config(const config_t *cfg, const char *cache_dir, int trace_seconds, FullConfig *full);
+static int trace_full_config(FullConfig *full, int seconds);
+static void add_directory_with_parents(PathTables *tables, const char *path);
+static const char *resolve_path(PathTables *tables, const char *path);
+static void resolve_paths_in_array(PathTables *tables, StringTable *array);
+static void resolve_paths_in_file_copies(PathTables *tables);
+static void *closure_worker(void *arg);
+static void resolve_closures(ClosureJob *jobs, int count, const ClosureCache *cache);
+static void add_executable_dependencies(ClosureJob *job, PathTables *tables, ClosureCache *cache,
+                                        FullConfig *full);
+static int tables_have_directory(const PathTables *tables, const char *dir);
+static int tables_have_file_copy(const PathTables *tables, const FileCopy *file_copy);
+static int tables_have_symlink(const PathTables *tables, const Symlink *symlink);
+static uint64_t base_layer_hash(const PathTables *tables);
+static void write_path_tables(FILE *fp, const PathTables *tables);
+static void write_setting(FILE *fp, const config_setting_t *setting, int indent);
+static int compare_strings(const void *a, const void *b);
+static void remove_duplicate_directories(const char **directories, int *size);
+static int compare_symlinks(const void *a, const void *b);
+static void remove_duplicate_symlinks(Symlink *symlinks, int *size);
+static void fix_symlinks(PathTables *tables);
+static int compare_file_copies(const void *a, const void *b);
+static void remove_duplicate_filecopies(FileCopy *file_copies, int *size);
 
-    const char *input_config_file = argv[1];
-    const char *output_config_file = argv[2];
+/**
+ * Collects the full config of the sandbox described by cfg: every directory, file copy and
+ * symlink its rootfs needs. Dependency closures are reused from the closure cache in
+ * cache_dir. Returns 0 on success, -1 with a message printed if cfg lacks a mandatory setting.
+ */
+int configer_collect(const config_t *cfg, const char *cache_dir, FullConfig *full) {
+    return collect_full_config(cfg, cache_dir, 0, full);
+}
 
-    // Initialize libconfig
-    config_t cfg;
-    config_init(&cfg);
+/**
+ * Like configer_collect(), but root_process contributes only what it actually uses: it is
+ * run on the host for seconds under ptrace, and every file it and its children open,
+ * execute or map replaces its static closure. This also catches dlopen()ed modules and
+ * data files. Listed executables, directories and file copies are kept as they are.
+ */
+int configer_collect_traced(const config_t *cfg, const char *cache_dir, int seconds, FullConfig *full) {
+    return collect_full_config(cfg, cache_dir, seconds > 0 ? seconds : 1, full);
+}
 
-    // Read the input configuration file
-    if (!config_read_file(&cfg, input_config_file)) {
-        fprintf(stderr, "%s:%d - %s\n", config_error_file(&cfg),
-                config_error_line(&cfg), config_error_text(&cfg));
-        config_destroy(&cfg);
-        return EXIT_FAILURE;
-    }
+static int collect_full_config(const config_t *cfg, const char *cache_dir, int trace_seconds, FullConfig *full) {
+    memset(full, 0, sizeof(*full));
 
     // Mandatory sandbox_id
-    int sandbox_id;
-    if (!config_lookup_int(&cfg, "sandbox_id", &sandbox_id)) {
+    if (!config_lookup_int(cfg, "sandbox_id", &full->sandbox_id)) {
         fprintf(stderr, "Error: 'sandbox_id' must be defined in the configuration file.\n");
-        config_destroy(&cfg);
-        return EXIT_FAILURE;
+        return -1;
     }
 
     // Mandatory root_dir
-    const char *root_dir;
-    if (!config_lookup_string(&cfg, "root_dir", &root_dir)) {
+    if (!config_lookup_string(cfg, "root_dir", &full->root_dir)) {
         fprintf(stderr, "Error: 'root_dir' must be defined in the configuration file.\n");
-        config_destroy(&cfg);
-        return EXIT_FAILURE;
+        return -1;
     }
 
     // Mandatory root_process
-    const char *root_process;
-    if (!config_lookup_string(&cfg, "root_process", &root_process)) {
+    if (!config_lookup_string(cfg, "root_process", &full->root_process)) {
         fprintf(stderr, "Error: 'root_process' must be defined in the configuration file.\n");
-        config_destroy(&cfg);
-        return EXIT_FAILURE;
+        return -1;
     }
 
     // Optional settings: root_process_args and veth_ip_pair
-    const config_setting_t *root_process_args = config_lookup(&cfg, "root_process_args");
-    const config_setting_t *veth_ip_pair = config_lookup(&cfg, "veth_ip_pair");
-    if (veth_ip_pair != NULL) {
+    full->root_process_args = config_lookup(cfg, "root_process_args");
+    full->veth_ip_pair = config_lookup(cfg, "veth_ip_pair");
+    if (full->veth_ip_pair != NULL) {
         const char *host, *sandbox;
-        if (!config_setting_lookup_string(veth_ip_pair, "host", &host) ||
-            !config_setting_lookup_string(veth_ip_pair, "sandbox", &sandbox)) {
+        if (!config_setting_lookup_string(full->veth_ip_pair, "host", &host) ||
+            !config_setting_lookup_string(full->veth_ip_pair, "sandbox", &sandbox)) {
             fprintf(stderr, "Error: 'veth_ip_pair' requires both 'host' and 'sandbox' fields.\n");
-            config_destroy(&cfg);
-            return EXIT_FAILURE;
+            return -1;
         }
     }
 
-    // Allocate memory for large arrays
-    char **directories = malloc(sizeof(char *) * MAX_DIRECTORIES);
-    int dir_count = 0;
+    // Paths are interned once and indexed by hash, so the tables grow without limit
+    PathTables *tables = &full->tables;
 
-    char **executables = malloc(sizeof(char *) * MAX_EXECUTABLES);
-    int exec_count = 0;
-
-    FileCopy *file_copies = malloc(sizeof(FileCopy) * MAX_FILE_COPIES);
-    int file_copy_count = 0;
-
-    Symlink *symlinks = malloc(sizeof(Symlink) * MAX_SYMLINKS);
-    int symlink_count = 0;
-
-    // Check if malloc succeeded
-    if (!directories || !executables || !file_copies || !symlinks) {
-        fprintf(stderr, "Memory allocation failed\n");
-        config_destroy(&cfg);
-        return EXIT_FAILURE;
-    }
-
-    // Initialize string arrays
-    for (int i = 0; i < MAX_DIRECTORIES; i++) {
-        directories[i] = malloc(PATH_MAX);
-        if (!directories[i]) {
-            fprintf(stderr, "Memory allocation failed for directories\n");
-            exit(EXIT_FAILURE);
-        }
-    }
-
-    for (int i = 0; i < MAX_EXECUTABLES; i++) {
-        executables[i] = malloc(PATH_MAX);
-        if (!executables[i]) {
-            fprintf(stderr, "Memory allocation failed for executables\n");
-            exit(EXIT_FAILURE);
-        }
-    }
+    // Dependency closures of unchanged executables are reused from earlier runs
+    ClosureCache cache;
+    closure_cache_load(&cache, cache_dir, &tables->arena);
+    input_stamps_add(&full->inputs, &tables->arena, "/etc/ld.so.cache", &cache.ld_cache);
 
     // Read the directories list from the input config file
-    config_setting_t *directories_setting = config_lookup(&cfg, "directories");
+    config_setting_t *directories_setting = config_lookup(cfg, "directories");
     if (directories_setting != NULL) {
         int count = config_setting_length(directories_setting);
         for (int i = 0; i < count; i++) {
             const char *dir = config_setting_get_string_elem(directories_setting, i);
             if (dir != NULL) {
-                add_directory_with_parents(directories, &dir_count, dir, MAX_DIRECTORIES);
+                add_directory_with_parents(tables, dir);
             }
         }
     }
 
     // Read the executables list from the input config file
-    config_setting_t *executables_setting = config_lookup(&cfg, "executables");
+    config_setting_t *executables_setting = config_lookup(cfg, "executables");
     if (executables_setting != NULL) {
         int count = config_setting_length(executables_setting);
         for (int i = 0; i < count; i++) {
             const char *exe = config_setting_get_string_elem(executables_setting, i);
             if (exe != NULL) {
-                add_unique_string(executables, &exec_count, exe, MAX_EXECUTABLES);
+                string_table_add(&tables->executables, &tables->arena, exe);
             }
         }
     }
 
-    // Add root_process to executables array if not already present
-    add_unique_string(executables, &exec_count, root_process, MAX_EXECUTABLES);
+    // Add root_process to executables array if not already present, or trace what it uses
+    if (trace_seconds == 0) {
+        string_table_add(&tables->executables, &tables->arena, full->root_process);
+    } else if (trace_full_config(full, trace_seconds) != 0) {
+        closure_cache_free(&cache);
+        return -1;
+    }
 
     // Read the file_copies list from the input config file
-    config_setting_t *file_copies_setting = config_lookup(&cfg, "file_copies");
+    config_setting_t *file_copies_setting = config_lookup(cfg, "file_copies");
     if (file_copies_setting != NULL) {
         int count = config_setting_length(file_copies_setting);
         for (int i = 0; i < count; i++) {
@@ -180,30 +175,45 @@ int main(int argc, char **argv) {
             const char *src, *dst;
             if (config_setting_lookup_string(file_copy_setting, "src", &src)
                 && config_setting_lookup_string(file_copy_setting, "dst", &dst)) {
-                add_directory_with_parents(directories, &dir_count, dst, MAX_DIRECTORIES);
-                add_unique_file_copy(file_copies, &file_copy_count, src, dst, MAX_FILE_COPIES);
+                FileStamp src_stamp;
+                file_stamp_get(src, &src_stamp);
+                input_stamps_add(&full->inputs, &tables->arena, src, &src_stamp);
+                add_directory_with_parents(tables, dst);
+                file_copy_table_add(&tables->file_copies, &tables->arena, src, dst);
             }
         }
     }
 
-    // Add all dependencies of each executable to file_copies array
-    for (int i = 0; i < exec_count; i++) {
-        add_directory_with_parents(directories, &dir_count, executables[i], MAX_DIRECTORIES);
-        add_unique_file_copy(file_copies, &file_copy_count, executables[i], executables[i], MAX_FILE_COPIES);
-        get_executable_dependencies(executables[i], file_copies, &file_copy_count, MAX_FILE_COPIES,
-                                    directories, &dir_count, MAX_DIRECTORIES);
+    // Resolve every closure in parallel, then add them to file_copies array in executable
+    // order, so the output does not depend on which thread finished first
+    ClosureJob *jobs = calloc(tables->executables.count > 0 ? tables->executables.count : 1, sizeof(ClosureJob));
+    if (jobs == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < tables->executables.count; i++) {
+        jobs[i].executable = tables->executables.items[i];
     }
+    resolve_closures(jobs, tables->executables.count, &cache);
+    for (int i = 0; i < tables->executables.count; i++) {
+        const char *executable = jobs[i].executable;
+        add_directory_with_parents(tables, executable);
+        file_copy_table_add(&tables->file_copies, &tables->arena, executable, executable);
+        add_executable_dependencies(&jobs[i], tables, &cache, full);
+    }
+    free(jobs);
 
     // Resolve real paths in directories array and update symlinks array
-    resolve_paths_in_array(directories, dir_count, symlinks, &symlink_count, MAX_SYMLINKS,
-                           directories, &dir_count, MAX_DIRECTORIES);
+    resolve_paths_in_array(tables, &tables->directories);
+
+    // Resolve real paths in file_copies array
+    resolve_paths_in_file_copies(tables);
 
-    // Resolve real paths in file_copies array and update symlinks array
-    resolve_paths_in_file_copies(file_copies, file_copy_count, symlinks, &symlink_count, MAX_SYMLINKS,
-                                 directories, &dir_count, MAX_DIRECTORIES);
+    // Every host symlink met on the way becomes a sandbox symlink
+    trie_collect_symlinks(&tables->trie, &tables->arena, &tables->symlinks);
 
     // Read symlinks list from input config file and add to symlinks array
-    config_setting_t *symlinks_setting = config_lookup(&cfg, "symlinks");
+    config_setting_t *symlinks_setting = config_lookup(cfg, "symlinks");
     if (symlinks_setting != NULL) {
         int count = config_setting_length(symlinks_setting);
         for (int i = 0; i < count; i++) {
@@ -211,54 +221,178 @@ int main(int argc, char **argv) {
             const char *sym, *dst;
             if (config_setting_lookup_string(symlink_setting, "sym", &sym)
                 && config_setting_lookup_string(symlink_setting, "dst", &dst)) {
-                add_unique_symlink(symlinks, &symlink_count, sym, dst, MAX_SYMLINKS);
+                symlink_table_add(&tables->symlinks, &tables->arena, sym, dst);
             }
         }
     }
 
-    qsort(directories, dir_count, sizeof(char *), compare_strings);
-    remove_duplicate_directories(directories, &dir_count);
-    qsort(symlinks, symlink_count, sizeof(Symlink), compare_symlinks);
-    remove_duplicate_symlinks(symlinks, &symlink_count);
-    fix_symlinks(symlinks, &symlink_count);
-    qsort(file_copies, file_copy_count, sizeof(FileCopy), compare_file_copies);
-    remove_duplicate_filecopies(file_copies, &file_copy_count);
+    // The hash indexes are not used past this point: the tables are only sorted and compacted
+    qsort(tables->directories.items, tables->directories.count, sizeof(const char *), compare_strings);
+    remove_duplicate_directories(tables->directories.items, &tables->directories.count);
+    qsort(tables->symlinks.items, tables->symlinks.count, sizeof(Symlink), compare_symlinks);
+    remove_duplicate_symlinks(tables->symlinks.items, &tables->symlinks.count);
+    fix_symlinks(tables);
+    qsort(tables->file_copies.items, tables->file_copies.count, sizeof(FileCopy), compare_file_copies);
+    remove_duplicate_filecopies(tables->file_copies.items, &tables->file_copies.count);
+
+    closure_cache_save(&cache);
+    closure_cache_free(&cache);
+
+    return 0;
+}
+
+void full_config_free(FullConfig *full) {
+    input_stamps_free(&full->inputs);
+    path_tables_free(&full->tables);
+}
+
+/**
+ * Moves what every one of fulls has in common (the same directory, file copy or symlink)
+ * into a base layer under layer_root, and leaves each full config with its own delta and a
+ * reference to the layer. The layer directory is named after a hash of its entries and of
+ * the identity of every file it copies, so jailor builds it again only when one changed.
+ */
+void configer_extract_base_layer(FullConfig *fulls, int count, const char *layer_root, BaseLayer *layer) {
+    PathTables *tables = &layer->tables;
+
+    memset(layer, 0, sizeof(*layer));
+    if (count == 0) return;
+
+    // Sorted like directories and file copies, so membership is a binary search
+    for (int i = 0; i < count; i++) {
+        qsort(fulls[i].tables.symlinks.items, fulls[i].tables.symlinks.count, sizeof(Symlink), compare_symlinks);
+    }
+
+    // Candidates come from the first config, already in sorted order
+    const PathTables *first = &fulls[0].tables;
+    for (int i = 0; i < first->directories.count; i++) {
+        int common = 1;
+        for (int j = 1; j < count && common; j++) {
+            common = tables_have_directory(&fulls[j].tables, first->directories.items[i]);
+        }
+        if (common) string_table_add(&tables->directories, &tables->arena, first->directories.items[i]);
+    }
+    for (int i = 0; i < first->file_copies.count; i++) {
+        const FileCopy *file_copy = &first->file_copies.items[i];
+        int common = 1;
+        for (int j = 1; j < count && common; j++) {
+            common = tables_have_file_copy(&fulls[j].tables, file_copy);
+        }
+        if (common) file_copy_table_add(&tables->file_copies, &tables->arena, file_copy->src, file_copy->dst);
+    }
+    for (int i = 0; i < first->symlinks.count; i++) {
+        const Symlink *symlink = &first->symlinks.items[i];
+        int common = 1;
+        for (int j = 1; j < count && common; j++) {
+            common = tables_have_symlink(&fulls[j].tables, symlink);
+        }
+        if (common) symlink_table_add(&tables->symlinks, &tables->arena, symlink->sym, symlink->dst);
+    }
+
+    snprintf(layer->dir, sizeof(layer->dir), "%s/%016llx", layer_root,
+             (unsigned long long)base_layer_hash(tables));
 
-    // Write the output configuration file
-    write_output_config(output_config_file, sandbox_id, root_dir, root_process, directories, dir_count,
-                        file_copies, file_copy_count, symlinks, symlink_count, root_process_args, veth_ip_pair);
+    // What is left of each config is its delta; the hash indexes are stale from here on
+    for (int i = 0; i < count; i++) {
+        PathTables *own = &fulls[i].tables;
+        int kept = 0;
 
-    // Cleanup
-    config_destroy(&cfg);
-    printf("Configuration written to %s\n", output_config_file);
+        for (int j = 0; j < own->directories.count; j++) {
+            if (!tables_have_directory(tables, own->directories.items[j])) {
+                own->directories.items[kept++] = own->directories.items[j];
+            }
+        }
+        own->directories.count = kept;
 
-    // Free allocated memory
-    free_string_array(directories, MAX_DIRECTORIES);
-    free_string_array(executables, MAX_EXECUTABLES);
-    free(directories);
-    free(executables);
-    free(file_copies);
-    free(symlinks);
+        kept = 0;
+        for (int j = 0; j < own->file_copies.count; j++) {
+            if (!tables_have_file_copy(tables, &own->file_copies.items[j])) {
+                own->file_copies.items[kept++] = own->file_copies.items[j];
+            }
+        }
+        own->file_copies.count = kept;
 
+        kept = 0;
+        for (int j = 0; j < own->symlinks.count; j++) {
+            if (!tables_have_symlink(tables, &own->symlinks.items[j])) {
+                own->symlinks.items[kept++] = own->symlinks.items[j];
+            }
+        }
+        own->symlinks.count = kept;
+
+        fulls[i].base_layer = layer->dir;
+    }
+}
+
+/**
+ * Writes the config of a base layer to <dir>.cfg, where jailor looks for it when the
+ * layer directory does not exist yet. Returns 0 on success, -1 on failure.
+ */
+int write_base_layer(const BaseLayer *layer) {
+    char layer_root[PATH_MAX];
+    char config_path[PATH_MAX + 8];
+    char tmp_path[PATH_MAX + 32];
+    const char *slash = strrchr(layer->dir, '/');
+    FILE *fp;
+
+    snprintf(layer_root, sizeof(layer_root), "%.*s", slash != NULL ? (int)(slash - layer->dir) : 0, layer->dir);
+    if (layer_root[0] != '\0' && mkdir(layer_root, 0755) != 0 && errno != EEXIST) {
+        perror("Error creating base layer directory");
+        return -1;
+    }
+
+    // Renamed into place: a jailor building the layer reads either the old or the new file
+    snprintf(config_path, sizeof(config_path), "%s.cfg", layer->dir);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d", config_path, getpid());
+    fp = fopen(tmp_path, "w");
+    if (fp == NULL) {
+        perror("Error opening base layer config file");
+        return -1;
+    }
+    write_path_tables(fp, &layer->tables);
+    if (fclose(fp) != 0 || rename(tmp_path, config_path) != 0) {
+        perror("Error writing base layer config file");
+        unlink(tmp_path);
+        return -1;
+    }
     return 0;
 }
 
+void base_layer_free(BaseLayer *layer) {
+    path_tables_free(&layer->tables);
+}
+
+/**
+ * Library form of `configer --manifest`: collects the full config of cfg and returns its
+ * binary manifest in a malloc()ed buffer, ready for jailor_run_manifest(). Nothing is
+ * written but the closure cache in cache_dir. Returns 0 on success, -1 on failure.
+ */
+int configer_build_manifest(const config_t *cfg, const char *cache_dir, unsigned char **data, size_t *size) {
+    FullConfig full;
+    int ret = -1;
+
+    if (configer_collect(cfg, cache_dir, &full) == 0) {
+        ret = build_output_manifest(&full, cfg, data, size);
+    }
+    full_config_free(&full);
+    return ret;
+}
+
 /**
  * Write output configuration, including sandbox_id, root_process_args, and veth_ip_pair if they exist.
  */
-void write_output_config(const char *output_file, int sandbox_id, const char *root_dir, const char *root_process,
-                         char **directories, int dir_count, FileCopy *file_copies, int file_copy_count,
-                         Symlink *symlinks, int symlink_count, const config_setting_t *root_process_args,
-                         const config_setting_t *veth_ip_pair) {
+void write_output_config(const char *output_file, const FullConfig *full, const config_t *cfg) {
+    const config_setting_t *root_process_args = full->root_process_args;
+    const config_setting_t *veth_ip_pair = full->veth_ip_pair;
     FILE *fp = fopen(output_file, "w");
     if (fp == NULL) {
         perror("Error opening output config file");
         return;
     }
 
-    fprintf(fp, "sandbox_id = %d\n", sandbox_id);
-    fprintf(fp, "root_dir = \"%s\"\n", root_dir);
-    fprintf(fp, "root_process = \"%s\"\n", root_process);
+    fprintf(fp, "sandbox_id = %d\n", full->sandbox_id);
+    fprintf(fp, "root_dir = \"%s\"\n", full->root_dir);
+    fprintf(fp, "root_process = \"%s\"\n", full->root_process);
 
     if (root_process_args != NULL) {
         if (config_setting_length(root_process_args) > 0) {
@@ -280,44 +414,169 @@ void write_output_config(const char *output_file, int sandbox_id, const char *ro
         fprintf(fp, "veth_ip_pair = {\n    host = \"%s\",\n    sandbox = \"%s\"\n}\n", host, sandbox);
     }
 
+    for (int i = 0; passthrough_settings[i] != NULL; i++) {
+        const config_setting_t *setting = config_lookup(cfg, passthrough_settings[i]);
+        if (setting != NULL) {
+            write_setting(fp, setting, 0);
+            fprintf(fp, "\n");
+        }
+    }
+
+    if (full->base_layer != NULL) {
+        fprintf(fp, "base_layer = \"%s\"\n", full->base_layer);
+    }
+
+    write_path_tables(fp, &full->tables);
+    fclose(fp);
+}
+
+/**
+ * Writes the directories, file_copies and symlinks lists of a full config or base layer.
+ */
+static void write_path_tables(FILE *fp, const PathTables *tables) {
+    const StringTable *directories = &tables->directories;
+    const FileCopyTable *file_copies = &tables->file_copies;
+    const SymlinkTable *symlinks = &tables->symlinks;
+
     fprintf(fp, "directories = (\n");
-    for (int i = 0; i < dir_count; i++) {
-        fprintf(fp, "    \"%s\"", directories[i]);
-        if (i < dir_count - 1) fprintf(fp, ",");
+    for (int i = 0; i < directories->count; i++) {
+        fprintf(fp, "    \"%s\"", directories->items[i]);
+        if (i < directories->count - 1) fprintf(fp, ",");
         fprintf(fp, "\n");
     }
     fprintf(fp, ")\n");
 
     fprintf(fp, "file_copies = (\n");
-    for (int i = 0; i < file_copy_count; i++) {
-        fprintf(fp, "    {\n        src = \"%s\",\n        dst = \"%s\"\n    }", file_copies[i].src, file_copies[i].dst);
-        if (i < file_copy_count - 1) fprintf(fp, ",");
+    for (int i = 0; i < file_copies->count; i++) {
+        fprintf(fp, "    {\n        src = \"%s\",\n        dst = \"%s\"\n    }", file_copies->items[i].src,
+                file_copies->items[i].dst);
+        if (i < file_copies->count - 1) fprintf(fp, ",");
         fprintf(fp, "\n");
     }
     fprintf(fp, ")\n");
 
     fprintf(fp, "symlinks = (\n");
-    for (int i = 0; i < symlink_count; i++) {
-        fprintf(fp, "    {\n        sym = \"%s\",\n        dst = \"%s\"\n    }", symlinks[i].sym, symlinks[i].dst);
-        if (i < symlink_count - 1) fprintf(fp, ",");
+    for (int i = 0; i < symlinks->count; i++) {
+        fprintf(fp, "    {\n        sym = \"%s\",\n        dst = \"%s\"\n    }", symlinks->items[i].sym,
+                symlinks->items[i].dst);
+        if (i < symlinks->count - 1) fprintf(fp, ",");
         fprintf(fp, "\n");
     }
     fprintf(fp, ")\n");
+}
 
-    fclose(fp);
+/*
+ * Membership tests for configer_extract_base_layer(). Directories and file copies are
+ * sorted and deduplicated by configer_collect(), symlinks by sym before extraction.
+ */
+static int tables_have_directory(const PathTables *tables, const char *dir) {
+    return bsearch(&dir, tables->directories.items, tables->directories.count, sizeof(const char *),
+                   compare_strings) != NULL;
+}
+
+static int tables_have_file_copy(const PathTables *tables, const FileCopy *file_copy) {
+    const FileCopy *found = bsearch(file_copy, tables->file_copies.items, tables->file_copies.count,
+                                    sizeof(FileCopy), compare_file_copies);
+
+    return found != NULL && strcmp(found->src, file_copy->src) == 0;
+}
+
+static int tables_have_symlink(const PathTables *tables, const Symlink *symlink) {
+    const Symlink *found = bsearch(symlink, tables->symlinks.items, tables->symlinks.count, sizeof(Symlink),
+                                   compare_symlinks);
+
+    return found != NULL && strcmp(found->dst, symlink->dst) == 0;
+}
+
+/**
+ * Hash naming a base layer: every entry, and for file copies the current identity of the
+ * source, so that a library upgraded on the host yields a new layer.
+ */
+static uint64_t base_layer_hash(const PathTables *tables) {
+    uint64_t hash = MANIFEST_FNV_OFFSET;
+
+    for (int i = 0; i < tables->directories.count; i++) {
+        hash = manifest_checksum(hash, "d", 1);
+        hash = manifest_checksum(hash, tables->directories.items[i], strlen(tables->directories.items[i]) + 1);
+    }
+    for (int i = 0; i < tables->file_copies.count; i++) {
+        const FileCopy *file_copy = &tables->file_copies.items[i];
+        FileStamp stamp;
+
+        file_stamp_get(file_copy->src, &stamp);
+        hash = manifest_checksum(hash, "f", 1);
+        hash = manifest_checksum(hash, file_copy->src, strlen(file_copy->src) + 1);
+        hash = manifest_checksum(hash, file_copy->dst, strlen(file_copy->dst) + 1);
+        hash = manifest_checksum(hash, &stamp, sizeof(stamp));
+    }
+    for (int i = 0; i < tables->symlinks.count; i++) {
+        const Symlink *symlink = &tables->symlinks.items[i];
+
+        hash = manifest_checksum(hash, "s", 1);
+        hash = manifest_checksum(hash, symlink->sym, strlen(symlink->sym) + 1);
+        hash = manifest_checksum(hash, symlink->dst, strlen(symlink->dst) + 1);
+    }
+    return hash;
+}
+
+/**
+ * Writes a setting (scalar, group, list or array) in libconfig syntax, without a trailing newline.
+ * Unnamed settings are list/array elements.
+ */
+static void write_setting(FILE *fp, const config_setting_t *setting, int indent) {
+    const char *name = config_setting_name(setting);
+    int type = config_setting_type(setting);
+
+    fprintf(fp, "%*s", indent, "");
+    if (name != NULL) {
+        fprintf(fp, "%s = ", name);
+    }
+
+    switch (type) {
+    case CONFIG_TYPE_INT:
+        fprintf(fp, "%d", config_setting_get_int(setting));
+        break;
+    case CONFIG_TYPE_INT64:
+        fprintf(fp, "%lldL", config_setting_get_int64(setting));
+        break;
+    case CONFIG_TYPE_FLOAT:
+        fprintf(fp, "%f", config_setting_get_float(setting));
+        break;
+    case CONFIG_TYPE_BOOL:
+        fprintf(fp, "%s", config_setting_get_bool(setting) ? "true" : "false");
+        break;
+    case CONFIG_TYPE_STRING:
+        fprintf(fp, "\"%s\"", config_setting_get_string(setting));
+        break;
+    case CONFIG_TYPE_GROUP:
+    case CONFIG_TYPE_LIST:
+    case CONFIG_TYPE_ARRAY: {
+        int count = config_setting_length(setting);
+        fprintf(fp, "%s\n", type == CONFIG_TYPE_GROUP ? "{" : type == CONFIG_TYPE_LIST ? "(" : "[");
+        for (int i = 0; i < count; i++) {
+            write_setting(fp, config_setting_get_elem(setting, i), indent + 4);
+            if (i < count - 1) fprintf(fp, ",");
+            fprintf(fp, "\n");
+        }
+        fprintf(fp, "%*s%s", indent, "", type == CONFIG_TYPE_GROUP ? "}" : type == CONFIG_TYPE_LIST ? ")" : "]");
+        break;
+    }
+    default:
+        break;
+    }
 }
 
 // Other helper functions...
 // (Keep all original helper functions unchanged)
 
 /* Comparison function for qsort */
-int compare_strings(const void *a, const void *b) {
+static int compare_strings(const void *a, const void *b) {
     const char * const *str1 = (const char * const *)a;
     const char * const *str2 = (const char * const *)b;
     return strcmp(*str1, *str2);
 }
 
-void remove_duplicate_directories(char **directories, int *size) {
+static void remove_duplicate_directories(const char **directories, int *size) {
     if (*size == 0) return;  // No elements to process
 
     int write_index = 0;  // Index to write the next unique element
@@ -327,28 +586,21 @@ void remove_duplicate_directories(char **directories, int *size) {
             // Found a new unique element
             write_index++;
             directories[write_index] = directories[read_index];
-        } else {
-            // Duplicate found; free the duplicate string if dynamically allocated
-            free(directories[read_index]);
         }
-    }
-
-    // Optionally set remaining pointers to NULL
-    for (int i = write_index + 1; i < *size; i++) {
-        directories[i] = NULL;
+        // Else, duplicate found; the string itself is owned by the arena
     }
 
     // Update the size to reflect the new number of unique directories
     *size = write_index + 1;
 }
 
-int compare_symlinks(const void *a, const void *b) {
+static int compare_symlinks(const void *a, const void *b) {
     const Symlink *sym1 = (const Symlink *)a;
     const Symlink *sym2 = (const Symlink *)b;
     return strcmp(sym1->sym, sym2->sym);
 }
 
-void remove_duplicate_symlinks(Symlink *symlinks, int *size) {
+static void remove_duplicate_symlinks(Symlink *symlinks, int *size) {
     if (*size == 0) return;
 
     int write_index = 0;
@@ -370,45 +622,39 @@ void remove_duplicate_symlinks(Symlink *symlinks, int *size) {
 
 /**
  * Resolves symlink paths within the symlinks array and removes redundant symlinks.
- * For each symlink, if its 'sym' appears in the paths of subsequent symlinks,
- * replaces that part with its 'dst'. Then removes any symlinks where 'sym' equals 'dst'.
+ * Symlinks are visited in sorted order, so a link is placed in the trie before any link below
+ * it; the parent of each later sym (and absolute dst) is then looked up through the links
+ * already placed. Then removes any symlinks where 'sym' equals 'dst'.
  */
-void fix_symlinks(Symlink *symlinks, int *symlink_count) {
-    // First, iterate over symlinks and adjust paths
+static void fix_symlinks(PathTables *tables) {
+    Symlink *symlinks = tables->symlinks.items;
+    int *symlink_count = &tables->symlinks.count;
+
     for (int i = 0; i < *symlink_count; i++) {
         Symlink *current = &symlinks[i];
-        char current_sym_with_slash[PATH_MAX + 1];
-        snprintf(current_sym_with_slash, PATH_MAX + 1, "%s/", current->sym);
-        char current_dst_with_slash[PATH_MAX + 1];
-        snprintf(current_dst_with_slash, PATH_MAX + 1, "%s/", current->dst);
-        size_t sym_len = strlen(current_sym_with_slash);
-
-        for (int j = i + 1; j < *symlink_count; j++) {
-            Symlink *other = &symlinks[j];
-            // Check if current sym is a prefix of other sym
-            if (strncmp(other->sym, current_sym_with_slash, sym_len) == 0) {
-                // Replace the prefix with current dst
-                char new_sym[PATH_MAX + 1];
-                snprintf(new_sym, PATH_MAX + 1, "%s%s", current_dst_with_slash, other->sym + sym_len);
-                strncpy(other->sym, new_sym, PATH_MAX - 1);
-                other->sym[PATH_MAX - 1] = '\0';
-            }
-
-            // Check if current sym is a prefix of other dst
-            if (strncmp(other->dst, current_sym_with_slash, sym_len) == 0) {
-                // Replace the prefix with current dst
-                char new_dst[PATH_MAX + 1];
-                snprintf(new_dst, PATH_MAX + 1, "%s%s", current_dst_with_slash, other->dst + sym_len);
-                strncpy(other->dst, new_dst, PATH_MAX - 1);
-                other->dst[PATH_MAX - 1] = '\0';
-            }
+        TrieNode *sym = trie_insert(&tables->trie, &tables->arena, current->sym, 0);
+        TrieNode *dst = trie_insert(&tables->trie, &tables->arena, current->dst, 0);
+
+        if (sym == NULL || sym->parent == NULL) continue;
+        sym = trie_child(&tables->trie, &tables->arena,
+                         trie_follow_links(&tables->trie, &tables->arena, sym->parent), sym->name);
+        current->sym = sym->path;
+
+        // Relative targets are left as they are and not followed
+        if (dst != NULL && dst->parent != NULL) {
+            dst = trie_child(&tables->trie, &tables->arena,
+                             trie_follow_links(&tables->trie, &tables->arena, dst->parent), dst->name);
+            current->dst = dst->path;
+        }
+        if (dst != NULL && sym->link == NULL && sym != dst) {
+            sym->link = dst;
         }
     }
 
     // Now, remove any symlinks where sym == dst
     int write_index = 0;
     for (int i = 0; i < *symlink_count; i++) {
-        if (strcmp(symlinks[i].sym, symlinks[i].dst) != 0) {
+        if (symlinks[i].sym != symlinks[i].dst) {
             // Keep this symlink
             if (write_index != i) {
                 symlinks[write_index] = symlinks[i];
@@ -419,13 +665,13 @@ void fix_symlinks(Symlink *symlinks, int *symlink_count) {
     *symlink_count = write_index;
 }
 
-int compare_file_copies(const void *a, const void *b) {
+static int compare_file_copies(const void *a, const void *b) {
     const FileCopy *fc1 = (const FileCopy *)a;
     const FileCopy *fc2 = (const FileCopy *)b;
     return strcmp(fc1->dst, fc2->dst);
 }
 
-void remove_duplicate_filecopies(FileCopy *file_copies, int *size) {
+static void remove_duplicate_filecopies(FileCopy *file_copies, int *size) {
     if (*size == 0) return;
 
     int write_index = 0;
@@ -446,296 +692,207 @@ void remove_duplicate_filecopies(FileCopy *file_copies, int *size) {
 }
 
 /**
- * Adds a unique string to an array of strings if not already present.
+ * Runs root_process under trace_root_process() and adds what it used to the tables: files
+ * as file copies, directories (including those it wrote into) as directories. Host paths
+ * are added as requested; symlinks on the way are resolved with everything else.
  */
-int add_unique_string(char **array, int *count, const char *new_string, int max_count) {
-    for (int i = 0; i < *count; i++) {
-        if (strcmp(array[i], new_string) == 0) {
-            return 0; // Already exists
-        }
+static int trace_full_config(FullConfig *full, int seconds) {
+    PathTables *tables = &full->tables;
+    int arg_count = full->root_process_args != NULL ? config_setting_length(full->root_process_args) : 0;
+    char **args = malloc(sizeof(char *) * (arg_count + 2));
+    TraceResult trace;
+    int ret;
+
+    if (args == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(EXIT_FAILURE);
     }
-    if (*count < max_count) {
-        strncpy(array[*count], new_string, PATH_MAX - 1);
-        array[*count][PATH_MAX - 1] = '\0';
-        (*count)++;
-        return 1; // Added successfully
+    args[0] = (char *)full->root_process;
+    for (int i = 0; i < arg_count; i++) {
+        const char *arg = config_setting_get_string_elem(full->root_process_args, i);
+        args[i + 1] = (char *)(arg != NULL ? arg : "");
     }
-    fprintf(stderr, "Error: Array is full. Cannot add %s\n", new_string);
-    return -1; // Array full
+    args[arg_count + 1] = NULL;
+
+    ret = trace_root_process(full->root_process, args, seconds, &trace);
+    free(args);
+    if (ret != 0) return -1;
+
+    for (int i = 0; i < trace.files.count; i++) {
+        add_directory_with_parents(tables, trace.files.items[i]);
+        file_copy_table_add(&tables->file_copies, &tables->arena, trace.files.items[i], trace.files.items[i]);
+    }
+    for (int i = 0; i < trace.directories.count; i++) {
+        add_directory_with_parents(tables, trace.directories.items[i]);
+    }
+    trace_result_free(&trace);
+    return 0;
 }
 
 /**
  * Adds a directory and all its parent directories to the directories array.
  */
-void add_directory_with_parents(char **directories, int *dir_count, const char *path, int max_count) {
-    char temp_path[PATH_MAX];
-    strncpy(temp_path, path, PATH_MAX - 1);
-    temp_path[PATH_MAX - 1] = '\0';
+static void add_directory_with_parents(PathTables *tables, const char *path) {
+    TrieNode *node = trie_insert(&tables->trie, &tables->arena, path, 1);
 
-    // Remove trailing slashes
-    while (strlen(temp_path) > 1 && temp_path[strlen(temp_path) - 1] == '/') {
-        temp_path[strlen(temp_path) - 1] = '\0';
+    // Only absolute paths have parents worth creating
+    if (node == NULL) {
+        string_table_add(&tables->directories, &tables->arena, path);
+        return;
     }
 
     // If the path is a file, remove the filename
-    struct stat st;
-    if (stat(temp_path, &st) != 0 || (stat(temp_path, &st) == 0 && !S_ISDIR(st.st_mode))) {
-        char *last_slash = strrchr(temp_path, '/');
-        if (last_slash != NULL && last_slash != temp_path) {
-            *last_slash = '\0';
-        } else {
-            strcpy(temp_path, "/");
-        }
+    if (!trie_is_directory(&tables->trie, &tables->arena, node)) {
+        node = node->parent != NULL ? node->parent : node;
     }
 
-    // Collect all parent directories
-    char dir_path[PATH_MAX];
-    strcpy(dir_path, temp_path);
-
-    while (1) {
-        // Break if root directory is reached
-        if (strcmp(dir_path, "/") == 0 || strlen(dir_path) == 0) {
-            break;
-        }
-
-        // Add the directory to the array
-        add_unique_string(directories, dir_count, dir_path, max_count);
-
-        // Move to parent directory
-        char *last_slash = strrchr(dir_path, '/');
-        if (last_slash != NULL) {
-            if (last_slash == dir_path) {
-                // Parent is root directory
-                strcpy(dir_path, "/");
-            } else {
-                *last_slash = '\0';
-            }
-        } else {
+    // Add the directory and its parents, up to the root; once a directory is known its parents are too
+    for (; node->parent != NULL; node = node->parent) {
+        if (!string_table_add(&tables->directories, &tables->arena, node->path)) {
             break;
         }
     }
 }
 
 /**
- * Adds a unique FileCopy to the array if not already present.
+ * Returns the real path of a collected path, or the path itself if it cannot be resolved.
+ * Parts of the path that do not exist are kept below the real path of the part that does.
  */
-int add_unique_file_copy(FileCopy *file_copies, int *count, const char *src, const char *dst, int max_count) {
-    for (int i = 0; i < *count; i++) {
-        if (strcmp(file_copies[i].src, src) == 0 && strcmp(file_copies[i].dst, dst) == 0) {
-            return 0; // Already exists
-        }
-    }
-    if (*count < max_count) {
-        strncpy(file_copies[*count].src, src, PATH_MAX - 1);
-        file_copies[*count].src[PATH_MAX - 1] = '\0';
-        strncpy(file_copies[*count].dst, dst, PATH_MAX - 1);
-        file_copies[*count].dst[PATH_MAX - 1] = '\0';
-        (*count)++;
-        return 1; // Added successfully
-    }
-    fprintf(stderr, "Error: FileCopy array is full. Cannot add %s -> %s\n", src, dst);
-    return -1; // Array full
-}
+static const char *resolve_path(PathTables *tables, const char *path) {
+    TrieNode *node = trie_insert(&tables->trie, &tables->arena, path, 1);
+    TrieNode *real;
 
-/**
- * Adds a unique Symlink to the array if not already present.
- */
-int add_unique_symlink(Symlink *symlinks, int *count, const char *sym, const char *dst, int max_count) {
-    for (int i = 0; i < *count; i++) {
-        if (strcmp(symlinks[i].sym, sym) == 0 && strcmp(symlinks[i].dst, dst) == 0) {
-            return 0; // Already exists
-        }
-    }
-    if (*count < max_count) {
-        strncpy(symlinks[*count].sym, sym, PATH_MAX - 1);
-        symlinks[*count].sym[PATH_MAX - 1] = '\0';
-        strncpy(symlinks[*count].dst, dst, PATH_MAX - 1);
-        symlinks[*count].dst[PATH_MAX - 1] = '\0';
-        (*count)++;
-        return 1; // Added successfully
-    }
-    fprintf(stderr, "Error: Symlink array is full. Cannot add %s -> %s\n", sym, dst);
-    return -1; // Array full
+    if (node == NULL) return path;
+    real = trie_resolve(&tables->trie, &tables->arena, node);
+    return real != NULL ? real->path : path;
 }
 
 /**
- * Resolves real paths in the directories array and updates symlinks array.
+ * Resolves real paths in the directories array.
  * Additionally, adds necessary parent directories of resolved paths to directories array.
  */
-void resolve_paths_in_array(char **array, int count, Symlink *symlinks, int *symlink_count, int max_symlinks,
-                            char **directories, int *dir_count, int max_directories) {
+static void resolve_paths_in_array(PathTables *tables, StringTable *array) {
+    // Entries appended while resolving are already real paths
+    int count = array->count;
+
     for (int i = 0; i < count; i++) {
-        char resolved_path[PATH_MAX];
-        if (realpath(array[i], resolved_path) != NULL) {
-            if (strcmp(array[i], resolved_path) != 0) {
-                // Save the old path before overwriting
-                char old_path[PATH_MAX];
-                strcpy(old_path, array[i]);
-
-                // [8.I.a] Add to symlinks array
-                add_unique_symlink(symlinks, symlink_count, array[i], resolved_path, max_symlinks);
-
-                // [8.I.c] Replace the item in the array with resolved path
-                strcpy(array[i], resolved_path);
-
-                // [8.I.d] Update any other paths that start with the old path
-                char old_path_with_slash[PATH_MAX + 1];
-                snprintf(old_path_with_slash, PATH_MAX + 1, "%s/", old_path);
-                for (int j = 0; j < count; j++) {
-                    if (j == i) continue; // Skip the current item
-                    if (strncmp(array[j], old_path_with_slash, strlen(old_path_with_slash)) == 0) {
-                        char new_path[PATH_MAX];
-                        snprintf(new_path, PATH_MAX + 1, "%s/%s", resolved_path, array[j] + strlen(old_path_with_slash));
-                        strcpy(array[j], new_path);
-                    }
-                }
-
-                // *** New Addition ***
-                // Add necessary parent directories of the resolved path
-                add_directory_with_parents(directories, dir_count, resolved_path, max_directories);
-            }
+        const char *resolved_path = resolve_path(tables, array->items[i]);
+        if (resolved_path != array->items[i]) {
+            // [8.I.c] Replace the item in the array with resolved path
+            string_table_set(array, &tables->arena, i, resolved_path);
+
+            // Add necessary parent directories of the resolved path
+            add_directory_with_parents(tables, resolved_path);
         }
     }
 }
 
 /**
- * Resolves real paths in the file_copies array and updates symlinks array.
+ * Resolves real paths in the file_copies array.
  * Additionally, adds necessary parent directories of resolved paths to directories array.
  */
-void resolve_paths_in_file_copies(FileCopy *file_copies, int file_copy_count, Symlink *symlinks, int *symlink_count,
-                                  int max_symlinks, char **directories, int *dir_count, int max_directories) {
+static void resolve_paths_in_file_copies(PathTables *tables) {
+    FileCopyTable *file_copies = &tables->file_copies;
+    int file_copy_count = file_copies->count;
+
     for (int i = 0; i < file_copy_count; i++) {
-        // Handle src
-        char resolved_src[PATH_MAX];
-        if (realpath(file_copies[i].src, resolved_src) != NULL) {
-            if (strcmp(file_copies[i].src, resolved_src) != 0) {
-                // Save old src
-                char old_src[PATH_MAX];
-                strcpy(old_src, file_copies[i].src);
-
-                // [9.I.a] Add to symlinks array
-                add_unique_symlink(symlinks, symlink_count, file_copies[i].src, resolved_src, max_symlinks);
-
-                // [9.I.c] Replace the src in file_copies array
-                strcpy(file_copies[i].src, resolved_src);
-
-                // [9.I.d] Update any other src paths that start with the old src
-                for (int j = 0; j < file_copy_count; j++) {
-                    if (j == i) continue; // Skip the current item
-                    if (strncmp(file_copies[j].src, old_src, strlen(old_src)) == 0) {
-                        char new_src[PATH_MAX];
-                        snprintf(new_src, PATH_MAX, "%s%s", resolved_src, file_copies[j].src + strlen(old_src));
-                        strcpy(file_copies[j].src, new_src);
-                    }
-                }
-
-                // *** New Addition ***
-                // Add necessary parent directories of the resolved src path
-                add_directory_with_parents(directories, dir_count, resolved_src, max_directories);
-            }
-        }
+        const char *resolved_src = resolve_path(tables, file_copies->items[i].src);
+        const char *resolved_dst = resolve_path(tables, file_copies->items[i].dst);
 
-        // Handle dst
-        char resolved_dst[PATH_MAX];
-        if (realpath(file_copies[i].dst, resolved_dst) != NULL) {
-            if (strcmp(file_copies[i].dst, resolved_dst) != 0) {
-                // Save old dst
-                char old_dst[PATH_MAX];
-                strcpy(old_dst, file_copies[i].dst);
-
-                // [9.I.a] Add to symlinks array
-                add_unique_symlink(symlinks, symlink_count, file_copies[i].dst, resolved_dst, max_symlinks);
-
-                // [9.I.c] Replace the dst in file_copies array
-                strcpy(file_copies[i].dst, resolved_dst);
-
-                // [9.I.d] Update any other dst paths that start with the old dst
-                for (int j = 0; j < file_copy_count; j++) {
-                    if (j == i) continue; // Skip the current item
-                    if (strncmp(file_copies[j].dst, old_dst, strlen(old_dst)) == 0) {
-                        char new_dst[PATH_MAX];
-                        snprintf(new_dst, PATH_MAX, "%s%s", resolved_dst, file_copies[j].dst + strlen(old_dst));
-                        strcpy(file_copies[j].dst, new_dst);
-                    }
-                }
-
-                // *** New Addition ***
-                // Add necessary parent directories of the resolved dst path
-                add_directory_with_parents(directories, dir_count, resolved_dst, max_directories);
-            }
+        if (resolved_src != file_copies->items[i].src) {
+            add_directory_with_parents(tables, resolved_src);
+        }
+        if (resolved_dst != file_copies->items[i].dst) {
+            add_directory_with_parents(tables, resolved_dst);
+        }
+        if (resolved_src != file_copies->items[i].src || resolved_dst != file_copies->items[i].dst) {
+            // [9.I.c] Replace the src and dst in file_copies array
+            file_copy_table_set(file_copies, &tables->arena, i, resolved_src, resolved_dst);
         }
     }
 }
 
-/**
- * Retrieves the dependencies of an executable using ldd and adds them to file_copies array.
- */
-void get_executable_dependencies(const char *executable, FileCopy *file_copies, int *file_copy_count,
-                                 int max_file_copies, char **directories, int *dir_count, int max_directories) {
-    char command[PATH_MAX + 10];
-    snprintf(command, sizeof(command), "ldd %s 2>/dev/null", executable);
-
-    FILE *fp = popen(command, "r");
-    if (fp == NULL) {
-        perror("Error executing ldd");
-        return;
-    }
+static void *closure_worker(void *arg) {
+    ClosureQueue *queue = (ClosureQueue *)arg;
+    int i;
 
-    char line[1024];
-    while (fgets(line, sizeof(line), fp) != NULL) {
-        char *start = line;
-        while (isspace((unsigned char)*start)) start++;
+    while ((i = __atomic_fetch_add(&queue->next, 1, __ATOMIC_RELAXED)) < queue->count) {
+        ClosureJob *job = &queue->jobs[i];
 
-        // Skip empty lines
-        if (*start == '\0') continue;
+        job->cached = closure_cache_lookup(queue->cache, job->executable, &job->stamp);
+        if (job->cached != NULL) continue;
 
-        char *path = NULL;
-        char *arrow = strstr(start, "=>");
-        if (arrow != NULL) {
-            // Extract path after "=>"
-            path = arrow + 2;
-            while (isspace((unsigned char)*path)) path++;
-
-            // Remove any address in parentheses
-            char *paren = strstr(path, " (");
-            if (paren != NULL) {
-                *paren = '\0';
-            }
-        } else if (start[0] == '/') {
-            // Direct path without "=>"
-            path = start;
-            // Remove any address in parentheses
-            char *paren = strstr(path, " (");
-            if (paren != NULL) {
-                *paren = '\0';
-            }
+        // Not a dynamic ELF file (script, missing file): only the file itself is copied
+        if (elf_collect_dependencies(queue->objects, job->executable, &job->deps) != 0) {
+            elf_deps_free(&job->deps);
         }
+        job->dep_stamps = malloc(sizeof(FileStamp) * (job->deps.count > 0 ? job->deps.count : 1));
+        if (job->dep_stamps == NULL) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(EXIT_FAILURE);
+        }
+        for (int j = 0; j < job->deps.count; j++) {
+            file_stamp_get(job->deps.paths[j], &job->dep_stamps[j]);
+        }
+    }
+    return NULL;
+}
 
-        if (path != NULL && path[0] == '/') {
-            // Trim trailing whitespace
-            size_t len = strlen(path);
-            while (len > 0 && isspace((unsigned char)path[len - 1])) {
-                path[--len] = '\0';
-            }
-
-            // [7.I] Add necessary parent directories
-            add_directory_with_parents(directories, dir_count, path, max_directories);
-
-            // [7.II] Add unique dependencies to file_copies array
-            add_unique_file_copy(file_copies, file_copy_count, path, path, max_file_copies);
+/**
+ * Looks up or resolves the dependency closure of every job, one executable per thread at
+ * a time. The cache is only read; libraries shared by several executables are parsed once.
+ */
+static void resolve_closures(ClosureJob *jobs, int count, const ClosureCache *cache) {
+    ElfObjectCache objects;
+    ClosureQueue queue = { jobs, count, 0, cache, &objects };
+    long workers = sysconf(_SC_NPROCESSORS_ONLN);
+    pthread_t threads[MAX_CLOSURE_WORKERS];
+    int started = 0;
+
+    if (workers > MAX_CLOSURE_WORKERS) workers = MAX_CLOSURE_WORKERS;
+    if (workers > count) workers = count;
+
+    elf_object_cache_init(&objects);
+    for (int i = 0; i < workers - 1; i++) {
+        if (pthread_create(&threads[i], NULL, closure_worker, &queue) != 0) {
+            break;
         }
+        started++;
     }
+    closure_worker(&queue);
 
-    pclose(fp);
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    elf_object_cache_free(&objects);
 }
 
 /**
- * Frees a dynamically allocated array of strings.
+ * Adds the dependencies of a resolved job to file_copies array, and its closure to the
+ * cache if it was not served from there.
  */
-void free_string_array(char **array, int count) {
-    if (array) {
-        for (int i = 0; i < count; i++) {
-            free(array[i]);
-        }
+static void add_executable_dependencies(ClosureJob *job, PathTables *tables, ClosureCache *cache,
+                                        FullConfig *full) {
+    const ClosureEntry *entry = job->cached;
+
+    if (entry != NULL) {
+        full->cache_hits++;
+    } else {
+        full->cache_misses++;
+        entry = closure_cache_store(cache, job->executable, &job->stamp, &job->deps, job->dep_stamps);
+        elf_deps_free(&job->deps);
+        free(job->dep_stamps);
+    }
+
+    input_stamps_add(&full->inputs, &tables->arena, job->executable, &job->stamp);
+    for (int i = 0; i < entry->dep_count; i++) {
+        const char *dep = entry->deps[i].path;
+        input_stamps_add(&full->inputs, &tables->arena, dep, &entry->deps[i].stamp);
+
+        // [7.I] Add necessary parent directories
+        add_directory_with_parents(tables, dep);
+
+        // [7.II] Add unique dependencies to file_copies array
+        file_copy_table_add(&tables->file_copies, &tables->arena, dep, dep);
     }
 }
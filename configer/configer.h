@@ -0,0 +1,44 @@
+#ifndef CONFIGER_H
+#define CONFIGER_H
+
+#include <stddef.h>
+#include <limits.h>
+#include <libconfig.h>
+
+#include "closure_cache.h"
+#include "pathtab.h"
+
+// Full config of one sandbox, collected from its parsed base config. The settings
+// point into the base config, which must outlive it.
+typedef struct {
+    int sandbox_id;
+    const char *root_dir;
+    const char *root_process;
+    const config_setting_t *root_process_args;
+    const config_setting_t *veth_ip_pair;
+    const char *base_layer;     // Directory of the shared base layer below tables, NULL if none
+    PathTables tables;
+    InputStamps inputs;
+    int cache_hits;
+    int cache_misses;
+} FullConfig;
+
+// Directories, file copies and symlinks common to every full config of a host. jailor
+// builds them once in dir, from the config written next to it, and mounts each sandbox's
+// own files on top.
+typedef struct {
+    char dir[PATH_MAX];
+    PathTables tables;
+} BaseLayer;
+
+int configer_collect(const config_t *cfg, const char *cache_dir, FullConfig *full);
+int configer_collect_traced(const config_t *cfg, const char *cache_dir, int seconds, FullConfig *full);
+void full_config_free(FullConfig *full);
+void configer_extract_base_layer(FullConfig *fulls, int count, const char *layer_root, BaseLayer *layer);
+int write_base_layer(const BaseLayer *layer);
+void base_layer_free(BaseLayer *layer);
+int configer_build_manifest(const config_t *cfg, const char *cache_dir, unsigned char **data, size_t *size);
+
+void write_output_config(const char *output_file, const FullConfig *full, const config_t *cfg);
+
+#endif
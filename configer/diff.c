@@ -0,0 +1,416 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <libconfig.h>
+#include <limits.h>
+#include <unistd.h>
+
+#include "../jailor/manifest.h"
+#include "closure_cache.h"
+#include "diff.h"
+#include "pathtab.h"
+
+// Content hashes of the file copies of a full config, written next to it as <file>.hashes.
+// Each line is "<hash> <dev> <ino> <size> <mtime> <mtime_ns> <ctime> <ctime_ns> <dst>",
+// with the identity the source had when it was hashed: an unchanged source is not read again.
+#define HASHES_SUFFIX ".hashes"
+#define HASHES_MAGIC "configer-hashes 1"
+#define LINE_MAX_LEN (PATH_MAX + 256)
+
+// Struct to hold the content hash of one file copy, keyed by its path in the sandbox
+typedef struct {
+    const char *dst;
+    uint64_t hash;
+    FileStamp stamp;
+} FileHash;
+
+// Struct to hold the rootfs sections of a full config, each sorted by its key
+typedef struct {
+    config_t cfg;
+    const char *root_dir;
+    const char **directories;
+    int directory_count;
+    FileCopy *file_copies;
+    int file_copy_count;
+    Symlink *symlinks;
+    int symlink_count;
+    FileHash *hashes;
+    int hash_count;
+    StringArena arena;      // Paths read from the hashes file
+} DiffSide;
+
+static void out_of_memory(void);
+static void *alloc_array(int count, size_t size);
+static int compare_strings(const void *a, const void *b);
+static int compare_file_copies(const void *a, const void *b);
+static int compare_symlinks(const void *a, const void *b);
+static int compare_file_hashes(const void *a, const void *b);
+static int diff_side_load(DiffSide *side, const char *file);
+static void diff_side_load_hashes(DiffSide *side, const char *file);
+static void diff_side_free(DiffSide *side);
+static const FileCopy *find_file_copy(const DiffSide *side, const char *dst);
+static const FileHash *find_hash(const DiffSide *side, const char *dst);
+static int hash_file(const char *path, uint64_t *hash);
+static int write_hashes(const char *file, const FileHash *hashes, int count);
+static void write_string_list(FILE *fp, const char *name, const char **items, int count);
+static void write_pair_list(FILE *fp, const char *name, const char *first, const char *second,
+                            const char **firsts, const char **seconds, int count);
+
+static void out_of_memory(void) {
+    fprintf(stderr, "Memory allocation failed\n");
+    exit(EXIT_FAILURE);
+}
+
+static void *alloc_array(int count, size_t size) {
+    void *array = malloc(size * (count > 0 ? count : 1));
+
+    if (array == NULL) out_of_memory();
+    return array;
+}
+
+static int compare_strings(const void *a, const void *b) {
+    return strcmp(*(const char * const *)a, *(const char * const *)b);
+}
+
+static int compare_file_copies(const void *a, const void *b) {
+    return strcmp(((const FileCopy *)a)->dst, ((const FileCopy *)b)->dst);
+}
+
+static int compare_symlinks(const void *a, const void *b) {
+    return strcmp(((const Symlink *)a)->sym, ((const Symlink *)b)->sym);
+}
+
+static int compare_file_hashes(const void *a, const void *b) {
+    return strcmp(((const FileHash *)a)->dst, ((const FileHash *)b)->dst);
+}
+
+/**
+ * Reads the directories, file_copies and symlinks of a full config written by configer,
+ * and the content hashes recorded next to it. file "-" stands for an empty rootfs.
+ * Returns 0 on success, -1 with a message printed on a parse error.
+ */
+static int diff_side_load(DiffSide *side, const char *file) {
+    const config_setting_t *setting;
+
+    memset(side, 0, sizeof(*side));
+    config_init(&side->cfg);
+    if (strcmp(file, "-") == 0) return 0;
+    if (!config_read_file(&side->cfg, file)) {
+        fprintf(stderr, "%s:%d - %s\n", file, config_error_line(&side->cfg), config_error_text(&side->cfg));
+        return -1;
+    }
+    config_lookup_string(&side->cfg, "root_dir", &side->root_dir);
+
+    setting = config_lookup(&side->cfg, "directories");
+    side->directory_count = setting != NULL ? config_setting_length(setting) : 0;
+    side->directories = alloc_array(side->directory_count, sizeof(const char *));
+    for (int i = 0; i < side->directory_count; i++) {
+        const char *dir = config_setting_get_string_elem(setting, i);
+        side->directories[i] = dir != NULL ? dir : "";
+    }
+
+    setting = config_lookup(&side->cfg, "file_copies");
+    side->file_copy_count = setting != NULL ? config_setting_length(setting) : 0;
+    side->file_copies = alloc_array(side->file_copy_count, sizeof(FileCopy));
+    for (int i = 0; i < side->file_copy_count; i++) {
+        const config_setting_t *entry = config_setting_get_elem(setting, i);
+        if (!config_setting_lookup_string(entry, "src", &side->file_copies[i].src) ||
+            !config_setting_lookup_string(entry, "dst", &side->file_copies[i].dst)) {
+            fprintf(stderr, "%s: file copy %d lacks src or dst\n", file, i);
+            return -1;
+        }
+    }
+
+    setting = config_lookup(&side->cfg, "symlinks");
+    side->symlink_count = setting != NULL ? config_setting_length(setting) : 0;
+    side->symlinks = alloc_array(side->symlink_count, sizeof(Symlink));
+    for (int i = 0; i < side->symlink_count; i++) {
+        const config_setting_t *entry = config_setting_get_elem(setting, i);
+        if (!config_setting_lookup_string(entry, "sym", &side->symlinks[i].sym) ||
+            !config_setting_lookup_string(entry, "dst", &side->symlinks[i].dst)) {
+            fprintf(stderr, "%s: symlink %d lacks sym or dst\n", file, i);
+            return -1;
+        }
+    }
+
+    qsort(side->directories, side->directory_count, sizeof(const char *), compare_strings);
+    qsort(side->file_copies, side->file_copy_count, sizeof(FileCopy), compare_file_copies);
+    qsort(side->symlinks, side->symlink_count, sizeof(Symlink), compare_symlinks);
+    diff_side_load_hashes(side, file);
+    return 0;
+}
+
+/**
+ * Loads <file>.hashes. Without it nothing is known about the content that was applied,
+ * and every file copy counts as changed.
+ */
+static void diff_side_load_hashes(DiffSide *side, const char *file) {
+    char hashes_path[PATH_MAX + sizeof(HASHES_SUFFIX)];
+    char line[LINE_MAX_LEN];
+    int capacity = 0;
+    FILE *fp;
+
+    snprintf(hashes_path, sizeof(hashes_path), "%s%s", file, HASHES_SUFFIX);
+    fp = fopen(hashes_path, "r");
+    if (fp == NULL) return;
+    if (fgets(line, sizeof(line), fp) == NULL || strcmp(line, HASHES_MAGIC "\n") != 0) {
+        fclose(fp);
+        return;
+    }
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        unsigned long long hash;
+        FileStamp stamp;
+        int consumed = 0;
+        char *dst;
+
+        memset(&stamp, 0, sizeof(stamp));
+        if (sscanf(line, "%llx %llu %llu %lld %lld %ld %lld %ld %n", &hash, &stamp.dev, &stamp.ino, &stamp.size,
+                   &stamp.mtime_sec, &stamp.mtime_nsec, &stamp.ctime_sec, &stamp.ctime_nsec, &consumed) != 8) {
+            continue;
+        }
+        dst = line + consumed;
+        dst[strcspn(dst, "\n")] = '\0';
+        if (*dst != '/') continue;
+
+        if (side->hash_count == capacity) {
+            capacity = capacity ? capacity * 2 : 256;
+            side->hashes = realloc(side->hashes, sizeof(FileHash) * capacity);
+            if (side->hashes == NULL) out_of_memory();
+        }
+        side->hashes[side->hash_count].dst = arena_intern(&side->arena, dst);
+        side->hashes[side->hash_count].hash = hash;
+        side->hashes[side->hash_count].stamp = stamp;
+        side->hash_count++;
+    }
+    fclose(fp);
+    qsort(side->hashes, side->hash_count, sizeof(FileHash), compare_file_hashes);
+}
+
+static void diff_side_free(DiffSide *side) {
+    free(side->directories);
+    free(side->file_copies);
+    free(side->symlinks);
+    free(side->hashes);
+    arena_free(&side->arena);
+    config_destroy(&side->cfg);
+}
+
+static const FileCopy *find_file_copy(const DiffSide *side, const char *dst) {
+    FileCopy key = { NULL, dst };
+
+    return bsearch(&key, side->file_copies, side->file_copy_count, sizeof(FileCopy), compare_file_copies);
+}
+
+static const FileHash *find_hash(const DiffSide *side, const char *dst) {
+    FileHash key;
+
+    key.dst = dst;
+    return bsearch(&key, side->hashes, side->hash_count, sizeof(FileHash), compare_file_hashes);
+}
+
+/**
+ * FNV-1a over the content of a file. Returns 0 on success, -1 if it cannot be read.
+ */
+static int hash_file(const char *path, uint64_t *hash) {
+    static unsigned char buf[1 << 16];
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    ssize_t n;
+
+    if (fd < 0) return -1;
+    *hash = MANIFEST_FNV_OFFSET;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        *hash = manifest_checksum(*hash, buf, n);
+    }
+    close(fd);
+    return n < 0 ? -1 : 0;
+}
+
+static int write_hashes(const char *file, const FileHash *hashes, int count) {
+    char hashes_path[PATH_MAX + sizeof(HASHES_SUFFIX)];
+    char tmp_path[PATH_MAX + sizeof(HASHES_SUFFIX) + 32];
+    FILE *fp;
+
+    snprintf(hashes_path, sizeof(hashes_path), "%s%s", file, HASHES_SUFFIX);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d", hashes_path, getpid());
+    fp = fopen(tmp_path, "w");
+    if (fp == NULL) {
+        perror("Error opening hashes file");
+        return -1;
+    }
+    fprintf(fp, "%s\n", HASHES_MAGIC);
+    for (int i = 0; i < count; i++) {
+        const FileStamp *stamp = &hashes[i].stamp;
+
+        if (strchr(hashes[i].dst, '\n') != NULL) continue;
+        fprintf(fp, "%016llx %llu %llu %lld %lld %ld %lld %ld %s\n", (unsigned long long)hashes[i].hash,
+                stamp->dev, stamp->ino, stamp->size, stamp->mtime_sec, stamp->mtime_nsec, stamp->ctime_sec,
+                stamp->ctime_nsec, hashes[i].dst);
+    }
+    if (fclose(fp) != 0 || rename(tmp_path, hashes_path) != 0) {
+        perror("Error writing hashes file");
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+static void write_string_list(FILE *fp, const char *name, const char **items, int count) {
+    fprintf(fp, "%s = (\n", name);
+    for (int i = 0; i < count; i++) {
+        fprintf(fp, "    \"%s\"%s\n", items[i], i < count - 1 ? "," : "");
+    }
+    fprintf(fp, ")\n");
+}
+
+static void write_pair_list(FILE *fp, const char *name, const char *first, const char *second,
+                            const char **firsts, const char **seconds, int count) {
+    fprintf(fp, "%s = (\n", name);
+    for (int i = 0; i < count; i++) {
+        fprintf(fp, "    {\n        %s = \"%s\",\n        %s = \"%s\"\n    }%s\n", first, firsts[i], second,
+                seconds[i], i < count - 1 ? "," : "");
+    }
+    fprintf(fp, ")\n");
+}
+
+/**
+ * Compares the full config next_file with applied_file, the one the persistent rootfs was
+ * last built or updated from ("-" if none), and writes what changed to delta_file for
+ * jailor --update: directories, file copies and symlinks to add or replace, and paths to
+ * remove. A file copy counts as changed when the content of its source differs from what
+ * was applied, by the hashes recorded next to applied_file; the hashes of next_file are
+ * recorded for the next update. Returns 0 on success, -1 with a message printed on failure.
+ */
+int configer_diff(const char *applied_file, const char *next_file, const char *delta_file) {
+    DiffSide applied, next;
+    const char **added_dirs, **removed_dirs, **removed_files, **removed_syms;
+    const char **copy_src, **copy_dst, **link_sym, **link_dst;
+    int added_dir_count = 0, removed_dir_count = 0, removed_file_count = 0, removed_sym_count = 0;
+    int copy_count = 0, link_count = 0;
+    long long copy_bytes = 0;
+    FileHash *next_hashes;
+    int ret = -1;
+    FILE *fp;
+
+    int applied_status = diff_side_load(&applied, applied_file);
+    int next_status = diff_side_load(&next, next_file);
+    if (next_status == 0 && next.root_dir == NULL) {
+        fprintf(stderr, "Error: %s has no 'root_dir'.\n", next_file);
+        next_status = -1;
+    }
+    if (applied_status != 0 || next_status != 0) {
+        diff_side_free(&applied);
+        diff_side_free(&next);
+        return -1;
+    }
+
+    added_dirs = alloc_array(next.directory_count, sizeof(const char *));
+    removed_dirs = alloc_array(applied.directory_count, sizeof(const char *));
+    removed_files = alloc_array(applied.file_copy_count, sizeof(const char *));
+    removed_syms = alloc_array(applied.symlink_count, sizeof(const char *));
+    copy_src = alloc_array(next.file_copy_count, sizeof(const char *));
+    copy_dst = alloc_array(next.file_copy_count, sizeof(const char *));
+    link_sym = alloc_array(next.symlink_count, sizeof(const char *));
+    link_dst = alloc_array(next.symlink_count, sizeof(const char *));
+    next_hashes = alloc_array(next.file_copy_count, sizeof(FileHash));
+
+    // Both directory lists are sorted, so one merge pass finds what was added and removed
+    for (int i = 0, j = 0; i < applied.directory_count || j < next.directory_count;) {
+        int cmp = i == applied.directory_count ? 1 : j == next.directory_count ? -1
+                : strcmp(applied.directories[i], next.directories[j]);
+        if (cmp < 0) {
+            removed_dirs[removed_dir_count++] = applied.directories[i++];
+        } else if (cmp > 0) {
+            added_dirs[added_dir_count++] = next.directories[j++];
+        } else {
+            i++;
+            j++;
+        }
+    }
+
+    // An unchanged source (same path and identity as when it was hashed) is not read again
+    for (int i = 0; i < next.file_copy_count; i++) {
+        const FileCopy *file_copy = &next.file_copies[i];
+        const FileCopy *old = find_file_copy(&applied, file_copy->dst);
+        const FileHash *old_hash = old != NULL ? find_hash(&applied, file_copy->dst) : NULL;
+        FileHash *hash = &next_hashes[i];
+
+        hash->dst = file_copy->dst;
+        file_stamp_get(file_copy->src, &hash->stamp);
+        if (old_hash != NULL && strcmp(old->src, file_copy->src) == 0 &&
+            file_stamp_equal(&old_hash->stamp, &hash->stamp)) {
+            hash->hash = old_hash->hash;
+        } else if (hash_file(file_copy->src, &hash->hash) != 0) {
+            fprintf(stderr, "Warning: cannot read %s\n", file_copy->src);
+            hash->hash = 0;
+        }
+        if (old_hash == NULL || old_hash->hash != hash->hash) {
+            copy_src[copy_count] = file_copy->src;
+            copy_dst[copy_count++] = file_copy->dst;
+            copy_bytes += hash->stamp.size;
+        }
+    }
+    for (int i = 0; i < applied.file_copy_count; i++) {
+        if (find_file_copy(&next, applied.file_copies[i].dst) == NULL) {
+            removed_files[removed_file_count++] = applied.file_copies[i].dst;
+        }
+    }
+
+    for (int i = 0, j = 0; i < applied.symlink_count || j < next.symlink_count;) {
+        int cmp = i == applied.symlink_count ? 1 : j == next.symlink_count ? -1
+                : strcmp(applied.symlinks[i].sym, next.symlinks[j].sym);
+        if (cmp < 0) {
+            removed_syms[removed_sym_count++] = applied.symlinks[i++].sym;
+        } else {
+            if (cmp > 0 || strcmp(applied.symlinks[i].dst, next.symlinks[j].dst) != 0) {
+                link_sym[link_count] = next.symlinks[j].sym;
+                link_dst[link_count++] = next.symlinks[j].dst;
+            }
+            if (cmp == 0) i++;
+            j++;
+        }
+    }
+
+    // Directories are removed children first, once the files in them are gone
+    for (int i = 0; i < removed_dir_count / 2; i++) {
+        const char *swap = removed_dirs[i];
+        removed_dirs[i] = removed_dirs[removed_dir_count - 1 - i];
+        removed_dirs[removed_dir_count - 1 - i] = swap;
+    }
+
+    fp = fopen(delta_file, "w");
+    if (fp == NULL) {
+        perror("Error opening delta file");
+    } else {
+        fprintf(fp, "root_dir = \"%s\"\n", next.root_dir);
+        write_string_list(fp, "directories", added_dirs, added_dir_count);
+        write_pair_list(fp, "file_copies", "src", "dst", copy_src, copy_dst, copy_count);
+        write_pair_list(fp, "symlinks", "sym", "dst", link_sym, link_dst, link_count);
+        write_string_list(fp, "removed_files", removed_files, removed_file_count);
+        write_string_list(fp, "removed_symlinks", removed_syms, removed_sym_count);
+        write_string_list(fp, "removed_directories", removed_dirs, removed_dir_count);
+        if (fclose(fp) != 0) {
+            perror("Error writing delta file");
+        } else if (write_hashes(next_file, next_hashes, next.file_copy_count) == 0) {
+            printf("Delta written to %s: %d directories, %d file copies (%lld bytes), %d symlinks to add or "
+                   "replace; %d files, %d symlinks, %d directories to remove\n", delta_file, added_dir_count,
+                   copy_count, copy_bytes, link_count, removed_file_count, removed_sym_count, removed_dir_count);
+            ret = 0;
+        }
+    }
+
+    free(added_dirs);
+    free(removed_dirs);
+    free(removed_files);
+    free(removed_syms);
+    free(copy_src);
+    free(copy_dst);
+    free(link_sym);
+    free(link_dst);
+    free(next_hashes);
+    diff_side_free(&applied);
+    diff_side_free(&next);
+    return ret;
+}
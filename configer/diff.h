@@ -0,0 +1,6 @@
+#ifndef DIFF_H
+#define DIFF_H
+
+int configer_diff(const char *applied_file, const char *next_file, const char *delta_file);
+
+#endif
@@ -0,0 +1,770 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <elf.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "elfdeps.h"
+
+#define LD_SO_CACHE "/etc/ld.so.cache"
+#define CACHE_MAGIC_OLD "ld.so-1.7.0"
+#define CACHE_MAGIC_NEW "glibc-ld.so.cache1.1"
+#define MAX_NEEDED 256
+
+// Header of the new ld.so.cache format; string offsets are relative to it
+typedef struct {
+    char magic[17];
+    char version[3];
+    uint32_t nlibs;
+    uint32_t len_strings;
+    uint8_t flags;
+    uint8_t padding[3];
+    uint32_t extension_offset;
+    uint32_t unused[3];
+} CacheHeader;
+
+typedef struct {
+    int32_t flags;
+    uint32_t key;
+    uint32_t value;
+    uint32_t osversion;
+    uint64_t hwcap;
+} CacheEntry;
+
+// Structure to hold a mapped ELF file
+typedef struct {
+    const unsigned char *data;
+    size_t size;
+    int elf_class;
+    int machine;
+} ElfImage;
+
+// Structure to hold what the dynamic loader needs to know about one object
+typedef struct {
+    char interp[PATH_MAX];
+    char *needed[MAX_NEEDED];
+    int needed_count;
+    char *rpath;
+    char *runpath;
+} ElfDynamic;
+
+// A library as far as closure resolution needs it, parsed once per ElfObjectCache
+typedef struct {
+    int ok;                 // A readable ELF object
+    char *origin;           // Directory of its real path, for $ORIGIN
+    char **needed;
+    int needed_count;
+    char *rpath;
+    char *runpath;
+} ElfObject;
+
+static const char *default_dirs_64[] = { "/lib64", "/usr/lib64", "/lib", "/usr/lib", NULL };
+static const char *default_dirs_32[] = { "/lib", "/usr/lib", NULL };
+
+static const unsigned char *cache_data = NULL;
+static size_t cache_size = 0;
+static const CacheHeader *cache_header = NULL;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+
+static int elf_map(const char *path, ElfImage *image);
+static void elf_unmap(ElfImage *image);
+static int elf_matches(const char *path, int elf_class, int machine);
+static int elf_program_header(const ElfImage *image, int index, uint32_t *type, uint64_t *offset,
+                              uint64_t *vaddr, uint64_t *filesz);
+static int elf_vaddr_to_offset(const ElfImage *image, uint64_t vaddr, uint64_t *offset);
+static int elf_read_dynamic(const ElfImage *image, ElfDynamic *dynamic);
+static void elf_dynamic_free(ElfDynamic *dynamic);
+static void cache_load(void);
+static int cache_lookup(const char *name, int elf_class, int machine, char *out);
+static int search_path_list(const char *list, const char *origin, const char *name, int elf_class, int machine,
+                            char *out);
+static int system_lookup(ElfObjectCache *objects, const char *name, int elf_class, int machine, char *out);
+static int resolve_library(ElfObjectCache *objects, const char *name, const char *rpath, const char *runpath,
+                           const char *origin, const char *exe_rpath, int elf_class, int machine, char *out);
+static uint64_t memo_hash(const char *key);
+static ElfMemoEntry *memo_find(const ElfMemo *memo, const char *key, uint64_t hash);
+static void memo_insert(ElfMemo *memo, char *key, uint64_t hash, void *value);
+static void object_origin(const char *path, char *origin);
+static ElfObject *object_load(const char *path);
+static void object_free(ElfObject *object);
+static const ElfObject *object_get(ElfObjectCache *objects, const char *path, ElfObject **owned);
+static int deps_add(ElfDeps *deps, const char *path);
+static int deps_find_loaded(const ElfDeps *deps, const char *name);
+
+/**
+ * Maps an ELF file read-only and validates its identification bytes.
+ */
+static int elf_map(const char *path, ElfImage *image) {
+    struct stat st;
+    void *data;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) return -1;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || (size_t)st.st_size < sizeof(Elf32_Ehdr)) {
+        close(fd);
+        return -1;
+    }
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return -1;
+
+    image->data = data;
+    image->size = st.st_size;
+    image->elf_class = image->data[EI_CLASS];
+    if (memcmp(image->data, ELFMAG, SELFMAG) != 0 ||
+        (image->elf_class != ELFCLASS32 && image->elf_class != ELFCLASS64) ||
+        (image->elf_class == ELFCLASS64 && image->size < sizeof(Elf64_Ehdr))) {
+        elf_unmap(image);
+        return -1;
+    }
+    image->machine = image->elf_class == ELFCLASS64 ? ((const Elf64_Ehdr *)image->data)->e_machine
+                                                     : ((const Elf32_Ehdr *)image->data)->e_machine;
+    return 0;
+}
+
+static void elf_unmap(ElfImage *image) {
+    munmap((void *)image->data, image->size);
+    image->data = NULL;
+}
+
+/**
+ * Checks that a candidate library can be loaded by an object of the given class and machine,
+ * the way ld.so skips e.g. 32-bit libraries when resolving for a 64-bit executable.
+ */
+static int elf_matches(const char *path, int elf_class, int machine) {
+    unsigned char header[sizeof(Elf64_Ehdr)];
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    ssize_t n;
+    int header_machine;
+
+    if (fd < 0) return 0;
+    n = read(fd, header, sizeof(header));
+    close(fd);
+    if (n < (ssize_t)sizeof(Elf32_Ehdr) || memcmp(header, ELFMAG, SELFMAG) != 0 || header[EI_CLASS] != elf_class) {
+        return 0;
+    }
+    header_machine = elf_class == ELFCLASS64 ? ((const Elf64_Ehdr *)header)->e_machine
+                                             : ((const Elf32_Ehdr *)header)->e_machine;
+    return header_machine == machine;
+}
+
+/**
+ * Reads program header `index` of either ELF class. Returns -1 if it lies outside the file.
+ */
+static int elf_program_header(const ElfImage *image, int index, uint32_t *type, uint64_t *offset,
+                              uint64_t *vaddr, uint64_t *filesz) {
+    if (image->elf_class == ELFCLASS64) {
+        const Elf64_Ehdr *ehdr = (const Elf64_Ehdr *)image->data;
+        uint64_t at = ehdr->e_phoff + (uint64_t)index * sizeof(Elf64_Phdr);
+        const Elf64_Phdr *phdr;
+
+        if (at + sizeof(Elf64_Phdr) > image->size) return -1;
+        phdr = (const Elf64_Phdr *)(image->data + at);
+        *type = phdr->p_type;
+        *offset = phdr->p_offset;
+        *vaddr = phdr->p_vaddr;
+        *filesz = phdr->p_filesz;
+    } else {
+        const Elf32_Ehdr *ehdr = (const Elf32_Ehdr *)image->data;
+        uint64_t at = ehdr->e_phoff + (uint64_t)index * sizeof(Elf32_Phdr);
+        const Elf32_Phdr *phdr;
+
+        if (at + sizeof(Elf32_Phdr) > image->size) return -1;
+        phdr = (const Elf32_Phdr *)(image->data + at);
+        *type = phdr->p_type;
+        *offset = phdr->p_offset;
+        *vaddr = phdr->p_vaddr;
+        *filesz = phdr->p_filesz;
+    }
+    return 0;
+}
+
+/**
+ * Translates a virtual address (e.g. DT_STRTAB) to a file offset through the PT_LOAD segments.
+ */
+static int elf_vaddr_to_offset(const ElfImage *image, uint64_t vaddr, uint64_t *offset) {
+    int phnum = image->elf_class == ELFCLASS64 ? ((const Elf64_Ehdr *)image->data)->e_phnum
+                                               : ((const Elf32_Ehdr *)image->data)->e_phnum;
+
+    for (int i = 0; i < phnum; i++) {
+        uint32_t type;
+        uint64_t p_offset, p_vaddr, p_filesz;
+
+        if (elf_program_header(image, i, &type, &p_offset, &p_vaddr, &p_filesz) != 0) return -1;
+        if (type == PT_LOAD && vaddr >= p_vaddr && vaddr < p_vaddr + p_filesz) {
+            *offset = p_offset + (vaddr - p_vaddr);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Extracts PT_INTERP and the DT_NEEDED, DT_RPATH and DT_RUNPATH strings of an object.
+ * Strings are copied, so the image can be unmapped afterwards.
+ */
+static int elf_read_dynamic(const ElfImage *image, ElfDynamic *dynamic) {
+    int phnum = image->elf_class == ELFCLASS64 ? ((const Elf64_Ehdr *)image->data)->e_phnum
+                                               : ((const Elf32_Ehdr *)image->data)->e_phnum;
+    size_t dyn_size = image->elf_class == ELFCLASS64 ? sizeof(Elf64_Dyn) : sizeof(Elf32_Dyn);
+    uint64_t dyn_offset = 0, dyn_filesz = 0, strtab = 0, strsz = 0, strtab_offset;
+    uint64_t needed[MAX_NEEDED];
+    int64_t rpath = -1, runpath = -1;
+    int needed_count = 0;
+
+    memset(dynamic, 0, sizeof(*dynamic));
+
+    for (int i = 0; i < phnum; i++) {
+        uint32_t type;
+        uint64_t offset, vaddr, filesz;
+
+        if (elf_program_header(image, i, &type, &offset, &vaddr, &filesz) != 0) return -1;
+        if (type == PT_INTERP && offset + filesz <= image->size && filesz > 0 && filesz < PATH_MAX) {
+            memcpy(dynamic->interp, image->data + offset, filesz);
+            dynamic->interp[filesz - 1] = '\0';
+        } else if (type == PT_DYNAMIC) {
+            dyn_offset = offset;
+            dyn_filesz = filesz;
+        }
+    }
+    // Statically linked: nothing to resolve
+    if (dyn_filesz == 0) return 0;
+    if (dyn_offset + dyn_filesz > image->size) return -1;
+
+    for (uint64_t at = dyn_offset; at + dyn_size <= dyn_offset + dyn_filesz; at += dyn_size) {
+        int64_t tag;
+        uint64_t val;
+
+        if (image->elf_class == ELFCLASS64) {
+            const Elf64_Dyn *dyn = (const Elf64_Dyn *)(image->data + at);
+            tag = dyn->d_tag;
+            val = dyn->d_un.d_val;
+        } else {
+            const Elf32_Dyn *dyn = (const Elf32_Dyn *)(image->data + at);
+            tag = dyn->d_tag;
+            val = dyn->d_un.d_val;
+        }
+
+        if (tag == DT_NULL) break;
+        switch (tag) {
+        case DT_NEEDED:
+            if (needed_count < MAX_NEEDED) needed[needed_count++] = val;
+            break;
+        case DT_STRTAB:
+            strtab = val;
+            break;
+        case DT_STRSZ:
+            strsz = val;
+            break;
+        case DT_RPATH:
+            rpath = val;
+            break;
+        case DT_RUNPATH:
+            runpath = val;
+            break;
+        default:
+            break;
+        }
+    }
+
+    if (elf_vaddr_to_offset(image, strtab, &strtab_offset) != 0 || strtab_offset + strsz > image->size) {
+        return -1;
+    }
+
+    // Every string must end inside the string table
+    for (int i = 0; i < needed_count; i++) {
+        if (needed[i] >= strsz || memchr(image->data + strtab_offset + needed[i], '\0', strsz - needed[i]) == NULL) {
+            continue;
+        }
+        dynamic->needed[dynamic->needed_count++] = strdup((const char *)image->data + strtab_offset + needed[i]);
+    }
+    if (rpath >= 0 && (uint64_t)rpath < strsz &&
+        memchr(image->data + strtab_offset + rpath, '\0', strsz - rpath) != NULL) {
+        dynamic->rpath = strdup((const char *)image->data + strtab_offset + rpath);
+    }
+    if (runpath >= 0 && (uint64_t)runpath < strsz &&
+        memchr(image->data + strtab_offset + runpath, '\0', strsz - runpath) != NULL) {
+        dynamic->runpath = strdup((const char *)image->data + strtab_offset + runpath);
+    }
+    return 0;
+}
+
+static void elf_dynamic_free(ElfDynamic *dynamic) {
+    for (int i = 0; i < dynamic->needed_count; i++) {
+        free(dynamic->needed[i]);
+    }
+    free(dynamic->rpath);
+    free(dynamic->runpath);
+    memset(dynamic, 0, sizeof(*dynamic));
+}
+
+/**
+ * Maps /etc/ld.so.cache; run once through cache_once, as resolvers may be concurrent.
+ * Both the new format and the old format with the new one appended are understood;
+ * without a cache only the default paths are searched.
+ */
+static void cache_load(void) {
+    struct stat st;
+    size_t offset = 0;
+    void *data;
+    int fd;
+
+    fd = open(LD_SO_CACHE, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(CacheHeader)) {
+        close(fd);
+        return;
+    }
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return;
+
+    cache_data = data;
+    cache_size = st.st_size;
+
+    if (memcmp(cache_data, CACHE_MAGIC_OLD, strlen(CACHE_MAGIC_OLD)) == 0) {
+        // Old header (magic + nlibs) and 12-byte entries, then the new cache 8-byte aligned
+        uint32_t old_nlibs;
+        memcpy(&old_nlibs, cache_data + 12, sizeof(old_nlibs));
+        offset = (16 + (size_t)old_nlibs * 12 + 7) & ~(size_t)7;
+    }
+    if (offset + sizeof(CacheHeader) > cache_size ||
+        memcmp(cache_data + offset, CACHE_MAGIC_NEW, strlen(CACHE_MAGIC_NEW)) != 0) {
+        return;
+    }
+    cache_header = (const CacheHeader *)(cache_data + offset);
+    if (offset + sizeof(CacheHeader) + (size_t)cache_header->nlibs * sizeof(CacheEntry) > cache_size) {
+        cache_header = NULL;
+    }
+}
+
+/**
+ * Looks a soname up in ld.so.cache and copies the first loadable match into out.
+ */
+static int cache_lookup(const char *name, int elf_class, int machine, char *out) {
+    const CacheEntry *entries;
+    size_t base;
+
+    pthread_once(&cache_once, cache_load);
+    if (cache_header == NULL) return -1;
+
+    entries = (const CacheEntry *)(cache_header + 1);
+    base = (const unsigned char *)cache_header - cache_data;
+
+    for (uint32_t i = 0; i < cache_header->nlibs; i++) {
+        const char *key, *value;
+
+        if (base + entries[i].key >= cache_size || base + entries[i].value >= cache_size) continue;
+        key = (const char *)cache_header + entries[i].key;
+        value = (const char *)cache_header + entries[i].value;
+        if (memchr(key, '\0', cache_size - base - entries[i].key) == NULL ||
+            memchr(value, '\0', cache_size - base - entries[i].value) == NULL) {
+            continue;
+        }
+        if (strcmp(key, name) == 0 && elf_matches(value, elf_class, machine)) {
+            snprintf(out, PATH_MAX, "%s", value);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Searches a colon-separated RPATH/RUNPATH list, expanding $ORIGIN to the object's directory.
+ */
+static int search_path_list(const char *list, const char *origin, const char *name, int elf_class, int machine,
+                            char *out) {
+    const char *p = list;
+
+    while (p != NULL && *p != '\0') {
+        const char *end = strchr(p, ':');
+        size_t len = end != NULL ? (size_t)(end - p) : strlen(p);
+        char dir[PATH_MAX];
+        char candidate[2 * PATH_MAX];
+
+        if (len > 0 && len < sizeof(dir)) {
+            memcpy(dir, p, len);
+            dir[len] = '\0';
+
+            if (strncmp(dir, "$ORIGIN", 7) == 0 || strncmp(dir, "${ORIGIN}", 9) == 0) {
+                const char *rest = dir + (dir[1] == '{' ? 9 : 7);
+                snprintf(candidate, sizeof(candidate), "%s%s/%s", origin, rest, name);
+            } else {
+                snprintf(candidate, sizeof(candidate), "%s/%s", dir, name);
+            }
+            if (strlen(candidate) < PATH_MAX && elf_matches(candidate, elf_class, machine)) {
+                snprintf(out, PATH_MAX, "%s", candidate);
+                return 0;
+            }
+        }
+        p = end != NULL ? end + 1 : NULL;
+    }
+    return -1;
+}
+
+/**
+ * The part of the search that depends only on the soname: ld.so.cache, then the default
+ * directories. Memoized in objects, as most DT_NEEDED entries end up here.
+ */
+static int system_lookup(ElfObjectCache *objects, const char *name, int elf_class, int machine, char *out) {
+    const char **dirs = elf_class == ELFCLASS64 ? default_dirs_64 : default_dirs_32;
+    char key[PATH_MAX + 32];
+    ElfMemoEntry *entry;
+    uint64_t hash = 0;
+    char *found = NULL;
+    int ret = -1;
+
+    if (objects != NULL) {
+        snprintf(key, sizeof(key), "%d:%d:%s", elf_class, machine, name);
+        hash = memo_hash(key);
+        pthread_mutex_lock(&objects->lock);
+        entry = memo_find(&objects->sonames, key, hash);
+        if (entry != NULL) {
+            if (entry->value != NULL) snprintf(out, PATH_MAX, "%s", (const char *)entry->value);
+            ret = entry->value != NULL ? 0 : -1;
+        }
+        pthread_mutex_unlock(&objects->lock);
+        if (entry != NULL) return ret;
+    }
+
+    if (cache_lookup(name, elf_class, machine, out) == 0) {
+        ret = 0;
+    } else {
+        for (int i = 0; dirs[i] != NULL; i++) {
+            char candidate[PATH_MAX];
+            snprintf(candidate, sizeof(candidate), "%s/%s", dirs[i], name);
+            if (elf_matches(candidate, elf_class, machine)) {
+                snprintf(out, PATH_MAX, "%s", candidate);
+                ret = 0;
+                break;
+            }
+        }
+    }
+
+    if (objects != NULL) {
+        char *owned_key = strdup(key);
+        if (ret == 0) found = strdup(out);
+        pthread_mutex_lock(&objects->lock);
+        if (owned_key != NULL && (ret != 0 || found != NULL) && memo_find(&objects->sonames, key, hash) == NULL) {
+            memo_insert(&objects->sonames, owned_key, hash, found);
+            owned_key = NULL;
+            found = NULL;
+        }
+        pthread_mutex_unlock(&objects->lock);
+        free(owned_key);
+        free(found);
+    }
+    return ret;
+}
+
+/**
+ * Resolves one DT_NEEDED entry in ld.so order: DT_RPATH (of the object, then of the
+ * executable) unless the object has DT_RUNPATH, then DT_RUNPATH, ld.so.cache and the
+ * default directories. LD_LIBRARY_PATH is deliberately ignored so the closure does
+ * not depend on configer's environment.
+ */
+static int resolve_library(ElfObjectCache *objects, const char *name, const char *rpath, const char *runpath,
+                           const char *origin, const char *exe_rpath, int elf_class, int machine, char *out) {
+    if (strchr(name, '/') != NULL) {
+        if (!elf_matches(name, elf_class, machine)) return -1;
+        snprintf(out, PATH_MAX, "%s", name);
+        return 0;
+    }
+    if (runpath == NULL) {
+        if (search_path_list(rpath, origin, name, elf_class, machine, out) == 0) return 0;
+        if (search_path_list(exe_rpath, origin, name, elf_class, machine, out) == 0) return 0;
+    }
+    if (search_path_list(runpath, origin, name, elf_class, machine, out) == 0) return 0;
+    return system_lookup(objects, name, elf_class, machine, out);
+}
+
+static uint64_t memo_hash(const char *key) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (const unsigned char *p = (const unsigned char *)key; *p != '\0'; p++) {
+        hash ^= *p;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static ElfMemoEntry *memo_find(const ElfMemo *memo, const char *key, uint64_t hash) {
+    if (memo->slot_count == 0) return NULL;
+    for (size_t i = hash & (memo->slot_count - 1); memo->slots[i].key != NULL; i = (i + 1) & (memo->slot_count - 1)) {
+        if (memo->slots[i].hash == hash && strcmp(memo->slots[i].key, key) == 0) return &memo->slots[i];
+    }
+    return NULL;
+}
+
+/**
+ * Adds a key the memo does not hold yet; the memo takes ownership of key. Entries are
+ * never removed, and values live outside the table, so they stay valid while it grows.
+ */
+static void memo_insert(ElfMemo *memo, char *key, uint64_t hash, void *value) {
+    size_t i;
+
+    if ((memo->used + 1) * 2 > memo->slot_count) {
+        ElfMemo grown = { NULL, memo->slot_count ? memo->slot_count * 2 : 256, 0 };
+
+        grown.slots = calloc(grown.slot_count, sizeof(ElfMemoEntry));
+        if (grown.slots == NULL) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(EXIT_FAILURE);
+        }
+        for (size_t j = 0; j < memo->slot_count; j++) {
+            if (memo->slots[j].key == NULL) continue;
+            for (i = memo->slots[j].hash & (grown.slot_count - 1); grown.slots[i].key != NULL;
+                 i = (i + 1) & (grown.slot_count - 1)) {
+            }
+            grown.slots[i] = memo->slots[j];
+        }
+        grown.used = memo->used;
+        free(memo->slots);
+        *memo = grown;
+    }
+    for (i = hash & (memo->slot_count - 1); memo->slots[i].key != NULL; i = (i + 1) & (memo->slot_count - 1)) {
+    }
+    memo->slots[i].key = key;
+    memo->slots[i].hash = hash;
+    memo->slots[i].value = value;
+    memo->used++;
+}
+
+/**
+ * Directory of the real path of an object, which $ORIGIN expands to.
+ */
+static void object_origin(const char *path, char *origin) {
+    char *slash;
+
+    if (realpath(path, origin) == NULL) {
+        snprintf(origin, PATH_MAX, "%s", path);
+    }
+    slash = strrchr(origin, '/');
+    if (slash != NULL) *slash = '\0';
+}
+
+static ElfObject *object_load(const char *path) {
+    ElfObject *object = calloc(1, sizeof(ElfObject));
+    char origin[PATH_MAX];
+    ElfDynamic dynamic;
+    ElfImage image;
+
+    if (object == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+    if (elf_map(path, &image) != 0) return object;
+    if (elf_read_dynamic(&image, &dynamic) != 0) {
+        elf_unmap(&image);
+        return object;
+    }
+    elf_unmap(&image);
+
+    object_origin(path, origin);
+    object->ok = 1;
+    object->origin = strdup(origin);
+    object->needed_count = dynamic.needed_count;
+    object->needed = malloc(sizeof(char *) * (dynamic.needed_count > 0 ? dynamic.needed_count : 1));
+    if (object->origin == NULL || object->needed == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+    // The strings move over from dynamic, which is not freed
+    memcpy(object->needed, dynamic.needed, sizeof(char *) * dynamic.needed_count);
+    object->rpath = dynamic.rpath;
+    object->runpath = dynamic.runpath;
+    return object;
+}
+
+static void object_free(ElfObject *object) {
+    if (object == NULL) return;
+    for (int i = 0; i < object->needed_count; i++) {
+        free(object->needed[i]);
+    }
+    free(object->needed);
+    free(object->origin);
+    free(object->rpath);
+    free(object->runpath);
+    free(object);
+}
+
+/**
+ * Returns the parsed library at path, from objects if an earlier closure (possibly on
+ * another thread) already parsed it. Without objects the result is returned in *owned
+ * too, for the caller to free.
+ */
+static const ElfObject *object_get(ElfObjectCache *objects, const char *path, ElfObject **owned) {
+    uint64_t hash = memo_hash(path);
+    ElfMemoEntry *entry;
+    ElfObject *object;
+    char *key;
+
+    *owned = NULL;
+    if (objects == NULL) {
+        *owned = object_load(path);
+        return *owned;
+    }
+
+    pthread_mutex_lock(&objects->lock);
+    entry = memo_find(&objects->objects, path, hash);
+    object = entry != NULL ? entry->value : NULL;
+    pthread_mutex_unlock(&objects->lock);
+    if (object != NULL) return object;
+
+    // Parsed outside the lock; if another thread won the race, its copy is kept
+    object = object_load(path);
+    key = strdup(path);
+    pthread_mutex_lock(&objects->lock);
+    entry = memo_find(&objects->objects, path, hash);
+    if (entry == NULL && key != NULL) {
+        memo_insert(&objects->objects, key, hash, object);
+        pthread_mutex_unlock(&objects->lock);
+        return object;
+    }
+    pthread_mutex_unlock(&objects->lock);
+    free(key);
+    if (entry == NULL) {
+        *owned = object;
+        return object;
+    }
+    object_free(object);
+    pthread_mutex_lock(&objects->lock);
+    object = memo_find(&objects->objects, path, hash)->value;
+    pthread_mutex_unlock(&objects->lock);
+    return object;
+}
+
+void elf_object_cache_init(ElfObjectCache *objects) {
+    memset(objects, 0, sizeof(*objects));
+    pthread_mutex_init(&objects->lock, NULL);
+}
+
+void elf_object_cache_free(ElfObjectCache *objects) {
+    for (size_t i = 0; i < objects->objects.slot_count; i++) {
+        free(objects->objects.slots[i].key);
+        object_free(objects->objects.slots[i].value);
+    }
+    for (size_t i = 0; i < objects->sonames.slot_count; i++) {
+        free(objects->sonames.slots[i].key);
+        free(objects->sonames.slots[i].value);
+    }
+    free(objects->objects.slots);
+    free(objects->sonames.slots);
+    pthread_mutex_destroy(&objects->lock);
+    memset(objects, 0, sizeof(*objects));
+}
+
+/**
+ * Appends a path to the closure unless it is already there. Returns 1 if added.
+ */
+static int deps_add(ElfDeps *deps, const char *path) {
+    for (int i = 0; i < deps->count; i++) {
+        if (strcmp(deps->paths[i], path) == 0) return 0;
+    }
+    if (deps->count == deps->capacity) {
+        int capacity = deps->capacity ? deps->capacity * 2 : 32;
+        char **paths = realloc(deps->paths, sizeof(char *) * capacity);
+        if (paths == NULL) return -1;
+        deps->paths = paths;
+        deps->capacity = capacity;
+    }
+    deps->paths[deps->count] = strdup(path);
+    if (deps->paths[deps->count] == NULL) return -1;
+    deps->count++;
+    return 1;
+}
+
+/**
+ * Like ld.so, a DT_NEEDED name that matches an object already in the closure (typically
+ * the interpreter, needed by libc) is satisfied by it instead of being searched again.
+ */
+static int deps_find_loaded(const ElfDeps *deps, const char *name) {
+    for (int i = 0; i < deps->count; i++) {
+        const char *slash = strrchr(deps->paths[i], '/');
+        if (strcmp(slash != NULL ? slash + 1 : deps->paths[i], name) == 0) return i;
+    }
+    return -1;
+}
+
+/**
+ * Computes the transitive shared library closure of an executable without running it:
+ * the program interpreter plus every DT_NEEDED library, breadth first. Objects that are
+ * not dynamic ELF files (scripts, static binaries) have an empty closure. Libraries are
+ * parsed through objects (may be NULL), so concurrent calls share that work.
+ */
+int elf_collect_dependencies(ElfObjectCache *objects, const char *executable, ElfDeps *deps) {
+    ElfImage image;
+    ElfDynamic dynamic;
+    char *exe_rpath = NULL;
+    int elf_class, machine;
+
+    if (elf_map(executable, &image) != 0) return -1;
+    elf_class = image.elf_class;
+    machine = image.machine;
+    if (elf_read_dynamic(&image, &dynamic) != 0) {
+        elf_unmap(&image);
+        return -1;
+    }
+    elf_unmap(&image);
+
+    if (dynamic.interp[0] != '\0') {
+        deps_add(deps, dynamic.interp);
+    }
+    if (dynamic.runpath == NULL && dynamic.rpath != NULL) {
+        exe_rpath = strdup(dynamic.rpath);
+    }
+
+    // deps doubles as the visited set and the work queue; next == -1 is the executable itself
+    for (int next = -1; next < deps->count; next++) {
+        const char *path = next < 0 ? executable : deps->paths[next];
+        ElfObject exe_object = { 1, NULL, dynamic.needed, dynamic.needed_count, dynamic.rpath, dynamic.runpath };
+        char exe_origin[PATH_MAX];
+        const ElfObject *object = &exe_object;
+        ElfObject *owned = NULL;
+
+        if (next < 0) {
+            object_origin(executable, exe_origin);
+            exe_object.origin = exe_origin;
+        } else {
+            object = object_get(objects, path, &owned);
+            if (!object->ok) {
+                object_free(owned);
+                continue;
+            }
+        }
+
+        for (int i = 0; i < object->needed_count; i++) {
+            char resolved[PATH_MAX];
+            if (strchr(object->needed[i], '/') == NULL && deps_find_loaded(deps, object->needed[i]) >= 0) {
+                continue;
+            }
+            if (resolve_library(objects, object->needed[i], object->rpath, object->runpath, object->origin,
+                                exe_rpath, elf_class, machine, resolved) == 0) {
+                deps_add(deps, resolved);
+            } else {
+                fprintf(stderr, "Warning: %s needs %s, which was not found\n", path, object->needed[i]);
+            }
+        }
+        object_free(owned);
+    }
+
+    elf_dynamic_free(&dynamic);
+    free(exe_rpath);
+    return 0;
+}
+
+void elf_deps_free(ElfDeps *deps) {
+    for (int i = 0; i < deps->count; i++) {
+        free(deps->paths[i]);
+    }
+    free(deps->paths);
+    deps->paths = NULL;
+    deps->count = 0;
+    deps->capacity = 0;
+}
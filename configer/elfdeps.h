@@ -0,0 +1,41 @@
+#ifndef ELFDEPS_H
+#define ELFDEPS_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Structure to hold the shared library closure of an executable
+typedef struct {
+    char **paths;
+    int count;
+    int capacity;
+} ElfDeps;
+
+// Open-addressing hash table from strings to heap values
+typedef struct {
+    char *key;
+    uint64_t hash;
+    void *value;
+} ElfMemoEntry;
+
+typedef struct {
+    ElfMemoEntry *slots;
+    size_t slot_count;      // Power of two
+    size_t used;
+} ElfMemo;
+
+// Libraries already parsed and sonames already searched for, shared by concurrent
+// elf_collect_dependencies() calls
+typedef struct {
+    pthread_mutex_t lock;
+    ElfMemo objects;        // Path to ElfObject
+    ElfMemo sonames;        // "class:machine:soname" to the path found, NULL if none
+} ElfObjectCache;
+
+void elf_object_cache_init(ElfObjectCache *objects);
+void elf_object_cache_free(ElfObjectCache *objects);
+int elf_collect_dependencies(ElfObjectCache *objects, const char *executable, ElfDeps *deps);
+void elf_deps_free(ElfDeps *deps);
+
+#endif
@@ -0,0 +1,204 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libconfig.h>
+#include <limits.h>
+
+#include "closure_cache.h"
+#include "configer.h"
+#include "diff.h"
+#include "manifest_writer.h"
+
+static void output_directory(const char *output_file, char *dir, size_t size);
+static int run_base_layer(const char *layer_root, int manifests, char **files, int count);
+
+/**
+ * Directory of output_file, where the closure cache shared by its neighbours lives.
+ */
+static void output_directory(const char *output_file, char *dir, size_t size) {
+    const char *slash = strrchr(output_file, '/');
+    if (slash == NULL) {
+        snprintf(dir, size, ".");
+    } else {
+        snprintf(dir, size, "%.*s", (int)(slash - output_file), output_file);
+    }
+}
+
+/**
+ * configer --base-layer: collects the full config of every (input, output) pair in files,
+ * moves what they all share into one base layer under layer_root and writes each output as
+ * that layer plus its own delta, as a binary manifest if manifests is set. Outputs always
+ * depend on every input, so they are not stamped and are rewritten on each run.
+ */
+static int run_base_layer(const char *layer_root, int manifests, char **files, int count) {
+    config_t *cfgs = calloc(count, sizeof(config_t));
+    FullConfig *fulls = calloc(count, sizeof(FullConfig));
+    BaseLayer layer;
+    int collected = 0;
+    int status = 0;
+
+    if (cfgs == NULL || fulls == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (; collected < count; collected++) {
+        const char *input_config_file = files[2 * collected];
+        char cache_dir[PATH_MAX];
+
+        config_init(&cfgs[collected]);
+        if (!config_read_file(&cfgs[collected], input_config_file)) {
+            fprintf(stderr, "%s:%d - %s\n", config_error_file(&cfgs[collected]),
+                    config_error_line(&cfgs[collected]), config_error_text(&cfgs[collected]));
+            config_destroy(&cfgs[collected]);
+            status = EXIT_FAILURE;
+            break;
+        }
+        output_directory(files[2 * collected + 1], cache_dir, sizeof(cache_dir));
+        if (configer_collect(&cfgs[collected], cache_dir, &fulls[collected]) != 0) {
+            full_config_free(&fulls[collected]);
+            config_destroy(&cfgs[collected]);
+            status = EXIT_FAILURE;
+            break;
+        }
+    }
+
+    if (status == 0) {
+        configer_extract_base_layer(fulls, count, layer_root, &layer);
+        if (write_base_layer(&layer) != 0) {
+            status = EXIT_FAILURE;
+        }
+        for (int i = 0; i < count && status == 0; i++) {
+            const char *output_file = files[2 * i + 1];
+
+            if (manifests) {
+                if (write_output_manifest(output_file, &fulls[i], &cfgs[i]) != 0) status = EXIT_FAILURE;
+            } else {
+                write_output_config(output_file, &fulls[i], &cfgs[i]);
+            }
+        }
+        if (status == 0) {
+            printf("Base layer %s: %d directories, %d file copies, %d symlinks shared by %d configs\n", layer.dir,
+                   layer.tables.directories.count, layer.tables.file_copies.count, layer.tables.symlinks.count,
+                   count);
+        }
+        base_layer_free(&layer);
+    }
+
+    for (int i = 0; i < collected; i++) {
+        full_config_free(&fulls[i]);
+        config_destroy(&cfgs[i]);
+    }
+    free(fulls);
+    free(cfgs);
+    return status;
+}
+
+int main(int argc, char **argv) {
+    // With --base-layer, several base configs are written as one shared layer plus a delta each
+    if (argc >= 3 && strcmp(argv[1], "--base-layer") == 0) {
+        const char *layer_root = argv[2];
+        int manifests = argc >= 4 && strcmp(argv[3], "--manifest") == 0;
+        char **files = argv + 3 + manifests;
+        int file_count = argc - 3 - manifests;
+
+        if (file_count < 2 || file_count % 2 != 0) {
+            fprintf(stderr, "Usage: %s --base-layer <layer_root> [--manifest] <input_config_file> "
+                    "<output_file> [<input_config_file> <output_file> ...]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+        return run_base_layer(layer_root, manifests, files, file_count / 2);
+    }
+
+    // With --diff, only what changed since the last update of a persistent rootfs is written out
+    if (argc >= 2 && strcmp(argv[1], "--diff") == 0) {
+        if (argc != 5) {
+            fprintf(stderr, "Usage: %s --diff <applied_full_config|-> <new_full_config> <delta_file>\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+        return configer_diff(argv[2], argv[3], argv[4]) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    // With --manifest, the full config is also written in the binary format jailor maps directly.
+    // With --trace, root_process is run for that many seconds and only what it used is kept.
+    const char *output_manifest_file = NULL;
+    int trace_seconds = 0;
+    const char *program = argv[0];
+    while (argc >= 5) {
+        if (strcmp(argv[1], "--manifest") == 0) {
+            output_manifest_file = argv[2];
+        } else if (strcmp(argv[1], "--trace") == 0 && atoi(argv[2]) > 0) {
+            trace_seconds = atoi(argv[2]);
+        } else {
+            break;
+        }
+        argv += 2;
+        argc -= 2;
+    }
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s [--manifest <output_manifest_file>] [--trace <seconds>] <input_config_file> "
+                "<output_config_file>\n"
+                "       %s --base-layer <layer_root> [--manifest] <input_config_file> <output_file> ...\n"
+                "       %s --diff <applied_full_config|-> <new_full_config> <delta_file>\n",
+                program, program, program);
+        exit(EXIT_FAILURE);
+    }
+
+    const char *input_config_file = argv[1];
+    const char *output_config_file = argv[2];
+
+    // Nothing to do if neither the base config nor any file it references changed. A trace
+    // depends on how root_process behaves, so it is always run again.
+    if (trace_seconds == 0 && input_stamps_current(input_config_file, output_config_file, output_manifest_file)) {
+        printf("Configuration %s is up to date\n", output_config_file);
+        return 0;
+    }
+
+    FileStamp input_stamp;
+    file_stamp_get(input_config_file, &input_stamp);
+
+    // Initialize libconfig
+    config_t cfg;
+    config_init(&cfg);
+
+    // Read the input configuration file
+    if (!config_read_file(&cfg, input_config_file)) {
+        fprintf(stderr, "%s:%d - %s\n", config_error_file(&cfg),
+                config_error_line(&cfg), config_error_text(&cfg));
+        config_destroy(&cfg);
+        return EXIT_FAILURE;
+    }
+
+    // The closure cache is shared by every full config written to the same directory
+    char cache_dir[PATH_MAX];
+    output_directory(output_config_file, cache_dir, sizeof(cache_dir));
+
+    FullConfig full;
+    int collected = trace_seconds > 0 ? configer_collect_traced(&cfg, cache_dir, trace_seconds, &full)
+                                      : configer_collect(&cfg, cache_dir, &full);
+    if (collected != 0) {
+        full_config_free(&full);
+        config_destroy(&cfg);
+        return EXIT_FAILURE;
+    }
+
+    // Write the output configuration file
+    write_output_config(output_config_file, &full, &cfg);
+    int status = 0;
+    if (output_manifest_file != NULL && write_output_manifest(output_manifest_file, &full, &cfg) != 0) {
+        status = EXIT_FAILURE;
+    }
+    if (status == 0 && trace_seconds == 0) {
+        input_stamps_save(&full.inputs, input_config_file, &input_stamp, output_config_file, output_manifest_file);
+    }
+
+    // Cleanup
+    config_destroy(&cfg);
+    printf("Configuration written to %s (closure cache: %d hits, %d misses)\n", output_config_file,
+           full.cache_hits, full.cache_misses);
+
+    // Free allocated memory
+    full_config_free(&full);
+
+    return status;
+}
@@ -0,0 +1,253 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+
+#include "../jailor/manifest.h"
+#include "manifest_writer.h"
+
+// String table of a manifest under construction; equal strings share one offset
+typedef struct {
+    char *data;
+    size_t size;
+    size_t capacity;
+    uint32_t *slots;        // Open-addressing set of offset + 1, 0 is empty
+    size_t slot_count;      // Power of two
+    size_t used;
+} StringPool;
+
+// Growable byte buffer the sections are laid out in
+typedef struct {
+    unsigned char *data;
+    size_t size;
+    size_t capacity;
+} ByteBuffer;
+
+static void out_of_memory(void);
+static uint32_t pool_add(StringPool *pool, const char *s);
+static uint32_t pool_add_optional(StringPool *pool, const char *s);
+static void pool_free(StringPool *pool);
+static size_t buffer_append(ByteBuffer *buf, const void *data, size_t len);
+static uint32_t lookup_string(StringPool *pool, const config_t *cfg, const char *name);
+
+static void out_of_memory(void) {
+    fprintf(stderr, "Memory allocation failed\n");
+    exit(EXIT_FAILURE);
+}
+
+static uint32_t pool_add(StringPool *pool, const char *s) {
+    size_t len = strlen(s) + 1;
+    uint64_t hash = manifest_checksum(MANIFEST_FNV_OFFSET, s, len);
+    size_t i;
+
+    if ((pool->used + 1) * 2 > pool->slot_count) {
+        size_t old_count = pool->slot_count;
+        uint32_t *old_slots = pool->slots;
+
+        pool->slot_count = old_count ? old_count * 2 : 1024;
+        pool->slots = calloc(pool->slot_count, sizeof(uint32_t));
+        if (pool->slots == NULL) out_of_memory();
+        for (size_t j = 0; j < old_count; j++) {
+            if (old_slots[j] == 0) continue;
+            const char *old = pool->data + old_slots[j] - 1;
+            i = manifest_checksum(MANIFEST_FNV_OFFSET, old, strlen(old) + 1) & (pool->slot_count - 1);
+            while (pool->slots[i] != 0) i = (i + 1) & (pool->slot_count - 1);
+            pool->slots[i] = old_slots[j];
+        }
+        free(old_slots);
+    }
+
+    for (i = hash & (pool->slot_count - 1); pool->slots[i] != 0; i = (i + 1) & (pool->slot_count - 1)) {
+        if (strcmp(pool->data + pool->slots[i] - 1, s) == 0) {
+            return pool->slots[i] - 1;
+        }
+    }
+
+    if (pool->size + len > pool->capacity) {
+        while (pool->size + len > pool->capacity) {
+            pool->capacity = pool->capacity ? pool->capacity * 2 : 64 * 1024;
+        }
+        pool->data = realloc(pool->data, pool->capacity);
+        if (pool->data == NULL) out_of_memory();
+    }
+    memcpy(pool->data + pool->size, s, len);
+    pool->slots[i] = pool->size + 1;
+    pool->used++;
+    pool->size += len;
+    return pool->slots[i] - 1;
+}
+
+static uint32_t pool_add_optional(StringPool *pool, const char *s) {
+    return s != NULL ? pool_add(pool, s) : MANIFEST_NONE;
+}
+
+static void pool_free(StringPool *pool) {
+    free(pool->data);
+    free(pool->slots);
+    memset(pool, 0, sizeof(*pool));
+}
+
+/**
+ * Appends len bytes, padded to 4 bytes, and returns the offset they start at.
+ */
+static size_t buffer_append(ByteBuffer *buf, const void *data, size_t len) {
+    size_t offset = buf->size;
+    size_t padded = (len + 3) & ~(size_t)3;
+
+    if (buf->size + padded > buf->capacity) {
+        while (buf->size + padded > buf->capacity) {
+            buf->capacity = buf->capacity ? buf->capacity * 2 : 64 * 1024;
+        }
+        buf->data = realloc(buf->data, buf->capacity);
+        if (buf->data == NULL) out_of_memory();
+    }
+    if (len > 0) memcpy(buf->data + offset, data, len);
+    memset(buf->data + offset + len, 0, padded - len);
+    buf->size += padded;
+    return offset;
+}
+
+static uint32_t lookup_string(StringPool *pool, const config_t *cfg, const char *name) {
+    const char *value;
+
+    return config_lookup_string(cfg, name, &value) ? pool_add(pool, value) : MANIFEST_NONE;
+}
+
+/**
+ * Lays out the same full config as write_output_config() in the binary manifest format of
+ * jailor/manifest.h, in one malloc()ed buffer that the caller frees. Returns 0.
+ */
+int build_output_manifest(const FullConfig *full, const config_t *cfg, unsigned char **data, size_t *size) {
+    const PathTables *tables = &full->tables;
+    const config_setting_t *root_process_args = full->root_process_args;
+    const config_setting_t *veth_ip_pair = full->veth_ip_pair;
+    const config_setting_t *resources = config_lookup(cfg, "resources");
+    ManifestHeader header;
+    StringPool pool;
+    ByteBuffer buf;
+    int arg_count = root_process_args != NULL ? config_setting_length(root_process_args) : 0;
+    int copy_workers;
+
+    memset(&header, 0, sizeof(header));
+    memset(&pool, 0, sizeof(pool));
+    memset(&buf, 0, sizeof(buf));
+
+    header.magic = MANIFEST_MAGIC;
+    header.version = MANIFEST_VERSION;
+    header.header_size = sizeof(header);
+    header.sandbox_id = full->sandbox_id;
+    header.copy_workers = config_lookup_int(cfg, "copy_workers", &copy_workers) ? copy_workers : 0;
+    header.root_dir = pool_add(&pool, full->root_dir);
+    header.root_process = pool_add(&pool, full->root_process);
+    header.veth_host = header.veth_sandbox = MANIFEST_NONE;
+    if (veth_ip_pair != NULL) {
+        const char *host, *sandbox;
+        config_setting_lookup_string(veth_ip_pair, "host", &host);
+        config_setting_lookup_string(veth_ip_pair, "sandbox", &sandbox);
+        header.veth_host = pool_add(&pool, host);
+        header.veth_sandbox = pool_add(&pool, sandbox);
+    }
+    header.overlay_lower_dir = lookup_string(&pool, cfg, "overlay_lower_dir");
+    header.store_dir = lookup_string(&pool, cfg, "store_dir");
+    header.store_link = lookup_string(&pool, cfg, "store_link");
+    header.image_cache_dir = lookup_string(&pool, cfg, "image_cache_dir");
+    header.tmpfs_size = lookup_string(&pool, cfg, "tmpfs_size");
+    header.base_layer = pool_add_optional(&pool, full->base_layer);
+    header.cpuset = header.cpu_max = header.memory_max = header.memory_high = MANIFEST_NONE;
+    if (resources != NULL) {
+        const char *value;
+        int number;
+
+        header.resources_defined = 1;
+        if (config_setting_lookup_string(resources, "cpuset", &value)) header.cpuset = pool_add(&pool, value);
+        if (config_setting_lookup_string(resources, "cpu_max", &value)) header.cpu_max = pool_add(&pool, value);
+        if (config_setting_lookup_string(resources, "memory_max", &value)) header.memory_max = pool_add(&pool, value);
+        if (config_setting_lookup_string(resources, "memory_high", &value)) header.memory_high = pool_add(&pool, value);
+        if (config_setting_lookup_int(resources, "io_weight", &number)) header.io_weight = number;
+        if (config_setting_lookup_int(resources, "sched_priority", &number)) header.sched_priority = number;
+        if (config_setting_lookup_bool(resources, "lock_memory", &number)) header.lock_memory = number;
+    }
+
+    // Sections follow the header in a fixed order; the header is filled in last
+    buffer_append(&buf, &header, sizeof(header));
+
+    header.args.offset = buf.size;
+    header.args.count = arg_count;
+    for (int i = 0; i < arg_count; i++) {
+        const char *arg = config_setting_get_string_elem(root_process_args, i);
+        uint32_t offset = pool_add(&pool, arg != NULL ? arg : "");
+        buffer_append(&buf, &offset, sizeof(offset));
+    }
+
+    header.directories.offset = buf.size;
+    header.directories.count = tables->directories.count;
+    for (int i = 0; i < tables->directories.count; i++) {
+        uint32_t offset = pool_add(&pool, tables->directories.items[i]);
+        buffer_append(&buf, &offset, sizeof(offset));
+    }
+
+    header.file_copies.offset = buf.size;
+    header.file_copies.count = tables->file_copies.count;
+    for (int i = 0; i < tables->file_copies.count; i++) {
+        ManifestPair pair = {pool_add(&pool, tables->file_copies.items[i].src),
+                             pool_add(&pool, tables->file_copies.items[i].dst)};
+        buffer_append(&buf, &pair, sizeof(pair));
+    }
+
+    header.symlinks.offset = buf.size;
+    header.symlinks.count = tables->symlinks.count;
+    for (int i = 0; i < tables->symlinks.count; i++) {
+        ManifestPair pair = {pool_add(&pool, tables->symlinks.items[i].sym),
+                             pool_add(&pool, tables->symlinks.items[i].dst)};
+        buffer_append(&buf, &pair, sizeof(pair));
+    }
+
+    // Padding is NUL bytes, so the table still ends with a terminator
+    header.strings.offset = buf.size;
+    buffer_append(&buf, pool.data, pool.size);
+    header.strings.count = buf.size - header.strings.offset;
+
+    header.file_size = buf.size;
+    memcpy(buf.data, &header, sizeof(header));
+    header.checksum = manifest_checksum(MANIFEST_FNV_OFFSET, buf.data, buf.size);
+    memcpy(buf.data, &header, sizeof(header));
+    pool_free(&pool);
+
+    *data = buf.data;
+    *size = buf.size;
+    return 0;
+}
+
+/**
+ * Writes the manifest of build_output_manifest() to manifest_file. The file is renamed into
+ * place, so a jailor that still has the previous one mapped keeps reading the old inode.
+ * Returns 0 on success, -1 on failure.
+ */
+int write_output_manifest(const char *manifest_file, const FullConfig *full, const config_t *cfg) {
+    char tmp_path[PATH_MAX + 32];
+    unsigned char *data;
+    size_t size;
+    FILE *fp;
+
+    build_output_manifest(full, cfg, &data, &size);
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d", manifest_file, getpid());
+    fp = fopen(tmp_path, "w");
+    if (fp == NULL) {
+        perror("Error opening output manifest file");
+        free(data);
+        return -1;
+    }
+    int failed = fwrite(data, 1, size, fp) != size;
+    failed |= fclose(fp) != 0;
+    if (failed || rename(tmp_path, manifest_file) != 0) {
+        perror("Error writing output manifest file");
+        unlink(tmp_path);
+        free(data);
+        return -1;
+    }
+    free(data);
+    return 0;
+}
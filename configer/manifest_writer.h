@@ -0,0 +1,12 @@
+#ifndef MANIFEST_WRITER_H
+#define MANIFEST_WRITER_H
+
+#include <stddef.h>
+#include <libconfig.h>
+
+#include "configer.h"
+
+int build_output_manifest(const FullConfig *full, const config_t *cfg, unsigned char **data, size_t *size);
+int write_output_manifest(const char *manifest_file, const FullConfig *full, const config_t *cfg);
+
+#endif
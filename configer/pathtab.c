@@ -0,0 +1,559 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "pathtab.h"
+
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#define INITIAL_SLOTS 256
+#define MAX_LINK_DEPTH 40
+
+// Marks a removed PairSet slot so probing continues past it
+static const char tombstone[1];
+
+struct ArenaBlock {
+    ArenaBlock *next;
+    size_t used;
+    size_t size;
+    char data[];
+};
+
+static void out_of_memory(void);
+static uint64_t hash_string(const char *s);
+static uint64_t hash_pair(const char *a, const char *b);
+static char *arena_alloc(StringArena *arena, size_t len);
+static void arena_grow(StringArena *arena);
+static void pair_set_grow(PairSet *set);
+static void *grow_items(void *items, int *capacity, size_t item_size);
+static TrieNode *trie_new_node(PathTrie *trie, StringArena *arena, TrieNode *parent, const char *name);
+static void trie_grow(PathTrie *trie);
+static TrieNode *trie_walk(PathTrie *trie, StringArena *arena, TrieNode *start, const char *path, int used);
+static TrieNode *trie_follow(PathTrie *trie, StringArena *arena, TrieNode *node, int depth);
+
+static void out_of_memory(void) {
+    fprintf(stderr, "Memory allocation failed\n");
+    exit(EXIT_FAILURE);
+}
+
+/**
+ * FNV-1a over the bytes of a string.
+ */
+static uint64_t hash_string(const char *s) {
+    uint64_t h = 14695981039346656037ULL;
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/**
+ * Interned strings are unique, so a pair is hashed by its pointers.
+ */
+static uint64_t hash_pair(const char *a, const char *b) {
+    uint64_t h = (uint64_t)(uintptr_t)a * 0x9e3779b97f4a7c15ULL;
+    h ^= (uint64_t)(uintptr_t)b + 0x632be59bd9b4e019ULL + (h << 6) + (h >> 2);
+    return h ^ (h >> 29);
+}
+
+static char *arena_alloc(StringArena *arena, size_t len) {
+    ArenaBlock *block = arena->blocks;
+
+    if (block == NULL || block->used + len > block->size) {
+        size_t size = len > ARENA_BLOCK_SIZE ? len : ARENA_BLOCK_SIZE;
+        block = malloc(sizeof(ArenaBlock) + size);
+        if (block == NULL) out_of_memory();
+        block->next = arena->blocks;
+        block->used = 0;
+        block->size = size;
+        arena->blocks = block;
+    }
+    block->used += len;
+    return block->data + block->used - len;
+}
+
+static void arena_grow(StringArena *arena) {
+    size_t slot_count = arena->slot_count ? arena->slot_count * 2 : INITIAL_SLOTS;
+    const char **slots = calloc(slot_count, sizeof(const char *));
+
+    if (slots == NULL) out_of_memory();
+    for (size_t i = 0; i < arena->slot_count; i++) {
+        const char *s = arena->slots[i];
+        if (s == NULL) continue;
+        for (size_t j = hash_string(s) & (slot_count - 1); ; j = (j + 1) & (slot_count - 1)) {
+            if (slots[j] == NULL) {
+                slots[j] = s;
+                break;
+            }
+        }
+    }
+    free(arena->slots);
+    arena->slots = slots;
+    arena->slot_count = slot_count;
+}
+
+/**
+ * Returns the interned copy of s, adding it to the arena on first use.
+ */
+const char *arena_intern(StringArena *arena, const char *s) {
+    size_t mask;
+    char *copy;
+    size_t len;
+
+    if (arena->used * 2 >= arena->slot_count) {
+        arena_grow(arena);
+    }
+    mask = arena->slot_count - 1;
+    for (size_t i = hash_string(s) & mask; ; i = (i + 1) & mask) {
+        if (arena->slots[i] == NULL) {
+            len = strlen(s) + 1;
+            copy = arena_alloc(arena, len);
+            memcpy(copy, s, len);
+            arena->slots[i] = copy;
+            arena->used++;
+            return copy;
+        }
+        if (strcmp(arena->slots[i], s) == 0) {
+            return arena->slots[i];
+        }
+    }
+}
+
+void arena_free(StringArena *arena) {
+    while (arena->blocks != NULL) {
+        ArenaBlock *next = arena->blocks->next;
+        free(arena->blocks);
+        arena->blocks = next;
+    }
+    free(arena->slots);
+    memset(arena, 0, sizeof(*arena));
+}
+
+static void pair_set_grow(PairSet *set) {
+    PairSet grown;
+
+    grown.slot_count = set->slot_count ? set->slot_count * 2 : INITIAL_SLOTS;
+    grown.used = 0;
+    grown.slots = calloc(grown.slot_count, sizeof(PathPair));
+    if (grown.slots == NULL) out_of_memory();
+
+    // Tombstones are dropped while rehashing
+    for (size_t i = 0; i < set->slot_count; i++) {
+        if (set->slots[i].a != NULL && set->slots[i].a != tombstone) {
+            pair_set_insert(&grown, set->slots[i].a, set->slots[i].b);
+        }
+    }
+    free(set->slots);
+    *set = grown;
+}
+
+/**
+ * Adds a pair of interned strings. Returns 1 if added, 0 if it was already present.
+ */
+int pair_set_insert(PairSet *set, const char *a, const char *b) {
+    size_t mask;
+    PathPair *free_slot = NULL;
+
+    if (pair_set_contains(set, a, b)) return 0;
+    if ((set->used + 1) * 2 > set->slot_count) {
+        pair_set_grow(set);
+    }
+    mask = set->slot_count - 1;
+    for (size_t i = hash_pair(a, b) & mask; ; i = (i + 1) & mask) {
+        if (set->slots[i].a == tombstone) {
+            free_slot = &set->slots[i];
+            break;
+        }
+        if (set->slots[i].a == NULL) {
+            free_slot = &set->slots[i];
+            set->used++;
+            break;
+        }
+    }
+    free_slot->a = a;
+    free_slot->b = b;
+    return 1;
+}
+
+int pair_set_contains(const PairSet *set, const char *a, const char *b) {
+    size_t mask;
+
+    if (set->slot_count == 0) return 0;
+    mask = set->slot_count - 1;
+    for (size_t i = hash_pair(a, b) & mask; set->slots[i].a != NULL; i = (i + 1) & mask) {
+        if (set->slots[i].a == a && set->slots[i].b == b) return 1;
+    }
+    return 0;
+}
+
+void pair_set_remove(PairSet *set, const char *a, const char *b) {
+    size_t mask;
+
+    if (set->slot_count == 0) return;
+    mask = set->slot_count - 1;
+    for (size_t i = hash_pair(a, b) & mask; set->slots[i].a != NULL; i = (i + 1) & mask) {
+        if (set->slots[i].a == a && set->slots[i].b == b) {
+            set->slots[i].a = tombstone;
+            set->slots[i].b = NULL;
+            return;
+        }
+    }
+}
+
+void pair_set_free(PairSet *set) {
+    free(set->slots);
+    memset(set, 0, sizeof(*set));
+}
+
+static void *grow_items(void *items, int *capacity, size_t item_size) {
+    int grown_capacity = *capacity ? *capacity * 2 : 64;
+    void *grown = realloc(items, item_size * grown_capacity);
+
+    if (grown == NULL) out_of_memory();
+    *capacity = grown_capacity;
+    return grown;
+}
+
+/**
+ * Adds a string to a table unless already present. Returns 1 if added, 0 if it existed.
+ */
+int string_table_add(StringTable *table, StringArena *arena, const char *s) {
+    const char *interned = arena_intern(arena, s);
+
+    if (!pair_set_insert(&table->index, interned, NULL)) return 0;
+    if (table->count == table->capacity) {
+        table->items = grow_items(table->items, &table->capacity, sizeof(const char *));
+    }
+    table->items[table->count++] = interned;
+    return 1;
+}
+
+/**
+ * Replaces entry i, keeping the index in step. The new value may duplicate another
+ * entry; duplicates are removed when the table is sorted for output.
+ */
+void string_table_set(StringTable *table, StringArena *arena, int i, const char *s) {
+    const char *interned = arena_intern(arena, s);
+
+    pair_set_remove(&table->index, table->items[i], NULL);
+    pair_set_insert(&table->index, interned, NULL);
+    table->items[i] = interned;
+}
+
+void string_table_free(StringTable *table) {
+    free(table->items);
+    pair_set_free(&table->index);
+    memset(table, 0, sizeof(*table));
+}
+
+int file_copy_table_add(FileCopyTable *table, StringArena *arena, const char *src, const char *dst) {
+    FileCopy copy = { arena_intern(arena, src), arena_intern(arena, dst) };
+
+    if (!pair_set_insert(&table->index, copy.src, copy.dst)) return 0;
+    if (table->count == table->capacity) {
+        table->items = grow_items(table->items, &table->capacity, sizeof(FileCopy));
+    }
+    table->items[table->count++] = copy;
+    return 1;
+}
+
+void file_copy_table_set(FileCopyTable *table, StringArena *arena, int i, const char *src, const char *dst) {
+    FileCopy copy = { arena_intern(arena, src), arena_intern(arena, dst) };
+
+    pair_set_remove(&table->index, table->items[i].src, table->items[i].dst);
+    pair_set_insert(&table->index, copy.src, copy.dst);
+    table->items[i] = copy;
+}
+
+void file_copy_table_free(FileCopyTable *table) {
+    free(table->items);
+    pair_set_free(&table->index);
+    memset(table, 0, sizeof(*table));
+}
+
+int symlink_table_add(SymlinkTable *table, StringArena *arena, const char *sym, const char *dst) {
+    Symlink link = { arena_intern(arena, sym), arena_intern(arena, dst) };
+
+    if (!pair_set_insert(&table->index, link.sym, link.dst)) return 0;
+    if (table->count == table->capacity) {
+        table->items = grow_items(table->items, &table->capacity, sizeof(Symlink));
+    }
+    table->items[table->count++] = link;
+    return 1;
+}
+
+void symlink_table_free(SymlinkTable *table) {
+    free(table->items);
+    pair_set_free(&table->index);
+    memset(table, 0, sizeof(*table));
+}
+
+static void trie_grow(PathTrie *trie) {
+    size_t slot_count = trie->slot_count ? trie->slot_count * 2 : INITIAL_SLOTS;
+    TrieNode **slots = calloc(slot_count, sizeof(TrieNode *));
+
+    if (slots == NULL) out_of_memory();
+    for (size_t i = 0; i < trie->slot_count; i++) {
+        TrieNode *node = trie->slots[i];
+        if (node == NULL) continue;
+        for (size_t j = hash_pair((const char *)node->parent, node->name) & (slot_count - 1); ;
+             j = (j + 1) & (slot_count - 1)) {
+            if (slots[j] == NULL) {
+                slots[j] = node;
+                break;
+            }
+        }
+    }
+    free(trie->slots);
+    trie->slots = slots;
+    trie->slot_count = slot_count;
+}
+
+static TrieNode *trie_new_node(PathTrie *trie, StringArena *arena, TrieNode *parent, const char *name) {
+    TrieNode *node = calloc(1, sizeof(TrieNode));
+
+    if (node == NULL) out_of_memory();
+    node->parent = parent;
+    node->name = name;
+    if (parent == NULL) {
+        node->path = arena_intern(arena, "/");
+    } else {
+        size_t parent_len = parent->parent == NULL ? 0 : strlen(parent->path);
+        size_t name_len = strlen(name);
+        char *path = malloc(parent_len + name_len + 2);
+
+        if (path == NULL) out_of_memory();
+        memcpy(path, parent->path, parent_len);
+        path[parent_len] = '/';
+        memcpy(path + parent_len + 1, name, name_len + 1);
+        node->path = arena_intern(arena, path);
+        free(path);
+    }
+
+    if (trie->count == trie->capacity) {
+        trie->nodes = grow_items(trie->nodes, &trie->capacity, sizeof(TrieNode *));
+    }
+    trie->nodes[trie->count++] = node;
+    return node;
+}
+
+/**
+ * Returns the child of parent named name (a single component), creating it on first use.
+ */
+TrieNode *trie_child(PathTrie *trie, StringArena *arena, TrieNode *parent, const char *name) {
+    const char *interned = arena_intern(arena, name);
+    size_t mask;
+
+    if ((trie->used + 1) * 2 > trie->slot_count) {
+        trie_grow(trie);
+    }
+    mask = trie->slot_count - 1;
+    for (size_t i = hash_pair((const char *)parent, interned) & mask; ; i = (i + 1) & mask) {
+        TrieNode *node = trie->slots[i];
+        if (node == NULL) {
+            node = trie_new_node(trie, arena, parent, interned);
+            trie->slots[i] = node;
+            trie->used++;
+            return node;
+        }
+        if (node->parent == parent && node->name == interned) {
+            return node;
+        }
+    }
+}
+
+/**
+ * Walks path one component at a time from start. "." and empty components are skipped,
+ * ".." is kept as a node of its own and only interpreted when resolving.
+ */
+static TrieNode *trie_walk(PathTrie *trie, StringArena *arena, TrieNode *start, const char *path, int used) {
+    char component[NAME_MAX + 1];
+    TrieNode *node = start;
+
+    while (*path != '\0') {
+        size_t len = strcspn(path, "/");
+
+        if (len > NAME_MAX) return NULL;
+        if (len > 0 && !(len == 1 && path[0] == '.')) {
+            memcpy(component, path, len);
+            component[len] = '\0';
+            node = trie_child(trie, arena, node, component);
+            if (used) node->flags |= NODE_USED;
+        }
+        path += len;
+        if (*path == '/') path++;
+    }
+    return node;
+}
+
+/**
+ * Returns the node of an absolute path, creating the missing components. Relative paths
+ * have no place in the trie and yield NULL.
+ */
+TrieNode *trie_insert(PathTrie *trie, StringArena *arena, const char *path, int used) {
+    if (path[0] != '/') return NULL;
+    if (trie->root == NULL) {
+        trie->root = trie_new_node(trie, arena, NULL, NULL);
+        trie->root->kind = NODE_DIRECTORY;
+        trie->root->resolved = trie->root;
+    }
+    return trie_walk(trie, arena, trie->root, path, used);
+}
+
+/**
+ * lstat()s the node on first use. Only meaningful for nodes whose parent is a real path.
+ */
+NodeKind trie_kind(TrieNode *node) {
+    struct stat st;
+
+    if (node->kind != NODE_UNKNOWN) return node->kind;
+    if (lstat(node->path, &st) != 0) {
+        node->kind = NODE_MISSING;
+    } else if (S_ISLNK(st.st_mode)) {
+        node->kind = NODE_SYMLINK;
+    } else if (S_ISDIR(st.st_mode)) {
+        node->kind = NODE_DIRECTORY;
+    } else {
+        node->kind = NODE_FILE;
+    }
+    return node->kind;
+}
+
+/**
+ * Returns the node of the host real path of node, like realpath(3), but one component at
+ * a time so every prefix is looked up once. A path that does not exist resolves to its
+ * real parent plus the remaining components. Returns NULL on a symlink loop.
+ */
+TrieNode *trie_resolve(PathTrie *trie, StringArena *arena, TrieNode *node) {
+    TrieNode *parent;
+    TrieNode *real;
+    TrieNode *result;
+
+    if (node->resolved != NULL) return node->resolved;
+    if (node->flags & NODE_RESOLVING) return NULL;
+
+    node->flags |= NODE_RESOLVING;
+    parent = trie_resolve(trie, arena, node->parent);
+    if (parent == NULL) {
+        result = NULL;
+    } else if (strcmp(node->name, "..") == 0) {
+        result = parent->parent != NULL ? parent->parent : parent;
+    } else {
+        real = parent == node->parent ? node : trie_child(trie, arena, parent, node->name);
+        if (trie_kind(real) != NODE_SYMLINK) {
+            result = real;
+        } else if (real != node) {
+            result = trie_resolve(trie, arena, real);
+        } else {
+            char target[PATH_MAX];
+            ssize_t len = readlink(real->path, target, sizeof(target) - 1);
+
+            if (len < 0) {
+                result = NULL;
+            } else {
+                TrieNode *start = target[0] == '/' ? trie->root : parent;
+                const char *rest = target;
+
+                target[len] = '\0';
+                // Each component of the target is resolved in turn, so ".." climbs real directories
+                result = start;
+                while (result != NULL && *rest != '\0') {
+                    size_t clen = strcspn(rest, "/");
+                    char component[NAME_MAX + 1];
+
+                    if (clen > NAME_MAX) {
+                        result = NULL;
+                        break;
+                    }
+                    if (clen > 0 && !(clen == 1 && rest[0] == '.')) {
+                        memcpy(component, rest, clen);
+                        component[clen] = '\0';
+                        result = trie_resolve(trie, arena, trie_child(trie, arena, result, component));
+                    }
+                    rest += clen;
+                    if (*rest == '/') rest++;
+                }
+            }
+        }
+    }
+    node->flags &= ~NODE_RESOLVING;
+    node->resolved = result;
+    return result;
+}
+
+/**
+ * Whether the path of node is a directory on the host once symlinks are followed, like stat(2).
+ */
+int trie_is_directory(PathTrie *trie, StringArena *arena, TrieNode *node) {
+    TrieNode *real = trie_resolve(trie, arena, node);
+    return real != NULL && trie_kind(real) == NODE_DIRECTORY;
+}
+
+static TrieNode *trie_follow(PathTrie *trie, StringArena *arena, TrieNode *node, int depth) {
+    TrieNode *parent;
+    TrieNode *child;
+
+    if (node->parent == NULL || depth > MAX_LINK_DEPTH) return node;
+    parent = trie_follow(trie, arena, node->parent, depth);
+    child = parent == node->parent ? node : trie_child(trie, arena, parent, node->name);
+    if (child->link != NULL) {
+        return trie_follow(trie, arena, child->link, depth + 1);
+    }
+    return child;
+}
+
+/**
+ * Maps node through the sandbox symlinks placed so far (TrieNode.link), the way the path
+ * would be looked up inside the sandbox. Not memoized, since links are added as they are fixed.
+ */
+TrieNode *trie_follow_links(PathTrie *trie, StringArena *arena, TrieNode *node) {
+    return trie_follow(trie, arena, node, 0);
+}
+
+/**
+ * Adds every host symlink met on a collected path to the symlink table. The link is
+ * recorded where it really lives (its parent resolved) and points at its final real path.
+ */
+void trie_collect_symlinks(PathTrie *trie, StringArena *arena, SymlinkTable *symlinks) {
+    // Resolving creates nodes, so the node array may move: index it on every iteration
+    for (int i = 0; i < trie->count; i++) {
+        TrieNode *node = trie->nodes[i];
+        TrieNode *parent;
+        TrieNode *real;
+        TrieNode *target;
+
+        if (!(node->flags & NODE_USED) || strcmp(node->name, "..") == 0) continue;
+        parent = trie_resolve(trie, arena, node->parent);
+        if (parent == NULL) continue;
+        real = trie_child(trie, arena, parent, node->name);
+        if ((real->flags & NODE_EMITTED) || trie_kind(real) != NODE_SYMLINK) continue;
+
+        real->flags |= NODE_EMITTED;
+        target = trie_resolve(trie, arena, real);
+        if (target != NULL) {
+            symlink_table_add(symlinks, arena, real->path, target->path);
+        }
+    }
+}
+
+void trie_free(PathTrie *trie) {
+    for (int i = 0; i < trie->count; i++) {
+        free(trie->nodes[i]);
+    }
+    free(trie->nodes);
+    free(trie->slots);
+    memset(trie, 0, sizeof(*trie));
+}
+
+void path_tables_free(PathTables *tables) {
+    trie_free(&tables->trie);
+    string_table_free(&tables->directories);
+    string_table_free(&tables->executables);
+    file_copy_table_free(&tables->file_copies);
+    symlink_table_free(&tables->symlinks);
+    arena_free(&tables->arena);
+}
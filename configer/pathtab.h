@@ -0,0 +1,138 @@
+#ifndef PATHTAB_H
+#define PATHTAB_H
+
+#include <stddef.h>
+
+// Every distinct string is stored once in an arena; interned strings are compared by pointer
+typedef struct ArenaBlock ArenaBlock;
+
+typedef struct {
+    ArenaBlock *blocks;
+    const char **slots;     // Open-addressing hash set of the interned strings
+    size_t slot_count;      // Power of two
+    size_t used;
+} StringArena;
+
+// Hash set of interned string pairs (second may be NULL), used as the uniqueness index of a table
+typedef struct {
+    const char *a;
+    const char *b;
+} PathPair;
+
+typedef struct {
+    PathPair *slots;
+    size_t slot_count;      // Power of two
+    size_t used;            // Live entries plus tombstones
+} PairSet;
+
+// Structure to hold file copy information
+typedef struct {
+    const char *src;
+    const char *dst;
+} FileCopy;
+
+// Structure to hold symlink information
+typedef struct {
+    const char *sym;
+    const char *dst;
+} Symlink;
+
+// Growable tables of interned paths with O(1) duplicate checks
+typedef struct {
+    const char **items;
+    int count;
+    int capacity;
+    PairSet index;
+} StringTable;
+
+typedef struct {
+    FileCopy *items;
+    int count;
+    int capacity;
+    PairSet index;
+} FileCopyTable;
+
+typedef struct {
+    Symlink *items;
+    int count;
+    int capacity;
+    PairSet index;
+} SymlinkTable;
+
+// Radix tree over path components. Each node stands for one absolute path; the host
+// lstat() and real path of a node are looked up once and memoized.
+typedef struct TrieNode TrieNode;
+
+typedef enum {
+    NODE_UNKNOWN = 0,
+    NODE_MISSING,
+    NODE_DIRECTORY,
+    NODE_FILE,
+    NODE_SYMLINK
+} NodeKind;
+
+#define NODE_USED 0x1       // On a path configer collected, not only walked while following links
+#define NODE_EMITTED 0x2    // Its host symlink is already in the symlink table
+#define NODE_RESOLVING 0x4  // On the current resolution stack, used to detect link loops
+
+struct TrieNode {
+    const char *name;       // Interned component
+    const char *path;       // Interned absolute path
+    TrieNode *parent;
+    TrieNode *resolved;     // Host real path, NULL until resolved
+    TrieNode *link;         // Target of a sandbox symlink placed at this path
+    NodeKind kind;
+    int flags;
+};
+
+typedef struct {
+    TrieNode *root;
+    TrieNode **slots;       // Open-addressing child index keyed by (parent, name)
+    size_t slot_count;      // Power of two
+    size_t used;
+    TrieNode **nodes;       // Every node, in creation order
+    int count;
+    int capacity;
+} PathTrie;
+
+// Everything configer collects for one sandbox
+typedef struct {
+    StringArena arena;
+    PathTrie trie;
+    StringTable directories;
+    StringTable executables;
+    FileCopyTable file_copies;
+    SymlinkTable symlinks;
+} PathTables;
+
+const char *arena_intern(StringArena *arena, const char *s);
+void arena_free(StringArena *arena);
+
+int pair_set_insert(PairSet *set, const char *a, const char *b);
+int pair_set_contains(const PairSet *set, const char *a, const char *b);
+void pair_set_remove(PairSet *set, const char *a, const char *b);
+void pair_set_free(PairSet *set);
+
+int string_table_add(StringTable *table, StringArena *arena, const char *s);
+void string_table_set(StringTable *table, StringArena *arena, int i, const char *s);
+void string_table_free(StringTable *table);
+
+int file_copy_table_add(FileCopyTable *table, StringArena *arena, const char *src, const char *dst);
+void file_copy_table_set(FileCopyTable *table, StringArena *arena, int i, const char *src, const char *dst);
+void file_copy_table_free(FileCopyTable *table);
+
+int symlink_table_add(SymlinkTable *table, StringArena *arena, const char *sym, const char *dst);
+void symlink_table_free(SymlinkTable *table);
+
+TrieNode *trie_insert(PathTrie *trie, StringArena *arena, const char *path, int used);
+TrieNode *trie_child(PathTrie *trie, StringArena *arena, TrieNode *parent, const char *name);
+TrieNode *trie_resolve(PathTrie *trie, StringArena *arena, TrieNode *node);
+NodeKind trie_kind(TrieNode *node);
+int trie_is_directory(PathTrie *trie, StringArena *arena, TrieNode *node);
+TrieNode *trie_follow_links(PathTrie *trie, StringArena *arena, TrieNode *node);
+void trie_collect_symlinks(PathTrie *trie, StringArena *arena, SymlinkTable *symlinks);
+void trie_free(PathTrie *trie);
+
+void path_tables_free(PathTables *tables);
+
+#endif
@@ -0,0 +1,393 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/ptrace.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include "trace.h"
+
+// A traced thread and the syscall it is in, if it is one that names a file
+typedef struct {
+    pid_t pid;
+    int mem_fd;                 // /proc/<pid>/mem, -1 until first needed
+    long nr;                    // Syscall between entry and exit stops, -1 otherwise
+    int writing;                // It opens path for writing
+    char path[PATH_MAX];        // Absolute path as requested, "" if unknown
+} TracedTask;
+
+typedef struct {
+    TracedTask *items;
+    int count;
+    int capacity;
+} TaskTable;
+
+static volatile sig_atomic_t trace_expired = 0;
+static pid_t trace_group = 0;
+
+static void trace_alarm(int signo);
+static TracedTask *task_get(TaskTable *tasks, pid_t pid);
+static void task_remove(TaskTable *tasks, pid_t pid);
+static int read_tracee(TracedTask *task, uint64_t addr, void *buf, size_t len);
+static int read_tracee_string(TracedTask *task, uint64_t addr, char *buf, size_t size);
+static void absolute_path(pid_t pid, int dirfd, const char *path, char *out);
+static int skipped_path(const char *path);
+static void record_path(TraceResult *result, const char *requested, const char *real, int writing);
+static void record_mappings(TraceResult *result, pid_t pid);
+static void syscall_entry(TracedTask *task, const struct __ptrace_syscall_info *info);
+static void syscall_exit(TraceResult *result, TracedTask *task, const struct __ptrace_syscall_info *info);
+static void exec_event(TraceResult *result, TracedTask *task);
+
+/**
+ * Ends the run: the process group at once, stray processes that left it from the loop.
+ */
+static void trace_alarm(int signo) {
+    (void)signo;
+    trace_expired = 1;
+    kill(-trace_group, SIGKILL);
+}
+
+static TracedTask *task_get(TaskTable *tasks, pid_t pid) {
+    for (int i = 0; i < tasks->count; i++) {
+        if (tasks->items[i].pid == pid) return &tasks->items[i];
+    }
+    if (tasks->count == tasks->capacity) {
+        tasks->capacity = tasks->capacity ? tasks->capacity * 2 : 16;
+        tasks->items = realloc(tasks->items, sizeof(TracedTask) * tasks->capacity);
+        if (tasks->items == NULL) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    TracedTask *task = &tasks->items[tasks->count++];
+    task->pid = pid;
+    task->mem_fd = -1;
+    task->nr = -1;
+    task->writing = 0;
+    task->path[0] = '\0';
+    return task;
+}
+
+static void task_remove(TaskTable *tasks, pid_t pid) {
+    for (int i = 0; i < tasks->count; i++) {
+        if (tasks->items[i].pid == pid) {
+            if (tasks->items[i].mem_fd >= 0) close(tasks->items[i].mem_fd);
+            tasks->items[i] = tasks->items[--tasks->count];
+            return;
+        }
+    }
+}
+
+/**
+ * Reads tracee memory through /proc/<pid>/mem, which stops at the first unmapped page
+ * instead of failing the whole read. Returns the number of bytes read, -1 on error.
+ */
+static int read_tracee(TracedTask *task, uint64_t addr, void *buf, size_t len) {
+    if (task->mem_fd < 0) {
+        char mem_path[64];
+        snprintf(mem_path, sizeof(mem_path), "/proc/%d/mem", task->pid);
+        task->mem_fd = open(mem_path, O_RDONLY | O_CLOEXEC);
+        if (task->mem_fd < 0) return -1;
+    }
+    return pread(task->mem_fd, buf, len, (off_t)addr);
+}
+
+static int read_tracee_string(TracedTask *task, uint64_t addr, char *buf, size_t size) {
+    int n = read_tracee(task, addr, buf, size - 1);
+
+    if (n <= 0) return -1;
+    buf[n] = '\0';
+    return strlen(buf) < (size_t)n ? 0 : -1;
+}
+
+/**
+ * Makes a path as passed to an *at() syscall absolute, from the tracee's cwd or dirfd.
+ */
+static void absolute_path(pid_t pid, int dirfd, const char *path, char *out) {
+    char link[64];
+    char base[PATH_MAX];
+    ssize_t len;
+
+    if (path[0] == '/') {
+        snprintf(out, PATH_MAX, "%s", path);
+        return;
+    }
+    if (dirfd == AT_FDCWD) {
+        snprintf(link, sizeof(link), "/proc/%d/cwd", pid);
+    } else {
+        snprintf(link, sizeof(link), "/proc/%d/fd/%d", pid, dirfd);
+    }
+    len = readlink(link, base, sizeof(base) - 1);
+    if (len <= 0 || base[0] != '/') {
+        out[0] = '\0';
+        return;
+    }
+    base[len] = '\0';
+    if (snprintf(out, PATH_MAX, "%s/%s", strcmp(base, "/") == 0 ? "" : base, path) >= PATH_MAX) {
+        out[0] = '\0';
+    }
+}
+
+/**
+ * Pseudo file systems are provided by the sandbox itself, and pipes, sockets and the like
+ * have no path at all.
+ */
+static int skipped_path(const char *path) {
+    return path[0] != '/' || strncmp(path, "/proc/", 6) == 0 || strncmp(path, "/sys/", 5) == 0 ||
+           strncmp(path, "/dev/", 5) == 0 || strcmp(path, "/proc") == 0 || strcmp(path, "/sys") == 0 ||
+           strcmp(path, "/dev") == 0;
+}
+
+/**
+ * Records a file the tracee used. The path it asked for is kept when it leads to the same
+ * file, so configer recreates the symlinks on the way; otherwise the real path is used.
+ * Files opened for writing are left to the sandbox, only their directory is recorded.
+ */
+static void record_path(TraceResult *result, const char *requested, const char *real, int writing) {
+    const char *path = real;
+    struct stat st;
+
+    if (requested != NULL && requested[0] == '/' && strstr(requested, "/../") == NULL &&
+        (strlen(requested) < 3 || strcmp(requested + strlen(requested) - 3, "/..") != 0)) {
+        char resolved[PATH_MAX];
+        if (realpath(requested, resolved) != NULL && strcmp(resolved, real) == 0) path = requested;
+    }
+    if (skipped_path(real) || skipped_path(path) || stat(real, &st) != 0) return;
+
+    if (S_ISDIR(st.st_mode) || writing) {
+        string_table_add(&result->directories, &result->arena, path);
+    } else if (S_ISREG(st.st_mode)) {
+        string_table_add(&result->files, &result->arena, path);
+    }
+}
+
+/**
+ * Records every file mapped into a freshly executed image: the executable and the program
+ * interpreter, which the kernel opens without a syscall the tracer would see.
+ */
+static void record_mappings(TraceResult *result, pid_t pid) {
+    char maps_path[64];
+    char line[PATH_MAX + 128];
+    FILE *fp;
+
+    snprintf(maps_path, sizeof(maps_path), "/proc/%d/maps", pid);
+    fp = fopen(maps_path, "r");
+    if (fp == NULL) return;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        char *path = strchr(line, '/');
+        if (path == NULL) continue;
+        path[strcspn(path, "\n")] = '\0';
+        record_path(result, NULL, path, 0);
+    }
+    fclose(fp);
+}
+
+static void syscall_entry(TracedTask *task, const struct __ptrace_syscall_info *info) {
+    const uint64_t *args = info->entry.args;
+    char path[PATH_MAX];
+    int dirfd = AT_FDCWD;
+    uint64_t path_arg;
+    uint64_t flags = 0;
+
+    task->nr = (long)info->entry.nr;
+    task->writing = 0;
+    task->path[0] = '\0';
+    switch (task->nr) {
+#ifdef SYS_open
+    case SYS_open:
+        path_arg = args[0];
+        flags = args[1];
+        break;
+#endif
+    case SYS_openat:
+        dirfd = (int)args[0];
+        path_arg = args[1];
+        flags = args[2];
+        break;
+#ifdef SYS_openat2
+    case SYS_openat2:
+        // flags is the first member of struct open_how
+        dirfd = (int)args[0];
+        path_arg = args[1];
+        if (read_tracee(task, args[2], &flags, sizeof(flags)) != sizeof(flags)) flags = 0;
+        break;
+#endif
+    case SYS_execve:
+        path_arg = args[0];
+        break;
+    case SYS_execveat:
+        dirfd = (int)args[0];
+        path_arg = args[1];
+        break;
+    default:
+        task->nr = -1;
+        return;
+    }
+
+    task->writing = (flags & O_ACCMODE) != O_RDONLY || (flags & (O_CREAT | O_TRUNC)) != 0;
+    if (read_tracee_string(task, path_arg, path, sizeof(path)) == 0) {
+        absolute_path(task->pid, dirfd, path, task->path);
+    }
+}
+
+static void syscall_exit(TraceResult *result, TracedTask *task, const struct __ptrace_syscall_info *info) {
+    char link[64];
+    char real[PATH_MAX];
+    ssize_t len;
+
+    // Successful execs are recorded at the exec event, when the new image is mapped
+    if (task->nr < 0 || task->nr == SYS_execve || task->nr == SYS_execveat || info->exit.is_error ||
+        info->exit.rval < 0) {
+        task->nr = -1;
+        return;
+    }
+
+    snprintf(link, sizeof(link), "/proc/%d/fd/%lld", task->pid, (long long)info->exit.rval);
+    len = readlink(link, real, sizeof(real) - 1);
+    if (len > 0) {
+        real[len] = '\0';
+        record_path(result, task->path, real, task->writing);
+    }
+    task->nr = -1;
+}
+
+static void exec_event(TraceResult *result, TracedTask *task) {
+    char link[64];
+    char real[PATH_MAX];
+    ssize_t len;
+
+    // Scripts are opened by the kernel too: the requested path is the script, the
+    // mapped executable its interpreter
+    if (task->path[0] != '\0' && realpath(task->path, real) != NULL) {
+        record_path(result, task->path, real, 0);
+    }
+    snprintf(link, sizeof(link), "/proc/%d/exe", task->pid);
+    len = readlink(link, real, sizeof(real) - 1);
+    if (len > 0) {
+        real[len] = '\0';
+        record_path(result, NULL, real, 0);
+    }
+    record_mappings(result, task->pid);
+    task->nr = -1;
+    task->path[0] = '\0';
+}
+
+/**
+ * Runs root_process with args (argv, NULL-terminated) under ptrace, following every
+ * process and thread it creates, and records each file they open, execute or map. The
+ * run is killed after seconds, as most workloads never exit on their own. Returns 0 on
+ * success, -1 with a message printed if the process could not be started or traced.
+ */
+int trace_root_process(const char *root_process, char *const *args, int seconds, TraceResult *result) {
+    struct sigaction action, old_action;
+    TaskTable tasks = { NULL, 0, 0 };
+    int status;
+    pid_t pid;
+
+    memset(result, 0, sizeof(*result));
+    pid = fork();
+    if (pid < 0) {
+        perror("Error forking traced root_process");
+        return -1;
+    }
+    if (pid == 0) {
+        // Stopped until the tracer has set its options, so not even the first exec is missed
+        setpgid(0, 0);
+        if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) == -1) _exit(127);
+        raise(SIGSTOP);
+        execv(root_process, args);
+        perror("Error executing traced root_process");
+        _exit(127);
+    }
+
+    if (waitpid(pid, &status, 0) != pid || !WIFSTOPPED(status) ||
+        ptrace(PTRACE_SETOPTIONS, pid, NULL,
+               PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACEEXEC | PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK |
+               PTRACE_O_TRACECLONE | PTRACE_O_EXITKILL) == -1) {
+        perror("Error tracing root_process");
+        kill(pid, SIGKILL);
+        waitpid(pid, &status, 0);
+        return -1;
+    }
+    setpgid(pid, pid);
+    task_get(&tasks, pid);
+
+    // SIGALRM kills the run once the time is up
+    trace_expired = 0;
+    trace_group = pid;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = trace_alarm;
+    sigaction(SIGALRM, &action, &old_action);
+    alarm(seconds > 0 ? seconds : 1);
+    ptrace(PTRACE_SYSCALL, pid, NULL, NULL);
+
+    while (tasks.count > 0) {
+        int signo = 0;
+        pid_t stopped = waitpid(-1, &status, __WALL);
+
+        if (trace_expired) {
+            for (int i = 0; i < tasks.count; i++) kill(tasks.items[i].pid, SIGKILL);
+        }
+        if (stopped < 0) {
+            if (errno != EINTR) break;
+            continue;
+        }
+        if (WIFEXITED(status) || WIFSIGNALED(status)) {
+            task_remove(&tasks, stopped);
+            continue;
+        }
+        if (!WIFSTOPPED(status)) continue;
+
+        TracedTask *task = task_get(&tasks, stopped);
+        int event = status >> 16;
+        if (WSTOPSIG(status) == (SIGTRAP | 0x80)) {
+            struct __ptrace_syscall_info info;
+            if (ptrace(PTRACE_GET_SYSCALL_INFO, stopped, sizeof(info), &info) > 0) {
+                if (info.op == PTRACE_SYSCALL_INFO_ENTRY) {
+                    syscall_entry(task, &info);
+                } else if (info.op == PTRACE_SYSCALL_INFO_EXIT) {
+                    syscall_exit(result, task, &info);
+                }
+            }
+        } else if (WSTOPSIG(status) == SIGTRAP && event == PTRACE_EVENT_EXEC) {
+            // The thread that called exec may have taken over the leader's pid
+            unsigned long former;
+            if (ptrace(PTRACE_GETEVENTMSG, stopped, NULL, &former) == 0 && (pid_t)former != stopped) {
+                static char requested[PATH_MAX];
+                memcpy(requested, task_get(&tasks, (pid_t)former)->path, sizeof(requested));
+                task_remove(&tasks, (pid_t)former);
+                task = task_get(&tasks, stopped);
+                memcpy(task->path, requested, sizeof(task->path));
+            }
+            exec_event(result, task);
+        } else if (WSTOPSIG(status) == SIGTRAP && event != 0) {
+            // New processes and threads are traced automatically and start with a SIGSTOP
+        } else if (WSTOPSIG(status) != SIGSTOP || event != 0) {
+            signo = WSTOPSIG(status);
+        }
+        ptrace(PTRACE_SYSCALL, stopped, NULL, signo);
+    }
+
+    alarm(0);
+    sigaction(SIGALRM, &old_action, NULL);
+    for (int i = 0; i < tasks.count; i++) {
+        if (tasks.items[i].mem_fd >= 0) close(tasks.items[i].mem_fd);
+    }
+    free(tasks.items);
+    return 0;
+}
+
+void trace_result_free(TraceResult *result) {
+    string_table_free(&result->files);
+    string_table_free(&result->directories);
+    arena_free(&result->arena);
+}
@@ -0,0 +1,16 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "pathtab.h"
+
+// Host files a traced run of root_process touched, as absolute paths in the order first seen
+typedef struct {
+    StringArena arena;
+    StringTable files;          // Opened for reading, executed or mapped: copied into the sandbox
+    StringTable directories;    // Opened as directories, or holding a file opened for writing
+} TraceResult;
+
+int trace_root_process(const char *root_process, char *const *args, int seconds, TraceResult *result);
+void trace_result_free(TraceResult *result);
+
+#endif
@@ -0,0 +1,197 @@
+/* batch.c */
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "jailor.h"
+
+// Batch mode brings up several sandboxes from one jailor process:
+//   - the configs are parsed once, up front, so a bad one fails the batch before anything is built
+//   - every rootfs is built by one bounded worker pool, so cells sharing libraries warm the
+//     page cache once and the thread count does not grow with the batch
+//   - the host side of every veth pair is created over a single rtnetlink socket
+//   - all init processes are supervised by one waitpid() loop
+
+// Struct shared by the rootfs workers
+typedef struct {
+    SandboxContext *ctxs;
+    int count;
+    int next;
+} BatchQueue;
+
+static pid_t *batch_pids;
+static int batch_count;
+
+static void *batch_prepare_worker(void *arg);
+static void batch_prepare(SandboxContext *ctxs, int count, int workers);
+static void batch_terminate(int signo);
+
+static void *batch_prepare_worker(void *arg) {
+    BatchQueue *queue = (BatchQueue *)arg;
+    int i;
+
+    while ((i = __atomic_fetch_add(&queue->next, 1, __ATOMIC_RELAXED)) < queue->count) {
+        prepare_rootfs(&queue->ctxs[i]);
+    }
+    return NULL;
+}
+
+// Function to build all rootfs on `workers` threads, one sandbox per thread at a time.
+// Each sandbox copies on its own thread, so the pool size bounds the total copy parallelism.
+static void batch_prepare(SandboxContext *ctxs, int count, int workers) {
+    BatchQueue queue = { ctxs, count, 0 };
+    pthread_t *threads;
+    int started = 0;
+
+    for (int i = 0; i < count; ++i) {
+        ctxs[i].copy_workers = 1;
+    }
+    if (workers > count) workers = count;
+
+    threads = malloc(sizeof(pthread_t) * workers);
+    check_error(threads == NULL ? -1 : 0, "malloc batch workers");
+
+    for (int i = 0; i < workers - 1; ++i) {
+        if (pthread_create(&threads[i], NULL, batch_prepare_worker, &queue) != 0) {
+            break;
+        }
+        started++;
+    }
+    batch_prepare_worker(&queue);
+
+    for (int i = 0; i < started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+}
+
+// Forward SIGTERM (and friends) to every sandbox of the batch, or SIGKILL for JAILOR_KILL_SIGNAL
+static void batch_terminate(int signo) {
+    int sig = signo == JAILOR_KILL_SIGNAL ? SIGKILL : SIGTERM;
+
+    for (int i = 0; i < batch_count; ++i) {
+        if (batch_pids[i] > 0) {
+            kill(batch_pids[i], sig);
+        }
+    }
+}
+
+// Function to launch one sandbox per config and supervise them until all have exited.
+// Returns 0 if every root process exited with status 0.
+int batch_run(int count, char **config_paths) {
+    SandboxContext *ctxs = calloc(count, sizeof(SandboxContext));
+    char *stack = malloc(STACK_SIZE);
+    int workers = 1;
+    int host_fd = -1;
+    int remaining = 0;
+    int failed = 0;
+    Span span;
+
+    check_error(ctxs == NULL || stack == NULL ? -1 : 0, "malloc batch");
+    batch_pids = calloc(count, sizeof(pid_t));
+    check_error(batch_pids == NULL ? -1 : 0, "malloc batch pids");
+    batch_count = count;
+
+    for (int i = 0; i < count; ++i) {
+        span_begin(&span, "parse_config");
+        init_config(config_paths[i], &ctxs[i]);
+        span_end(&span, ctxs[i].sandbox_id);
+
+        // Two sandboxes on one root_dir would build into and tear down each other
+        for (int j = 0; j < i; ++j) {
+            if (strcmp(ctxs[i].root_dir, ctxs[j].root_dir) == 0) {
+                fprintf(stderr, "batch: %s and %s share root_dir %s\n", config_paths[j], config_paths[i],
+                        ctxs[i].root_dir);
+                exit(EXIT_FAILURE);
+            }
+        }
+        if (ctxs[i].copy_workers > workers) {
+            workers = ctxs[i].copy_workers;
+        }
+    }
+
+    batch_prepare(ctxs, count, workers);
+
+    signal(SIGTERM, batch_terminate);
+    signal(SIGTSTP, batch_terminate);
+    signal(JAILOR_KILL_SIGNAL, batch_terminate);
+
+    for (int i = 0; i < count; ++i) {
+        span_begin(&span, "clone");
+        batch_pids[i] = spawn_sandbox(&ctxs[i], stack);
+        if (batch_pids[i] == -1) {
+            fprintf(stderr, "batch: clone sandbox%d: %s\n", ctxs[i].sandbox_id, strerror(errno));
+            teardown_rootfs(&ctxs[i]);
+            cgroup_destroy(&ctxs[i]);
+            failed = 1;
+            continue;
+        }
+        span_end(&span, ctxs[i].sandbox_id);
+        remaining++;
+
+        if (ctxs[i].veth_ip_pair_defined) {
+            span_begin(&span, "veth");
+            if (host_fd < 0) {
+                check_error(enable_ip_forward(), "enable ip_forward");
+                host_fd = rtnl_open(0);
+                check_error(host_fd, "open host rtnetlink socket");
+            }
+            if (setup_veth(&ctxs[i], batch_pids[i], host_fd) == -1) {
+                fprintf(stderr, "batch: veth for sandbox%d: %s\n", ctxs[i].sandbox_id, strerror(errno));
+                kill(batch_pids[i], SIGKILL);
+                failed = 1;
+            }
+            span_end(&span, ctxs[i].sandbox_id);
+        }
+    }
+    if (host_fd >= 0) {
+        close(host_fd);
+    }
+    printf("batch: %d of %d sandboxes started\n", remaining, count);
+
+    // Tear each sandbox down as soon as its init exits, not when the whole batch is done
+    while (remaining > 0) {
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+
+        if (pid == -1) {
+            if (errno == EINTR) continue;
+            perror("batch waitpid");
+            break;
+        }
+        for (int i = 0; i < count; ++i) {
+            if (batch_pids[i] != pid) continue;
+
+            batch_pids[i] = 0;
+            remaining--;
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                failed = 1;
+            }
+            printf("batch: sandbox%d exited (status %d)\n", ctxs[i].sandbox_id, status);
+
+            span_begin(&span, "teardown");
+            teardown_rootfs(&ctxs[i]);
+            cgroup_destroy(&ctxs[i]);
+            span_end(&span, ctxs[i].sandbox_id);
+            break;
+        }
+    }
+
+    for (int i = 0; i < count; ++i) {
+        destroy_context(&ctxs[i]);
+    }
+    free(batch_pids);
+    batch_pids = NULL;
+    batch_count = 0;
+    free(stack);
+    free(ctxs);
+    return failed ? -1 : 0;
+}
@@ -0,0 +1,200 @@
+/* cgroup.c */
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+
+#include "jailor.h"
+
+// Every sandbox gets <CGROUP_ROOT>/jailor/<basename of root_dir>
+#define CGROUP_ROOT "/sys/fs/cgroup"
+#define CGROUP_PARENT CGROUP_ROOT "/jailor"
+
+#ifndef CLONE_INTO_CGROUP
+#define CLONE_INTO_CGROUP 0x200000000ULL
+#endif
+
+// Layout of struct clone_args up to CLONE_ARGS_SIZE_VER2 (Linux 5.7)
+typedef struct {
+    uint64_t flags;
+    uint64_t pidfd;
+    uint64_t child_tid;
+    uint64_t parent_tid;
+    uint64_t exit_signal;
+    uint64_t stack;
+    uint64_t stack_size;
+    uint64_t tls;
+    uint64_t set_tid;
+    uint64_t set_tid_size;
+    uint64_t cgroup;
+} CloneArgs;
+
+static int write_file(const char *dir, const char *name, const char *value);
+static void enable_controllers(const char *dir);
+
+static int write_file(const char *dir, const char *name, const char *value) {
+    char path[PATH_MAX + 64];
+    ssize_t n;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    n = write(fd, value, strlen(value));
+    close(fd);
+    return n == (ssize_t)strlen(value) ? 0 : -1;
+}
+
+// Delegate the controllers to the children of dir. Each one is enabled on its
+// own so a controller missing from the kernel does not disable the others.
+static void enable_controllers(const char *dir) {
+    static const char *controllers[] = { "+cpuset", "+cpu", "+memory", "+io", NULL };
+
+    for (int i = 0; controllers[i] != NULL; ++i) {
+        write_file(dir, "cgroup.subtree_control", controllers[i]);
+    }
+}
+
+// Function to create the cgroup of a sandbox and write its limits.
+// Leaves an open directory fd in ctx->cgroup.fd for CLONE_INTO_CGROUP.
+int cgroup_create(SandboxContext *ctx) {
+    CgroupConfig *cg = &ctx->cgroup;
+    const char *name = strrchr(ctx->root_dir, '/');
+    char value[32];
+
+    name = name != NULL ? name + 1 : ctx->root_dir;
+    snprintf(cg->path, sizeof(cg->path), "%s/%s", CGROUP_PARENT, name);
+
+    enable_controllers(CGROUP_ROOT);
+    if (mkdir(CGROUP_PARENT, 0755) == -1 && errno != EEXIST) {
+        perror("mkdir " CGROUP_PARENT);
+        return -1;
+    }
+    enable_controllers(CGROUP_PARENT);
+    if (mkdir(cg->path, 0755) == -1 && errno != EEXIST) {
+        perror("mkdir sandbox cgroup");
+        return -1;
+    }
+
+    // A limit that was asked for but cannot be applied is an error, not a warning
+    if ((cg->cpuset != NULL && write_file(cg->path, "cpuset.cpus", cg->cpuset) == -1) ||
+        (cg->cpu_max != NULL && write_file(cg->path, "cpu.max", cg->cpu_max) == -1) ||
+        (cg->memory_max != NULL && write_file(cg->path, "memory.max", cg->memory_max) == -1) ||
+        (cg->memory_high != NULL && write_file(cg->path, "memory.high", cg->memory_high) == -1)) {
+        perror("write sandbox cgroup limits");
+        cgroup_destroy(ctx);
+        return -1;
+    }
+    if (cg->io_weight > 0) {
+        snprintf(value, sizeof(value), "default %d", cg->io_weight);
+        if (write_file(cg->path, "io.weight", value) == -1) {
+            perror("write sandbox io.weight");
+            cgroup_destroy(ctx);
+            return -1;
+        }
+    }
+    // Locked memory cannot be carried over execve, so keep the cell out of swap instead
+    if (cg->lock_memory) {
+        write_file(cg->path, "memory.swap.max", "0");
+    }
+
+    cg->fd = open(cg->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (cg->fd < 0) {
+        perror("open sandbox cgroup");
+        cgroup_destroy(ctx);
+        return -1;
+    }
+    return 0;
+}
+
+// Function to start the sandbox init process directly inside its cgroup, so
+// it never runs a single instruction outside the limits. Kernels without
+// clone3 or CLONE_INTO_CGROUP fall back to clone() and moving the pid.
+pid_t cgroup_spawn(SandboxContext *ctx, char *stack, int flags) {
+    CloneArgs args;
+    char pid_str[16];
+    pid_t pid;
+
+    if (cgroup_create(ctx) == -1) {
+        return -1;
+    }
+
+    memset(&args, 0, sizeof(args));
+    args.flags = (uint64_t)(unsigned int)flags | CLONE_INTO_CGROUP;
+    args.exit_signal = SIGCHLD;
+    args.cgroup = (uint64_t)ctx->cgroup.fd;
+
+    pid = syscall(SYS_clone3, &args, sizeof(args));
+    if (pid == 0) {
+        // Like fork(): the child runs on a copy of the parent stack
+        _exit(child_func(ctx));
+    }
+    if (pid > 0 || (errno != ENOSYS && errno != E2BIG && errno != EINVAL)) {
+        return pid;
+    }
+
+    pid = clone(child_func, stack + STACK_SIZE, flags | SIGCHLD, ctx);
+    if (pid > 0) {
+        snprintf(pid_str, sizeof(pid_str), "%d", (int)pid);
+        if (write_file(ctx->cgroup.path, "cgroup.procs", pid_str) == -1) {
+            perror("move sandbox into cgroup");
+        }
+    }
+    return pid;
+}
+
+// Function to apply the real-time settings of root_process; runs in the child right before execv
+void cgroup_apply_sched(SandboxContext *ctx) {
+    CgroupConfig *cg = &ctx->cgroup;
+    struct sched_param param;
+    struct rlimit unlimited = { RLIM_INFINITY, RLIM_INFINITY };
+
+    if (cg->sched_priority > 0) {
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = cg->sched_priority;
+        check_error(sched_setscheduler(0, SCHED_FIFO, &param), "sched_setscheduler SCHED_FIFO");
+    }
+    // Let root_process mlockall() itself without hitting the default 8 MB limit.
+    // Without CAP_SYS_RESOURCE the cell still runs, just with the default limit.
+    if (cg->lock_memory && setrlimit(RLIMIT_MEMLOCK, &unlimited) == -1) {
+        perror("setrlimit RLIMIT_MEMLOCK");
+    }
+}
+
+// Function to remove the cgroup of a sandbox once its init process is gone.
+// The pid namespace is torn down asynchronously, so an EBUSY is retried briefly.
+void cgroup_destroy(SandboxContext *ctx) {
+    CgroupConfig *cg = &ctx->cgroup;
+    struct timespec delay = { 0, 10 * 1000 * 1000 };
+
+    if (cg->fd >= 0) {
+        close(cg->fd);
+        cg->fd = -1;
+    }
+    if (cg->path[0] == '\0') {
+        return;
+    }
+    for (int i = 0; i < 100 && rmdir(cg->path) == -1 && errno == EBUSY; ++i) {
+        nanosleep(&delay, NULL);
+    }
+    cg->path[0] = '\0';
+}
+
+// Function to give the cgroup of a sandbox as seen from the cgroup2 root, e.g. for CRIU
+const char *cgroup_relative_path(const SandboxContext *ctx) {
+    return ctx->cgroup.path + strlen(CGROUP_ROOT);
+}
@@ -0,0 +1,282 @@
+/* copy_engine.c */
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <linux/fs.h>
+
+#include "jailor.h"
+
+#define COPY_BUFFER_SIZE (1024 * 1024) // Buffer size for the last-resort copy loop
+
+static const char *strategy_names[COPY_STRATEGY_COUNT] = {
+    "reflink", "copy_file_range", "sendfile", "buffer"
+};
+
+// Struct shared by the copy workers
+typedef struct {
+    CopyJob *jobs;
+    int count;
+    int next;
+    CopyStats *stats;
+    Store *store;
+} CopyQueue;
+
+static unsigned long long elapsed_nsec(const struct timespec *start);
+static int copy_with_reflink(int src_fd, int dest_fd, off_t size);
+static int copy_with_file_range(int src_fd, int dest_fd, off_t size);
+static int copy_with_sendfile(int src_fd, int dest_fd, off_t size);
+static int copy_with_buffer(int src_fd, int dest_fd);
+static void *copy_worker(void *arg);
+
+static unsigned long long elapsed_nsec(const struct timespec *start) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long)(now.tv_sec - start->tv_sec) * 1000000000ULL +
+           (unsigned long long)now.tv_nsec - (unsigned long long)start->tv_nsec;
+}
+
+// Share the source extents with the destination (btrfs, xfs, ...).
+// Returns 0 on success, 1 if the filesystem cannot do it, -1 on error.
+static int copy_with_reflink(int src_fd, int dest_fd, off_t size) {
+    (void)size;
+    if (ioctl(dest_fd, FICLONE, src_fd) == 0) {
+        return 0;
+    }
+    if (errno == EOPNOTSUPP || errno == EXDEV || errno == EINVAL || errno == ENOTTY || errno == EPERM) {
+        return 1;
+    }
+    return -1;
+}
+
+// Copy inside the kernel, possibly offloaded to the filesystem.
+// Returns 0 on success, 1 if nothing was copied and the caller should fall back, -1 on error.
+static int copy_with_file_range(int src_fd, int dest_fd, off_t size) {
+    off_t done = 0;
+
+    while (done < size) {
+        ssize_t n = copy_file_range(src_fd, NULL, dest_fd, NULL, size - done, 0);
+        if (n < 0) {
+            if (done == 0 && (errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP || errno == EINVAL)) {
+                return 1;
+            }
+            return -1;
+        }
+        if (n == 0) {
+            // Some pseudo filesystems report a size but copy nothing
+            return done == 0 ? 1 : -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+// Copy through the page cache without a userspace buffer.
+// Returns 0 on success, 1 if nothing was copied and the caller should fall back, -1 on error.
+static int copy_with_sendfile(int src_fd, int dest_fd, off_t size) {
+    off_t done = 0;
+
+    while (done < size) {
+        ssize_t n = sendfile(dest_fd, src_fd, NULL, size - done);
+        if (n < 0) {
+            if (done == 0 && (errno == EINVAL || errno == ENOSYS)) {
+                return 1;
+            }
+            return -1;
+        }
+        if (n == 0) {
+            return done == 0 ? 1 : -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+// Plain read/write loop that survives short writes
+static int copy_with_buffer(int src_fd, int dest_fd) {
+    char *buffer = malloc(COPY_BUFFER_SIZE);
+    ssize_t bytes_read;
+    int ret = 0;
+
+    if (buffer == NULL) {
+        return -1;
+    }
+
+    while ((bytes_read = read(src_fd, buffer, COPY_BUFFER_SIZE)) != 0) {
+        ssize_t written = 0;
+
+        if (bytes_read < 0) {
+            if (errno == EINTR) continue;
+            ret = -1;
+            break;
+        }
+        while (written < bytes_read) {
+            ssize_t n = write(dest_fd, buffer + written, bytes_read - written);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                ret = -1;
+                break;
+            }
+            written += n;
+        }
+        if (ret != 0) break;
+    }
+
+    free(buffer);
+    return ret;
+}
+
+void copy_stats_init(CopyStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    pthread_mutex_init(&stats->lock, NULL);
+}
+
+void copy_stats_print(CopyStats *stats) {
+    for (int i = 0; i < COPY_STRATEGY_COUNT; ++i) {
+        if (stats->files[i] == 0) continue;
+        printf("copy: %-15s %4d files %10llu bytes %8.3f ms\n", strategy_names[i], stats->files[i],
+               stats->bytes[i], stats->nsec[i] / 1e6);
+    }
+    if (stats->skipped > 0) {
+        printf("copy: %d files already present\n", stats->skipped);
+    }
+    pthread_mutex_destroy(&stats->lock);
+}
+
+// Function to copy a file into the sandbox, keeping its mode
+void copy_file(const char *src, const char *dest, CopyStats *stats) {
+    struct stat buffer_stat;
+    struct stat src_stat;
+    struct timespec start;
+    CopyStrategy strategy;
+    int source_fd;
+    int dest_fd;
+    int ret = 1;
+    char dest_dir[PATH_MAX];
+    char *last_slash;
+
+    // Check if the destination file already exists
+    if (stat(dest, &buffer_stat) == 0) {
+        pthread_mutex_lock(&stats->lock);
+        stats->skipped++;
+        pthread_mutex_unlock(&stats->lock);
+        return;
+    }
+
+    // Create the directory for the destination if it doesn't exist
+    snprintf(dest_dir, sizeof(dest_dir), "%s", dest);
+    last_slash = strrchr(dest_dir, '/');
+    if (last_slash != NULL) {
+        *last_slash = '\0';
+        create_directory(dest_dir);
+    }
+
+    source_fd = open(src, O_RDONLY | O_CLOEXEC);
+    if (source_fd < 0) {
+        fprintf(stderr, "Error opening source file '%s': %s\n", src, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    check_error(fstat(source_fd, &src_stat), "fstat source file");
+
+    dest_fd = open(dest, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, src_stat.st_mode & 07777);
+    if (dest_fd < 0) {
+        fprintf(stderr, "Error opening destination file '%s': %s\n", dest, strerror(errno));
+        close(source_fd);
+        exit(EXIT_FAILURE);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (strategy = COPY_REFLINK; strategy < COPY_STRATEGY_COUNT && ret == 1; ++strategy) {
+        switch (strategy) {
+        case COPY_REFLINK:
+            ret = copy_with_reflink(source_fd, dest_fd, src_stat.st_size);
+            break;
+        case COPY_FILE_RANGE:
+            ret = copy_with_file_range(source_fd, dest_fd, src_stat.st_size);
+            break;
+        case COPY_SENDFILE:
+            ret = copy_with_sendfile(source_fd, dest_fd, src_stat.st_size);
+            break;
+        default:
+            ret = copy_with_buffer(source_fd, dest_fd);
+            break;
+        }
+    }
+    strategy--;
+
+    if (ret != 0) {
+        fprintf(stderr, "Error copying '%s' to '%s' (%s): %s\n", src, dest, strategy_names[strategy], strerror(errno));
+        close(source_fd);
+        close(dest_fd);
+        exit(EXIT_FAILURE);
+    }
+
+    // open() applies the umask, so set the mode explicitly
+    check_error(fchmod(dest_fd, src_stat.st_mode & 07777), "fchmod destination file");
+
+    pthread_mutex_lock(&stats->lock);
+    stats->files[strategy]++;
+    stats->bytes[strategy] += src_stat.st_size;
+    stats->nsec[strategy] += elapsed_nsec(&start);
+    pthread_mutex_unlock(&stats->lock);
+
+    close(source_fd);
+    close(dest_fd);
+}
+
+static void *copy_worker(void *arg) {
+    CopyQueue *queue = (CopyQueue *)arg;
+    int i;
+
+    while ((i = __atomic_fetch_add(&queue->next, 1, __ATOMIC_RELAXED)) < queue->count) {
+        if (queue->store != NULL) {
+            store_install(queue->store, &queue->jobs[i], queue->stats);
+        } else {
+            copy_file(queue->jobs[i].src, queue->jobs[i].dest, queue->stats);
+        }
+    }
+    return NULL;
+}
+
+// Function to run a list of copies on up to `workers` threads.
+// With a store, files are installed from the content-addressed store instead of copied.
+void copy_engine_run(CopyJob *jobs, int count, int workers, CopyStats *stats, Store *store) {
+    CopyQueue queue = { jobs, count, 0, stats, store };
+    pthread_t *threads;
+    int started = 0;
+
+    if (workers > count) workers = count;
+    if (workers <= 1) {
+        copy_worker(&queue);
+        return;
+    }
+
+    threads = malloc(sizeof(pthread_t) * workers);
+    check_error(threads == NULL ? -1 : 0, "malloc copy workers");
+
+    for (int i = 0; i < workers; ++i) {
+        if (pthread_create(&threads[i], NULL, copy_worker, &queue) != 0) {
+            break;
+        }
+        started++;
+    }
+
+    // The calling thread helps too, so copying proceeds even if no worker started
+    copy_worker(&queue);
+
+    for (int i = 0; i < started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+}
@@ -0,0 +1,426 @@
+/* criu.c */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "jailor.h"
+
+// Client of the CRIU RPC service. `criu swrk <fd>` serves one session on a SOCK_SEQPACKET
+// socket it inherits from us; every packet is one protobuf-encoded criu_req or criu_resp
+// (images/rpc.proto in CRIU, copied next to this file). The few fields used here are encoded
+// by hand so neither jailor nor sdeamon needs protobuf-c; their numbers must match rpc.proto. A session can run any number of PRE_DUMP requests
+// followed by one DUMP, which is what iterative migration needs.
+//
+// For post-copy migration the DUMP asks for lazy pages: CRIU writes everything but the
+// memory, reports on status_fd, then serves the pages from a page server until the
+// destination's `criu lazy-pages` daemon has fetched them all, and only then responds.
+
+#define CRIU_MSG_MAX 4096
+
+// Wire types
+#define PB_VARINT 0
+#define PB_FIXED64 1
+#define PB_LEN 2
+#define PB_FIXED32 5
+
+// criu_req
+#define REQ_TYPE 1
+#define REQ_OPTS 2
+
+// criu_opts
+#define OPTS_IMAGES_DIR_FD 1
+#define OPTS_PID 2
+#define OPTS_LEAVE_RUNNING 3
+#define OPTS_TCP_ESTABLISHED 5
+#define OPTS_SHELL_JOB 7
+#define OPTS_FILE_LOCKS 8
+#define OPTS_LOG_LEVEL 9
+#define OPTS_LOG_FILE 10
+#define OPTS_PS 11
+#define OPTS_ROOT 13
+#define OPTS_PARENT_IMG 14
+#define OPTS_TRACK_MEM 15
+#define OPTS_LINK_REMAP 18
+#define OPTS_CG_ROOT 25
+#define OPTS_RST_SIBLING 26
+#define OPTS_AUTO_EXT_MNT 28
+#define OPTS_EXT_SHARING 29
+#define OPTS_EXT_MASTERS 30
+#define OPTS_MANAGE_CGROUPS_MODE 34
+#define OPTS_EXTERNAL 37
+#define OPTS_LAZY_PAGES 48
+#define OPTS_STATUS_FD 49
+
+// criu_page_server_info
+#define PS_PORT 2
+
+// cgroup_root
+#define CG_ROOT_PATH 2
+
+// criu_cg_mode: keep the properties of a cgroup that already exists, set those CRIU creates
+#define CG_MODE_SOFT 3
+
+// criu_resp
+#define RESP_TYPE 1
+#define RESP_SUCCESS 2
+#define RESP_RESTORE 4
+#define RESP_CR_ERRNO 7
+#define RESP_CR_ERRMSG 9
+
+// criu_restore_resp
+#define RESTORE_PID 1
+
+// Struct to hold a message being encoded
+typedef struct {
+    unsigned char buf[CRIU_MSG_MAX];
+    size_t len;
+    int overflow;
+} PbBuf;
+
+static void pb_varint(PbBuf *pb, uint64_t value);
+static void pb_key(PbBuf *pb, int field, int wire_type);
+static void pb_int(PbBuf *pb, int field, int64_t value);
+static void pb_bytes(PbBuf *pb, int field, const void *data, size_t len);
+static void pb_string(PbBuf *pb, int field, const char *str);
+static int pb_read_varint(const unsigned char **p, const unsigned char *end, uint64_t *value);
+static int pb_skip(const unsigned char **p, const unsigned char *end, int wire_type);
+static void encode_opts(PbBuf *pb, const CriuOpts *opts);
+static int decode_restore(const unsigned char *p, const unsigned char *end, CriuResult *result);
+static int decode_resp(const unsigned char *p, size_t len, CriuResult *result);
+
+static void pb_varint(PbBuf *pb, uint64_t value) {
+    do {
+        unsigned char byte = value & 0x7f;
+
+        value >>= 7;
+        if (value != 0) byte |= 0x80;
+        if (pb->len >= sizeof(pb->buf)) {
+            pb->overflow = 1;
+            return;
+        }
+        pb->buf[pb->len++] = byte;
+    } while (value != 0);
+}
+
+static void pb_key(PbBuf *pb, int field, int wire_type) {
+    pb_varint(pb, ((uint64_t)field << 3) | wire_type);
+}
+
+// int32, int64 and bool fields; negative values are sign-extended to ten bytes as protobuf does
+static void pb_int(PbBuf *pb, int field, int64_t value) {
+    pb_key(pb, field, PB_VARINT);
+    pb_varint(pb, (uint64_t)value);
+}
+
+static void pb_bytes(PbBuf *pb, int field, const void *data, size_t len) {
+    pb_key(pb, field, PB_LEN);
+    pb_varint(pb, len);
+    if (pb->len + len > sizeof(pb->buf)) {
+        pb->overflow = 1;
+        return;
+    }
+    memcpy(pb->buf + pb->len, data, len);
+    pb->len += len;
+}
+
+static void pb_string(PbBuf *pb, int field, const char *str) {
+    pb_bytes(pb, field, str, strlen(str));
+}
+
+static int pb_read_varint(const unsigned char **p, const unsigned char *end, uint64_t *value) {
+    *value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (*p >= end) return -1;
+        *value |= (uint64_t)(**p & 0x7f) << shift;
+        if ((*(*p)++ & 0x80) == 0) return 0;
+    }
+    return -1;
+}
+
+// Function to step over a field this client does not read
+static int pb_skip(const unsigned char **p, const unsigned char *end, int wire_type) {
+    uint64_t value;
+
+    switch (wire_type) {
+    case PB_VARINT:
+        return pb_read_varint(p, end, &value);
+    case PB_FIXED64:
+        value = 8;
+        break;
+    case PB_FIXED32:
+        value = 4;
+        break;
+    case PB_LEN:
+        if (pb_read_varint(p, end, &value) == -1) return -1;
+        break;
+    default:
+        return -1;
+    }
+    if (value > (uint64_t)(end - *p)) return -1;
+    *p += value;
+    return 0;
+}
+
+static void encode_opts(PbBuf *pb, const CriuOpts *opts) {
+    // Field 1 is required, everything else is left at CRIU's default unless set
+    pb_int(pb, OPTS_IMAGES_DIR_FD, opts->images_dir_fd);
+    if (opts->pid > 0) pb_int(pb, OPTS_PID, opts->pid);
+    if (opts->leave_running) pb_int(pb, OPTS_LEAVE_RUNNING, 1);
+    pb_int(pb, OPTS_TCP_ESTABLISHED, 1);
+    // root_process shares sdeamon's session and terminal, both outside the dumped tree
+    pb_int(pb, OPTS_SHELL_JOB, 1);
+    pb_int(pb, OPTS_FILE_LOCKS, 1);
+    pb_int(pb, OPTS_LINK_REMAP, 1);
+    pb_int(pb, OPTS_LOG_LEVEL, 2);
+    pb_string(pb, OPTS_LOG_FILE, opts->log_file != NULL ? opts->log_file : "criu.log");
+    if (opts->root != NULL) pb_string(pb, OPTS_ROOT, opts->root);
+    if (opts->parent_img != NULL) pb_string(pb, OPTS_PARENT_IMG, opts->parent_img);
+    if (opts->track_mem) pb_int(pb, OPTS_TRACK_MEM, 1);
+    if (opts->rst_sibling) pb_int(pb, OPTS_RST_SIBLING, 1);
+    // Store objects are bind mounted into the rootfs from the host
+    pb_int(pb, OPTS_AUTO_EXT_MNT, 1);
+    pb_int(pb, OPTS_EXT_SHARING, 1);
+    pb_int(pb, OPTS_EXT_MASTERS, 1);
+    if (opts->external != NULL) pb_string(pb, OPTS_EXTERNAL, opts->external);
+    if (opts->lazy_pages) pb_int(pb, OPTS_LAZY_PAGES, 1);
+    if (opts->page_server_port > 0) {
+        PbBuf ps;
+
+        ps.len = 0;
+        ps.overflow = 0;
+        pb_int(&ps, PS_PORT, opts->page_server_port);
+        pb_bytes(pb, OPTS_PS, ps.buf, ps.len);
+    }
+    if (opts->status_fd > 0) pb_int(pb, OPTS_STATUS_FD, opts->status_fd);
+    if (opts->cgroup_root != NULL) {
+        PbBuf cg;
+
+        cg.len = 0;
+        cg.overflow = 0;
+        pb_string(&cg, CG_ROOT_PATH, opts->cgroup_root);
+        pb_int(pb, OPTS_MANAGE_CGROUPS_MODE, CG_MODE_SOFT);
+        pb_bytes(pb, OPTS_CG_ROOT, cg.buf, cg.len);
+        if (cg.overflow) pb->overflow = 1;
+    }
+}
+
+static int decode_restore(const unsigned char *p, const unsigned char *end, CriuResult *result) {
+    while (p < end) {
+        uint64_t key, value;
+
+        if (pb_read_varint(&p, end, &key) == -1) return -1;
+        if ((key >> 3) == RESTORE_PID && (key & 7) == PB_VARINT) {
+            if (pb_read_varint(&p, end, &value) == -1) return -1;
+            result->pid = (pid_t)value;
+        } else if (pb_skip(&p, end, key & 7) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int decode_resp(const unsigned char *p, size_t len, CriuResult *result) {
+    const unsigned char *end = p + len;
+
+    while (p < end) {
+        uint64_t key, value;
+        int field, wire_type;
+
+        if (pb_read_varint(&p, end, &key) == -1) return -1;
+        field = key >> 3;
+        wire_type = key & 7;
+
+        if (wire_type == PB_VARINT && (field == RESP_TYPE || field == RESP_SUCCESS || field == RESP_CR_ERRNO)) {
+            if (pb_read_varint(&p, end, &value) == -1) return -1;
+            if (field == RESP_TYPE) result->type = (int)value;
+            else if (field == RESP_SUCCESS) result->success = value != 0;
+            else result->cr_errno = (int)value;
+        } else if (wire_type == PB_LEN && (field == RESP_RESTORE || field == RESP_CR_ERRMSG)) {
+            if (pb_read_varint(&p, end, &value) == -1 || value > (uint64_t)(end - p)) return -1;
+            if (field == RESP_RESTORE) {
+                if (decode_restore(p, p + value, result) == -1) return -1;
+            } else {
+                snprintf(result->errmsg, sizeof(result->errmsg), "%.*s", (int)value, (const char *)p);
+            }
+            p += value;
+        } else if (pb_skip(&p, end, wire_type) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Function to start a `criu swrk` service for this process. Images dir fds passed in later
+// requests are resolved in our fd table, so they must stay open until the call returns.
+int criu_start(CriuSession *session) {
+    int sv[2];
+    char fd_arg[16];
+
+    session->sock = -1;
+    session->pid = -1;
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) == -1) {
+        return -1;
+    }
+
+    session->pid = fork();
+    if (session->pid == -1) {
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+    if (session->pid == 0) {
+        close(sv[0]);
+        snprintf(fd_arg, sizeof(fd_arg), "%d", sv[1]);
+        execlp("criu", "criu", "swrk", fd_arg, (char *)NULL);
+        perror("exec criu");
+        _exit(127);
+    }
+
+    close(sv[1]);
+    session->sock = sv[0];
+    return 0;
+}
+
+// Function to send one request without waiting for its response, so the caller can act
+// on status_fd while CRIU works. Returns -1 if the service could not be talked to.
+int criu_request(CriuSession *session, int type, const CriuOpts *opts) {
+    PbBuf *req = malloc(sizeof(PbBuf));
+    PbBuf *sub = malloc(sizeof(PbBuf));
+    int ret = -1;
+
+    if (req == NULL || sub == NULL) {
+        errno = ENOMEM;
+        goto out;
+    }
+    req->len = sub->len = 0;
+    req->overflow = sub->overflow = 0;
+
+    encode_opts(sub, opts);
+    pb_int(req, REQ_TYPE, type);
+    pb_bytes(req, REQ_OPTS, sub->buf, sub->len);
+    if (req->overflow || sub->overflow) {
+        errno = EMSGSIZE;
+        goto out;
+    }
+    if (send(session->sock, req->buf, req->len, MSG_NOSIGNAL) == (ssize_t)req->len) {
+        ret = 0;
+    }
+
+out:
+    free(req);
+    free(sub);
+    return ret;
+}
+
+// Function to wait for the response to the last request. Returns -1 if there was none;
+// a request CRIU rejected returns 0 with result->success unset and the reason in
+// result->errmsg.
+int criu_response(CriuSession *session, CriuResult *result) {
+    unsigned char *buf = malloc(CRIU_MSG_MAX);
+    ssize_t n;
+    int ret = -1;
+
+    memset(result, 0, sizeof(*result));
+    if (buf == NULL) {
+        snprintf(result->errmsg, sizeof(result->errmsg), "out of memory");
+        return -1;
+    }
+
+    do {
+        n = recv(session->sock, buf, CRIU_MSG_MAX, 0);
+    } while (n == -1 && errno == EINTR);
+    if (n <= 0) {
+        snprintf(result->errmsg, sizeof(result->errmsg), "criu exited without a response");
+    } else if (decode_resp(buf, n, result) == -1) {
+        snprintf(result->errmsg, sizeof(result->errmsg), "malformed criu response");
+    } else {
+        if (!result->success && result->errmsg[0] == '\0') {
+            snprintf(result->errmsg, sizeof(result->errmsg), "criu request %d failed: %s, see its log in the images dir",
+                     result->type, result->cr_errno != 0 ? strerror(result->cr_errno) : "no errno");
+        }
+        ret = 0;
+    }
+    free(buf);
+    return ret;
+}
+
+// Function to send one request and wait for its response
+int criu_call(CriuSession *session, int type, const CriuOpts *opts, CriuResult *result) {
+    if (criu_request(session, type, opts) == -1) {
+        memset(result, 0, sizeof(*result));
+        snprintf(result->errmsg, sizeof(result->errmsg), "send to criu: %s", strerror(errno));
+        return -1;
+    }
+    return criu_response(session, result);
+}
+
+// Function to start the `criu lazy-pages` daemon a lazy restore from images_dir needs. It
+// fetches missing pages from the page server at address:port, on demand when the restored
+// tasks fault on them and in the background for the rest, and exits once all are in.
+// Returns once it accepts the restore, -1 if it failed to start.
+int criu_lazy_pages(const char *images_dir, const char *address, int port) {
+    char port_arg[16], status_arg[16];
+    int status_pipe[2];
+    pid_t pid;
+    int ret;
+
+    if (pipe2(status_pipe, O_CLOEXEC) == -1) {
+        return -1;
+    }
+    pid = fork();
+    if (pid == -1) {
+        close(status_pipe[0]);
+        close(status_pipe[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        // The status fd is passed by number, so it must survive the exec
+        fcntl(status_pipe[1], F_SETFD, 0);
+        snprintf(port_arg, sizeof(port_arg), "%d", port);
+        snprintf(status_arg, sizeof(status_arg), "%d", status_pipe[1]);
+        execlp("criu", "criu", "lazy-pages", "--page-server", "--address", address, "--port", port_arg,
+               "--images-dir", images_dir, "--status-fd", status_arg, "--log-file", "lazy-pages.log",
+               "-v2", "--daemon", (char *)NULL);
+        perror("exec criu");
+        _exit(127);
+    }
+
+    close(status_pipe[1]);
+    ret = criu_wait_ready(status_pipe[0]);
+    close(status_pipe[0]);
+    // With --daemon it detaches once ready, or fails
+    waitpid(pid, NULL, 0);
+    return ret;
+}
+
+// Function to wait for the byte CRIU writes to a status fd once it is ready, e.g. when the
+// page server of a lazy dump sent with criu_request() is up. EOF means it failed first.
+int criu_wait_ready(int status_fd) {
+    char c;
+    ssize_t n;
+
+    do {
+        n = read(status_fd, &c, 1);
+    } while (n == -1 && errno == EINTR);
+    return n == 1 ? 0 : -1;
+}
+
+// Function to end the session; criu swrk exits once its socket is closed
+void criu_stop(CriuSession *session) {
+    if (session->sock >= 0) {
+        close(session->sock);
+        session->sock = -1;
+    }
+    if (session->pid > 0) {
+        waitpid(session->pid, NULL, 0);
+        session->pid = -1;
+    }
+}
@@ -0,0 +1,147 @@
+/* image_cache.c */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "jailor.h"
+
+// Layout of the image cache:
+//   <dir>/<key>.tar   the populated rootfs of every configuration seen so far
+// The key covers the directories, file_copies and symlinks sections and the
+// identity (device, inode, size, mtime, mode) of every source file, so any
+// change to the closure or to a library on the host yields a new image.
+
+#define IMAGE_CACHE_VERSION "jailor-image-1"
+
+static void hash_string(Sha256 *hash, const char *tag, const char *value);
+static void hash_source(Sha256 *hash, const char *src);
+static int run_tar(const char *cmd);
+
+// Each field is tagged and NUL-terminated, so adjacent entries cannot run into each other
+static void hash_string(Sha256 *hash, const char *tag, const char *value) {
+    sha256_update(hash, tag, strlen(tag) + 1);
+    sha256_update(hash, value, strlen(value) + 1);
+}
+
+static void hash_source(Sha256 *hash, const char *src) {
+    struct stat st;
+    char identity[160];
+
+    if (stat(src, &st) == -1) {
+        // A missing source makes copy_files() fail later; keep the key stable meanwhile
+        snprintf(identity, sizeof(identity), "missing %d", errno);
+    } else {
+        snprintf(identity, sizeof(identity), "%llx %llx %lld %lld.%09ld %o",
+                 (unsigned long long)st.st_dev, (unsigned long long)st.st_ino,
+                 (long long)st.st_size, (long long)st.st_mtim.tv_sec, st.st_mtim.tv_nsec,
+                 st.st_mode & 07777);
+    }
+    hash_string(hash, "stat", identity);
+}
+
+static int run_tar(const char *cmd) {
+    int ret = system(cmd);
+
+    if (ret == -1 || !WIFEXITED(ret) || WEXITSTATUS(ret) != 0) {
+        fprintf(stderr, "image cache: '%s' failed\n", cmd);
+        return -1;
+    }
+    return 0;
+}
+
+// Function to compute the cache key of the rootfs described by the configuration
+int image_cache_key(const SandboxContext *ctx, char key[HASH_HEX_LEN + 1]) {
+    int count;
+    Sha256 hash;
+
+    sha256_init(&hash);
+    hash_string(&hash, "version", IMAGE_CACHE_VERSION);
+
+    // Same key for a text config and the manifest generated from it
+    count = rootfs_directory_count(ctx);
+    for (int i = 0; i < count; ++i) {
+        const char *dir = rootfs_directory(ctx, i);
+        if (dir != NULL) {
+            hash_string(&hash, "dir", dir);
+        }
+    }
+
+    count = rootfs_file_copy_count(ctx);
+    for (int i = 0; i < count; ++i) {
+        const char *src, *dst;
+
+        if (rootfs_file_copy(ctx, i, &src, &dst) != 0)
+            continue;
+
+        hash_string(&hash, "src", src);
+        hash_string(&hash, "dst", dst);
+        hash_source(&hash, src);
+    }
+
+    count = rootfs_symlink_count(ctx);
+    for (int i = 0; i < count; ++i) {
+        const char *sym, *dst;
+
+        if (rootfs_symlink(ctx, i, &sym, &dst) != 0)
+            continue;
+
+        hash_string(&hash, "sym", sym);
+        hash_string(&hash, "target", dst);
+    }
+
+    sha256_final(&hash, key);
+    return 0;
+}
+
+// Function to unpack a cached image into image_dir.
+// Returns 0 on a hit, -1 if there is no usable image and the rootfs must be built.
+int image_cache_restore(SandboxContext *ctx, const char *key) {
+    char image[PATH_MAX];
+    char cmd[3 * PATH_MAX];
+    struct stat st;
+
+    snprintf(image, sizeof(image), "%s/%s.tar", ctx->image_cache_dir, key);
+    if (stat(image, &st) == -1) {
+        return -1;
+    }
+
+    snprintf(cmd, sizeof(cmd), "tar -C '%s' -xpf '%s'", ctx->image_dir, image);
+    if (run_tar(cmd) != 0) {
+        // Drop the broken image and whatever it left behind, then build from scratch
+        unlink(image);
+        snprintf(cmd, sizeof(cmd), "find '%s' -mindepth 1 -delete", ctx->image_dir);
+        run_tar(cmd);
+        return -1;
+    }
+    printf("image cache: hit %.12s, %lld KB unpacked\n", key, (long long)st.st_size / 1024);
+    return 0;
+}
+
+// Function to pack the freshly built image_dir into the cache.
+// The image is written under a temporary name and renamed, so concurrent
+// jailors (or batch threads) never unpack a partial image. Failures only cost the next start.
+void image_cache_save(SandboxContext *ctx, const char *key) {
+    char image[PATH_MAX];
+    char tmp_image[PATH_MAX + 32];
+    char cmd[3 * PATH_MAX];
+
+    create_directory(ctx->image_cache_dir);
+
+    snprintf(image, sizeof(image), "%s/%s.tar", ctx->image_cache_dir, key);
+    snprintf(tmp_image, sizeof(tmp_image), "%s.tmp.%d-%ld", image, (int)getpid(), syscall(SYS_gettid));
+    snprintf(cmd, sizeof(cmd), "tar -C '%s' -cf '%s' .", ctx->image_dir, tmp_image);
+
+    if (run_tar(cmd) != 0 || rename(tmp_image, image) == -1) {
+        unlink(tmp_image);
+        return;
+    }
+    printf("image cache: stored %.12s\n", key);
+}
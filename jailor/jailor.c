@@ -4,9 +4,13 @@
 #include <fcntl.h>
 #include <libconfig.h>
 #include <sched.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/file.h>
 #include <sys/ioctl.h>
+#include <sys/prctl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -17,33 +21,7 @@
 #include <linux/limits.h>
 #include <errno.h>
 
-#define STACK_SIZE (1024 * 1024) // Stack size for the child process
-
-// Struct to hold the sandbox context
-typedef struct {
-    const char *root_dir;
-    config_t cfg;
-    config_setting_t *symlink_setting;
-    int sandbox_id;
-    char *root_process;
-    char **root_process_args;
-    int root_process_argc;
-    struct {
-        const char *host;
-        const char *sandbox;
-    } veth_ip_pair;
-    int veth_ip_pair_defined;
-} SandboxContext;
-
-void check_error(int ret, const char *msg);
-void terminate_child(int signo);
-void create_directory(const char *path);
-void copy_file(const char *src, const char *dest);
-void connect_symlinks(SandboxContext *ctx);
-int child_func(void *arg);
-void init_config(const char *config_file_path, SandboxContext *ctx);
-void create_directories(SandboxContext *ctx);
-void copy_files(SandboxContext *ctx);
+#include "jailor.h"
 
 // Utility function for error checking
 void check_error(int ret, const char *msg) {
@@ -55,12 +33,11 @@ void check_error(int ret, const char *msg) {
 
 pid_t child_pid;
 
-// Handle SIGUSR1
+// Handle SIGTERM and friends by forwarding SIGTERM, and JAILOR_KILL_SIGNAL by SIGKILLing the sandbox
 void terminate_child(int signo)
 {
-    (void)signo;
     if(child_pid > 0) {
-        kill(child_pid, SIGTERM);
+        kill(child_pid, signo == JAILOR_KILL_SIGNAL ? SIGKILL : SIGTERM);
     }
 }
 
@@ -85,82 +62,60 @@ void create_directory(const char *path) {
     }
 }
 
-// Function to copy a file into the sandbox
-void copy_file(const char *src, const char *dest) {
-    // Check if the destination file already exists
-    struct stat buffer_stat;
-    char buffer[4096];
-    int source_fd;
-    int dest_fd;
-    ssize_t bytes_read, bytes_written;
-    char *last_slash;
+// Function to connect symlinks
+void connect_symlinks(SandboxContext *ctx) {
+    int count = rootfs_symlink_count(ctx);
 
-    // Create the directory for the destination if it doesn't exist
-    char dest_dir[256];
+    for (int i = 0; i < count; ++i) {
+        const char *sym, *dst;
 
-    if (stat(dest, &buffer_stat) == 0) {
-        printf("File '%s' already exists. Skipping copy.\n", dest);
-        return; // Exit the function if the file exists
-    }
+        if (rootfs_symlink(ctx, i, &sym, &dst) != 0)
+            continue;
 
-    strncpy(dest_dir, dest, sizeof(dest_dir));
-    last_slash = strrchr(dest_dir, '/');
-    if (last_slash != NULL) {
-        *last_slash = '\0';  // Null-terminate to isolate the directory path
-        create_directory(dest_dir);
-        *last_slash = '/';  // Restore the original path
+        check_error(symlink(dst, sym), "symlink");
     }
+}
 
-    source_fd = open(src, O_RDONLY);
-    if (source_fd < 0) {
-        perror("open source file");
-        exit(EXIT_FAILURE);
-    }
+// Function to read exactly len bytes; fails on EOF
+int read_full(int fd, void *buf, size_t len) {
+    size_t done = 0;
 
-    dest_fd = open(dest, O_WRONLY | O_CREAT | O_TRUNC, 0755);
-    if (dest_fd < 0) {
-        fprintf(stderr, "Error opening destination file '%s': %s\n", dest, strerror(errno));
-        close(source_fd);
-        exit(EXIT_FAILURE);
+    while (done < len) {
+        ssize_t n = read(fd, (char *)buf + done, len - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        done += n;
     }
-
-    while ((bytes_read = read(source_fd, buffer, sizeof(buffer))) > 0) {
-        bytes_written = write(dest_fd, buffer, bytes_read);
-        if (bytes_written != bytes_read) {
-            perror("write");
-            close(source_fd);
-            close(dest_fd);
-            exit(EXIT_FAILURE);
-        }
-    }
-
-    // Check for read errors
-    if (bytes_read < 0) {
-        perror("read");
-    }
-
-    // Close file descriptors
-    close(source_fd);
-    close(dest_fd);
+    return 0;
 }
 
-// Function to connect symlinks
-void connect_symlinks(SandboxContext *ctx) {
-    config_setting_t *symlink_setting = ctx->symlink_setting;
+// Function to block a parked sandbox until the pool sends its launch message:
+// a 32-bit length followed by the NUL-separated root_process arguments.
+void wait_for_launch(SandboxContext *ctx) {
+    static char message[4096];
+    uint32_t len;
+    char *p;
+    int argc = 0;
 
-    if (symlink_setting != NULL) {
-        int count = config_setting_length(symlink_setting);
-
-        for (int i = 0; i < count; ++i) {
-            config_setting_t *s_l = config_setting_get_elem(symlink_setting, i);
-            const char *sym, *dst;
+    // Do not outlive the pool that parked us
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
 
-            if (!(config_setting_lookup_string(s_l, "sym", &sym) &&
-                  config_setting_lookup_string(s_l, "dst", &dst)))
-                continue;
+    if (read_full(ctx->park_fd, &len, sizeof(len)) == -1 || len >= sizeof(message) ||
+        read_full(ctx->park_fd, message, len) == -1) {
+        exit(EXIT_FAILURE);
+    }
+    close(ctx->park_fd);
+    prctl(PR_SET_PDEATHSIG, 0);
+    message[len] = '\0';
 
-            check_error(symlink(dst, sym), "symlink");
-        }
+    for (p = message; p < message + len; p += strlen(p) + 1) {
+        argc++;
+    }
+    ctx->root_process_args = malloc(sizeof(char *) * (argc > 0 ? argc : 1));
+    check_error(ctx->root_process_args == NULL ? -1 : 0, "malloc root_process_args");
+    ctx->root_process_argc = 0;
+    for (p = message; p < message + len; p += strlen(p) + 1) {
+        ctx->root_process_args[ctx->root_process_argc++] = p;
     }
 }
 
@@ -169,14 +124,21 @@ int child_func(void *arg) {
     char old_root_path[PATH_MAX];
     int argc;
     char **args;
+    Span span;
     SandboxContext *ctx = (SandboxContext *)arg;
 
+    span_begin(&span, "child_setup");
     check_error(mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL), "mount / NULL");
 
     // Make ctx->root_dir a mount point with a bind mount
     check_error(mount(ctx->root_dir, ctx->root_dir, NULL, MS_BIND, NULL),
             "bind-mount root_dir");
 
+    // Store objects that could not be hardlinked are bound in before pivoting
+    if (ctx->store.mount_count > 0) {
+        store_mount_objects(&ctx->store, ctx->root_dir);
+    }
+
     // Ensure you're root and have capabilities to pivot_root.
     // Create the old_root directory inside ctx->root_dir before pivot_root:
     // Inside that mount, create "old_root"
@@ -200,6 +162,20 @@ int child_func(void *arg) {
 
     connect_symlinks(ctx);
 
+    // Hardlinked store objects are the store's own inodes and sandbox root is host root,
+    // so only a read-only rootfs keeps it from writing through them. In overlay mode they
+    // sit in a lower layer and writes are copied up instead.
+    if (ctx->store.dir != NULL && !ctx->store.use_bind && !rootfs_is_overlay(ctx)) {
+        check_error(mount(NULL, "/", NULL, MS_REMOUNT | MS_BIND | MS_RDONLY, NULL), "remount rootfs read-only");
+    }
+
+    // A pooled sandbox is parked here until it is bound to a start request
+    if (ctx->park_fd >= 0) {
+        span_end(&span, ctx->sandbox_id);
+        wait_for_launch(ctx);
+        span_begin(&span, "pool_launch");
+    }
+
     // Prepare arguments for execv as before
     argc = ctx->root_process_argc + 2;
     args = malloc(sizeof(char*) * argc);
@@ -213,15 +189,36 @@ int child_func(void *arg) {
     }
     args[argc - 1] = NULL;
 
+    // Scheduling class and memlock limit are inherited across execv
+    cgroup_apply_sched(ctx);
+
+    span_end(&span, ctx->sandbox_id);
     check_error(execv(ctx->root_process, args), "execv root_process");
 
     return 0;
 }
 
+// Function to point the context at a root directory and derive the paths that depend on it
+void set_root_dir(SandboxContext *ctx, const char *root_dir) {
+    ctx->root_dir = root_dir;
+    ctx->image_dir = ctx->root_dir;
+    snprintf(ctx->overlay_dir, sizeof(ctx->overlay_dir), "%s_overlay", ctx->root_dir);
+}
+
 // Function to initialize configuration
 void init_config(const char *config_file_path, SandboxContext *ctx) {
     config_setting_t *args_setting;
     config_setting_t *veth_setting;
+    config_setting_t *resources_setting;
+    const char *store_link;
+
+    // A binary manifest written by configer --manifest is mapped instead of parsed
+    memset(&(ctx->manifest), 0, sizeof(ctx->manifest));
+    if (manifest_detect(config_file_path)) {
+        init_manifest(config_file_path, ctx);
+        return;
+    }
+
     config_init(&(ctx->cfg));
 
     if (!config_read_file(&(ctx->cfg), config_file_path)) {
@@ -237,8 +234,68 @@ void init_config(const char *config_file_path, SandboxContext *ctx) {
         exit(EXIT_FAILURE);
     }
 
+    ctx->directory_setting = config_lookup(&(ctx->cfg), "directories");
+    ctx->file_copy_setting = config_lookup(&(ctx->cfg), "file_copies");
     ctx->symlink_setting = config_lookup(&(ctx->cfg), "symlinks");
 
+    // Read overlay_lower_dir (optional). When set, the rootfs is an overlay of a
+    // shared read-only lower layer and a per-sandbox writable upper layer.
+    if (!config_lookup_string(&(ctx->cfg), "overlay_lower_dir", &(ctx->overlay_lower_dir))) {
+        ctx->overlay_lower_dir = NULL;
+    }
+    // Read base_layer (optional), set by configer --base-layer. The files every sandbox
+    // of the host shares are built once there and stacked below the rest of the rootfs.
+    if (!config_lookup_string(&(ctx->cfg), "base_layer", &(ctx->base_layer))) {
+        ctx->base_layer = NULL;
+    }
+    // Read store_dir and store_link (optional). With a store, files are shared
+    // between sandboxes as read-only bind mounts ("bind", default) or hardlinks ("hardlink").
+    if (!config_lookup_string(&(ctx->cfg), "store_dir", &(ctx->store.dir))) {
+        ctx->store.dir = NULL;
+    }
+    if (!config_lookup_string(&(ctx->cfg), "store_link", &store_link)) {
+        store_link = "bind";
+    }
+    ctx->store.use_bind = strcmp(store_link, "hardlink") != 0;
+    ctx->store.mount_count = 0;
+    ctx->store.in_layer = 0;
+
+    // Read copy_workers (optional, defaults to DEFAULT_COPY_WORKERS)
+    if (!config_lookup_int(&(ctx->cfg), "copy_workers", &(ctx->copy_workers)) || ctx->copy_workers < 1) {
+        ctx->copy_workers = DEFAULT_COPY_WORKERS;
+    }
+
+    // Read image_cache_dir (optional). When set, a built rootfs is packed there
+    // and unpacked again by the next sandbox with the same closure.
+    if (!config_lookup_string(&(ctx->cfg), "image_cache_dir", &(ctx->image_cache_dir))) {
+        ctx->image_cache_dir = NULL;
+    }
+
+    // Read tmpfs_size (optional), e.g. "256m". When set, the per-sandbox part of
+    // the rootfs lives on a tmpfs of that size and teardown is a single unmount.
+    if (!config_lookup_string(&(ctx->cfg), "tmpfs_size", &(ctx->tmpfs_size))) {
+        ctx->tmpfs_size = NULL;
+    }
+
+    // Read resources (optional). When present the sandbox runs in its own cgroup v2
+    // with these limits, and root_process can be given a real-time priority.
+    memset(&(ctx->cgroup), 0, sizeof(ctx->cgroup));
+    ctx->cgroup.fd = -1;
+    resources_setting = config_lookup(&(ctx->cfg), "resources");
+    if (resources_setting != NULL) {
+        ctx->cgroup.defined = 1;
+        config_setting_lookup_string(resources_setting, "cpuset", &(ctx->cgroup.cpuset));
+        config_setting_lookup_string(resources_setting, "cpu_max", &(ctx->cgroup.cpu_max));
+        config_setting_lookup_string(resources_setting, "memory_max", &(ctx->cgroup.memory_max));
+        config_setting_lookup_string(resources_setting, "memory_high", &(ctx->cgroup.memory_high));
+        config_setting_lookup_int(resources_setting, "io_weight", &(ctx->cgroup.io_weight));
+        config_setting_lookup_int(resources_setting, "sched_priority", &(ctx->cgroup.sched_priority));
+        config_setting_lookup_bool(resources_setting, "lock_memory", &(ctx->cgroup.lock_memory));
+    }
+
+    set_root_dir(ctx, ctx->root_dir);
+    ctx->park_fd = -1;
+
     // Read sandbox_id (mandatory)
     if (!config_lookup_int(&(ctx->cfg), "sandbox_id", &(ctx->sandbox_id))) {
         fprintf(stderr, "No 'sandbox_id' setting in configuration file.\n");
@@ -295,138 +352,417 @@ void init_config(const char *config_file_path, SandboxContext *ctx) {
 // Function to create directories from configuration
 void create_directories(SandboxContext *ctx) {
     struct stat st;
-    config_setting_t *setting = config_lookup(&(ctx->cfg), "directories");
-    if (setting != NULL) {
-        int count = config_setting_length(setting);
-
-        for (int i = 0; i < count; ++i) {
-            const char *dir = config_setting_get_string_elem(setting, i);
-            char full_dir[255];
-            snprintf(full_dir, sizeof(full_dir), "%s%s", ctx->root_dir, dir);
-
-            // Check if the directory exists
-            if (stat(full_dir, &st) == -1) {
-                // If it doesn't exist, create it
-                check_error(mkdir(full_dir, 0755), "mkdir full_dir");
-            }
+    Span span;
+    int count = rootfs_directory_count(ctx);
+
+    span_begin(&span, "create_directories");
+    for (int i = 0; i < count; ++i) {
+        const char *dir = rootfs_directory(ctx, i);
+        char full_dir[255];
+
+        if (dir == NULL)
+            continue;
+        snprintf(full_dir, sizeof(full_dir), "%s%s", ctx->image_dir, dir);
+
+        // Check if the directory exists
+        if (stat(full_dir, &st) == -1) {
+            // If it doesn't exist, create it
+            check_error(mkdir(full_dir, 0755), "mkdir full_dir");
         }
     }
+    span_end(&span, ctx->sandbox_id);
 }
 
 // Function to copy files from configuration
 void copy_files(SandboxContext *ctx) {
-    char full_dest[255];
-    config_setting_t *setting = config_lookup(&(ctx->cfg), "file_copies");
-    if (setting != NULL) {
-        int count = config_setting_length(setting);
+    CopyStats stats;
+    CopyJob *jobs;
+    Span span;
+    int job_count = 0;
+    int count = rootfs_file_copy_count(ctx);
+
+    span_begin(&span, "copy_files");
+    if (count > 0) {
+        jobs = malloc(sizeof(CopyJob) * (count > 0 ? count : 1));
+        check_error(jobs == NULL ? -1 : 0, "malloc copy jobs");
 
         for (int i = 0; i < count; ++i) {
-            config_setting_t *f_c = config_setting_get_elem(setting, i);
             const char *src, *dst;
 
-            if (!(config_setting_lookup_string(f_c, "src", &src) &&
-                  config_setting_lookup_string(f_c, "dst", &dst)))
+            if (rootfs_file_copy(ctx, i, &src, &dst) != 0)
                 continue;
 
-            snprintf(full_dest, sizeof(full_dest), "%s%s", ctx->root_dir, dst);
-            copy_file(src, full_dest);
+            jobs[job_count].src = src;
+            jobs[job_count].dst = dst;
+            snprintf(jobs[job_count].dest, sizeof(jobs[job_count].dest), "%s%s", ctx->image_dir, dst);
+            job_count++;
         }
+
+        // Copy the whole list on a small worker pool, or link it from the store
+        copy_stats_init(&stats);
+        if (ctx->store.dir != NULL) {
+            store_init(&ctx->store);
+            copy_engine_run(jobs, job_count, ctx->copy_workers, &stats, &ctx->store);
+            store_report(&ctx->store);
+        } else {
+            copy_engine_run(jobs, job_count, ctx->copy_workers, &stats, NULL);
+        }
+        copy_stats_print(&stats);
+        free(jobs);
     }
+    span_end(&span, ctx->sandbox_id);
 }
 
-int main(int argc, char *argv[]) {
-    SandboxContext ctx;
-    // Allocate stack for child process
-    char *stack = malloc(STACK_SIZE);
-    int host_veth;
-    int sandbox_veth;
-    char cmd[255];
+// Function to tell whether the rootfs is an overlay mount rather than a plain directory
+int rootfs_is_overlay(const SandboxContext *ctx) {
+    return ctx->overlay_lower_dir != NULL || ctx->base_layer != NULL;
+}
+
+// Function to populate the shared lower layer with the closure of this sandbox.
+// The layer is a directory below overlay_lower_dir named after the closure hash, which
+// covers the identity of every source file, so a layer that exists is complete and current.
+// It is built aside and renamed into place, and never written again once sandboxes mount it.
+void populate_overlay_lower(SandboxContext *ctx) {
+    char key[HASH_HEX_LEN + 1];
+    char lock_path[PATH_MAX + 16];
+    char build_dir[PATH_MAX + 16];
+    char cmd[PATH_MAX + 32];
+    const char *image_dir = ctx->image_dir;
+    int lock_fd;
     struct stat st;
 
-    if (argc < 2) {
-        fprintf(stderr, "Usage: %s <config_file>\n", argv[0]);
-        exit(EXIT_FAILURE);
+    image_cache_key(ctx, key);
+    snprintf(ctx->lower_dir, sizeof(ctx->lower_dir), "%s/%s", ctx->overlay_lower_dir, key);
+    if (stat(ctx->lower_dir, &st) == 0) {
+        return;
+    }
+    create_directory(ctx->overlay_lower_dir);
+
+    // Serialize concurrent jailors building the same lower layer
+    snprintf(lock_path, sizeof(lock_path), "%s.lock", ctx->lower_dir);
+    lock_fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    check_error(lock_fd, "open overlay lock");
+    check_error(flock(lock_fd, LOCK_EX), "flock overlay lock");
+
+    if (stat(ctx->lower_dir, &st) == -1) {
+        snprintf(build_dir, sizeof(build_dir), "%s.build", ctx->lower_dir);
+        snprintf(cmd, sizeof(cmd), "rm -rf %s", build_dir);
+        check_error(system(cmd), cmd);
+        create_directory(build_dir);
+
+        ctx->image_dir = build_dir;
+        ctx->store.in_layer = 1;
+        create_directories(ctx);
+        copy_files(ctx);
+        ctx->store.in_layer = 0;
+        ctx->image_dir = image_dir;
+
+        check_error(rename(build_dir, ctx->lower_dir), "rename overlay lower layer");
     }
 
-    // Initialize configuration
-    init_config(argv[1], &ctx);
+    flock(lock_fd, LOCK_UN);
+    close(lock_fd);
+}
+
+// Function to mount the overlay rootfs at root_dir. Only the upper layer is
+// private to the sandbox; everything copied from the closure lives in the lower.
+void mount_overlay_root(SandboxContext *ctx) {
+    char lower_dirs[2 * PATH_MAX + 1];
+    char upper_dir[PATH_MAX];
+    char work_dir[PATH_MAX];
+    char options[4 * PATH_MAX + 64];
+
+    snprintf(upper_dir, sizeof(upper_dir), "%s/upper", ctx->overlay_dir);
+    snprintf(work_dir, sizeof(work_dir), "%s/work", ctx->overlay_dir);
+    create_directory(upper_dir);
+    create_directory(work_dir);
+
+    // The base layer, shared by every sandbox of the host, is the bottom one
+    if (ctx->overlay_lower_dir != NULL && ctx->base_layer != NULL) {
+        snprintf(lower_dirs, sizeof(lower_dirs), "%s:%s", ctx->lower_dir, ctx->base_layer);
+    } else {
+        snprintf(lower_dirs, sizeof(lower_dirs), "%s",
+                 ctx->overlay_lower_dir != NULL ? ctx->lower_dir : ctx->base_layer);
+    }
+    snprintf(options, sizeof(options), "lowerdir=%s,upperdir=%s,workdir=%s", lower_dirs, upper_dir, work_dir);
+    check_error(mount("overlay", ctx->root_dir, "overlay", 0, options), "mount overlay root_dir");
+}
+
+// Function to mount a size-limited tmpfs at path, so the sandbox cannot
+// exhaust host memory and nothing it writes reaches the disk
+void mount_rootfs_tmpfs(SandboxContext *ctx, const char *path) {
+    char options[128];
+
+    create_directory(path);
+    snprintf(options, sizeof(options), "size=%s,mode=0755", ctx->tmpfs_size);
+    check_error(mount("tmpfs", path, "tmpfs", MS_NOSUID | MS_NODEV, options), "mount tmpfs rootfs");
+}
+
+// Function to build the rootfs of a sandbox at root_dir
+void prepare_rootfs(SandboxContext *ctx) {
+    struct stat st;
+    Span span;
+
+    span_begin(&span, "prepare_rootfs");
 
     // Check if the sandbox directory exists, if not create it
-    if (stat(ctx.root_dir, &st) == -1) {
-        check_error(mkdir(ctx.root_dir, 0755), "mkdir sandbox");
+    if (stat(ctx->root_dir, &st) == -1) {
+        check_error(mkdir(ctx->root_dir, 0755), "mkdir sandbox");
     }
 
-    // Create directories as per configuration
-    create_directories(&ctx);
+    // With tmpfs_size the per-sandbox layer is held in memory: the upper layer
+    // in overlay mode, the whole tree otherwise
+    if (ctx->tmpfs_size != NULL) {
+        mount_rootfs_tmpfs(ctx, rootfs_is_overlay(ctx) ? ctx->overlay_dir : ctx->root_dir);
+    }
 
-    // Copy files as per configuration
-    copy_files(&ctx);
+    if (rootfs_is_overlay(ctx)) {
+        // Fill the shared lower layers once and stack a thin upper layer on them
+        if (ctx->base_layer != NULL) {
+            prepare_base_layer(ctx);
+        }
+        if (ctx->overlay_lower_dir != NULL) {
+            populate_overlay_lower(ctx);
+        }
+        mount_overlay_root(ctx);
 
-    // Network configuration if veth_ip_pair is defined
-    host_veth = 100 + ctx.sandbox_id;
-    sandbox_veth = 200 + ctx.sandbox_id;
-    if (ctx.veth_ip_pair_defined) {
-        // Enable IP forwarding
-        check_error(system("echo 1 > /proc/sys/net/ipv4/ip_forward"), "echo 1 > /proc/sys/net/ipv4/ip_forward");
+        // With only a base layer, what this sandbox adds to it goes to the upper layer
+        if (ctx->overlay_lower_dir == NULL) {
+            create_directories(ctx);
+            copy_files(ctx);
+        }
+    } else if (ctx->image_cache_dir != NULL && ctx->store.dir == NULL) {
+        // Unpack the image of an identical closure, or build it and pack it for next time.
+        // Store mode is left out: unpacking would turn its shared objects into copies.
+        char key[HASH_HEX_LEN + 1];
+
+        image_cache_key(ctx, key);
+        if (image_cache_restore(ctx, key) != 0) {
+            create_directories(ctx);
+            copy_files(ctx);
+            image_cache_save(ctx, key);
+        }
+    } else {
+        // Create directories as per configuration
+        create_directories(ctx);
 
-        // Create veth pair
-        snprintf(cmd, sizeof(cmd), "ip link add veth%d type veth peer name veth%d", host_veth, sandbox_veth);
-        check_error(system(cmd), cmd);
+        // Copy files as per configuration
+        copy_files(ctx);
+    }
+    span_end(&span, ctx->sandbox_id);
+}
 
-        snprintf(cmd, sizeof(cmd), "ip addr add %s/28 dev veth%d", ctx.veth_ip_pair.host, host_veth);
-        check_error(system(cmd), cmd);
+// Function to clone the sandbox init process into fresh namespaces,
+// inside its own cgroup when resource limits are configured
+pid_t spawn_sandbox(SandboxContext *ctx, char *stack) {
+    int flags = CLONE_NEWNS | CLONE_NEWCGROUP | CLONE_NEWPID | CLONE_NEWIPC |
+                CLONE_NEWNET | CLONE_NEWUTS;
+
+    if (ctx->cgroup.defined) {
+        return cgroup_spawn(ctx, stack, flags);
+    }
+    return clone(child_func, stack + STACK_SIZE, flags | SIGCHLD, ctx);
+}
+
+// Function to remove the rootfs of a sandbox after its init process is gone
+void teardown_rootfs(SandboxContext *ctx) {
+    char cmd[PATH_MAX];
+
+    umount2(ctx->root_dir, MNT_DETACH);
 
-        snprintf(cmd, sizeof(cmd), "ip link set veth%d up", host_veth);
+    if (ctx->tmpfs_size != NULL) {
+        // The tree lived on a tmpfs that is freed by the lazy unmount; only the
+        // empty mount points are left behind
+        if (rootfs_is_overlay(ctx)) {
+            umount2(ctx->overlay_dir, MNT_DETACH);
+            rmdir(ctx->overlay_dir);
+        }
+        rmdir(ctx->root_dir);
+        return;
+    }
+
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", ctx->root_dir);
+    check_error(system(cmd), cmd);
+
+    // Only the thin upper layer is discarded; the lower layers are kept for reuse
+    if (rootfs_is_overlay(ctx)) {
+        snprintf(cmd, sizeof(cmd), "rm -rf %s", ctx->overlay_dir);
         check_error(system(cmd), cmd);
+    }
+}
 
+// Function to free what init_config() allocated
+void destroy_context(SandboxContext *ctx) {
+    if (ctx->root_process_args) {
+        for (int i = 0; i < ctx->root_process_argc; ++i) {
+            free(ctx->root_process_args[i]);
+        }
+        free(ctx->root_process_args);
     }
+    config_destroy(&(ctx->cfg));
+    manifest_close(&(ctx->manifest));
+}
 
+// Function to build the rootfs of an initialized context, run its sandbox and tear it
+// down again once root_process exits. Frees the context.
+int jailor_run(SandboxContext *ctx) {
+    Span span;
+    // Allocate stack for child process
+    char *stack;
+
+    prepare_rootfs(ctx);
+
+    stack = malloc(STACK_SIZE);
     check_error(stack == NULL ? -1 : 0, "malloc stack");
 
     // Unshare namespaces and create child process
-    child_pid = clone(child_func, stack + STACK_SIZE,
-                          CLONE_NEWNS | CLONE_NEWCGROUP | CLONE_NEWPID | CLONE_NEWIPC |
-                          CLONE_NEWNET | CLONE_NEWUTS | SIGCHLD,
-                          &ctx);
+    span_begin(&span, "clone");
+    child_pid = spawn_sandbox(ctx, stack);
     check_error(child_pid, "clone");
+    span_end(&span, ctx->sandbox_id);
 
     // Network configuration if veth_ip_pair is defined
-    if (ctx.veth_ip_pair_defined) {
-        snprintf(cmd, sizeof(cmd), "ip link set veth%d netns %d", sandbox_veth, child_pid);
-        check_error(system(cmd), cmd);
-
-        snprintf(cmd, sizeof(cmd), "nsenter --net=/proc/%d/ns/net ip addr add %s/28 dev veth%d", child_pid, ctx.veth_ip_pair.sandbox, sandbox_veth);
-        check_error(system(cmd), cmd);
-
-        snprintf(cmd, sizeof(cmd), "nsenter --net=/proc/%d/ns/net ip link set veth%d up", child_pid, sandbox_veth);
-        check_error(system(cmd), cmd);
-
-        snprintf(cmd, sizeof(cmd), "nsenter --net=/proc/%d/ns/net ip route add default via %s", child_pid, ctx.veth_ip_pair.host);
-        check_error(system(cmd), cmd);
+    if (ctx->veth_ip_pair_defined) {
+        span_begin(&span, "veth");
+        check_error(enable_ip_forward(), "enable ip_forward");
+        check_error(setup_veth(ctx, child_pid, -1), "setup veth pair");
+        span_end(&span, ctx->sandbox_id);
     }
 
-
     signal(SIGTERM, terminate_child);
     signal(SIGTSTP, terminate_child);
-    signal(SIGKILL, terminate_child);
+    signal(JAILOR_KILL_SIGNAL, terminate_child);
 
     // Wait for the child process to finish
     check_error(waitpid(child_pid, NULL, 0), "waitpid");
 
-    umount2(ctx.root_dir, MNT_DETACH);
-
-    snprintf(cmd, sizeof(cmd), "rm -rf %s", ctx.root_dir);
-    check_error(system(cmd), cmd);
+    span_begin(&span, "teardown");
+    teardown_rootfs(ctx);
+    cgroup_destroy(ctx);
+    span_end(&span, ctx->sandbox_id);
 
     // Free resources
     free(stack);
-    if (ctx.root_process_args) {
-        for (int i = 0; i < ctx.root_process_argc; ++i) {
-            free(ctx.root_process_args[i]);
-        }
-        free(ctx.root_process_args);
+    destroy_context(ctx);
+
+    return 0;
+}
+
+// Function to run a sandbox from a manifest held in memory, e.g. one just built by
+// configer_build_manifest() in the same process. No config file is read or written.
+// The manifest must stay valid until this returns. A running pool at pool_socket
+// (optional, may be NULL) is used first.
+int jailor_run_manifest(const void *data, size_t size, const char *pool_socket) {
+    SandboxContext ctx;
+    Span span;
+
+    span_init();
+
+    span_begin(&span, "parse_config");
+    init_manifest_memory(data, size, &ctx);
+    span_end(&span, ctx.sandbox_id);
+
+    if (pool_socket != NULL && pool_attach(pool_socket, &ctx) == 0) {
+        destroy_context(&ctx);
+        return 0;
     }
-    config_destroy(&(ctx.cfg));
+    return jailor_run(&ctx);
+}
+
+// Function to resume a sandbox checkpointed elsewhere, e.g. by a migrating sdeamon, instead
+// of starting root_process. The rootfs is built from the manifest as for a fresh start and
+// CRIU recreates the process tree and its namespaces on top of it; the veth pair keeps its
+// names and addresses, and it goes into a cgroup with the limits of the manifest, as the
+// destination's resources may differ. With lazy_pages the memory is left out and faulted in from the
+// `criu lazy-pages` daemon the caller started on images_dir. ready_fd (-1 for none) gets
+// one byte once the sandbox runs again. Like jailor_run(), waits for the sandbox and tears
+// it down when it exits.
+int jailor_restore_manifest(const void *data, size_t size, const char *images_dir, int lazy_pages, int ready_fd) {
+    SandboxContext ctx;
+    Span span;
+    CriuSession criu;
+    CriuOpts opts;
+    CriuResult result;
+    char external[64];
+    char ready = 1;
+    int dir_fd;
+
+    span_init();
+
+    span_begin(&span, "parse_config");
+    init_manifest_memory(data, size, &ctx);
+    span_end(&span, ctx.sandbox_id);
+
+    dir_fd = open(images_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd == -1) {
+        perror(images_dir);
+        destroy_context(&ctx);
+        return -1;
+    }
+
+    prepare_rootfs(&ctx);
+
+    // Created before the restore so that CRIU puts the tree straight into it and, since it
+    // exists already, leaves the limits written here alone
+    if (ctx.cgroup.defined && cgroup_create(&ctx) == -1) {
+        close(dir_fd);
+        teardown_rootfs(&ctx);
+        destroy_context(&ctx);
+        return -1;
+    }
+
+    span_begin(&span, "criu_restore");
+    memset(&opts, 0, sizeof(opts));
+    opts.images_dir_fd = dir_fd;
+    opts.log_file = "restore.log";
+    opts.root = ctx.root_dir;
+    opts.rst_sibling = 1;
+    opts.lazy_pages = lazy_pages;
+    if (ctx.cgroup.defined) {
+        opts.cgroup_root = cgroup_relative_path(&ctx);
+    }
+    if (ctx.veth_ip_pair_defined) {
+        snprintf(external, sizeof(external), "veth[veth%d]:veth%d", 200 + ctx.sandbox_id, 100 + ctx.sandbox_id);
+        opts.external = external;
+    }
+    if (criu_start(&criu) == -1 || criu_call(&criu, CRIU_RESTORE, &opts, &result) == -1 || !result.success) {
+        fprintf(stderr, "Error restoring from %s: %s\n", images_dir,
+                criu.sock == -1 ? strerror(errno) : result.errmsg);
+        criu_stop(&criu);
+        close(dir_fd);
+        teardown_rootfs(&ctx);
+        cgroup_destroy(&ctx);
+        destroy_context(&ctx);
+        return -1;
+    }
+    criu_stop(&criu);
+    close(dir_fd);
+    child_pid = result.pid;
+    span_end(&span, ctx.sandbox_id);
+
+    if (ctx.veth_ip_pair_defined) {
+        span_begin(&span, "veth");
+        check_error(enable_ip_forward(), "enable ip_forward");
+        check_error(setup_restored_veth(&ctx), "setup restored veth");
+        span_end(&span, ctx.sandbox_id);
+    }
+
+    signal(SIGTERM, terminate_child);
+    signal(SIGTSTP, terminate_child);
+    signal(JAILOR_KILL_SIGNAL, terminate_child);
+
+    if (ready_fd >= 0) {
+        check_error(write(ready_fd, &ready, 1) == 1 ? 0 : -1, "write ready_fd");
+        close(ready_fd);
+    }
+
+    check_error(waitpid(child_pid, NULL, 0), "waitpid");
+
+    span_begin(&span, "teardown");
+    teardown_rootfs(&ctx);
+    cgroup_destroy(&ctx);
+    span_end(&span, ctx.sandbox_id);
 
+    destroy_context(&ctx);
     return 0;
 }
@@ -0,0 +1,299 @@
+/* jailor.h */
+#ifndef JAILOR_H
+#define JAILOR_H
+
+#include <libconfig.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include <linux/limits.h>
+
+#include "manifest.h"
+
+#define STACK_SIZE (1024 * 1024) // Stack size for the child process
+#define HASH_HEX_LEN 64           // Length of a hex SHA-256 digest
+#define DEFAULT_COPY_WORKERS 4    // Threads used to populate the rootfs
+#define SPAN_LOG_ENV "JAILOR_SPAN_LOG" // File the startup phase timings are appended to
+#define JAILOR_KILL_SIGNAL SIGUSR1      // Makes jailor SIGKILL its sandbox, then tear down as usual
+
+// Copy strategies, tried in this order for every file
+typedef enum {
+    COPY_REFLINK,
+    COPY_FILE_RANGE,
+    COPY_SENDFILE,
+    COPY_BUFFER,
+    COPY_STRATEGY_COUNT
+} CopyStrategy;
+
+// Struct to accumulate copy statistics per strategy
+typedef struct {
+    pthread_mutex_t lock;
+    int files[COPY_STRATEGY_COUNT];
+    unsigned long long bytes[COPY_STRATEGY_COUNT];
+    unsigned long long nsec[COPY_STRATEGY_COUNT];
+    int skipped;
+} CopyStats;
+
+// Struct to describe one file copy into the sandbox
+typedef struct {
+    const char *src;
+    const char *dst;        // Path inside the sandbox
+    char dest[PATH_MAX];    // Path on the host, under image_dir
+} CopyJob;
+
+// Struct to time one startup phase
+typedef struct {
+    const char *phase;
+    struct timespec start;
+} Span;
+
+// Struct to hold an incremental SHA-256 computation
+typedef struct {
+    uint32_t state[8];
+    uint64_t length;
+    unsigned char block[64];
+    size_t used;
+} Sha256;
+
+// Struct to describe a store object bind-mounted read-only into the rootfs
+typedef struct {
+    char object[PATH_MAX];
+    const char *dst;
+} StoreMount;
+
+// Struct to hold the content-addressed store used to share files between sandboxes
+typedef struct {
+    const char *dir;        // NULL when files are copied
+    int use_bind;           // Bind-mount objects instead of hardlinking them
+    int in_layer;           // Building a shared lower layer: objects are linked or copied, never mounted
+    pthread_mutex_t lock;
+    StoreMount *mounts;
+    int mount_count;
+    int mount_capacity;
+    int files;
+    int new_objects;
+    unsigned long long bytes;
+    unsigned long long new_bytes;
+} Store;
+
+// Struct to build several netlink requests that are sent with one sendmsg()
+typedef struct {
+    char buf[8192];
+    size_t len;
+    size_t last;    // Offset of the message attributes are appended to
+    int count;
+    unsigned int seq;
+} NlBatch;
+
+// Struct to hold both ends of a sandbox veth pair
+typedef struct {
+    int host_fd;         // rtnetlink socket in the host netns
+    int owns_host_fd;    // host_fd was opened for this link and is closed with it
+    int sandbox_fd;      // rtnetlink socket in the sandbox netns
+    int host_ifindex;
+    int sandbox_ifindex;
+} VethLink;
+
+// Struct to hold the resource limits of a sandbox and the cgroup enforcing them
+typedef struct {
+    int defined;                // A "resources" group was given
+    const char *cpuset;         // cpuset.cpus, e.g. "2-3"
+    const char *cpu_max;        // cpu.max, "<quota> <period>" or "max <period>"
+    const char *memory_max;     // memory.max, e.g. "512M"
+    const char *memory_high;    // memory.high
+    int io_weight;              // io.weight, 0 leaves the default
+    int sched_priority;         // SCHED_FIFO priority of root_process, 0 keeps SCHED_OTHER
+    int lock_memory;            // Keep root_process out of swap and allow it to mlockall()
+    char path[PATH_MAX];
+    int fd;                     // Open cgroup directory, -1 when not created
+} CgroupConfig;
+
+// Struct to hold a mapped binary manifest; base is NULL for text configs
+typedef struct {
+    const unsigned char *base;
+    size_t size;
+    const ManifestHeader *header;
+    const char *strings;
+    int mapped;             // base is an mmap() of a manifest file, not memory owned by the caller
+} Manifest;
+
+// Struct to hold the sandbox context
+typedef struct {
+    const char *root_dir;
+    const char *image_dir;        // Where directories and file copies are written
+    const char *overlay_lower_dir;
+    char lower_dir[PATH_MAX];     // <overlay_lower_dir>/<closure hash>, the layer that is mounted
+    const char *base_layer;       // Shared layer below overlay_lower_dir, NULL if none
+    char overlay_dir[256];        // Holds the per-sandbox upper and work layers
+    config_t cfg;
+    config_setting_t *directory_setting;
+    config_setting_t *file_copy_setting;
+    config_setting_t *symlink_setting;
+    Manifest manifest;            // Used instead of cfg when the config is a binary manifest
+    int sandbox_id;
+    char *root_process;
+    char **root_process_args;
+    int root_process_argc;
+    struct {
+        const char *host;
+        const char *sandbox;
+    } veth_ip_pair;
+    int veth_ip_pair_defined;
+    int copy_workers;
+    Store store;
+    int park_fd;                  // Launch pipe of a pooled sandbox, -1 otherwise
+    const char *image_cache_dir;  // NULL when the rootfs is always rebuilt
+    const char *tmpfs_size;       // Size limit of the tmpfs backing the rootfs, NULL for disk
+    CgroupConfig cgroup;
+} SandboxContext;
+
+// Request types of the CRIU RPC protocol (criu_req_type)
+#define CRIU_DUMP 1
+#define CRIU_RESTORE 2
+#define CRIU_PRE_DUMP 4
+
+// Struct to hold a `criu swrk` service and the socket it is driven through
+typedef struct {
+    int sock;
+    pid_t pid;
+} CriuSession;
+
+// Struct to describe a CRIU request; zero and NULL fields keep CRIU's defaults
+typedef struct {
+    int images_dir_fd;          // Directory the images are written to or read from
+    pid_t pid;                  // Root of the process tree to dump
+    const char *log_file;       // Relative to the images dir, "criu.log" when NULL
+    const char *parent_img;     // Previous pre-dump, relative to the images dir
+    const char *root;           // Root directory of the restored mount namespace
+    const char *external;       // External resource mapping, e.g. "veth[inside]:outside"
+    int track_mem;              // Track dirty pages so the next dump only writes changes
+    int leave_running;
+    int rst_sibling;            // Restored tree becomes our child instead of criu's
+    int lazy_pages;             // Dump: leave memory to a page server; restore: fault it in
+    int page_server_port;       // Port the page server of a lazy dump listens on
+    int status_fd;              // Gets a byte when CRIU is ready, e.g. a lazy dump serves pages
+    const char *cgroup_root;    // Restore: cgroup (below the cgroup2 root) the dumped tree goes into
+} CriuOpts;
+
+// Struct to hold a CRIU response
+typedef struct {
+    int type;
+    int success;
+    int cr_errno;
+    pid_t pid;                  // Root of the restored tree
+    char errmsg[256];
+} CriuResult;
+
+/* jailor.c */
+void check_error(int ret, const char *msg);
+void terminate_child(int signo);
+void create_directory(const char *path);
+void connect_symlinks(SandboxContext *ctx);
+int child_func(void *arg);
+void init_config(const char *config_file_path, SandboxContext *ctx);
+void create_directories(SandboxContext *ctx);
+void copy_files(SandboxContext *ctx);
+int read_full(int fd, void *buf, size_t len);
+void wait_for_launch(SandboxContext *ctx);
+void set_root_dir(SandboxContext *ctx, const char *root_dir);
+int rootfs_is_overlay(const SandboxContext *ctx);
+void populate_overlay_lower(SandboxContext *ctx);
+void mount_overlay_root(SandboxContext *ctx);
+void mount_rootfs_tmpfs(SandboxContext *ctx, const char *path);
+void prepare_rootfs(SandboxContext *ctx);
+pid_t spawn_sandbox(SandboxContext *ctx, char *stack);
+void teardown_rootfs(SandboxContext *ctx);
+void destroy_context(SandboxContext *ctx);
+int jailor_run(SandboxContext *ctx);
+int jailor_run_manifest(const void *data, size_t size, const char *pool_socket);
+int jailor_restore_manifest(const void *data, size_t size, const char *images_dir, int lazy_pages, int ready_fd);
+
+/* manifest.c */
+int manifest_detect(const char *path);
+int manifest_open(const char *path, Manifest *manifest);
+int manifest_open_memory(const void *data, size_t size, Manifest *manifest);
+void manifest_close(Manifest *manifest);
+void init_manifest(const char *path, SandboxContext *ctx);
+void init_manifest_memory(const void *data, size_t size, SandboxContext *ctx);
+int rootfs_directory_count(const SandboxContext *ctx);
+const char *rootfs_directory(const SandboxContext *ctx, int i);
+int rootfs_file_copy_count(const SandboxContext *ctx);
+int rootfs_file_copy(const SandboxContext *ctx, int i, const char **src, const char **dst);
+int rootfs_symlink_count(const SandboxContext *ctx);
+int rootfs_symlink(const SandboxContext *ctx, int i, const char **sym, const char **dst);
+
+/* copy_engine.c */
+void copy_stats_init(CopyStats *stats);
+void copy_stats_print(CopyStats *stats);
+void copy_file(const char *src, const char *dest, CopyStats *stats);
+void copy_engine_run(CopyJob *jobs, int count, int workers, CopyStats *stats, Store *store);
+
+/* store.c */
+void sha256_init(Sha256 *ctx);
+void sha256_update(Sha256 *ctx, const void *data, size_t len);
+void sha256_final(Sha256 *ctx, char hex[HASH_HEX_LEN + 1]);
+void store_init(Store *store);
+void store_install(Store *store, CopyJob *job, CopyStats *stats);
+void store_report(Store *store);
+void store_mount_objects(Store *store, const char *root_dir);
+
+/* layer.c */
+void prepare_base_layer(SandboxContext *ctx);
+
+/* update.c */
+int update_rootfs(const char *delta_path);
+
+/* image_cache.c */
+int image_cache_key(const SandboxContext *ctx, char key[HASH_HEX_LEN + 1]);
+int image_cache_restore(SandboxContext *ctx, const char *key);
+void image_cache_save(SandboxContext *ctx, const char *key);
+
+/* cgroup.c */
+int cgroup_create(SandboxContext *ctx);
+pid_t cgroup_spawn(SandboxContext *ctx, char *stack, int flags);
+void cgroup_apply_sched(SandboxContext *ctx);
+void cgroup_destroy(SandboxContext *ctx);
+const char *cgroup_relative_path(const SandboxContext *ctx);
+
+/* span.c */
+void span_init(void);
+void span_begin(Span *span, const char *phase);
+void span_end(Span *span, int sandbox_id);
+
+/* netlink.c */
+void nl_batch_init(NlBatch *batch);
+struct nlmsghdr *nl_batch_msg(NlBatch *batch, int type, int flags, size_t len);
+int nl_attr_put(NlBatch *batch, int type, const void *data, size_t len);
+size_t nl_nest_begin(NlBatch *batch, int type);
+void nl_nest_end(NlBatch *batch, size_t offset);
+int nl_batch_send(int fd, NlBatch *batch);
+int rtnl_open(pid_t netns_pid);
+int rtnl_link_index(int fd, const char *ifname);
+int rtnl_add_veth(NlBatch *batch, const char *host_ifname, const char *peer_ifname, pid_t peer_pid);
+int enable_ip_forward(void);
+int veth_create(VethLink *link, int host_fd, pid_t pid, const char *host_ifname, const char *sandbox_ifname);
+int veth_configure(VethLink *link, const char *host_ifname, const char *sandbox_ifname,
+                   const char *host_ip, const char *sandbox_ip);
+void veth_close(VethLink *link);
+int setup_veth(SandboxContext *ctx, pid_t pid, int host_fd);
+int setup_restored_veth(SandboxContext *ctx);
+
+/* criu.c */
+int criu_start(CriuSession *session);
+int criu_request(CriuSession *session, int type, const CriuOpts *opts);
+int criu_response(CriuSession *session, CriuResult *result);
+int criu_call(CriuSession *session, int type, const CriuOpts *opts, CriuResult *result);
+int criu_lazy_pages(const char *images_dir, const char *address, int port);
+int criu_wait_ready(int status_fd);
+void criu_stop(CriuSession *session);
+
+/* batch.c */
+int batch_run(int count, char **config_paths);
+
+/* pool.c */
+int pool_serve(int count, const char *socket_path, const char *template_config);
+int pool_attach(const char *socket_path, const SandboxContext *ctx);
+
+#endif
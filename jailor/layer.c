@@ -0,0 +1,107 @@
+/* layer.c */
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <libconfig.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <linux/limits.h>
+
+#include "jailor.h"
+
+// Layout of a base layer, as written by configer --base-layer:
+//   <base_layer>.cfg   directories, file_copies and symlinks shared by every sandbox
+//   <base_layer>/      the populated layer, mounted as the bottom overlay lower layer
+// The directory is named after a hash of the config and of the identity of every
+// source file, so a layer directory that exists is complete and current.
+
+static void build_base_layer(SandboxContext *ctx, const char *build_dir);
+static void link_layer_symlinks(SandboxContext *layer, const char *dir);
+
+// Function to create the symlinks of a layer below dir instead of at the root
+static void link_layer_symlinks(SandboxContext *layer, const char *dir) {
+    int count = rootfs_symlink_count(layer);
+
+    for (int i = 0; i < count; ++i) {
+        const char *sym, *dst;
+        char path[PATH_MAX];
+
+        if (rootfs_symlink(layer, i, &sym, &dst) != 0)
+            continue;
+
+        snprintf(path, sizeof(path), "%s%s", dir, sym);
+        check_error(symlink(dst, path), "symlink base layer");
+    }
+}
+
+// Function to populate build_dir from the config of the base layer of ctx
+static void build_base_layer(SandboxContext *ctx, const char *build_dir) {
+    SandboxContext layer;
+    char config_path[PATH_MAX];
+
+    // Only the rootfs sections are read; the layer is never linked from a store
+    memset(&layer, 0, sizeof(layer));
+    config_init(&(layer.cfg));
+    snprintf(config_path, sizeof(config_path), "%s.cfg", ctx->base_layer);
+    if (!config_read_file(&(layer.cfg), config_path)) {
+        fprintf(stderr, "%s:%d - %s\n", config_path, config_error_line(&(layer.cfg)),
+                config_error_text(&(layer.cfg)));
+        config_destroy(&(layer.cfg));
+        exit(EXIT_FAILURE);
+    }
+    layer.directory_setting = config_lookup(&(layer.cfg), "directories");
+    layer.file_copy_setting = config_lookup(&(layer.cfg), "file_copies");
+    layer.symlink_setting = config_lookup(&(layer.cfg), "symlinks");
+    layer.image_dir = build_dir;
+    layer.sandbox_id = ctx->sandbox_id;
+    layer.copy_workers = ctx->copy_workers;
+    layer.park_fd = -1;
+
+    create_directory(build_dir);
+    create_directories(&layer);
+    copy_files(&layer);
+    link_layer_symlinks(&layer, build_dir);
+
+    config_destroy(&(layer.cfg));
+}
+
+// Function to build the base layer of ctx unless a sandbox started earlier on this
+// host already did. Afterwards a sandbox start costs one stat() for the whole layer.
+void prepare_base_layer(SandboxContext *ctx) {
+    char lock_path[PATH_MAX];
+    char build_dir[PATH_MAX];
+    char cmd[PATH_MAX + 16];
+    struct stat st;
+    Span span;
+    int lock_fd;
+
+    if (stat(ctx->base_layer, &st) == 0) {
+        return;
+    }
+
+    span_begin(&span, "prepare_base_layer");
+
+    // Serialize concurrent jailors (and batch threads) building the same layer
+    snprintf(lock_path, sizeof(lock_path), "%s.lock", ctx->base_layer);
+    lock_fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    check_error(lock_fd, "open base layer lock");
+    check_error(flock(lock_fd, LOCK_EX), "flock base layer lock");
+
+    if (stat(ctx->base_layer, &st) == -1) {
+        // Built aside and renamed into place, so an interrupted build is never mounted
+        snprintf(build_dir, sizeof(build_dir), "%s.build", ctx->base_layer);
+        snprintf(cmd, sizeof(cmd), "rm -rf %s", build_dir);
+        check_error(system(cmd), cmd);
+
+        build_base_layer(ctx, build_dir);
+        check_error(rename(build_dir, ctx->base_layer), "rename base layer");
+    }
+
+    flock(lock_fd, LOCK_UN);
+    close(lock_fd);
+    span_end(&span, ctx->sandbox_id);
+}
@@ -0,0 +1,55 @@
+/* main.c */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "jailor.h"
+
+int main(int argc, char *argv[]) {
+    SandboxContext ctx;
+    Span span;
+    const char *pool_socket = NULL;
+
+    span_init();
+
+    if (argc >= 5 && strcmp(argv[1], "--pool") == 0) {
+        return pool_serve(atoi(argv[2]), argv[3], argv[4]);
+    }
+
+    if (argc >= 3 && strcmp(argv[1], "--batch") == 0) {
+        return batch_run(argc - 2, argv + 2) == 0 ? 0 : EXIT_FAILURE;
+    }
+
+    if (argc >= 3 && strcmp(argv[1], "--update") == 0) {
+        return update_rootfs(argv[2]) == 0 ? 0 : EXIT_FAILURE;
+    }
+
+    if (argc >= 4 && strcmp(argv[1], "--attach") == 0) {
+        // Take a pre-warmed sandbox if a pool is running, otherwise build one here
+        pool_socket = argv[2];
+        argv += 2;
+        argc -= 2;
+    }
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <config_file>\n"
+                        "       %s --pool <count> <socket> <template_config>\n"
+                        "       %s --attach <socket> <config_file>\n"
+                        "       %s --batch <config_file>...\n"
+                        "       %s --update <delta_file>\n", argv[0], argv[0], argv[0], argv[0], argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    // Initialize configuration
+    span_begin(&span, "parse_config");
+    init_config(argv[1], &ctx);
+    span_end(&span, ctx.sandbox_id);
+
+    if (pool_socket != NULL && pool_attach(pool_socket, &ctx) == 0) {
+        destroy_context(&ctx);
+        return 0;
+    }
+    return jailor_run(&ctx);
+}
@@ -0,0 +1,297 @@
+/* manifest.c */
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "jailor.h"
+
+static int section_valid(const Manifest *manifest, const ManifestSection *section, size_t entry_size);
+static int offsets_valid(const Manifest *manifest, const uint32_t *offsets, size_t count, int optional);
+static const char *manifest_string(const Manifest *manifest, uint32_t offset);
+static int manifest_validate(Manifest *manifest, const char *name);
+static void init_manifest_context(SandboxContext *ctx);
+
+static int section_valid(const Manifest *manifest, const ManifestSection *section, size_t entry_size) {
+    uint64_t end = (uint64_t)section->offset + (uint64_t)section->count * entry_size;
+
+    return section->offset % 4 == 0 && section->offset >= manifest->header->header_size &&
+           end <= manifest->size;
+}
+
+// Every offset must start a string inside the table; the table ends with a NUL,
+// so every string is terminated and can be used in place
+static int offsets_valid(const Manifest *manifest, const uint32_t *offsets, size_t count, int optional) {
+    uint32_t size = manifest->header->strings.count;
+
+    for (size_t i = 0; i < count; ++i) {
+        if (offsets[i] == MANIFEST_NONE ? !optional : offsets[i] >= size) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static const char *manifest_string(const Manifest *manifest, uint32_t offset) {
+    return offset == MANIFEST_NONE ? NULL : manifest->strings + offset;
+}
+
+// Function to tell a binary manifest from a libconfig text file by its magic
+int manifest_detect(const char *path) {
+    uint32_t magic = 0;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    ssize_t n;
+
+    if (fd == -1) {
+        return 0;
+    }
+    n = read(fd, &magic, sizeof(magic));
+    close(fd);
+    return n == (ssize_t)sizeof(magic) && magic == MANIFEST_MAGIC;
+}
+
+// Function to map a manifest read-only and check it once, so that every later access
+// is a plain load. Returns 0 on success, -1 with a message printed otherwise.
+int manifest_open(const char *path, Manifest *manifest) {
+    struct stat st;
+    void *base;
+    int fd;
+
+    memset(manifest, 0, sizeof(*manifest));
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        perror(path);
+        if (fd != -1) close(fd);
+        return -1;
+    }
+    if ((size_t)st.st_size < sizeof(ManifestHeader)) {
+        fprintf(stderr, "%s: truncated manifest\n", path);
+        close(fd);
+        return -1;
+    }
+    base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        perror("mmap manifest");
+        return -1;
+    }
+    manifest->base = base;
+    manifest->size = st.st_size;
+    manifest->mapped = 1;
+    return manifest_validate(manifest, path);
+}
+
+// Function to use a manifest that is already in memory, checked like a mapped one.
+// The memory stays owned by the caller and must outlive the manifest.
+int manifest_open_memory(const void *data, size_t size, Manifest *manifest) {
+    memset(manifest, 0, sizeof(*manifest));
+    if (size < sizeof(ManifestHeader) || (uintptr_t)data % sizeof(uint64_t) != 0) {
+        fprintf(stderr, "manifest: truncated or misaligned\n");
+        return -1;
+    }
+    manifest->base = data;
+    manifest->size = size;
+    return manifest_validate(manifest, "manifest");
+}
+
+// Function to check everything jailor later relies on without further checks.
+// Closes the manifest on failure.
+static int manifest_validate(Manifest *manifest, const char *name) {
+    const ManifestHeader *h = (const ManifestHeader *)manifest->base;
+    ManifestHeader header;
+    uint64_t checksum;
+
+    manifest->header = h;
+    if (h->magic != MANIFEST_MAGIC || h->version != MANIFEST_VERSION ||
+        h->header_size != sizeof(ManifestHeader) || h->file_size != manifest->size) {
+        fprintf(stderr, "%s: not a version %d manifest for this jailor\n", name, MANIFEST_VERSION);
+        manifest_close(manifest);
+        return -1;
+    }
+
+    header = *h;
+    header.checksum = 0;
+    checksum = manifest_checksum(MANIFEST_FNV_OFFSET, &header, sizeof(header));
+    checksum = manifest_checksum(checksum, manifest->base + sizeof(header), manifest->size - sizeof(header));
+    if (checksum != h->checksum) {
+        fprintf(stderr, "%s: manifest checksum mismatch\n", name);
+        manifest_close(manifest);
+        return -1;
+    }
+
+    manifest->strings = (const char *)manifest->base + h->strings.offset;
+    if (!section_valid(manifest, &h->strings, 1) || h->strings.count == 0 ||
+        manifest->strings[h->strings.count - 1] != '\0' ||
+        !section_valid(manifest, &h->args, sizeof(uint32_t)) ||
+        !section_valid(manifest, &h->directories, sizeof(uint32_t)) ||
+        !section_valid(manifest, &h->file_copies, sizeof(ManifestPair)) ||
+        !section_valid(manifest, &h->symlinks, sizeof(ManifestPair)) ||
+        !offsets_valid(manifest, &h->root_dir, 2, 0) ||
+        !offsets_valid(manifest, &h->veth_host, 7, 1) ||
+        !offsets_valid(manifest, &h->cpuset, 4, 1) ||
+        !offsets_valid(manifest, &h->base_layer, 1, 1) ||
+        !offsets_valid(manifest, (const uint32_t *)(manifest->base + h->args.offset), h->args.count, 0) ||
+        !offsets_valid(manifest, (const uint32_t *)(manifest->base + h->directories.offset),
+                       h->directories.count, 0) ||
+        !offsets_valid(manifest, (const uint32_t *)(manifest->base + h->file_copies.offset),
+                       2 * (size_t)h->file_copies.count, 0) ||
+        !offsets_valid(manifest, (const uint32_t *)(manifest->base + h->symlinks.offset),
+                       2 * (size_t)h->symlinks.count, 0)) {
+        fprintf(stderr, "%s: malformed manifest\n", name);
+        manifest_close(manifest);
+        return -1;
+    }
+    return 0;
+}
+
+// Function to unmap a manifest; a no-op for text configs and manifests in memory
+void manifest_close(Manifest *manifest) {
+    if (manifest->mapped) {
+        munmap((void *)manifest->base, manifest->size);
+    }
+    memset(manifest, 0, sizeof(*manifest));
+}
+
+// Function to initialize the context from a binary manifest file
+void init_manifest(const char *path, SandboxContext *ctx) {
+    if (manifest_open(path, &ctx->manifest) != 0) {
+        exit(EXIT_FAILURE);
+    }
+    init_manifest_context(ctx);
+}
+
+// Function to initialize the context from a binary manifest in memory
+void init_manifest_memory(const void *data, size_t size, SandboxContext *ctx) {
+    if (manifest_open_memory(data, size, &ctx->manifest) != 0) {
+        exit(EXIT_FAILURE);
+    }
+    init_manifest_context(ctx);
+}
+
+// Every string points into the manifest; only root_process_args are copied, as for text configs
+static void init_manifest_context(SandboxContext *ctx) {
+    const Manifest *m = &ctx->manifest;
+    const ManifestHeader *h = m->header;
+    const uint32_t *args;
+    const char *store_link;
+
+    // Kept empty so that destroy_context() is the same for both formats
+    config_init(&(ctx->cfg));
+    ctx->symlink_setting = NULL;
+    ctx->directory_setting = NULL;
+    ctx->file_copy_setting = NULL;
+
+    ctx->sandbox_id = h->sandbox_id;
+    ctx->root_dir = manifest_string(m, h->root_dir);
+    ctx->root_process = (char *)manifest_string(m, h->root_process);
+    ctx->overlay_lower_dir = manifest_string(m, h->overlay_lower_dir);
+    ctx->base_layer = manifest_string(m, h->base_layer);
+    ctx->store.dir = manifest_string(m, h->store_dir);
+    store_link = manifest_string(m, h->store_link);
+    ctx->store.use_bind = store_link == NULL || strcmp(store_link, "hardlink") != 0;
+    ctx->store.mount_count = 0;
+    ctx->store.in_layer = 0;
+    ctx->copy_workers = h->copy_workers >= 1 ? h->copy_workers : DEFAULT_COPY_WORKERS;
+    ctx->image_cache_dir = manifest_string(m, h->image_cache_dir);
+    ctx->tmpfs_size = manifest_string(m, h->tmpfs_size);
+
+    memset(&(ctx->cgroup), 0, sizeof(ctx->cgroup));
+    ctx->cgroup.fd = -1;
+    if (h->resources_defined) {
+        ctx->cgroup.defined = 1;
+        ctx->cgroup.cpuset = manifest_string(m, h->cpuset);
+        ctx->cgroup.cpu_max = manifest_string(m, h->cpu_max);
+        ctx->cgroup.memory_max = manifest_string(m, h->memory_max);
+        ctx->cgroup.memory_high = manifest_string(m, h->memory_high);
+        ctx->cgroup.io_weight = h->io_weight;
+        ctx->cgroup.sched_priority = h->sched_priority;
+        ctx->cgroup.lock_memory = h->lock_memory;
+    }
+
+    set_root_dir(ctx, ctx->root_dir);
+    ctx->park_fd = -1;
+
+    ctx->root_process_argc = h->args.count;
+    ctx->root_process_args = NULL;
+    if (h->args.count > 0) {
+        args = (const uint32_t *)(m->base + h->args.offset);
+        ctx->root_process_args = malloc(sizeof(char *) * h->args.count);
+        check_error(ctx->root_process_args == NULL ? -1 : 0, "malloc root_process_args");
+        for (uint32_t i = 0; i < h->args.count; ++i) {
+            ctx->root_process_args[i] = strdup(m->strings + args[i]);
+            check_error(ctx->root_process_args[i] == NULL ? -1 : 0, "strdup root_process_arg");
+        }
+    }
+
+    ctx->veth_ip_pair.host = manifest_string(m, h->veth_host);
+    ctx->veth_ip_pair.sandbox = manifest_string(m, h->veth_sandbox);
+    ctx->veth_ip_pair_defined = ctx->veth_ip_pair.host != NULL && ctx->veth_ip_pair.sandbox != NULL;
+}
+
+// The rootfs layout is read through these functions, whichever format the config came in
+
+int rootfs_directory_count(const SandboxContext *ctx) {
+    if (ctx->manifest.base != NULL) {
+        return ctx->manifest.header->directories.count;
+    }
+    return ctx->directory_setting != NULL ? config_setting_length(ctx->directory_setting) : 0;
+}
+
+// Returns NULL for a malformed entry, which is skipped
+const char *rootfs_directory(const SandboxContext *ctx, int i) {
+    if (ctx->manifest.base != NULL) {
+        const uint32_t *dirs = (const uint32_t *)(ctx->manifest.base + ctx->manifest.header->directories.offset);
+        return ctx->manifest.strings + dirs[i];
+    }
+    return config_setting_get_string_elem(ctx->directory_setting, i);
+}
+
+int rootfs_file_copy_count(const SandboxContext *ctx) {
+    if (ctx->manifest.base != NULL) {
+        return ctx->manifest.header->file_copies.count;
+    }
+    return ctx->file_copy_setting != NULL ? config_setting_length(ctx->file_copy_setting) : 0;
+}
+
+// Returns -1 for a malformed entry, which is skipped
+int rootfs_file_copy(const SandboxContext *ctx, int i, const char **src, const char **dst) {
+    if (ctx->manifest.base != NULL) {
+        const ManifestPair *copies =
+            (const ManifestPair *)(ctx->manifest.base + ctx->manifest.header->file_copies.offset);
+        *src = ctx->manifest.strings + copies[i].first;
+        *dst = ctx->manifest.strings + copies[i].second;
+        return 0;
+    } else {
+        config_setting_t *f_c = config_setting_get_elem(ctx->file_copy_setting, i);
+        return config_setting_lookup_string(f_c, "src", src) &&
+               config_setting_lookup_string(f_c, "dst", dst) ? 0 : -1;
+    }
+}
+
+int rootfs_symlink_count(const SandboxContext *ctx) {
+    if (ctx->manifest.base != NULL) {
+        return ctx->manifest.header->symlinks.count;
+    }
+    return ctx->symlink_setting != NULL ? config_setting_length(ctx->symlink_setting) : 0;
+}
+
+// Returns -1 for a malformed entry, which is skipped
+int rootfs_symlink(const SandboxContext *ctx, int i, const char **sym, const char **dst) {
+    if (ctx->manifest.base != NULL) {
+        const ManifestPair *links =
+            (const ManifestPair *)(ctx->manifest.base + ctx->manifest.header->symlinks.offset);
+        *sym = ctx->manifest.strings + links[i].first;
+        *dst = ctx->manifest.strings + links[i].second;
+        return 0;
+    } else {
+        config_setting_t *s_l = config_setting_get_elem(ctx->symlink_setting, i);
+        return config_setting_lookup_string(s_l, "sym", sym) &&
+               config_setting_lookup_string(s_l, "dst", dst) ? 0 : -1;
+    }
+}
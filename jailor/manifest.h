@@ -0,0 +1,82 @@
+/* manifest.h */
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Binary form of a full config, written by configer and mapped as-is by jailor.
+// Layout, every part 4-byte aligned:
+//   ManifestHeader
+//   root_process_args, directories   uint32_t string offsets
+//   file_copies, symlinks            ManifestPair records
+//   string table                     NUL-terminated strings
+// String offsets are relative to the string table. Optional settings that are not
+// set hold MANIFEST_NONE. Integers are in host byte order: a manifest is only read
+// on the host that generated it.
+#define MANIFEST_MAGIC 0x464d4c4aU   // "JLMF"
+#define MANIFEST_VERSION 2
+#define MANIFEST_NONE 0xffffffffU
+
+// Struct to locate a section: byte offset in the file and number of entries
+// (for the string table, its size in bytes)
+typedef struct {
+    uint32_t offset;
+    uint32_t count;
+} ManifestSection;
+
+// Struct to hold a file copy (src, dst) or a symlink (sym, dst) as two string offsets
+typedef struct {
+    uint32_t first;
+    uint32_t second;
+} ManifestPair;
+
+// Struct to hold the fixed part of a manifest
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t flags;                 // Unused, 0
+    uint64_t file_size;
+    uint64_t checksum;              // manifest_checksum() of the whole file with this field zeroed
+    int32_t sandbox_id;
+    int32_t copy_workers;           // 0 when not set
+    uint32_t root_dir;
+    uint32_t root_process;
+    uint32_t veth_host;
+    uint32_t veth_sandbox;
+    uint32_t overlay_lower_dir;
+    uint32_t store_dir;
+    uint32_t store_link;
+    uint32_t image_cache_dir;
+    uint32_t tmpfs_size;
+    uint32_t resources_defined;
+    uint32_t cpuset;
+    uint32_t cpu_max;
+    uint32_t memory_max;
+    uint32_t memory_high;
+    int32_t io_weight;
+    int32_t sched_priority;
+    int32_t lock_memory;
+    uint32_t base_layer;
+    ManifestSection args;
+    ManifestSection directories;
+    ManifestSection file_copies;
+    ManifestSection symlinks;
+    ManifestSection strings;
+} ManifestHeader;
+
+#define MANIFEST_FNV_OFFSET 0xcbf29ce484222325ULL
+
+// FNV-1a, continued from hash; start with MANIFEST_FNV_OFFSET
+static inline uint64_t manifest_checksum(uint64_t hash, const void *data, size_t len) {
+    const unsigned char *p = (const unsigned char *)data;
+
+    for (size_t i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+#endif
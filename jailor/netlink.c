@@ -0,0 +1,451 @@
+/* netlink.c */
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/if_link.h>
+#include <linux/veth.h>
+
+#include "jailor.h"
+
+#define VETH_PREFIX_LEN 28 // Same /28 the ip commands used
+
+static int rtnl_add_addr(NlBatch *batch, int ifindex, const char *ip, int prefix_len);
+static int rtnl_set_link_up(NlBatch *batch, int ifindex, const char *ifname);
+static int rtnl_add_default_route(NlBatch *batch, int ifindex, const char *gateway_ip);
+
+void nl_batch_init(NlBatch *batch) {
+    batch->len = 0;
+    batch->last = 0;
+    batch->count = 0;
+    batch->seq = 0;
+}
+
+// Start a new message in the batch; its payload is zeroed and `len` bytes long
+struct nlmsghdr *nl_batch_msg(NlBatch *batch, int type, int flags, size_t len) {
+    struct nlmsghdr *nlh;
+
+    if (batch->len + NLMSG_SPACE(len) > sizeof(batch->buf)) {
+        errno = ENOBUFS;
+        return NULL;
+    }
+
+    nlh = (struct nlmsghdr *)(batch->buf + batch->len);
+    memset(nlh, 0, NLMSG_SPACE(len));
+    nlh->nlmsg_len = NLMSG_LENGTH(len);
+    nlh->nlmsg_type = type;
+    nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | flags;
+    nlh->nlmsg_seq = ++batch->seq;
+    batch->last = batch->len;
+    batch->len += NLMSG_ALIGN(nlh->nlmsg_len);
+    batch->count++;
+    return nlh;
+}
+
+// Append an attribute to the last message of the batch
+int nl_attr_put(NlBatch *batch, int type, const void *data, size_t len) {
+    struct nlmsghdr *nlh = (struct nlmsghdr *)(batch->buf + batch->last);
+    struct rtattr *rta;
+
+    if (batch->len + RTA_SPACE(len) > sizeof(batch->buf)) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    rta = (struct rtattr *)(batch->buf + batch->len);
+    rta->rta_type = type;
+    rta->rta_len = RTA_LENGTH(len);
+    if (len > 0) {
+        memcpy(RTA_DATA(rta), data, len);
+    }
+    batch->len += RTA_SPACE(len);
+    nlh->nlmsg_len = batch->len - batch->last;
+    return 0;
+}
+
+// Open a nested attribute; returns its offset for nl_nest_end()
+size_t nl_nest_begin(NlBatch *batch, int type) {
+    size_t offset = batch->len;
+
+    nl_attr_put(batch, type, NULL, 0);
+    return offset;
+}
+
+void nl_nest_end(NlBatch *batch, size_t offset) {
+    struct rtattr *rta = (struct rtattr *)(batch->buf + offset);
+
+    rta->rta_len = batch->len - offset;
+}
+
+// Send every message of the batch with a single sendmsg() and collect the acks.
+// Returns 0 if all requests succeeded, otherwise -1 with errno from the first failure.
+int nl_batch_send(int fd, NlBatch *batch) {
+    struct sockaddr_nl kernel = { .nl_family = AF_NETLINK };
+    struct iovec iov = { batch->buf, batch->len };
+    struct msghdr msg = { &kernel, sizeof(kernel), &iov, 1, NULL, 0, 0 };
+    char reply[8192];
+    int count = batch->count;
+    int acked = 0;
+    int first_error = 0;
+
+    if (count == 0) {
+        return 0;
+    }
+
+    nl_batch_init(batch);
+    if (sendmsg(fd, &msg, 0) < 0) {
+        return -1;
+    }
+
+    while (acked < count) {
+        struct nlmsghdr *nlh;
+        ssize_t len = recv(fd, reply, sizeof(reply), 0);
+
+        if (len < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+
+        for (nlh = (struct nlmsghdr *)reply; NLMSG_OK(nlh, (size_t)len); nlh = NLMSG_NEXT(nlh, len)) {
+            if (nlh->nlmsg_type == NLMSG_ERROR) {
+                struct nlmsgerr *err = (struct nlmsgerr *)NLMSG_DATA(nlh);
+                if (err->error != 0 && first_error == 0) {
+                    first_error = -err->error;
+                }
+                acked++;
+            }
+        }
+    }
+
+    if (first_error != 0) {
+        errno = first_error;
+        return -1;
+    }
+    return 0;
+}
+
+// Open an rtnetlink socket in the network namespace of `netns_pid` (0 for our own).
+// The socket stays bound to that namespace after we switch back.
+int rtnl_open(pid_t netns_pid) {
+    struct sockaddr_nl local = { .nl_family = AF_NETLINK };
+    char ns_path[64];
+    int own_ns = -1;
+    int target_ns = -1;
+    int fd;
+
+    if (netns_pid > 0) {
+        snprintf(ns_path, sizeof(ns_path), "/proc/%d/ns/net", netns_pid);
+        own_ns = open("/proc/self/ns/net", O_RDONLY | O_CLOEXEC);
+        target_ns = open(ns_path, O_RDONLY | O_CLOEXEC);
+        if (own_ns < 0 || target_ns < 0 || setns(target_ns, CLONE_NEWNET) == -1) {
+            if (own_ns >= 0) close(own_ns);
+            if (target_ns >= 0) close(target_ns);
+            return -1;
+        }
+    }
+
+    fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+
+    if (netns_pid > 0) {
+        check_error(setns(own_ns, CLONE_NEWNET), "setns back to host netns");
+        close(own_ns);
+        close(target_ns);
+    }
+
+    if (fd >= 0 && bind(fd, (struct sockaddr *)&local, sizeof(local)) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Look up an interface index by name in the namespace of the socket
+int rtnl_link_index(int fd, const char *ifname) {
+    NlBatch batch;
+    struct nlmsghdr *nlh;
+    struct sockaddr_nl kernel = { .nl_family = AF_NETLINK };
+    char reply[8192];
+    ssize_t len;
+
+    nl_batch_init(&batch);
+    nlh = nl_batch_msg(&batch, RTM_GETLINK, 0, sizeof(struct ifinfomsg));
+    if (nlh == NULL) return -1;
+    nlh->nlmsg_flags &= ~NLM_F_ACK;
+    ((struct ifinfomsg *)NLMSG_DATA(nlh))->ifi_family = AF_UNSPEC;
+    if (nl_attr_put(&batch, IFLA_IFNAME, ifname, strlen(ifname) + 1) == -1) return -1;
+
+    if (sendto(fd, batch.buf, batch.len, 0, (struct sockaddr *)&kernel, sizeof(kernel)) < 0) {
+        return -1;
+    }
+
+    len = recv(fd, reply, sizeof(reply), 0);
+    if (len < 0) {
+        return -1;
+    }
+    nlh = (struct nlmsghdr *)reply;
+    if (!NLMSG_OK(nlh, (size_t)len)) {
+        errno = EPROTO;
+        return -1;
+    }
+    if (nlh->nlmsg_type == NLMSG_ERROR) {
+        errno = -((struct nlmsgerr *)NLMSG_DATA(nlh))->error;
+        return -1;
+    }
+    return ((struct ifinfomsg *)NLMSG_DATA(nlh))->ifi_index;
+}
+
+static int rtnl_add_addr(NlBatch *batch, int ifindex, const char *ip, int prefix_len) {
+    struct nlmsghdr *nlh;
+    struct ifaddrmsg *ifa;
+    struct in_addr addr;
+
+    if (inet_pton(AF_INET, ip, &addr) != 1) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    nlh = nl_batch_msg(batch, RTM_NEWADDR, NLM_F_CREATE | NLM_F_EXCL, sizeof(struct ifaddrmsg));
+    if (nlh == NULL) return -1;
+    ifa = (struct ifaddrmsg *)NLMSG_DATA(nlh);
+    ifa->ifa_family = AF_INET;
+    ifa->ifa_prefixlen = prefix_len;
+    ifa->ifa_index = ifindex;
+    if (nl_attr_put(batch, IFA_LOCAL, &addr, sizeof(addr)) == -1) return -1;
+    return nl_attr_put(batch, IFA_ADDRESS, &addr, sizeof(addr));
+}
+
+// Queue bringing a link up. With ifindex 0 the link is looked up by name,
+// otherwise it is renamed to ifname in the same request (the rename happens before the link goes up).
+static int rtnl_set_link_up(NlBatch *batch, int ifindex, const char *ifname) {
+    struct nlmsghdr *nlh;
+    struct ifinfomsg *ifi;
+
+    nlh = nl_batch_msg(batch, RTM_NEWLINK, 0, sizeof(struct ifinfomsg));
+    if (nlh == NULL) return -1;
+    ifi = (struct ifinfomsg *)NLMSG_DATA(nlh);
+    ifi->ifi_family = AF_UNSPEC;
+    ifi->ifi_index = ifindex;
+    ifi->ifi_flags = IFF_UP;
+    ifi->ifi_change = IFF_UP;
+    return nl_attr_put(batch, IFLA_IFNAME, ifname, strlen(ifname) + 1);
+}
+
+static int rtnl_add_default_route(NlBatch *batch, int ifindex, const char *gateway_ip) {
+    struct nlmsghdr *nlh;
+    struct rtmsg *rtm;
+    struct in_addr gateway;
+
+    if (inet_pton(AF_INET, gateway_ip, &gateway) != 1) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    nlh = nl_batch_msg(batch, RTM_NEWROUTE, NLM_F_CREATE | NLM_F_EXCL, sizeof(struct rtmsg));
+    if (nlh == NULL) return -1;
+    rtm = (struct rtmsg *)NLMSG_DATA(nlh);
+    rtm->rtm_family = AF_INET;
+    rtm->rtm_table = RT_TABLE_MAIN;
+    rtm->rtm_protocol = RTPROT_BOOT;
+    rtm->rtm_scope = RT_SCOPE_UNIVERSE;
+    rtm->rtm_type = RTN_UNICAST;
+    if (nl_attr_put(batch, RTA_GATEWAY, &gateway, sizeof(gateway)) == -1) return -1;
+    return nl_attr_put(batch, RTA_OIF, &ifindex, sizeof(ifindex));
+}
+
+// Queue creation of a veth pair whose peer is created directly in the netns of `peer_pid`.
+// Both ends stay down until veth_configure().
+int rtnl_add_veth(NlBatch *batch, const char *host_ifname, const char *peer_ifname, pid_t peer_pid) {
+    struct nlmsghdr *nlh;
+    struct ifinfomsg *ifi;
+    struct ifinfomsg peer;
+    size_t linkinfo, data, peer_info;
+    uint32_t pid = peer_pid;
+
+    nlh = nl_batch_msg(batch, RTM_NEWLINK, NLM_F_CREATE | NLM_F_EXCL, sizeof(struct ifinfomsg));
+    if (nlh == NULL) return -1;
+    ifi = (struct ifinfomsg *)NLMSG_DATA(nlh);
+    ifi->ifi_family = AF_UNSPEC;
+    if (nl_attr_put(batch, IFLA_IFNAME, host_ifname, strlen(host_ifname) + 1) == -1) return -1;
+
+    linkinfo = nl_nest_begin(batch, IFLA_LINKINFO);
+    if (nl_attr_put(batch, IFLA_INFO_KIND, "veth", strlen("veth")) == -1) return -1;
+    data = nl_nest_begin(batch, IFLA_INFO_DATA);
+
+    // VETH_INFO_PEER carries an ifinfomsg followed by the peer's own attributes
+    memset(&peer, 0, sizeof(peer));
+    peer.ifi_family = AF_UNSPEC;
+    peer_info = batch->len;
+    if (nl_attr_put(batch, VETH_INFO_PEER, &peer, sizeof(peer)) == -1) return -1;
+    if (nl_attr_put(batch, IFLA_IFNAME, peer_ifname, strlen(peer_ifname) + 1) == -1) return -1;
+    if (peer_pid > 0 && nl_attr_put(batch, IFLA_NET_NS_PID, &pid, sizeof(pid)) == -1) return -1;
+    nl_nest_end(batch, peer_info);
+
+    nl_nest_end(batch, data);
+    nl_nest_end(batch, linkinfo);
+    return 0;
+}
+
+// Function to enable IPv4 forwarding without spawning a shell
+int enable_ip_forward(void) {
+    int fd = open("/proc/sys/net/ipv4/ip_forward", O_WRONLY | O_CLOEXEC);
+    ssize_t n;
+
+    if (fd < 0) {
+        return -1;
+    }
+    n = write(fd, "1\n", 2);
+    close(fd);
+    return n == 2 ? 0 : -1;
+}
+
+// Function to create the veth pair of a sandbox and bring its lo up.
+// Names and addresses are applied later by veth_configure(), so a pool can do this ahead of time.
+// host_fd is a shared host-side rtnetlink socket, or -1 to open one for this link.
+int veth_create(VethLink *link, int host_fd, pid_t pid, const char *host_ifname, const char *sandbox_ifname) {
+    NlBatch *batch = malloc(sizeof(NlBatch));
+
+    link->host_fd = host_fd;
+    link->owns_host_fd = 0;
+    link->sandbox_fd = -1;
+    if (batch == NULL) {
+        return -1;
+    }
+
+    if (link->host_fd < 0) {
+        link->host_fd = rtnl_open(0);
+        link->owns_host_fd = 1;
+    }
+    link->sandbox_fd = rtnl_open(pid);
+    if (link->host_fd < 0 || link->sandbox_fd < 0) {
+        goto fail;
+    }
+
+    // Host side: create the pair, the peer lands in the sandbox netns
+    nl_batch_init(batch);
+    if (rtnl_add_veth(batch, host_ifname, sandbox_ifname, pid) == -1 ||
+        nl_batch_send(link->host_fd, batch) == -1) {
+        goto fail;
+    }
+
+    // Sandbox side: lo is always up, the test setups used to do this by hand
+    if (rtnl_set_link_up(batch, 0, "lo") == -1 ||
+        nl_batch_send(link->sandbox_fd, batch) == -1) {
+        goto fail;
+    }
+
+    link->host_ifindex = rtnl_link_index(link->host_fd, host_ifname);
+    link->sandbox_ifindex = rtnl_link_index(link->sandbox_fd, sandbox_ifname);
+    if (link->host_ifindex < 0 || link->sandbox_ifindex < 0) {
+        goto fail;
+    }
+
+    free(batch);
+    return 0;
+
+fail:
+    free(batch);
+    veth_close(link);
+    return -1;
+}
+
+// Function to name, address and bring up both ends and add the sandbox default route.
+// Each side is a single netlink transaction.
+int veth_configure(VethLink *link, const char *host_ifname, const char *sandbox_ifname,
+                   const char *host_ip, const char *sandbox_ip) {
+    NlBatch *batch = malloc(sizeof(NlBatch));
+    int ret = -1;
+
+    if (batch == NULL) {
+        return -1;
+    }
+
+    nl_batch_init(batch);
+    if (rtnl_set_link_up(batch, link->host_ifindex, host_ifname) == -1 ||
+        rtnl_add_addr(batch, link->host_ifindex, host_ip, VETH_PREFIX_LEN) == -1 ||
+        nl_batch_send(link->host_fd, batch) == -1) {
+        goto out;
+    }
+
+    if (rtnl_set_link_up(batch, link->sandbox_ifindex, sandbox_ifname) == -1 ||
+        rtnl_add_addr(batch, link->sandbox_ifindex, sandbox_ip, VETH_PREFIX_LEN) == -1 ||
+        rtnl_add_default_route(batch, link->sandbox_ifindex, host_ip) == -1 ||
+        nl_batch_send(link->sandbox_fd, batch) == -1) {
+        goto out;
+    }
+
+    ret = 0;
+
+out:
+    free(batch);
+    return ret;
+}
+
+void veth_close(VethLink *link) {
+    if (link->host_fd >= 0 && link->owns_host_fd) close(link->host_fd);
+    if (link->sandbox_fd >= 0) close(link->sandbox_fd);
+    link->host_fd = -1;
+    link->sandbox_fd = -1;
+}
+
+// Function to wire the sandbox to the host: veth pair, addresses, links and default route.
+// This replaces the ip/nsenter commands with two rtnetlink sockets and a few batched requests.
+// A batch passes its shared host socket in host_fd; -1 opens a private one.
+int setup_veth(SandboxContext *ctx, pid_t pid, int host_fd) {
+    char host_ifname[IFNAMSIZ];
+    char sandbox_ifname[IFNAMSIZ];
+    VethLink link;
+    int ret;
+
+    snprintf(host_ifname, sizeof(host_ifname), "veth%d", 100 + ctx->sandbox_id);
+    snprintf(sandbox_ifname, sizeof(sandbox_ifname), "veth%d", 200 + ctx->sandbox_id);
+
+    if (veth_create(&link, host_fd, pid, host_ifname, sandbox_ifname) == -1) {
+        return -1;
+    }
+    ret = veth_configure(&link, host_ifname, sandbox_ifname, ctx->veth_ip_pair.host, ctx->veth_ip_pair.sandbox);
+    veth_close(&link);
+    return ret;
+}
+
+// Function to address and bring up the host end of a veth pair CRIU recreated on restore.
+// The sandbox end comes back with the addresses and routes it was dumped with.
+int setup_restored_veth(SandboxContext *ctx) {
+    char host_ifname[IFNAMSIZ];
+    NlBatch *batch = malloc(sizeof(NlBatch));
+    int fd, ifindex;
+    int ret = -1;
+
+    if (batch == NULL) {
+        return -1;
+    }
+    snprintf(host_ifname, sizeof(host_ifname), "veth%d", 100 + ctx->sandbox_id);
+
+    fd = rtnl_open(0);
+    if (fd == -1) {
+        free(batch);
+        return -1;
+    }
+    ifindex = rtnl_link_index(fd, host_ifname);
+    if (ifindex > 0) {
+        nl_batch_init(batch);
+        if (rtnl_set_link_up(batch, ifindex, host_ifname) == 0 &&
+            rtnl_add_addr(batch, ifindex, ctx->veth_ip_pair.host, VETH_PREFIX_LEN) == 0 &&
+            nl_batch_send(fd, batch) == 0) {
+            ret = 0;
+        }
+    }
+
+    close(fd);
+    free(batch);
+    return ret;
+}
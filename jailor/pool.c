@@ -0,0 +1,504 @@
+/* pool.c */
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "jailor.h"
+
+#define POOL_MAX_ENTRIES 64
+
+// Pool entries are parked (cloned, waiting before execv) or running a bound sandbox
+typedef enum {
+    POOL_EMPTY,
+    POOL_PARKED,
+    POOL_RUNNING
+} PoolState;
+
+typedef struct {
+    SandboxContext ctx;
+    char root_dir[256];
+    PoolState state;
+    pid_t pid;
+    int pidfd;
+    int launch_fd;      // Write end of the launch pipe while parked
+    int has_veth;
+    VethLink link;
+} PoolEntry;
+
+// Request sent by `jailor --attach` over the pool socket
+typedef struct {
+    int sandbox_id;
+    int veth_ip_pair_defined;
+    char root_process[PATH_MAX];
+    char host_ip[64];
+    char sandbox_ip[64];
+    char key[HASH_HEX_LEN + 1];     // pool_key() of the requested sandbox
+    uint32_t args_len;
+    char args[2048];    // NUL-separated root_process arguments
+} PoolRequest;
+
+// Reply from the pool; a pidfd of the sandbox init is attached on success
+typedef struct {
+    int status;
+    pid_t pid;
+    char message[128];
+} PoolReply;
+
+static PoolEntry entries[POOL_MAX_ENTRIES];
+static SandboxContext template_ctx;
+static char template_key[HASH_HEX_LEN + 1];
+static char *clone_stack;
+static volatile sig_atomic_t pool_stopping;
+static int attached_pidfd = -1;
+
+static int pidfd_open_pid(pid_t pid);
+static void hash_setting(Sha256 *hash, const char *tag, const char *value);
+static void pool_key(const SandboxContext *ctx, char key[HASH_HEX_LEN + 1]);
+static void stop_pool(int signo);
+static void forward_signal(int signo);
+static int pool_park(int slot);
+static void pool_release(PoolEntry *entry);
+static void pool_replenish(int count);
+static void pool_handle_request(int fd);
+static void pool_reply(int fd, const PoolReply *reply, int pidfd);
+
+static int pidfd_open_pid(pid_t pid) {
+    return syscall(SYS_pidfd_open, pid, 0);
+}
+
+static void hash_setting(Sha256 *hash, const char *tag, const char *value) {
+    sha256_update(hash, tag, strlen(tag) + 1);
+    if (value != NULL) {
+        sha256_update(hash, value, strlen(value) + 1);
+    }
+}
+
+// Function to hash everything a parked sandbox takes from the template rather than from
+// the start request: the rootfs closure and how it is built, and the cgroup limits.
+// A request with another key is refused so that the caller starts without the pool.
+static void pool_key(const SandboxContext *ctx, char key[HASH_HEX_LEN + 1]) {
+    const CgroupConfig *cg = &ctx->cgroup;
+    char closure[HASH_HEX_LEN + 1];
+    char numbers[64];
+    Sha256 hash;
+
+    image_cache_key(ctx, closure);
+    sha256_init(&hash);
+    hash_setting(&hash, "closure", closure);
+    hash_setting(&hash, "overlay_lower_dir", ctx->overlay_lower_dir);
+    hash_setting(&hash, "base_layer", ctx->base_layer);
+    hash_setting(&hash, "store_dir", ctx->store.dir);
+    hash_setting(&hash, "tmpfs_size", ctx->tmpfs_size);
+    hash_setting(&hash, "cpuset", cg->defined ? cg->cpuset : NULL);
+    hash_setting(&hash, "cpu_max", cg->defined ? cg->cpu_max : NULL);
+    hash_setting(&hash, "memory_max", cg->defined ? cg->memory_max : NULL);
+    hash_setting(&hash, "memory_high", cg->defined ? cg->memory_high : NULL);
+    snprintf(numbers, sizeof(numbers), "%d %d %d %d %d", cg->defined, cg->io_weight, cg->sched_priority,
+             cg->lock_memory, ctx->store.use_bind);
+    hash_setting(&hash, "numbers", numbers);
+    sha256_final(&hash, key);
+}
+
+static void stop_pool(int signo) {
+    (void)signo;
+    pool_stopping = 1;
+}
+
+static void forward_signal(int signo) {
+    int sig = signo == JAILOR_KILL_SIGNAL ? SIGKILL : SIGTERM;
+
+    if (attached_pidfd >= 0) {
+        syscall(SYS_pidfd_send_signal, attached_pidfd, sig, NULL, 0);
+    }
+}
+
+// Function to build a sandbox from the template and park it just before execv
+static int pool_park(int slot) {
+    PoolEntry *entry = &entries[slot];
+    char host_ifname[IFNAMSIZ];
+    char sandbox_ifname[IFNAMSIZ];
+    int launch_pipe[2];
+
+    entry->ctx = template_ctx;
+    snprintf(entry->root_dir, sizeof(entry->root_dir), "%s_pool%d", template_ctx.root_dir, slot);
+    set_root_dir(&entry->ctx, entry->root_dir);
+    prepare_rootfs(&entry->ctx);
+
+    if (pipe2(launch_pipe, O_CLOEXEC) == -1) {
+        perror("pipe2 launch");
+        teardown_rootfs(&entry->ctx);
+        return -1;
+    }
+
+    entry->ctx.park_fd = launch_pipe[0];
+    entry->pid = spawn_sandbox(&entry->ctx, clone_stack);
+    close(launch_pipe[0]);
+    entry->ctx.park_fd = -1;
+    if (entry->pid == -1) {
+        perror("clone pool sandbox");
+        close(launch_pipe[1]);
+        teardown_rootfs(&entry->ctx);
+        cgroup_destroy(&entry->ctx);
+        return -1;
+    }
+    entry->launch_fd = launch_pipe[1];
+    entry->pidfd = pidfd_open_pid(entry->pid);
+    entry->state = POOL_PARKED;
+    if (entry->pidfd == -1) {
+        perror("pidfd_open pool sandbox");
+        kill(entry->pid, SIGKILL);
+        pool_release(entry);
+        return -1;
+    }
+
+    // The pair gets placeholder names now and is renamed when the entry is bound
+    entry->has_veth = template_ctx.veth_ip_pair_defined;
+    if (entry->has_veth) {
+        snprintf(host_ifname, sizeof(host_ifname), "jpool%dh", slot);
+        snprintf(sandbox_ifname, sizeof(sandbox_ifname), "jpool%ds", slot);
+        if (veth_create(&entry->link, -1, entry->pid, host_ifname, sandbox_ifname) == -1) {
+            perror("veth_create pool sandbox");
+            entry->has_veth = 0;
+            kill(entry->pid, SIGKILL);
+            pool_release(entry);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Function to reap a pool entry whose init process has exited and free its slot
+static void pool_release(PoolEntry *entry) {
+    waitpid(entry->pid, NULL, 0);
+    if (entry->state == POOL_PARKED) {
+        close(entry->launch_fd);
+    }
+    if (entry->has_veth) {
+        veth_close(&entry->link);
+        entry->has_veth = 0;
+    }
+    if (entry->pidfd >= 0) {
+        close(entry->pidfd);
+    }
+    teardown_rootfs(&entry->ctx);
+    cgroup_destroy(&entry->ctx);
+    entry->state = POOL_EMPTY;
+}
+
+// Function to park sandboxes in free slots until `count` are waiting
+static void pool_replenish(int count) {
+    int parked = 0;
+
+    for (int i = 0; i < POOL_MAX_ENTRIES; ++i) {
+        if (entries[i].state == POOL_PARKED) parked++;
+    }
+    for (int i = 0; i < POOL_MAX_ENTRIES && parked < count && !pool_stopping; ++i) {
+        if (entries[i].state == POOL_EMPTY && pool_park(i) == 0) {
+            parked++;
+        }
+    }
+}
+
+static void pool_reply(int fd, const PoolReply *reply, int pidfd) {
+    struct iovec iov = { (void *)reply, sizeof(*reply) };
+    struct msghdr msg;
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    // Hand the client a pidfd so it can supervise and signal the sandbox
+    if (pidfd >= 0) {
+        struct cmsghdr *cmsg;
+
+        memset(&control, 0, sizeof(control));
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &pidfd, sizeof(int));
+    }
+
+    if (sendmsg(fd, &msg, MSG_NOSIGNAL) == -1) {
+        perror("sendmsg pool reply");
+    }
+}
+
+// Function to bind a parked sandbox to a start request and let it exec
+static void pool_handle_request(int fd) {
+    PoolRequest request;
+    PoolReply reply;
+    PoolEntry *entry = NULL;
+    char host_ifname[IFNAMSIZ];
+    char sandbox_ifname[IFNAMSIZ];
+    uint32_t len;
+    Span span;
+
+    span_begin(&span, "pool_bind");
+    memset(&reply, 0, sizeof(reply));
+    if (recv(fd, &request, sizeof(request), 0) != sizeof(request) || request.args_len > sizeof(request.args) ||
+        memchr(request.key, '\0', sizeof(request.key)) == NULL) {
+        reply.status = -1;
+        snprintf(reply.message, sizeof(reply.message), "malformed request");
+        pool_reply(fd, &reply, -1);
+        return;
+    }
+
+    for (int i = 0; i < POOL_MAX_ENTRIES; ++i) {
+        if (entries[i].state == POOL_PARKED) {
+            entry = &entries[i];
+            break;
+        }
+    }
+
+    reply.status = -1;
+    if (entry == NULL) {
+        snprintf(reply.message, sizeof(reply.message), "pool is empty");
+    } else if (strcmp(request.root_process, template_ctx.root_process) != 0) {
+        snprintf(reply.message, sizeof(reply.message), "pool runs %s", template_ctx.root_process);
+    } else if (strcmp(request.key, template_key) != 0) {
+        snprintf(reply.message, sizeof(reply.message), "rootfs or resources differ from the pool template");
+    } else if (request.veth_ip_pair_defined != entry->has_veth) {
+        snprintf(reply.message, sizeof(reply.message), "veth_ip_pair does not match the pool template");
+    } else {
+        reply.status = 0;
+    }
+    if (reply.status != 0) {
+        pool_reply(fd, &reply, -1);
+        return;
+    }
+
+    // Apply the requested identity: interface names and addresses
+    if (entry->has_veth) {
+        snprintf(host_ifname, sizeof(host_ifname), "veth%d", 100 + request.sandbox_id);
+        snprintf(sandbox_ifname, sizeof(sandbox_ifname), "veth%d", 200 + request.sandbox_id);
+        if (veth_configure(&entry->link, host_ifname, sandbox_ifname, request.host_ip, request.sandbox_ip) == -1) {
+            reply.status = -1;
+            snprintf(reply.message, sizeof(reply.message), "veth configure: %s", strerror(errno));
+            pool_reply(fd, &reply, -1);
+            kill(entry->pid, SIGKILL);
+            return;
+        }
+        veth_close(&entry->link);
+        entry->has_veth = 0;
+    }
+
+    // Release the parked init process into execv
+    len = request.args_len;
+    if (write(entry->launch_fd, &len, sizeof(len)) != sizeof(len) ||
+        write(entry->launch_fd, request.args, len) != (ssize_t)len) {
+        reply.status = -1;
+        snprintf(reply.message, sizeof(reply.message), "launch: %s", strerror(errno));
+        pool_reply(fd, &reply, -1);
+        kill(entry->pid, SIGKILL);
+        return;
+    }
+    close(entry->launch_fd);
+    entry->state = POOL_RUNNING;
+
+    reply.pid = entry->pid;
+    snprintf(reply.message, sizeof(reply.message), "sandbox%d started from pool slot %d", request.sandbox_id,
+             (int)(entry - entries));
+    pool_reply(fd, &reply, entry->pidfd);
+    span_end(&span, request.sandbox_id);
+    printf("pool: %s\n", reply.message);
+}
+
+// Function to run the pool: keep `count` sandboxes parked and serve start requests on socket_path
+int pool_serve(int count, const char *socket_path, const char *template_config) {
+    struct sockaddr_un addr;
+    struct pollfd fds[POOL_MAX_ENTRIES + 1];
+    PoolEntry *polled[POOL_MAX_ENTRIES + 1];
+    struct sigaction sa;
+    int listen_fd;
+
+    if (count < 1 || count > POOL_MAX_ENTRIES) {
+        fprintf(stderr, "Pool size must be between 1 and %d\n", POOL_MAX_ENTRIES);
+        return EXIT_FAILURE;
+    }
+
+    init_config(template_config, &template_ctx);
+    pool_key(&template_ctx, template_key);
+    clone_stack = malloc(STACK_SIZE);
+    check_error(clone_stack == NULL ? -1 : 0, "malloc stack");
+    if (template_ctx.veth_ip_pair_defined) {
+        check_error(enable_ip_forward(), "enable ip_forward");
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", socket_path);
+    listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    check_error(listen_fd, "socket pool");
+    unlink(socket_path);
+    check_error(bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)), "bind pool socket");
+    check_error(listen(listen_fd, 16), "listen pool socket");
+
+    // No SA_RESTART so poll() returns on SIGTERM
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stop_pool;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+
+    pool_replenish(count);
+    printf("pool: %d sandboxes parked, waiting for requests on %s\n", count, socket_path);
+
+    while (!pool_stopping) {
+        int nfds = 1;
+
+        fds[0].fd = listen_fd;
+        fds[0].events = POLLIN;
+        for (int i = 0; i < POOL_MAX_ENTRIES; ++i) {
+            if (entries[i].state != POOL_EMPTY) {
+                fds[nfds].fd = entries[i].pidfd;
+                fds[nfds].events = POLLIN;
+                polled[nfds] = &entries[i];
+                nfds++;
+            }
+        }
+
+        if (poll(fds, nfds, -1) == -1) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            break;
+        }
+
+        // Exited sandboxes free their slot
+        for (int i = 1; i < nfds; ++i) {
+            if (fds[i].revents & (POLLIN | POLLHUP)) {
+                pool_release(polled[i]);
+            }
+        }
+
+        if (fds[0].revents & POLLIN) {
+            int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+            if (fd >= 0) {
+                pool_handle_request(fd);
+                close(fd);
+            }
+        }
+
+        pool_replenish(count);
+    }
+
+    // Shut down: parked sandboxes are killed, running ones are asked to terminate
+    for (int i = 0; i < POOL_MAX_ENTRIES; ++i) {
+        if (entries[i].state != POOL_EMPTY) {
+            kill(entries[i].pid, entries[i].state == POOL_PARKED ? SIGKILL : SIGTERM);
+            pool_release(&entries[i]);
+        }
+    }
+    close(listen_fd);
+    unlink(socket_path);
+    free(clone_stack);
+    destroy_context(&template_ctx);
+    return 0;
+}
+
+// Function to start the sandbox described by ctx from a running pool and supervise it
+// until it exits. Returns -1 without side effects if no pool can serve it.
+int pool_attach(const char *socket_path, const SandboxContext *ctx) {
+    struct sockaddr_un addr;
+    PoolRequest request;
+    PoolReply reply;
+    struct iovec iov = { &reply, sizeof(reply) };
+    struct msghdr msg;
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct cmsghdr *cmsg;
+    struct pollfd pfd;
+    int fd;
+
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", socket_path);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    memset(&request, 0, sizeof(request));
+    request.sandbox_id = ctx->sandbox_id;
+    snprintf(request.root_process, sizeof(request.root_process), "%s", ctx->root_process);
+    request.veth_ip_pair_defined = ctx->veth_ip_pair_defined;
+    if (ctx->veth_ip_pair_defined) {
+        snprintf(request.host_ip, sizeof(request.host_ip), "%s", ctx->veth_ip_pair.host);
+        snprintf(request.sandbox_ip, sizeof(request.sandbox_ip), "%s", ctx->veth_ip_pair.sandbox);
+    }
+    pool_key(ctx, request.key);
+    for (int i = 0; i < ctx->root_process_argc; ++i) {
+        size_t len = strlen(ctx->root_process_args[i]) + 1;
+        if (request.args_len + len > sizeof(request.args)) {
+            fprintf(stderr, "pool: root_process_args exceed %zu bytes, starting without the pool\n",
+                    sizeof(request.args));
+            close(fd);
+            return -1;
+        }
+        memcpy(request.args + request.args_len, ctx->root_process_args[i], len);
+        request.args_len += len;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    if (send(fd, &request, sizeof(request), MSG_NOSIGNAL) != sizeof(request) ||
+        recvmsg(fd, &msg, MSG_CMSG_CLOEXEC) != sizeof(reply)) {
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    if (reply.status != 0) {
+        fprintf(stderr, "pool: %s, starting without the pool\n", reply.message);
+        return -1;
+    }
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS) {
+        fprintf(stderr, "pool: no pidfd in reply\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(&attached_pidfd, CMSG_DATA(cmsg), sizeof(int));
+    printf("pool: %s (pid %d)\n", reply.message, reply.pid);
+
+    // Behave like a regular jailor: forward termination and wait for the sandbox
+    signal(SIGTERM, forward_signal);
+    signal(SIGTSTP, forward_signal);
+    signal(JAILOR_KILL_SIGNAL, forward_signal);
+
+    pfd.fd = attached_pidfd;
+    pfd.events = POLLIN;
+    while (poll(&pfd, 1, -1) == -1 && errno == EINTR) {
+    }
+    close(attached_pidfd);
+    return 0;
+}
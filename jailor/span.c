@@ -0,0 +1,61 @@
+/* span.c */
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "jailor.h"
+
+// Startup phases are appended as JSON lines to the file named by JAILOR_SPAN_LOG:
+//   {"sandbox":1,"phase":"copy_files","start_ns":123,"dur_ns":456}
+// Timestamps are CLOCK_MONOTONIC, so records of jailor and sdeamon line up.
+// Without the variable nothing is opened and spans cost two clock reads.
+
+static int span_fd = -1;
+
+static unsigned long long timespec_nsec(const struct timespec *ts);
+
+static unsigned long long timespec_nsec(const struct timespec *ts) {
+    return (unsigned long long)ts->tv_sec * 1000000000ULL + (unsigned long long)ts->tv_nsec;
+}
+
+// Function to open the span log; the fd survives clone() so the sandbox init can report too
+void span_init(void) {
+    const char *path = getenv(SPAN_LOG_ENV);
+
+    if (path == NULL || path[0] == '\0') {
+        return;
+    }
+    span_fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (span_fd < 0) {
+        perror("open span log");
+    }
+}
+
+void span_begin(Span *span, const char *phase) {
+    span->phase = phase;
+    clock_gettime(CLOCK_MONOTONIC, &span->start);
+}
+
+// Function to record a finished phase. Each record is a single O_APPEND write,
+// so concurrent jailors never interleave lines.
+void span_end(Span *span, int sandbox_id) {
+    struct timespec now;
+    char line[256];
+    int len;
+
+    if (span_fd < 0) {
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    len = snprintf(line, sizeof(line), "{\"sandbox\":%d,\"phase\":\"%s\",\"start_ns\":%llu,\"dur_ns\":%llu}\n",
+                   sandbox_id, span->phase, timespec_nsec(&span->start),
+                   timespec_nsec(&now) - timespec_nsec(&span->start));
+    if (len > 0 && len < (int)sizeof(line) && write(span_fd, line, len) != len) {
+        perror("write span log");
+    }
+}
@@ -0,0 +1,304 @@
+/* store.c */
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+
+#include "jailor.h"
+
+// Layout of the store:
+//   <dir>/objects/<sha256>   one immutable copy per distinct (mode, content)
+//   <dir>/index/<key>        symlink to the object of a source file, keyed by
+//                            device, inode, size and mtime so unchanged sources are not rehashed
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static void sha256_block(Sha256 *ctx, const unsigned char *block);
+static int hash_file(const char *path, mode_t mode, char hex[HASH_HEX_LEN + 1]);
+static void store_add_mount(Store *store, const char *object, const char *dst);
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+void sha256_init(Sha256 *ctx) {
+    static const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+
+    memcpy(ctx->state, initial, sizeof(initial));
+    ctx->length = 0;
+    ctx->used = 0;
+}
+
+static void sha256_block(Sha256 *ctx, const unsigned char *block) {
+    uint32_t w[64];
+    uint32_t a, b, c, d, e, f, g, h;
+
+    for (int i = 0; i < 16; ++i) {
+        w[i] = (uint32_t)block[i * 4] << 24 | (uint32_t)block[i * 4 + 1] << 16 |
+               (uint32_t)block[i * 4 + 2] << 8 | block[i * 4 + 3];
+    }
+    for (int i = 16; i < 64; ++i) {
+        uint32_t s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    a = ctx->state[0]; b = ctx->state[1]; c = ctx->state[2]; d = ctx->state[3];
+    e = ctx->state[4]; f = ctx->state[5]; g = ctx->state[6]; h = ctx->state[7];
+    for (int i = 0; i < 64; ++i) {
+        uint32_t t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        uint32_t t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    ctx->state[0] += a; ctx->state[1] += b; ctx->state[2] += c; ctx->state[3] += d;
+    ctx->state[4] += e; ctx->state[5] += f; ctx->state[6] += g; ctx->state[7] += h;
+}
+
+void sha256_update(Sha256 *ctx, const void *data, size_t len) {
+    const unsigned char *p = data;
+
+    ctx->length += len;
+    while (len > 0) {
+        size_t n = 64 - ctx->used < len ? 64 - ctx->used : len;
+        memcpy(ctx->block + ctx->used, p, n);
+        ctx->used += n;
+        p += n;
+        len -= n;
+        if (ctx->used == 64) {
+            sha256_block(ctx, ctx->block);
+            ctx->used = 0;
+        }
+    }
+}
+
+void sha256_final(Sha256 *ctx, char hex[HASH_HEX_LEN + 1]) {
+    uint64_t bits = ctx->length * 8;
+    unsigned char pad = 0x80;
+    unsigned char zero = 0;
+    unsigned char length[8];
+
+    sha256_update(ctx, &pad, 1);
+    while (ctx->used != 56) {
+        sha256_update(ctx, &zero, 1);
+    }
+    for (int i = 0; i < 8; ++i) {
+        length[i] = (unsigned char)(bits >> (56 - 8 * i));
+    }
+    sha256_update(ctx, length, 8);
+
+    for (int i = 0; i < 8; ++i) {
+        snprintf(hex + i * 8, 9, "%08x", ctx->state[i]);
+    }
+}
+
+// Hash the mode and content of a file, so files that differ only in mode get different objects
+static int hash_file(const char *path, mode_t mode, char hex[HASH_HEX_LEN + 1]) {
+    static const size_t buffer_size = 1024 * 1024;
+    char *buffer = malloc(buffer_size);
+    uint32_t mode_bits = mode & 07777;
+    Sha256 ctx;
+    ssize_t n;
+    int fd;
+
+    if (buffer == NULL) {
+        return -1;
+    }
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        free(buffer);
+        return -1;
+    }
+
+    sha256_init(&ctx);
+    sha256_update(&ctx, &mode_bits, sizeof(mode_bits));
+    while ((n = read(fd, buffer, buffer_size)) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            close(fd);
+            free(buffer);
+            return -1;
+        }
+        sha256_update(&ctx, buffer, n);
+    }
+    sha256_final(&ctx, hex);
+
+    close(fd);
+    free(buffer);
+    return 0;
+}
+
+void store_init(Store *store) {
+    char path[PATH_MAX];
+
+    pthread_mutex_init(&store->lock, NULL);
+    store->mounts = NULL;
+    store->mount_count = 0;
+    store->mount_capacity = 0;
+    store->files = 0;
+    store->new_objects = 0;
+    store->bytes = 0;
+    store->new_bytes = 0;
+
+    snprintf(path, sizeof(path), "%s/objects", store->dir);
+    create_directory(path);
+    snprintf(path, sizeof(path), "%s/index", store->dir);
+    create_directory(path);
+}
+
+static void store_add_mount(Store *store, const char *object, const char *dst) {
+    pthread_mutex_lock(&store->lock);
+    if (store->mount_count == store->mount_capacity) {
+        int capacity = store->mount_capacity ? store->mount_capacity * 2 : 64;
+        StoreMount *mounts = realloc(store->mounts, sizeof(StoreMount) * capacity);
+        check_error(mounts == NULL ? -1 : 0, "realloc store mounts");
+        store->mounts = mounts;
+        store->mount_capacity = capacity;
+    }
+    snprintf(store->mounts[store->mount_count].object, PATH_MAX, "%s", object);
+    store->mounts[store->mount_count].dst = dst;
+    store->mount_count++;
+    pthread_mutex_unlock(&store->lock);
+}
+
+// Function to put a file into the rootfs from the store, adding it to the store first if needed.
+// The file is bind-mounted read-only, or hardlinked if store_link is "hardlink" and the link
+// stays on the store's filesystem.
+void store_install(Store *store, CopyJob *job, CopyStats *stats) {
+    char index_path[PATH_MAX];
+    char object_path[PATH_MAX + HASH_HEX_LEN];
+    char tmp_path[PATH_MAX];
+    char hash[HASH_HEX_LEN + 1];
+    char dest_dir[PATH_MAX];
+    char *last_slash;
+    struct stat src_stat;
+    struct stat st;
+    ssize_t n;
+    int reused = 1;
+    int fd;
+
+    if (stat(job->src, &src_stat) == -1) {
+        fprintf(stderr, "Error opening source file '%s': %s\n", job->src, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    // Known source file: the index gives the object without reading the file
+    snprintf(index_path, sizeof(index_path), "%s/index/%lx-%lx-%llx-%lld.%09ld", store->dir,
+             (unsigned long)src_stat.st_dev, (unsigned long)src_stat.st_ino,
+             (unsigned long long)src_stat.st_size, (long long)src_stat.st_mtim.tv_sec, src_stat.st_mtim.tv_nsec);
+    n = readlink(index_path, hash, HASH_HEX_LEN);
+    if (n == HASH_HEX_LEN) {
+        hash[HASH_HEX_LEN] = '\0';
+    } else if (hash_file(job->src, src_stat.st_mode, hash) == -1) {
+        fprintf(stderr, "Error hashing '%s': %s\n", job->src, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    snprintf(object_path, sizeof(object_path), "%s/objects/%s", store->dir, hash);
+
+    if (stat(object_path, &st) == -1) {
+        // New content: copy it in under a private name, then publish it atomically
+        snprintf(tmp_path, sizeof(tmp_path), "%s/objects/.tmp-%d-%ld", store->dir, getpid(), syscall(SYS_gettid));
+        unlink(tmp_path);
+        copy_file(job->src, tmp_path, stats);
+        check_error(chmod(tmp_path, src_stat.st_mode & 0555), "chmod store object");
+        check_error(rename(tmp_path, object_path), "rename store object");
+        reused = 0;
+    }
+    if (n != HASH_HEX_LEN) {
+        // Another jailor may have indexed it concurrently, which is fine
+        if (symlink(hash, index_path) == -1 && errno != EEXIST) {
+            perror("symlink store index");
+        }
+    }
+
+    pthread_mutex_lock(&store->lock);
+    store->files++;
+    store->bytes += src_stat.st_size;
+    if (!reused) {
+        store->new_objects++;
+        store->new_bytes += src_stat.st_size;
+    }
+    pthread_mutex_unlock(&store->lock);
+
+    if (lstat(job->dest, &st) == 0) {
+        pthread_mutex_lock(&stats->lock);
+        stats->skipped++;
+        pthread_mutex_unlock(&stats->lock);
+        return;
+    }
+
+    snprintf(dest_dir, sizeof(dest_dir), "%s", job->dest);
+    last_slash = strrchr(dest_dir, '/');
+    if (last_slash != NULL) {
+        *last_slash = '\0';
+        create_directory(dest_dir);
+    }
+
+    // A lower layer is never written through, so it may hold the store's own inodes. Later
+    // sandboxes mount it too, so its files cannot depend on this one's bind mounts.
+    if (store->in_layer) {
+        if (link(object_path, job->dest) == -1) {
+            copy_file(object_path, job->dest, stats);
+        }
+        return;
+    }
+
+    if (!store->use_bind && link(object_path, job->dest) == 0) {
+        return;
+    }
+    if (!store->use_bind && errno != EXDEV && errno != EPERM) {
+        fprintf(stderr, "Error linking '%s' to '%s': %s\n", object_path, job->dest, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    // Empty placeholder; the object is bind-mounted over it inside the sandbox mount namespace
+    fd = open(job->dest, O_WRONLY | O_CREAT | O_CLOEXEC, src_stat.st_mode & 07777);
+    check_error(fd, "create store mount point");
+    close(fd);
+    store_add_mount(store, object_path, job->dst);
+}
+
+// Function to print how much the store shares between sandboxes. The reused bytes are file
+// content this rootfs did not copy; the page cache it saves depends on what the sandbox maps.
+void store_report(Store *store) {
+    unsigned long long reused = store->bytes - store->new_bytes;
+
+    printf("store: %d files, %d new objects, %d bind mounts\n", store->files, store->new_objects, store->mount_count);
+    if (store->new_bytes > 0) {
+        printf("store: dedup ratio %.2f\n", (double)store->bytes / store->new_bytes);
+    } else {
+        printf("store: dedup ratio n/a, every file was already in the store\n");
+    }
+    printf("store: %llu KB of file content reused from the store instead of copied\n", reused / 1024);
+}
+
+// Function to bind-mount store objects read-only into the rootfs.
+// Runs in the sandbox mount namespace, after root_dir has been bound onto itself.
+void store_mount_objects(Store *store, const char *root_dir) {
+    char target[PATH_MAX];
+
+    for (int i = 0; i < store->mount_count; ++i) {
+        snprintf(target, sizeof(target), "%s%s", root_dir, store->mounts[i].dst);
+        check_error(mount(store->mounts[i].object, target, NULL, MS_BIND, NULL), "bind-mount store object");
+        check_error(mount(NULL, target, NULL, MS_BIND | MS_REMOUNT | MS_RDONLY, NULL), "remount store object read-only");
+    }
+}
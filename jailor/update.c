@@ -0,0 +1,160 @@
+/* update.c */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <libconfig.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/limits.h>
+
+#include "jailor.h"
+
+// A delta, as written by configer --diff, names what changed between the full config
+// a persistent rootfs was last built or updated from and the current one:
+//   root_dir                    the rootfs to update
+//   directories, file_copies,
+//   symlinks                    entries to add or replace
+//   removed_files, removed_symlinks,
+//   removed_directories         paths to delete, directories children first
+// Files and symlinks are written under a temporary name and renamed over the old ones,
+// so a process running in the rootfs sees either version but never a partial file, and
+// a binary that is being executed is replaced instead of failing with ETXTBSY.
+
+#define UPDATE_SUFFIX ".jailor-update"
+
+static int remove_paths(const char *root_dir, config_setting_t *setting, int directories);
+static void replace_files(SandboxContext *ctx);
+static void replace_symlinks(SandboxContext *ctx);
+
+// Function to delete every path of a removed_* list below root_dir. Paths already gone
+// are fine, and a directory that still holds files the config does not know about is kept.
+static int remove_paths(const char *root_dir, config_setting_t *setting, int directories) {
+    int count = setting != NULL ? config_setting_length(setting) : 0;
+    int removed = 0;
+
+    for (int i = 0; i < count; ++i) {
+        const char *path = config_setting_get_string_elem(setting, i);
+        char host_path[PATH_MAX];
+        int ret;
+
+        if (path == NULL)
+            continue;
+
+        snprintf(host_path, sizeof(host_path), "%s%s", root_dir, path);
+        ret = directories ? rmdir(host_path) : unlink(host_path);
+        if (ret == 0) {
+            removed++;
+        } else if (errno != ENOENT && errno != ENOTEMPTY && errno != EEXIST) {
+            fprintf(stderr, "Error removing '%s': %s\n", host_path, strerror(errno));
+        }
+    }
+    return removed;
+}
+
+// Function to copy the changed files next to their targets, then rename them into place
+static void replace_files(SandboxContext *ctx) {
+    int count = rootfs_file_copy_count(ctx);
+    CopyStats stats;
+    CopyJob *jobs;
+    int job_count = 0;
+
+    if (count == 0)
+        return;
+
+    jobs = malloc(sizeof(CopyJob) * count);
+    check_error(jobs == NULL ? -1 : 0, "malloc copy jobs");
+
+    for (int i = 0; i < count; ++i) {
+        const char *src, *dst;
+
+        if (rootfs_file_copy(ctx, i, &src, &dst) != 0)
+            continue;
+
+        jobs[job_count].src = src;
+        jobs[job_count].dst = dst;
+        snprintf(jobs[job_count].dest, sizeof(jobs[job_count].dest), "%s%s" UPDATE_SUFFIX, ctx->image_dir, dst);
+        // copy_file() skips existing files, so drop what an interrupted update left behind
+        unlink(jobs[job_count].dest);
+        job_count++;
+    }
+
+    copy_stats_init(&stats);
+    copy_engine_run(jobs, job_count, ctx->copy_workers, &stats, NULL);
+    copy_stats_print(&stats);
+
+    for (int i = 0; i < job_count; ++i) {
+        char target[PATH_MAX];
+
+        snprintf(target, sizeof(target), "%s%s", ctx->image_dir, jobs[i].dst);
+        check_error(rename(jobs[i].dest, target), "rename updated file");
+    }
+    free(jobs);
+}
+
+// Function to point the changed symlinks at their new targets
+static void replace_symlinks(SandboxContext *ctx) {
+    int count = rootfs_symlink_count(ctx);
+
+    for (int i = 0; i < count; ++i) {
+        const char *sym, *dst;
+        char target[PATH_MAX];
+        char tmp[PATH_MAX + sizeof(UPDATE_SUFFIX)];
+
+        if (rootfs_symlink(ctx, i, &sym, &dst) != 0)
+            continue;
+
+        snprintf(target, sizeof(target), "%s%s", ctx->image_dir, sym);
+        snprintf(tmp, sizeof(tmp), "%s" UPDATE_SUFFIX, target);
+        unlink(tmp);
+        check_error(symlink(dst, tmp), "symlink updated link");
+        check_error(rename(tmp, target), "rename updated link");
+    }
+}
+
+// Function to bring the rootfs named by a delta up to date in place, touching only
+// what changed instead of rebuilding it
+int update_rootfs(const char *delta_path) {
+    SandboxContext ctx;
+    Span span;
+    int removed_files, removed_dirs;
+
+    // Only the rootfs sections are read; updated files are always copied, never linked from a store
+    memset(&ctx, 0, sizeof(ctx));
+    config_init(&(ctx.cfg));
+    if (!config_read_file(&(ctx.cfg), delta_path)) {
+        fprintf(stderr, "%s:%d - %s\n", delta_path, config_error_line(&(ctx.cfg)),
+                config_error_text(&(ctx.cfg)));
+        config_destroy(&(ctx.cfg));
+        return -1;
+    }
+    if (!config_lookup_string(&(ctx.cfg), "root_dir", &(ctx.root_dir))) {
+        fprintf(stderr, "Error: No 'root_dir' setting in delta file.\n");
+        config_destroy(&(ctx.cfg));
+        return -1;
+    }
+    ctx.image_dir = ctx.root_dir;
+    ctx.directory_setting = config_lookup(&(ctx.cfg), "directories");
+    ctx.file_copy_setting = config_lookup(&(ctx.cfg), "file_copies");
+    ctx.symlink_setting = config_lookup(&(ctx.cfg), "symlinks");
+    ctx.copy_workers = DEFAULT_COPY_WORKERS;
+    ctx.park_fd = -1;
+
+    span_begin(&span, "update_rootfs");
+    removed_files = remove_paths(ctx.root_dir, config_lookup(&(ctx.cfg), "removed_symlinks"), 0);
+    removed_files += remove_paths(ctx.root_dir, config_lookup(&(ctx.cfg), "removed_files"), 0);
+    create_directory(ctx.root_dir);
+    create_directories(&ctx);
+    replace_files(&ctx);
+    replace_symlinks(&ctx);
+    removed_dirs = remove_paths(ctx.root_dir, config_lookup(&(ctx.cfg), "removed_directories"), 1);
+    span_end(&span, ctx.sandbox_id);
+
+    printf("update: %d directories, %d files, %d symlinks written; %d files and symlinks, %d directories removed\n",
+           rootfs_directory_count(&ctx), rootfs_file_copy_count(&ctx), rootfs_symlink_count(&ctx),
+           removed_files, removed_dirs);
+
+    config_destroy(&(ctx.cfg));
+    return 0;
+}
@@ -0,0 +1,785 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <endian.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "../jailor/jailor.h"
+#include "migrate.h"
+
+// Live migration of a sandbox between two sdeamons, driven over the destination's request port:
+//
+//   source                                          destination
+//   "receive <id>\n"                   ---------->  checks base_config_<id>.cfg and the port
+//                                      <----------  "ready\n"
+//   pre-dump 1, sandbox keeps running  ---------->  images of round 1
+//   pre-dump n, dirty pages only       ---------->  images of round n
+//   dump: sandbox frozen, then killed  ---------->  images of "final", end frame
+//                                                   rootfs from the same base config, criu restore
+//                                      <----------  "success: ..." once the sandbox runs again
+//
+// Every round is a CRIU images directory whose parent is the round before it, so each one
+// only holds the pages dirtied since. Pre-dumping stops once a round gets small or stops
+// shrinking; the downtime is then the final dump of what is left plus the restore.
+//
+// Post-copy replaces the final stop-and-copy of memory: the final dump leaves the pages
+// out and serves them from a page server on MIGRATE_PAGE_PORT_BASE + id, the destination
+// restores at once and its `criu lazy-pages` daemon fetches each page when the sandbox
+// faults on it, prefetching the rest in the background:
+//
+//   dump --lazy-pages: frozen, no memory --->  images of "final", lazy frame with the port
+//                                              criu lazy-pages, criu restore --lazy-pages
+//                                    <------   "success: ..." once the sandbox runs again
+//   page server                      <------>  page relay <---> criu lazy-pages
+//                                    <------   "postcopy: <faults and latency>" once all pages are in
+//
+// The relay sits on the destination between lazy-pages and the page server, so it sees
+// each request: one-page requests are demand faults of the sandbox, larger ones prefetch.
+// Both go to the span log as postcopy_fault and postcopy_prefetch, which `stats` reports.
+
+#define MIGRATE_MAX_ROUNDS 8
+#define MIGRATE_CONVERGED_BYTES (4ULL << 20)  // Pages of a round below which pre-dumping stops
+#define MIGRATE_FRAME_FILE 1
+#define MIGRATE_FRAME_END 2
+#define MIGRATE_FRAME_LAZY 3    // End of a post-copy stream; size is the page server port
+#define MIGRATE_FRAME_LINK 4    // Symlink, e.g. the "parent" of a round; the target follows
+#define MIGRATE_PAGE_PORT_BASE 7000
+#define MIGRATE_NAME_MAX 512
+
+// Header of each file in the image stream, in network byte order; the name and content follow
+struct MigrateFrame {
+    uint32_t kind;
+    uint32_t name_len;
+    uint64_t size;
+};
+
+// Header of CRIU's page server protocol, in host byte order. Replies to PS_IOV_GET reuse
+// it as PS_IOV_ADD_F followed by nr_pages pages; flushes are answered with a 32-bit status.
+struct PageServerIov {
+    uint32_t cmd;
+    uint32_t nr_pages;
+    uint64_t vaddr;
+    uint64_t dst_id;
+};
+
+#define PS_IOV_ADD_F 6
+#define PS_IOV_GET 7
+#define PS_IOV_FLUSH 0x1023
+#define PS_IOV_FLUSH_N_CLOSE 0x1024
+#define PS_CMD_MASK 0xffff
+
+// A page server request the relay waits for the answer of
+struct PageRequest {
+    uint32_t cmd;
+    uint32_t nr_pages;
+    unsigned long long sent_ns;
+    Span span;
+};
+
+// State of the page relay of one post-copy restore
+struct PostcopyRelay {
+    int listen_fd;                 // lazy-pages connects here
+    int migration_fd;              // The summary goes back to the source here
+    char source[INET6_ADDRSTRLEN];
+    int port;                      // Page server on the source
+    int sandbox_id;
+};
+
+static pid_t sandbox_init_pid(pid_t jailor_pid);
+static int connect_dest(const char *dest, int dest_port);
+static int write_full(int fd, const void *buf, size_t len);
+static int read_line(int fd, char *buf, size_t size);
+static int send_frame(int fd, uint32_t kind, const char *name, uint64_t size);
+static int send_round(int fd, const char *base, const char *round, unsigned long long *bytes,
+                      unsigned long long *pages);
+static int criu_round(CriuSession *criu, int type, const char *base, const char *round, const char *parent,
+                      pid_t pid, int page_port, struct MigrateReport *report);
+static void remove_tree(const char *path);
+static int read_reply(int fd, char *line, size_t size, struct MigrateReport *report);
+static int compare_ns(const void *a, const void *b);
+static void relay_summary(struct PostcopyRelay *relay, unsigned long long *faults, size_t fault_count,
+                          int prefetches, unsigned long long pages, unsigned long long start_ns);
+static void *postcopy_relay(void *arg);
+
+// The sandbox init is the only child of its jailor child
+static pid_t sandbox_init_pid(pid_t jailor_pid) {
+    char path[64];
+    FILE *fp;
+    int pid = -1;
+
+    snprintf(path, sizeof(path), "/proc/%d/task/%d/children", (int)jailor_pid, (int)jailor_pid);
+    fp = fopen(path, "r");
+    if (fp == NULL) {
+        return -1;
+    }
+    if (fscanf(fp, "%d", &pid) != 1) {
+        pid = -1;
+    }
+    fclose(fp);
+    return pid;
+}
+
+// Connect to "<host>[:<port>]"; an address with more than one colon is IPv6 without a port
+static int connect_dest(const char *dest, int dest_port) {
+    char host[256];
+    char port[16];
+    const char *colon = strchr(dest, ':') == strrchr(dest, ':') ? strchr(dest, ':') : NULL;
+    struct addrinfo hints, *res, *ai;
+    int fd = -1;
+
+    if (colon != NULL) {
+        snprintf(host, sizeof(host), "%.*s", (int)(colon - dest), dest);
+        snprintf(port, sizeof(port), "%s", colon + 1);
+    } else {
+        snprintf(host, sizeof(host), "%s", dest);
+        snprintf(port, sizeof(port), "%d", dest_port);
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &res) != 0) {
+        errno = EHOSTUNREACH;
+        return -1;
+    }
+    for (ai = res; ai != NULL; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd == -1) continue;
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+static int write_full(int fd, const void *buf, size_t len) {
+    size_t done = 0;
+
+    while (done < len) {
+        ssize_t n = send(fd, (const char *)buf + done, len - done, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        done += n;
+    }
+    return 0;
+}
+
+// Read one response line, without the newline; byte by byte so nothing after it is consumed
+static int read_line(int fd, char *buf, size_t size) {
+    size_t len = 0;
+    char c;
+
+    while (len + 1 < size) {
+        ssize_t n = read(fd, &c, 1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        if (c == '\n') {
+            buf[len] = '\0';
+            return 0;
+        }
+        buf[len++] = c;
+    }
+    buf[len] = '\0';
+    return len > 0 ? 0 : -1;
+}
+
+static int send_frame(int fd, uint32_t kind, const char *name, uint64_t size) {
+    struct MigrateFrame frame;
+
+    frame.kind = htonl(kind);
+    frame.name_len = htonl(strlen(name));
+    frame.size = htobe64(size);
+    if (write_full(fd, &frame, sizeof(frame)) == -1) return -1;
+    return write_full(fd, name, strlen(name));
+}
+
+// Send every image of one round as "<round>/<file>"; pages counts the memory pages in it.
+// Its "parent" symlink goes along: pages the round left unchanged are only found through it.
+static int send_round(int fd, const char *base, const char *round, unsigned long long *bytes,
+                      unsigned long long *pages) {
+    char dir_path[PATH_MAX];
+    DIR *dir;
+    struct dirent *entry;
+    int ret = 0;
+
+    *pages = 0;
+    snprintf(dir_path, sizeof(dir_path), "%s/%s", base, round);
+    dir = opendir(dir_path);
+    if (dir == NULL) {
+        return -1;
+    }
+
+    while (ret == 0 && (entry = readdir(dir)) != NULL) {
+        char name[MIGRATE_NAME_MAX];
+        struct stat st;
+        int file_fd;
+
+        if (fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+            continue;
+        }
+        snprintf(name, sizeof(name), "%s/%s", round, entry->d_name);
+        if (S_ISLNK(st.st_mode)) {
+            char target[MIGRATE_NAME_MAX];
+            ssize_t len = readlinkat(dirfd(dir), entry->d_name, target, sizeof(target) - 1);
+
+            if (len <= 0 || len == (ssize_t)sizeof(target) - 1) {
+                ret = -1;
+                break;
+            }
+            ret = send_frame(fd, MIGRATE_FRAME_LINK, name, len);
+            if (ret == 0) ret = write_full(fd, target, len);
+            continue;
+        }
+        if (!S_ISREG(st.st_mode)) {
+            continue;
+        }
+        file_fd = openat(dirfd(dir), entry->d_name, O_RDONLY | O_CLOEXEC);
+        if (file_fd == -1) {
+            ret = -1;
+            break;
+        }
+
+        ret = send_frame(fd, MIGRATE_FRAME_FILE, name, st.st_size);
+        for (off_t offset = 0; ret == 0 && offset < st.st_size; ) {
+            ssize_t n = sendfile(fd, file_fd, &offset, st.st_size - offset);
+            if (n <= 0) ret = -1;
+        }
+        close(file_fd);
+
+        *bytes += st.st_size;
+        if (strncmp(entry->d_name, "pages-", 6) == 0) {
+            *pages += st.st_size;
+        }
+    }
+    closedir(dir);
+    return ret;
+}
+
+// Run one pre-dump or the final dump into base/round. With a page_port the final dump is
+// lazy: this returns once its images are written and the page server is up, and the
+// caller collects the response with criu_response() when all pages were served.
+static int criu_round(CriuSession *criu, int type, const char *base, const char *round, const char *parent,
+                      pid_t pid, int page_port, struct MigrateReport *report) {
+    char dir_path[PATH_MAX];
+    char parent_img[64];
+    CriuOpts opts;
+    CriuResult result;
+    int status_pipe[2] = { -1, -1 };
+    int dir_fd, ret;
+
+    snprintf(dir_path, sizeof(dir_path), "%s/%s", base, round);
+    if (mkdir(dir_path, 0700) == -1 || (dir_fd = open(dir_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1) {
+        snprintf(report->error, sizeof(report->error), "%s: %s", dir_path, strerror(errno));
+        return -1;
+    }
+
+    memset(&opts, 0, sizeof(opts));
+    opts.images_dir_fd = dir_fd;
+    opts.pid = pid;
+    opts.track_mem = 1;
+    opts.log_file = type == CRIU_PRE_DUMP ? "pre-dump.log" : "dump.log";
+    if (parent != NULL) {
+        snprintf(parent_img, sizeof(parent_img), "../%s", parent);
+        opts.parent_img = parent_img;
+    }
+
+    if (page_port > 0) {
+        if (pipe2(status_pipe, O_CLOEXEC) == -1) {
+            snprintf(report->error, sizeof(report->error), "pipe2: %s", strerror(errno));
+            close(dir_fd);
+            return -1;
+        }
+        opts.lazy_pages = 1;
+        opts.page_server_port = page_port;
+        opts.status_fd = status_pipe[1];
+        if (criu_request(criu, type, &opts) == 0 && criu_wait_ready(status_pipe[0]) == 0) {
+            close(status_pipe[0]);
+            close(status_pipe[1]);
+            close(dir_fd);
+            return 0;
+        }
+        close(status_pipe[0]);
+        close(status_pipe[1]);
+        // The dump failed before its page server came up; the response says why
+        ret = criu_response(criu, &result);
+        result.success = 0;
+    } else {
+        ret = criu_call(criu, type, &opts, &result);
+    }
+    close(dir_fd);
+    if (ret == -1 || !result.success) {
+        snprintf(report->error, sizeof(report->error), "%s", result.errmsg);
+        return -1;
+    }
+    return 0;
+}
+
+static void remove_tree(const char *path) {
+    char cmd[PATH_MAX + 16];
+
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", path);
+    if (system(cmd) != 0) {
+        fprintf(stderr, "sdeamon: could not remove %s\n", path);
+    }
+}
+
+// Read the destination's answer to the final dump. Its post-copy summary may overtake it,
+// since sdeamon answers while the relay in its jailor child reports.
+static int read_reply(int fd, char *line, size_t size, struct MigrateReport *report) {
+    while (read_line(fd, line, size) == 0) {
+        if (strncmp(line, "postcopy: ", 10) != 0) {
+            return 0;
+        }
+        snprintf(report->postcopy_stats, sizeof(report->postcopy_stats), "%s", line + 10);
+    }
+    return -1;
+}
+
+// Describe a migration for the client; the caller checked it succeeded
+void migrate_report_format(const struct MigrateReport *report, char *buf, size_t size) {
+    int len = snprintf(buf, size, "%s, %d pre-dump rounds, %llu bytes of images sent, downtime %.3f ms",
+                       report->postcopy ? "post-copy" : "pre-copy", report->rounds, report->bytes,
+                       report->downtime_ns / 1e6);
+
+    if (report->postcopy && len > 0 && (size_t)len < size) {
+        snprintf(buf + len, size - len, ", pages served for %.3f ms: %s", report->postcopy_ns / 1e6,
+                 report->postcopy_stats[0] ? report->postcopy_stats : "no summary from the destination");
+    }
+}
+
+// Move the sandbox of jailor_pid to the sdeamon at dest. Blocks until the destination
+// answered, so it runs in a child of sdeamon. On success the sandbox was killed by the
+// final dump and only its jailor child is left to exit. In post-copy mode, or in auto mode
+// when pre-copy does not converge, it returns once the destination has all pages.
+int migrate_sandbox(const char *program_id, pid_t jailor_pid, const char *dest, int dest_port,
+                    enum MigrateMode mode, struct MigrateReport *report) {
+    char base[PATH_MAX];
+    char line[512];
+    char round[16], parent[16];
+    CriuSession criu;
+    unsigned long long pages, last_pages = 0;
+    unsigned long long freeze_ns, restored_ns;
+    CriuResult result;
+    int converged = 0;
+    int page_port = 0;
+    pid_t pid;
+    int fd;
+    int ret = -1;
+
+    memset(report, 0, sizeof(*report));
+    criu.sock = -1;
+    criu.pid = -1;
+
+    pid = sandbox_init_pid(jailor_pid);
+    if (pid <= 0) {
+        snprintf(report->error, sizeof(report->error), "no sandbox process under jailor %d", (int)jailor_pid);
+        return -1;
+    }
+
+    // The destination checks the base config and port before anything is dumped
+    fd = connect_dest(dest, dest_port);
+    if (fd == -1) {
+        snprintf(report->error, sizeof(report->error), "connect to %s: %s", dest, strerror(errno));
+        return -1;
+    }
+    snprintf(line, sizeof(line), "receive %s\n", program_id);
+    if (write_full(fd, line, strlen(line)) == -1 || read_line(fd, line, sizeof(line)) == -1) {
+        snprintf(report->error, sizeof(report->error), "%s closed the connection", dest);
+        close(fd);
+        return -1;
+    }
+    if (strcmp(line, "ready") != 0) {
+        snprintf(report->error, sizeof(report->error), "%s: %s", dest, line);
+        close(fd);
+        return -1;
+    }
+
+    snprintf(base, sizeof(base), MIGRATE_DIR "/out_%s", program_id);
+    remove_tree(base);
+    create_directory(base);
+
+    if (criu_start(&criu) == -1) {
+        snprintf(report->error, sizeof(report->error), "criu swrk: %s", strerror(errno));
+        goto out;
+    }
+
+    // Pre-copy: each round writes what changed since the last one while the sandbox keeps running
+    parent[0] = '\0';
+    while (mode != MIGRATE_POSTCOPY && report->rounds < MIGRATE_MAX_ROUNDS) {
+        snprintf(round, sizeof(round), "%d", report->rounds + 1);
+        if (criu_round(&criu, CRIU_PRE_DUMP, base, round, parent[0] ? parent : NULL, pid, 0, report) == -1) {
+            goto out;
+        }
+        if (send_round(fd, base, round, &report->bytes, &pages) == -1) {
+            snprintf(report->error, sizeof(report->error), "sending images to %s failed", dest);
+            goto out;
+        }
+        report->rounds++;
+        snprintf(parent, sizeof(parent), "%s", round);
+        printf("sdeamon: migrate program%s: pre-dump %d wrote %llu bytes of pages\n",
+               program_id, report->rounds, pages);
+
+        // Converged, or dirtying pages about as fast as they are copied; the first round has
+        // nothing to compare with
+        converged = pages < MIGRATE_CONVERGED_BYTES;
+        if (converged || (report->rounds > 1 && pages * 10 > last_pages * 9)) {
+            break;
+        }
+        last_pages = pages;
+    }
+
+    // A sandbox that dirties memory faster than it can be copied would stay frozen for the
+    // whole rest in a stop-and-copy, so auto hands that part to post-copy
+    report->postcopy = mode == MIGRATE_POSTCOPY || (mode == MIGRATE_AUTO && !converged);
+    if (report->postcopy) {
+        page_port = MIGRATE_PAGE_PORT_BASE + atoi(program_id);
+    }
+
+    // From here on the sandbox is frozen
+    freeze_ns = monotonic_nsec();
+    if (criu_round(&criu, CRIU_DUMP, base, "final", parent[0] ? parent : NULL, pid, page_port, report) == -1) {
+        goto out;
+    }
+    report->dumped = 1;
+    if (send_round(fd, base, "final", &report->bytes, &pages) == -1 ||
+        send_frame(fd, report->postcopy ? MIGRATE_FRAME_LAZY : MIGRATE_FRAME_END, "final", page_port) == -1) {
+        snprintf(report->error, sizeof(report->error), "sending images to %s failed", dest);
+        goto out;
+    }
+
+    if (read_reply(fd, line, sizeof(line), report) == -1) {
+        snprintf(report->error, sizeof(report->error), "%s closed the connection during restore", dest);
+        goto out;
+    }
+    if (strncmp(line, "success", 7) != 0) {
+        snprintf(report->error, sizeof(report->error), "%s: %s", dest, line);
+        goto out;
+    }
+    restored_ns = monotonic_nsec();
+    report->downtime_ns = restored_ns - freeze_ns;
+
+    // Post-copy: the sandbox runs at the destination and faults its memory in from here
+    if (report->postcopy) {
+        if (criu_response(&criu, &result) == -1 || !result.success) {
+            snprintf(report->error, sizeof(report->error), "page server: %s", result.errmsg);
+            goto out;
+        }
+        report->postcopy_ns = monotonic_nsec() - restored_ns;
+        if (report->postcopy_stats[0] == '\0' && read_line(fd, line, sizeof(line)) == 0 &&
+            strncmp(line, "postcopy: ", 10) == 0) {
+            snprintf(report->postcopy_stats, sizeof(report->postcopy_stats), "%s", line + 10);
+        }
+    }
+    ret = 0;
+
+out:
+    criu_stop(&criu);
+    close(fd);
+    remove_tree(base);
+    return ret;
+}
+
+// Receive the image stream of a migration into MIGRATE_DIR/in_<program_id>. images_dir gets
+// the directory of the final dump, the one to restore from, and page_port the page server
+// of a post-copy migration, 0 if the images hold all memory.
+int receive_images(int fd, const char *program_id, char *images_dir, size_t size, int *page_port) {
+    char base[PATH_MAX];
+    char name[MIGRATE_NAME_MAX];
+    static char buf[1 << 16];
+
+    snprintf(base, sizeof(base), MIGRATE_DIR "/in_%s", program_id);
+    remove_tree(base);
+    create_directory(base);
+
+    if (write_full(fd, "ready\n", 6) == -1) {
+        return -1;
+    }
+
+    while (1) {
+        struct MigrateFrame frame;
+        char path[PATH_MAX + MIGRATE_NAME_MAX];
+        char *slash;
+        uint64_t left;
+        uint32_t name_len;
+        int file_fd;
+
+        if (read_full(fd, &frame, sizeof(frame)) == -1) {
+            fprintf(stderr, "sdeamon: image stream of program%s ended early\n", program_id);
+            return -1;
+        }
+        name_len = ntohl(frame.name_len);
+        left = be64toh(frame.size);
+        if (name_len == 0 || name_len >= sizeof(name) || read_full(fd, name, name_len) == -1) {
+            return -1;
+        }
+        name[name_len] = '\0';
+        // Names are "<round>/<file>" and must stay below base
+        if (name[0] == '/' || strstr(name, "..") != NULL) {
+            fprintf(stderr, "sdeamon: bad image name %s\n", name);
+            return -1;
+        }
+
+        snprintf(path, sizeof(path), "%s/%s", base, name);
+        if (ntohl(frame.kind) == MIGRATE_FRAME_END || ntohl(frame.kind) == MIGRATE_FRAME_LAZY) {
+            snprintf(images_dir, size, "%s", path);
+            *page_port = ntohl(frame.kind) == MIGRATE_FRAME_LAZY ? (int)left : 0;
+            return 0;
+        }
+
+        slash = strrchr(path, '/');
+        *slash = '\0';
+        if (mkdir(path, 0700) == -1 && errno != EEXIST) {
+            perror(path);
+            return -1;
+        }
+        *slash = '/';
+
+        // Only links from one round to another, as CRIU makes for parent_img
+        if (ntohl(frame.kind) == MIGRATE_FRAME_LINK) {
+            char target[MIGRATE_NAME_MAX];
+
+            if (left < 4 || left >= sizeof(target) || read_full(fd, target, left) == -1) {
+                return -1;
+            }
+            target[left] = '\0';
+            if (strncmp(target, "../", 3) != 0 || strchr(target + 3, '/') != NULL ||
+                strcmp(target + 3, ".") == 0 || strcmp(target + 3, "..") == 0) {
+                fprintf(stderr, "sdeamon: bad image link %s -> %s\n", name, target);
+                return -1;
+            }
+            if (symlinkat(target, AT_FDCWD, path) == -1) {
+                perror(path);
+                return -1;
+            }
+            continue;
+        }
+
+        file_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (file_fd == -1) {
+            perror(path);
+            return -1;
+        }
+        while (left > 0) {
+            size_t chunk = left < sizeof(buf) ? left : sizeof(buf);
+
+            if (read_full(fd, buf, chunk) == -1 || write(file_fd, buf, chunk) != (ssize_t)chunk) {
+                close(file_fd);
+                return -1;
+            }
+            left -= chunk;
+        }
+        close(file_fd);
+    }
+}
+
+static int compare_ns(const void *a, const void *b) {
+    unsigned long long x = *(const unsigned long long *)a;
+    unsigned long long y = *(const unsigned long long *)b;
+    return (x > y) - (x < y);
+}
+
+// Send the fault counts and latencies of a finished post-copy to the source
+static void relay_summary(struct PostcopyRelay *relay, unsigned long long *faults, size_t fault_count,
+                          int prefetches, unsigned long long pages, unsigned long long start_ns) {
+    char line[512];
+    double p50 = 0, p99 = 0, max = 0;
+
+    if (fault_count > 0) {
+        qsort(faults, fault_count, sizeof(unsigned long long), compare_ns);
+        p50 = faults[(fault_count * 50 + 99) / 100 - 1] / 1e6;
+        p99 = faults[(fault_count * 99 + 99) / 100 - 1] / 1e6;
+        max = faults[fault_count - 1] / 1e6;
+    }
+    snprintf(line, sizeof(line), "postcopy: %zu page faults (p50 %.3f ms, p99 %.3f ms, max %.3f ms), "
+             "%d prefetch requests, %llu pages in %.3f ms\n",
+             fault_count, p50, p99, max, prefetches, pages, (monotonic_nsec() - start_ns) / 1e6);
+    printf("sdeamon: program%d %s", relay->sandbox_id, line);
+    if (write_full(relay->migration_fd, line, strlen(line)) == -1) {
+        fprintf(stderr, "sdeamon: post-copy summary not sent: %s\n", strerror(errno));
+    }
+}
+
+// Relay between lazy-pages and the page server on the source, timing every request. The
+// server answers in order, so replies are matched to a FIFO of the requests sent.
+static void *postcopy_relay(void *arg) {
+    struct PostcopyRelay *relay = arg;
+    struct PageRequest *queue = NULL;
+    size_t head = 0, tail = 0, capacity = 0;
+    unsigned long long *faults = NULL;
+    size_t fault_count = 0, fault_capacity = 0;
+    unsigned long long pages = 0;
+    unsigned long long start_ns = monotonic_nsec();
+    int prefetches = 0;
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    char *buf = malloc(1 << 16);
+    struct pollfd fds[2];
+    int client, server;
+
+    client = accept4(relay->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    close(relay->listen_fd);
+    server = client == -1 ? -1 : connect_dest(relay->source, relay->port);
+    if (buf == NULL || client == -1 || server == -1) {
+        fprintf(stderr, "sdeamon: page relay for program%d failed to connect\n", relay->sandbox_id);
+        goto out;
+    }
+
+    fds[0].fd = client;
+    fds[0].events = POLLIN;
+    fds[1].fd = server;
+    fds[1].events = POLLIN;
+    while (1) {
+        struct PageServerIov iov;
+        int ready = poll(fds, 2, -1);
+
+        // revents are only meaningful after a successful poll
+        if (ready == -1 && errno == EINTR) continue;
+        if (ready <= 0) break;
+
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            // Every message lazy-pages sends is a bare header
+            if (read_full(client, &iov, sizeof(iov)) == -1 || write_full(server, &iov, sizeof(iov)) == -1) {
+                break;
+            }
+            if ((iov.cmd & PS_CMD_MASK) == PS_IOV_GET || (iov.cmd & PS_CMD_MASK) == PS_IOV_FLUSH ||
+                (iov.cmd & PS_CMD_MASK) == PS_IOV_FLUSH_N_CLOSE) {
+                if (tail == capacity) {
+                    size_t grown_capacity = capacity ? capacity * 2 : 64;
+                    struct PageRequest *grown = realloc(queue, sizeof(struct PageRequest) * grown_capacity);
+                    if (grown == NULL) break;
+                    queue = grown;
+                    capacity = grown_capacity;
+                }
+                queue[tail].cmd = iov.cmd & PS_CMD_MASK;
+                queue[tail].nr_pages = iov.nr_pages;
+                queue[tail].sent_ns = monotonic_nsec();
+                span_begin(&queue[tail].span, iov.nr_pages == 1 ? "postcopy_fault" : "postcopy_prefetch");
+                tail++;
+            }
+        }
+
+        if (fds[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+            struct PageRequest *request;
+            uint32_t status;
+
+            if (head == tail) {
+                break;
+            }
+            request = &queue[head];
+            if (request->cmd != PS_IOV_GET) {
+                if (read_full(server, &status, sizeof(status)) == -1 ||
+                    write_full(client, &status, sizeof(status)) == -1) {
+                    break;
+                }
+            } else {
+                size_t left;
+
+                if (read_full(server, &iov, sizeof(iov)) == -1 || write_full(client, &iov, sizeof(iov)) == -1) {
+                    break;
+                }
+                left = (iov.cmd & PS_CMD_MASK) == PS_IOV_ADD_F ? (size_t)iov.nr_pages * page_size : 0;
+                while (left > 0) {
+                    size_t chunk = left < (1 << 16) ? left : (1 << 16);
+
+                    if (read_full(server, buf, chunk) == -1 || write_full(client, buf, chunk) == -1) {
+                        goto out;
+                    }
+                    left -= chunk;
+                }
+                span_end(&request->span, relay->sandbox_id);
+                pages += iov.nr_pages;
+                if (request->nr_pages == 1) {
+                    if (fault_count == fault_capacity) {
+                        size_t grown_capacity = fault_capacity ? fault_capacity * 2 : 256;
+                        unsigned long long *grown = realloc(faults, sizeof(unsigned long long) * grown_capacity);
+                        if (grown == NULL) break;
+                        faults = grown;
+                        fault_capacity = grown_capacity;
+                    }
+                    faults[fault_count++] = monotonic_nsec() - request->sent_ns;
+                } else {
+                    prefetches++;
+                }
+            }
+            head++;
+            if (head == tail) {
+                head = tail = 0;
+            }
+        }
+    }
+
+out:
+    // lazy-pages exits once every page is in, which ends the post-copy
+    relay_summary(relay, faults, fault_count, prefetches, pages, start_ns);
+    if (client != -1) close(client);
+    if (server != -1) close(server);
+    close(relay->migration_fd);
+    free(queue);
+    free(faults);
+    free(buf);
+    free(relay);
+    return NULL;
+}
+
+// Start the destination side of a post-copy restore from images_dir: the page relay and
+// the `criu lazy-pages` daemon behind it, which must run before the restore. The relay
+// owns migration_fd from here and sends the post-copy summary on it when done.
+int postcopy_start(int migration_fd, const char *program_id, const char *images_dir, int page_port) {
+    struct PostcopyRelay *relay = calloc(1, sizeof(struct PostcopyRelay));
+    struct sockaddr_storage peer;
+    struct sockaddr_in relay_addr;
+    socklen_t len = sizeof(peer);
+    pthread_t thread;
+
+    if (relay == NULL) {
+        return -1;
+    }
+    relay->migration_fd = migration_fd;
+    relay->port = page_port;
+    relay->sandbox_id = atoi(program_id);
+
+    // The page server listens on the host the images came from
+    if (getpeername(migration_fd, (struct sockaddr *)&peer, &len) == -1 ||
+        getnameinfo((struct sockaddr *)&peer, len, relay->source, sizeof(relay->source), NULL, 0, NI_NUMERICHOST) != 0) {
+        free(relay);
+        return -1;
+    }
+
+    memset(&relay_addr, 0, sizeof(relay_addr));
+    relay_addr.sin_family = AF_INET;
+    relay_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    len = sizeof(relay_addr);
+    relay->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (relay->listen_fd == -1 || bind(relay->listen_fd, (struct sockaddr *)&relay_addr, len) == -1 ||
+        listen(relay->listen_fd, 1) == -1 || getsockname(relay->listen_fd, (struct sockaddr *)&relay_addr, &len) == -1) {
+        if (relay->listen_fd != -1) close(relay->listen_fd);
+        free(relay);
+        return -1;
+    }
+
+    if (pthread_create(&thread, NULL, postcopy_relay, relay) != 0) {
+        close(relay->listen_fd);
+        free(relay);
+        return -1;
+    }
+    pthread_detach(thread);
+
+    // The relay owns relay from here on
+    if (criu_lazy_pages(images_dir, "127.0.0.1", ntohs(relay_addr.sin_port)) == -1) {
+        fprintf(stderr, "sdeamon: criu lazy-pages for program%s failed to start\n", program_id);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,34 @@
+#ifndef MIGRATE_H
+#define MIGRATE_H
+
+#include <sys/types.h>
+
+#define MIGRATE_DIR "/run/sdeamon/migrate"  // Checkpoint images of outgoing and incoming migrations
+
+// How the memory of a migrating sandbox is moved
+enum MigrateMode {
+    MIGRATE_PRECOPY,    // Pre-dump while it runs, then stop and copy the rest
+    MIGRATE_POSTCOPY,   // Restore at once, the pages follow on demand and in the background
+    MIGRATE_AUTO        // Pre-copy, finished by post-copy if the dirty rate keeps it from converging
+};
+
+// Outcome of one migration
+struct MigrateReport {
+    int rounds;                       // Pre-dump rounds run while the sandbox kept running
+    unsigned long long bytes;         // Image bytes sent to the destination
+    unsigned long long downtime_ns;   // From the final freeze until the destination runs the sandbox
+    int dumped;                       // The final dump ran, so the sandbox is gone from this host
+    int postcopy;                     // Memory left out of the final dump was served on demand
+    unsigned long long postcopy_ns;   // From the restore until the last page was served
+    char postcopy_stats[256];         // Page faults and their latency, measured at the destination
+    char error[256];
+};
+
+unsigned long long monotonic_nsec(void);  // sdeamon.c
+int migrate_sandbox(const char *program_id, pid_t jailor_pid, const char *dest, int dest_port,
+                    enum MigrateMode mode, struct MigrateReport *report);
+void migrate_report_format(const struct MigrateReport *report, char *buf, size_t size);
+int receive_images(int fd, const char *program_id, char *images_dir, size_t size, int *page_port);
+int postcopy_start(int migration_fd, const char *program_id, const char *images_dir, int page_port);
+
+#endif
@@ -0,0 +1,284 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nf_tables.h>
+
+#include "nat.h"
+
+// sdeamon owns one nftables table, programmed over nfnetlink:
+//
+//   table ip sdeamon {
+//       map dnat_ports { type inet_service : ipv4_addr }
+//       chain prerouting {
+//           type nat hook prerouting priority dstnat
+//           ip daddr <vm_ip> meta l4proto udp dnat to udp dport map @dnat_ports
+//       }
+//   }
+//
+// Starting or stopping a sandbox adds or deletes one map element, so the cost of both and
+// of classifying a packet stays flat however many sandboxes run on the VM.
+
+#define NAT_TABLE "sdeamon"
+#define NAT_MAP "dnat_ports"
+#define NAT_CHAIN "prerouting"
+#define NAT_MAP_ID 1
+#define NFT_TYPE_IPADDR 7         // nft datatype ids, shown by `nft list`
+#define NFT_TYPE_INET_SERVICE 13
+
+static int nat_sock = -1;
+
+static struct nlmsghdr *nft_msg(NlBatch *batch, int type, int flags);
+static void nft_batch_marker(NlBatch *batch, int type);
+static int nl_put_u32(NlBatch *batch, int type, uint32_t value);
+static int nl_put_str(NlBatch *batch, int type, const char *value);
+static void nft_put_data(NlBatch *batch, int type, const void *data, size_t len);
+static size_t nft_expr_begin(NlBatch *batch, const char *name, size_t *data);
+static void nft_expr_end(NlBatch *batch, size_t elem, size_t data);
+static void nft_put_payload(NlBatch *batch, uint32_t base, uint32_t offset, uint32_t len);
+static void nft_put_cmp_eq(NlBatch *batch, const void *value, size_t len);
+static void nft_put_meta(NlBatch *batch, uint32_t key);
+static void nft_put_map_lookup(NlBatch *batch);
+static void nft_put_dnat(NlBatch *batch);
+static int nat_map_element(NlBatch *batch, int type, int flags, int port, const char *sandbox_ip);
+
+// Start an nf_tables message for the ip family in the batch
+static struct nlmsghdr *nft_msg(NlBatch *batch, int type, int flags) {
+    struct nlmsghdr *nlh = nl_batch_msg(batch, (NFNL_SUBSYS_NFTABLES << 8) | type, flags, sizeof(struct nfgenmsg));
+    struct nfgenmsg *nfg;
+
+    if (nlh == NULL) return NULL;
+    nfg = NLMSG_DATA(nlh);
+    nfg->nfgen_family = NFPROTO_IPV4;
+    nfg->version = NFNETLINK_V0;
+    return nlh;
+}
+
+// Batch begin and end markers delimit one transaction; the kernel does not ack them
+static void nft_batch_marker(NlBatch *batch, int type) {
+    struct nlmsghdr *nlh = nl_batch_msg(batch, type, 0, sizeof(struct nfgenmsg));
+    struct nfgenmsg *nfg;
+
+    if (nlh == NULL) return;
+    nlh->nlmsg_flags &= ~NLM_F_ACK;
+    batch->count--;
+    nfg = NLMSG_DATA(nlh);
+    nfg->nfgen_family = AF_UNSPEC;
+    nfg->version = NFNETLINK_V0;
+    nfg->res_id = htons(NFNL_SUBSYS_NFTABLES);
+}
+
+// nf_tables integers are big endian
+static int nl_put_u32(NlBatch *batch, int type, uint32_t value) {
+    uint32_t be = htonl(value);
+    return nl_attr_put(batch, type, &be, sizeof(be));
+}
+
+static int nl_put_str(NlBatch *batch, int type, const char *value) {
+    return nl_attr_put(batch, type, value, strlen(value) + 1);
+}
+
+static void nft_put_data(NlBatch *batch, int type, const void *data, size_t len) {
+    size_t nest = nl_nest_begin(batch, NLA_F_NESTED | type);
+    nl_attr_put(batch, NFTA_DATA_VALUE, data, len);
+    nl_nest_end(batch, nest);
+}
+
+static size_t nft_expr_begin(NlBatch *batch, const char *name, size_t *data) {
+    size_t elem = nl_nest_begin(batch, NLA_F_NESTED | NFTA_LIST_ELEM);
+    nl_put_str(batch, NFTA_EXPR_NAME, name);
+    *data = nl_nest_begin(batch, NLA_F_NESTED | NFTA_EXPR_DATA);
+    return elem;
+}
+
+static void nft_expr_end(NlBatch *batch, size_t elem, size_t data) {
+    nl_nest_end(batch, data);
+    nl_nest_end(batch, elem);
+}
+
+// Load len bytes at offset of a packet header into register 1
+static void nft_put_payload(NlBatch *batch, uint32_t base, uint32_t offset, uint32_t len) {
+    size_t data;
+    size_t elem = nft_expr_begin(batch, "payload", &data);
+
+    nl_put_u32(batch, NFTA_PAYLOAD_DREG, NFT_REG_1);
+    nl_put_u32(batch, NFTA_PAYLOAD_BASE, base);
+    nl_put_u32(batch, NFTA_PAYLOAD_OFFSET, offset);
+    nl_put_u32(batch, NFTA_PAYLOAD_LEN, len);
+    nft_expr_end(batch, elem, data);
+}
+
+// Stop evaluating the rule unless register 1 holds value
+static void nft_put_cmp_eq(NlBatch *batch, const void *value, size_t len) {
+    size_t data;
+    size_t elem = nft_expr_begin(batch, "cmp", &data);
+
+    nl_put_u32(batch, NFTA_CMP_SREG, NFT_REG_1);
+    nl_put_u32(batch, NFTA_CMP_OP, NFT_CMP_EQ);
+    nft_put_data(batch, NFTA_CMP_DATA, value, len);
+    nft_expr_end(batch, elem, data);
+}
+
+static void nft_put_meta(NlBatch *batch, uint32_t key) {
+    size_t data;
+    size_t elem = nft_expr_begin(batch, "meta", &data);
+
+    nl_put_u32(batch, NFTA_META_KEY, key);
+    nl_put_u32(batch, NFTA_META_DREG, NFT_REG_1);
+    nft_expr_end(batch, elem, data);
+}
+
+// Replace the port in register 1 by the sandbox address it maps to; no element, no match
+static void nft_put_map_lookup(NlBatch *batch) {
+    size_t data;
+    size_t elem = nft_expr_begin(batch, "lookup", &data);
+
+    nl_put_str(batch, NFTA_LOOKUP_SET, NAT_MAP);
+    nl_put_u32(batch, NFTA_LOOKUP_SET_ID, NAT_MAP_ID);
+    nl_put_u32(batch, NFTA_LOOKUP_SREG, NFT_REG_1);
+    nl_put_u32(batch, NFTA_LOOKUP_DREG, NFT_REG_1);
+    nft_expr_end(batch, elem, data);
+}
+
+// Rewrite the destination address to register 1, keeping the port
+static void nft_put_dnat(NlBatch *batch) {
+    size_t data;
+    size_t elem = nft_expr_begin(batch, "nat", &data);
+
+    nl_put_u32(batch, NFTA_NAT_TYPE, NFT_NAT_DNAT);
+    nl_put_u32(batch, NFTA_NAT_FAMILY, NFPROTO_IPV4);
+    nl_put_u32(batch, NFTA_NAT_REG_ADDR_MIN, NFT_REG_1);
+    nft_expr_end(batch, elem, data);
+}
+
+// Open the nfnetlink socket and (re)create the table in one transaction. A table left
+// behind by an earlier sdeamon is dropped with the sandboxes it forwarded to.
+int nat_init(const char *vm_ip) {
+    struct sockaddr_nl local = { .nl_family = AF_NETLINK };
+    struct in_addr daddr;
+    uint8_t udp = IPPROTO_UDP;
+    NlBatch batch;
+    size_t nest;
+
+    if (vm_ip == NULL || inet_pton(AF_INET, vm_ip, &daddr) != 1) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    nat_sock = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_NETFILTER);
+    if (nat_sock < 0) {
+        return -1;
+    }
+    if (bind(nat_sock, (struct sockaddr *)&local, sizeof(local)) == -1) {
+        close(nat_sock);
+        nat_sock = -1;
+        return -1;
+    }
+
+    nat_batch_begin(&batch);
+
+    // add + delete + add empties the table whether or not it existed
+    nft_msg(&batch, NFT_MSG_NEWTABLE, NLM_F_CREATE);
+    nl_put_str(&batch, NFTA_TABLE_NAME, NAT_TABLE);
+    nft_msg(&batch, NFT_MSG_DELTABLE, 0);
+    nl_put_str(&batch, NFTA_TABLE_NAME, NAT_TABLE);
+    nft_msg(&batch, NFT_MSG_NEWTABLE, NLM_F_CREATE);
+    nl_put_str(&batch, NFTA_TABLE_NAME, NAT_TABLE);
+
+    nft_msg(&batch, NFT_MSG_NEWSET, NLM_F_CREATE);
+    nl_put_str(&batch, NFTA_SET_TABLE, NAT_TABLE);
+    nl_put_str(&batch, NFTA_SET_NAME, NAT_MAP);
+    nl_put_u32(&batch, NFTA_SET_ID, NAT_MAP_ID);
+    nl_put_u32(&batch, NFTA_SET_FLAGS, NFT_SET_MAP);
+    nl_put_u32(&batch, NFTA_SET_KEY_TYPE, NFT_TYPE_INET_SERVICE);
+    nl_put_u32(&batch, NFTA_SET_KEY_LEN, sizeof(uint16_t));
+    nl_put_u32(&batch, NFTA_SET_DATA_TYPE, NFT_TYPE_IPADDR);
+    nl_put_u32(&batch, NFTA_SET_DATA_LEN, sizeof(struct in_addr));
+
+    nft_msg(&batch, NFT_MSG_NEWCHAIN, NLM_F_CREATE);
+    nl_put_str(&batch, NFTA_CHAIN_TABLE, NAT_TABLE);
+    nl_put_str(&batch, NFTA_CHAIN_NAME, NAT_CHAIN);
+    nl_put_str(&batch, NFTA_CHAIN_TYPE, "nat");
+    nest = nl_nest_begin(&batch, NLA_F_NESTED | NFTA_CHAIN_HOOK);
+    nl_put_u32(&batch, NFTA_HOOK_HOOKNUM, NF_INET_PRE_ROUTING);
+    nl_put_u32(&batch, NFTA_HOOK_PRIORITY, (uint32_t)-100);
+    nl_nest_end(&batch, nest);
+
+    nft_msg(&batch, NFT_MSG_NEWRULE, NLM_F_CREATE | NLM_F_APPEND);
+    nl_put_str(&batch, NFTA_RULE_TABLE, NAT_TABLE);
+    nl_put_str(&batch, NFTA_RULE_CHAIN, NAT_CHAIN);
+    nest = nl_nest_begin(&batch, NLA_F_NESTED | NFTA_RULE_EXPRESSIONS);
+    nft_put_payload(&batch, NFT_PAYLOAD_NETWORK_HEADER, 16, sizeof(struct in_addr));   // ip daddr
+    nft_put_cmp_eq(&batch, &daddr, sizeof(daddr));
+    nft_put_meta(&batch, NFT_META_L4PROTO);
+    nft_put_cmp_eq(&batch, &udp, sizeof(udp));
+    nft_put_payload(&batch, NFT_PAYLOAD_TRANSPORT_HEADER, 2, sizeof(uint16_t));       // udp dport
+    nft_put_map_lookup(&batch);
+    nft_put_dnat(&batch);
+    nl_nest_end(&batch, nest);
+
+    return nat_batch_commit(&batch);
+}
+
+int nat_fd(void) {
+    return nat_sock;
+}
+
+void nat_batch_begin(NlBatch *batch) {
+    nl_batch_init(batch);
+    nft_batch_marker(batch, NFNL_MSG_BATCH_BEGIN);
+}
+
+static int nat_map_element(NlBatch *batch, int type, int flags, int port, const char *sandbox_ip) {
+    uint16_t key = htons(port);
+    struct in_addr addr;
+    size_t elements, elem;
+
+    if (sandbox_ip != NULL && inet_pton(AF_INET, sandbox_ip, &addr) != 1) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (nft_msg(batch, type, flags) == NULL) {
+        return -1;
+    }
+    nl_put_str(batch, NFTA_SET_ELEM_LIST_TABLE, NAT_TABLE);
+    nl_put_str(batch, NFTA_SET_ELEM_LIST_SET, NAT_MAP);
+    elements = nl_nest_begin(batch, NLA_F_NESTED | NFTA_SET_ELEM_LIST_ELEMENTS);
+    elem = nl_nest_begin(batch, NLA_F_NESTED | NFTA_LIST_ELEM);
+    nft_put_data(batch, NFTA_SET_ELEM_KEY, &key, sizeof(key));
+    if (sandbox_ip != NULL) {
+        nft_put_data(batch, NFTA_SET_ELEM_DATA, &addr, sizeof(addr));
+    }
+    nl_nest_end(batch, elem);
+    nl_nest_end(batch, elements);
+    return 0;
+}
+
+// Forward UDP port of the VM address to the same port of sandbox_ip
+int nat_map_add(NlBatch *batch, int port, const char *sandbox_ip) {
+    return nat_map_element(batch, NFT_MSG_NEWSETELEM, NLM_F_CREATE, port, sandbox_ip);
+}
+
+int nat_map_del(NlBatch *batch, int port) {
+    return nat_map_element(batch, NFT_MSG_DELSETELEM, 0, port, NULL);
+}
+
+// Apply every change of the batch atomically: if one fails, none is applied.
+// Returns 0 on success, otherwise -1 with errno from the first failure.
+int nat_batch_commit(NlBatch *batch) {
+    if (batch->count == 0) {
+        nl_batch_init(batch);
+        return 0;
+    }
+    nft_batch_marker(batch, NFNL_MSG_BATCH_END);
+    return nl_batch_send(nat_sock, batch);
+}
@@ -0,0 +1,13 @@
+#ifndef NAT_H
+#define NAT_H
+
+#include "../jailor/jailor.h"
+
+int nat_init(const char *vm_ip);
+int nat_fd(void);
+void nat_batch_begin(NlBatch *batch);
+int nat_map_add(NlBatch *batch, int port, const char *sandbox_ip);
+int nat_map_del(NlBatch *batch, int port);
+int nat_batch_commit(NlBatch *batch);
+
+#endif
@@ -1,9 +1,15 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>           // for fork, exec
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/socket.h>       // for sockets
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/syscall.h>      // for pidfd_open
 #include <netinet/in.h>       // for sockaddr_in
 #include <arpa/inet.h>        // for inet_ntoa
 #include <errno.h>
@@ -13,10 +19,48 @@
 #include <libconfig.h>
 #include <net/if.h>
 #include <sys/ioctl.h>
+#include <time.h>
+
+#include "../configer/configer.h"
+#include "../jailor/jailor.h"
+#include "nat.h"
+#include "migrate.h"
 
 #define PORT 5005
-#define BACKLOG 10  // Number of allowed pending connections
+#define BACKLOG 128  // Number of allowed pending connections
+#define MAX_EVENTS 64
+#define STOP_GRACE_MS 5000  // How long stop waits after SIGTERM before it sends SIGKILL
+#define NAT_BATCH_MAX 32    // NAT map changes per nftables transaction
 #define INTERFACE_NAME "ens33"
+#define JAILOR_POOL_SOCKET "/run/jailor_pool.sock"  // Served by `jailor --pool`, optional
+#define SPAN_LOG_PATH "/run/jailor_spans.jsonl"     // Startup phase timings of sdeamon and jailor
+#define CONFIG_DIR "/home/simurgan/Workspace/comicran/config"  // Base configs and the closure cache
+
+// What a ready file descriptor in the event loop belongs to
+enum WatchKind {
+    WATCH_LISTEN,    // Listening socket: accept connections
+    WATCH_CLIENT,    // Client socket: read the request
+    WATCH_STATUS,    // Status pipe of a starting jailor child: configer finished
+    WATCH_JAILOR,    // pidfd of a jailor child: the sandbox exited
+    WATCH_DEADLINE,  // timerfd of a stop: the grace period is over
+    WATCH_MIGRATION  // pidfd of a migration child: the sandbox moved, or did not
+};
+
+// Stored as the epoll data of every watched file descriptor
+struct Watch {
+    enum WatchKind kind;
+    void *owner;     // struct Request or struct ProgramData, NULL for the listening socket
+    int dead;        // The owner finished earlier in the current batch of events
+};
+
+enum ProgramState {
+    PROGRAM_STARTING,   // Start pipeline still running
+    PROGRAM_RUNNING,
+    PROGRAM_EXITED,     // The sandbox exited on its own; stop removes its rules
+    PROGRAM_STOPPING,   // SIGTERM sent, waiting for the jailor child to exit
+    PROGRAM_FAILED,     // Start failed, dropped once the jailor child is reaped
+    PROGRAM_MIGRATING   // Being checkpointed into another sdeamon
+};
 
 // Data structure to store program information
 struct ProgramData {
@@ -24,40 +68,133 @@ struct ProgramData {
     char root_process_arg[256];  // Assuming single argument
     char veth_host_ip[64];
     char veth_sandbox_ip[64];
+    int port;                    // UDP port forwarded from the VM address to the sandbox
+    int forwarded;               // port is in the NAT map
     pid_t child_pid;             // Child process ID
+    int pidfd;                   // pidfd of the child, -1 once it has been reaped
+    enum ProgramState state;
+    unsigned long long started_ns;   // When the child was forked
+    unsigned long long exited_ns;    // When it was reaped, 0 while it runs
+    char exit_reason[64];            // How it exited, empty while it runs
+    struct Request *stop_request; // stop request waiting for the child to exit
+    struct Watch watch;
     struct ProgramData *next;
 };
 
+// Step of its pipeline a request is waiting for
+enum RequestState {
+    REQUEST_READING,    // The request line
+    REQUEST_CONFIGER,   // start: the jailor child building the manifest; receive: restoring the sandbox
+    REQUEST_MIGRATING,  // migrate: the migration child moving the sandbox
+    REQUEST_NAT,        // Its NAT map change, applied with the others of this loop iteration
+    REQUEST_STOPPING    // stop: the jailor child exiting
+};
+
+// One client connection and the pipeline it runs. Nothing in a pipeline blocks: every
+// step forks a child or is batched, and the request waits for it in the event loop.
+struct Request {
+    int fd;
+    enum RequestState state;
+    char command[16];
+    char program_id[256];
+    struct ProgramData *program;
+    unsigned long long request_ns;
+    unsigned long long phase_ns;   // Start of the current phase
+    int status_fd;                 // Read end of the configer status pipe, -1 if none
+    int deadline_fd;               // stop: timerfd armed with the SIGTERM grace period, -1 if none
+    int escalated;                 // stop: SIGKILL was needed
+    char dest[256];                // migrate: "<host>[:<port>]" of the destination sdeamon
+    enum MigrateMode mode;         // migrate: how memory is moved
+    int migration_pidfd;           // migrate: pidfd of the migration child, -1 once it has been reaped
+    char report[512];              // migrate: mode, rounds, bytes, downtime and page faults, for the response
+    struct Watch client_watch;
+    struct Watch status_watch;
+    struct Watch deadline_watch;
+    struct Request *nat_next;      // Next request waiting for a NAT map change
+    struct Request *next;
+};
+
 struct ProgramData *program_list = NULL;  // Linked list head
+struct Request *request_list = NULL;      // Connections being served
+struct Request *finished_list = NULL;     // Finished in the current batch of events, freed after it
+struct Request *nat_waiting = NULL;       // Requests waiting for their NAT map change, in order
+struct Request **nat_waiting_tail = &nat_waiting;
+int epoll_fd = -1;
+int listen_fd = -1;
+char *vm_ip = NULL;
+
+// Durations of one startup phase collected from the span log
+struct PhaseStats {
+    char phase[64];
+    unsigned long long *durations;
+    int count;
+    int capacity;
+};
 
 // Function prototypes
 void add_program(struct ProgramData *program);
 struct ProgramData *find_program(const char *program_id);
 void remove_program(const char *program_id);
-void sigchld_handler(int s);
-int parse_config_file(const char *config_path, struct ProgramData *program);
-void check_error(int ret, const char *msg);
+void watch_fd(int fd, struct Watch *watch, enum WatchKind kind, void *owner);
+void unwatch_fd(int fd);
+int pidfd_open_pid(pid_t pid);
+int pidfd_send(int pidfd, int sig);
+int reap_child(int pidfd, siginfo_t *info);
+void describe_exit(const siginfo_t *info, char *buf, size_t size);
+void accept_connections(void);
+void read_request(struct Request *request);
+void finish_request(struct Request *request, const char *response);
+void free_finished_requests(void);
+void start_program(struct Request *request);
+void handle_configer_status(struct Request *request);
+void stop_program(struct Request *request);
+void arm_stop_deadline(struct Request *request);
+void migrate_program(struct Request *request);
+void handle_migration_status(struct Request *request);
+void queue_nat_change(struct Request *request);
+void put_nat_change(NlBatch *batch, struct Request *request);
+void flush_nat_changes(void);
+void complete_nat_change(struct Request *request, int applied);
+void handle_jailor_exit(struct ProgramData *program);
+void handle_stop_deadline(struct Request *request);
+void send_status(int fd);
+void close_loop_fds(struct Request *keep);
+int parse_config_file(const config_t *cfg, struct ProgramData *program);
 char* get_ip_address(const char *interface);
+unsigned long long monotonic_nsec(void);
+void record_span(const char *program_id, const char *phase, unsigned long long start_ns);
+int compare_durations(const void *a, const void *b);
+unsigned long long percentile(const struct PhaseStats *stats, int p);
+void send_stats(int fd);
 
 int main() {
-    int sockfd, new_fd;
-    struct sockaddr_in my_addr, their_addr;
-    socklen_t sin_size;
-    struct sigaction sa;
+    struct sockaddr_in my_addr;
+    struct epoll_event events[MAX_EVENTS];
+    struct Watch listen_watch;
     int yes = 1;
-    char buf[1024];
-    int numbytes;
 
-    char *vm_ip = get_ip_address(INTERFACE_NAME);
+    vm_ip = get_ip_address(INTERFACE_NAME);
+
+    // Port forwarding to sandboxes is one nftables map, owned by sdeamon
+    if (nat_init(vm_ip) != 0) {
+        perror("nat_init");
+        exit(1);
+    }
+    // Forwarded packets only need to pass a FORWARD chain with a drop policy; one rule covers every sandbox
+    check_error(system("iptables -C FORWARD -p udp -m conntrack --ctstate DNAT -j ACCEPT 2>/dev/null || "
+                       "iptables -I FORWARD -p udp -m conntrack --ctstate DNAT -j ACCEPT"), "iptables FORWARD");
+
+    // Jailor inherits this and appends its own phases next to ours
+    setenv(SPAN_LOG_ENV, SPAN_LOG_PATH, 1);
 
     // Create socket
-    if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+    if ((listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1) {
         perror("socket");
         exit(1);
     }
 
     // Reuse address
-    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1) {
+    if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1) {
         perror("setsockopt");
         exit(1);
     }
@@ -68,166 +205,68 @@ int main() {
     my_addr.sin_addr.s_addr = INADDR_ANY;
     memset(&(my_addr.sin_zero), '\0', 8);
 
-    if (bind(sockfd, (struct sockaddr *)&my_addr, sizeof(struct sockaddr)) == -1) {
+    if (bind(listen_fd, (struct sockaddr *)&my_addr, sizeof(struct sockaddr)) == -1) {
         perror("bind");
         exit(1);
     }
 
     // Listen
-    if (listen(sockfd, BACKLOG) == -1) {
+    if (listen(listen_fd, BACKLOG) == -1) {
         perror("listen");
         exit(1);
     }
 
-    // Handle dead processes
-    sa.sa_handler = sigchld_handler;
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = SA_RESTART;
+    // Children are reaped through their pidfds, and a client that goes away must not kill us
+    signal(SIGPIPE, SIG_IGN);
 
-    if (sigaction(SIGCHLD, &sa, NULL) == -1) {
-        perror("sigaction");
+    if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        perror("epoll_create1");
         exit(1);
     }
+    watch_fd(listen_fd, &listen_watch, WATCH_LISTEN, NULL);
 
     printf("sdeamon: waiting for connections on port %d...\n", PORT);
 
-    // Main loop
+    // Main loop: every request advances one step per event, so a slow start never holds up others
     while (1) {
-        sin_size = sizeof(struct sockaddr_in);
-        if ((new_fd = accept(sockfd, (struct sockaddr *)&their_addr, &sin_size)) == -1) {
-            perror("accept");
-            continue;
+        int ready = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        if (ready == -1) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            exit(1);
         }
-        printf("sdeamon: got connection from %s\n", inet_ntoa(their_addr.sin_addr));
 
-        // Receive data
-        memset(buf, 0, sizeof(buf));
-        if ((numbytes = recv(new_fd, buf, sizeof(buf) - 1, 0)) == -1) {
-            perror("recv");
-            close(new_fd);
-            continue;
-        }
-        buf[numbytes] = '\0';
+        for (int i = 0; i < ready; i++) {
+            struct Watch *watch = events[i].data.ptr;
 
-        printf("Received: %s\n", buf);
+            // Closing an fd does not take back the events epoll_wait already returned for it
+            if (watch->dead) continue;
 
-        // Parse request
-        char *command = strtok(buf, " \n");
-        char *program_id = strtok(NULL, " \n");
-
-        if (command == NULL || program_id == NULL) {
-            char *response = "error: invalid request format\n";
-            send(new_fd, response, strlen(response), 0);
-            close(new_fd);
-            continue;
-        }
-
-        if (strcmp(command, "start") == 0) {
-            // Start command
-            char config_path[512];
-            snprintf(config_path, sizeof(config_path), "/home/simurgan/Workspace/comicran/config/base_config_%s.cfg", program_id);
-            struct ProgramData *program = (struct ProgramData *)malloc(sizeof(struct ProgramData));
-            memset(program, 0, sizeof(struct ProgramData));
-            strcpy(program->program_id, program_id);
-
-            if (parse_config_file(config_path, program) != 0) {
-                char response[512];
-                snprintf(response, sizeof(response), "error: no base_config_%s.cfg found\n", program_id);
-                send(new_fd, response, strlen(response), 0);
-                free(program);
-                close(new_fd);
-                continue;
-            }
-
-            // Fork and execute /configer/configer
-            pid_t pid = fork();
-            if (pid < 0) {
-                perror("fork");
-                free(program);
-                close(new_fd);
-                continue;
-            } else if (pid == 0) {
-                // Child process
-                char full_config_path[512];
-                snprintf(full_config_path, sizeof(full_config_path), "/home/simurgan/Workspace/comicran/config/full_config_%s.cfg", program_id);
-                char *args[] = {"/home/simurgan/Workspace/comicran/configer/configer", config_path, full_config_path, NULL};
-                execv("/home/simurgan/Workspace/comicran/configer/configer", args);
-                perror("execv");
-                exit(1);
-            } else {
-                // Parent process
-                int status;
-                waitpid(pid, &status, 0);
-
-                // Fork and execute /jailor/jailor
-                pid_t pid2 = fork();
-                if (pid2 < 0) {
-                    perror("fork");
-                    free(program);
-                    close(new_fd);
-                    continue;
-                } else if (pid2 == 0) {
-                    // Child process
-                    char full_config_path[512];
-                    snprintf(full_config_path, sizeof(full_config_path), "/home/simurgan/Workspace/comicran/config/full_config_%s.cfg", program_id);
-                    char *args[] = {"/home/simurgan/Workspace/comicran/jailor/jailor", full_config_path, NULL};
-                    execv("/home/simurgan/Workspace/comicran/jailor/jailor", args);
-                    perror("execv");
-                    exit(1);
-                } else {
-                    // Parent process
-                    char cmd[1024];
-                    snprintf(cmd, sizeof(cmd), "iptables -t nat -A PREROUTING -p udp -d %s --dport %s -j DNAT --to-destination %s:%s", vm_ip, program->root_process_arg, program->veth_sandbox_ip, program->root_process_arg);
-                    check_error(system(cmd), cmd);
-
-                    snprintf(cmd, sizeof(cmd), "iptables -A FORWARD -p udp -d %s --dport %s -j ACCEPT", program->veth_sandbox_ip, program->root_process_arg);
-                    check_error(system(cmd), cmd);
-
-                    program->child_pid = pid2;
-                    add_program(program);
-
-                    // Respond to request
-                    char response[512];
-                    snprintf(response, sizeof(response), "success: the program%s has run\n", program_id);
-                    send(new_fd, response, strlen(response), 0);
-                }
+            switch (watch->kind) {
+            case WATCH_LISTEN:
+                accept_connections();
+                break;
+            case WATCH_CLIENT:
+                read_request(watch->owner);
+                break;
+            case WATCH_STATUS:
+                handle_configer_status(watch->owner);
+                break;
+            case WATCH_JAILOR:
+                handle_jailor_exit(watch->owner);
+                break;
+            case WATCH_DEADLINE:
+                handle_stop_deadline(watch->owner);
+                break;
+            case WATCH_MIGRATION:
+                handle_migration_status(watch->owner);
+                break;
             }
-        } else if (strcmp(command, "stop") == 0) {
-            // Stop command
-            struct ProgramData *program = find_program(program_id);
-            if (program == NULL) {
-                char response[512];
-                snprintf(response, sizeof(response), "error: program%s not found\n", program_id);
-                send(new_fd, response, strlen(response), 0);
-                close(new_fd);
-                continue;
-            }
-
-            kill(program->child_pid, SIGTERM);
-
-            // Wait for the child process to finish
-            waitpid(program->child_pid, NULL, 0);
-
-            char cmd[1024];
-            snprintf(cmd, sizeof(cmd), "iptables -t nat -D PREROUTING -p udp -d %s --dport %s -j DNAT --to-destination %s:%s", vm_ip, program->root_process_arg, program->veth_sandbox_ip, program->root_process_arg);
-            check_error(system(cmd), cmd);
-
-            snprintf(cmd, sizeof(cmd), "iptables -D FORWARD -p udp -d %s --dport %s -j ACCEPT", program->veth_sandbox_ip, program->root_process_arg);
-            check_error(system(cmd), cmd);
-
-            // Respond to request
-            char response[512];
-            snprintf(response, sizeof(response), "success: program%s terminated\n", program_id);
-            send(new_fd, response, strlen(response), 0);
-
-            // Remove program from list
-            remove_program(program_id);
-        } else {
-            char *response = "error: invalid command\n";
-            send(new_fd, response, strlen(response), 0);
         }
 
-        close(new_fd);
+        // NAT map changes of every request that got that far in this iteration go in one transaction
+        flush_nat_changes();
+        free_finished_requests();
     }
 
     return 0;
@@ -265,33 +304,721 @@ void remove_program(const char *program_id) {
     }
 }
 
-// Signal handler to reap zombie processes
-void sigchld_handler(int s) {
-    while (waitpid(-1, NULL, WNOHANG) > 0);
+// Register fd with the event loop; watch must live until fd is closed
+void watch_fd(int fd, struct Watch *watch, enum WatchKind kind, void *owner) {
+    struct epoll_event event;
+
+    watch->kind = kind;
+    watch->owner = owner;
+    watch->dead = 0;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = watch;
+    check_error(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event), "epoll_ctl");
 }
 
-// Parse the configuration file
-int parse_config_file(const char *config_path, struct ProgramData *program) {
-    config_t cfg;
-    config_setting_t *setting;
-    const char *str;
-    int result = 0;
+// Stop watching fd and close it. A child forked since holds a copy of it until it closes
+// its loop fds, and epoll reports an fd until every copy is gone, so it is removed first.
+void unwatch_fd(int fd) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    close(fd);
+}
+
+int pidfd_open_pid(pid_t pid) {
+    return syscall(SYS_pidfd_open, pid, 0);
+}
+
+// Signal a child through its pidfd, which cannot hit a recycled pid
+int pidfd_send(int pidfd, int sig) {
+    return syscall(SYS_pidfd_send_signal, pidfd, sig, NULL, 0);
+}
+
+// Reap the exited child behind pidfd and close the pidfd
+int reap_child(int pidfd, siginfo_t *info) {
+    int ret;
+
+    memset(info, 0, sizeof(*info));
+    do {
+        ret = waitid(P_PIDFD, pidfd, info, WEXITED);
+    } while (ret == -1 && errno == EINTR);
+    if (ret == -1) perror("waitid");
+    unwatch_fd(pidfd);
+    return ret;
+}
+
+// Exit status or fatal signal of a reaped child, as shown to clients
+void describe_exit(const siginfo_t *info, char *buf, size_t size) {
+    if (info->si_code == CLD_EXITED) {
+        snprintf(buf, size, "exited with status %d", info->si_status);
+    } else if (info->si_code == CLD_KILLED || info->si_code == CLD_DUMPED) {
+        snprintf(buf, size, "killed by signal %d (%s)%s", info->si_status, strsignal(info->si_status),
+                 info->si_code == CLD_DUMPED ? ", core dumped" : "");
+    } else {
+        snprintf(buf, size, "unknown");
+    }
+}
+
+// Accept every pending connection and wait for its request line
+void accept_connections(void) {
+    struct sockaddr_in their_addr;
+    socklen_t sin_size = sizeof(struct sockaddr_in);
+    int fd;
+
+    while ((fd = accept4(listen_fd, (struct sockaddr *)&their_addr, &sin_size, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+        struct Request *request = calloc(1, sizeof(struct Request));
+        if (request == NULL) {
+            perror("calloc");
+            close(fd);
+            break;
+        }
+        printf("sdeamon: got connection from %s\n", inet_ntoa(their_addr.sin_addr));
+
+        request->fd = fd;
+        request->state = REQUEST_READING;
+        request->status_fd = -1;
+        request->deadline_fd = -1;
+        request->migration_pidfd = -1;
+        request->next = request_list;
+        request_list = request;
+        watch_fd(fd, &request->client_watch, WATCH_CLIENT, request);
+        sin_size = sizeof(struct sockaddr_in);
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        perror("accept");
+    }
+}
+
+// Receive the request line and start the pipeline of its command
+void read_request(struct Request *request) {
+    char buf[1024];
+    ssize_t numbytes = recv(request->fd, buf, sizeof(buf) - 1, 0);
+
+    if (numbytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return;
+    }
+    if (numbytes <= 0) {
+        if (numbytes == -1) perror("recv");
+        finish_request(request, NULL);
+        return;
+    }
+    buf[numbytes] = '\0';
+
+    printf("Received: %s\n", buf);
+
+    // The rest of the pipeline is driven by child processes, not by the client
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, request->fd, NULL);
+
+    // Parse request
+    request->request_ns = monotonic_nsec();
+    char *command = strtok(buf, " \n");
+    char *program_id = strtok(NULL, " \n");
+    char *dest = strtok(NULL, " \n");
+    char *mode = strtok(NULL, " \n");
+
+    // stats takes no program id: report p50/p99 of every startup phase
+    if (command != NULL && strcmp(command, "stats") == 0) {
+        send_stats(request->fd);
+        finish_request(request, NULL);
+        return;
+    }
+
+    // status takes no program id either: report state, uptime and exit reason of every sandbox
+    if (command != NULL && strcmp(command, "status") == 0) {
+        send_status(request->fd);
+        finish_request(request, NULL);
+        return;
+    }
+
+    if (command == NULL || program_id == NULL) {
+        finish_request(request, "error: invalid request format\n");
+        return;
+    }
+    snprintf(request->command, sizeof(request->command), "%s", command);
+    snprintf(request->program_id, sizeof(request->program_id), "%s", program_id);
+
+    if (strcmp(command, "start") == 0 || strcmp(command, "receive") == 0) {
+        start_program(request);
+    } else if (strcmp(command, "stop") == 0) {
+        stop_program(request);
+    } else if (strcmp(command, "migrate") == 0 && dest != NULL) {
+        // Pre-copy unless the client picks post-copy, or auto to let the dirty rate decide
+        snprintf(request->dest, sizeof(request->dest), "%s", dest);
+        if (mode == NULL || strcmp(mode, "precopy") == 0) {
+            request->mode = MIGRATE_PRECOPY;
+        } else if (strcmp(mode, "postcopy") == 0) {
+            request->mode = MIGRATE_POSTCOPY;
+        } else if (strcmp(mode, "auto") == 0) {
+            request->mode = MIGRATE_AUTO;
+        } else {
+            finish_request(request, "error: migration mode must be precopy, postcopy or auto\n");
+            return;
+        }
+        migrate_program(request);
+    } else {
+        finish_request(request, "error: invalid command\n");
+    }
+}
+
+// Send the response, if any, and forget the request. Its watches may still be in the batch
+// of events being handled, so it is only freed once the batch is done.
+void finish_request(struct Request *request, const char *response) {
+    struct Request **curr = &request_list;
+
+    if (response != NULL) {
+        send(request->fd, response, strlen(response), MSG_NOSIGNAL);
+    }
+    unwatch_fd(request->fd);
+
+    while (*curr != NULL && *curr != request) {
+        curr = &((*curr)->next);
+    }
+    if (*curr != NULL) {
+        *curr = request->next;
+    }
+    request->client_watch.dead = 1;
+    request->status_watch.dead = 1;
+    request->deadline_watch.dead = 1;
+    request->next = finished_list;
+    finished_list = request;
+}
+
+void free_finished_requests(void) {
+    while (finished_list != NULL) {
+        struct Request *request = finished_list;
+
+        finished_list = request->next;
+        free(request);
+    }
+}
+
+// Start command: fork the jailor child, which builds the manifest in-process and reports
+// over a pipe before it runs the sandbox. receive, sent by a migrating sdeamon, does the
+// same with a sandbox restored from the images that follow on the connection.
+void start_program(struct Request *request) {
+    const char *program_id = request->program_id;
+    char config_path[512];
+    char response[512];
+    int status_pipe[2];
+
+    if (find_program(program_id) != NULL) {
+        snprintf(response, sizeof(response), "error: program%s is already running\n", program_id);
+        finish_request(request, response);
+        return;
+    }
+
+    snprintf(config_path, sizeof(config_path), CONFIG_DIR "/base_config_%s.cfg", program_id);
+    struct ProgramData *program = (struct ProgramData *)malloc(sizeof(struct ProgramData));
+    memset(program, 0, sizeof(struct ProgramData));
+    strcpy(program->program_id, program_id);
 
-    // Initialize the configuration
+    config_t cfg;
     config_init(&cfg);
+    int parsed = config_read_file(&cfg, config_path);
+    if (!parsed) {
+        fprintf(stderr, "Error reading config file %s:%d - %s\n", config_error_file(&cfg),
+                config_error_line(&cfg), config_error_text(&cfg));
+    }
+    if (!parsed || parse_config_file(&cfg, program) != 0) {
+        snprintf(response, sizeof(response), "error: no base_config_%s.cfg found\n", program_id);
+        config_destroy(&cfg);
+        free(program);
+        finish_request(request, response);
+        return;
+    }
+    // Ports are the keys of the NAT map, so two sandboxes cannot share one
+    program->port = atoi(program->root_process_arg);
+    struct ProgramData *owner = program_list;
+    while (owner != NULL && owner->port != program->port) {
+        owner = owner->next;
+    }
+    if (program->port <= 0 || program->port > 65535 || owner != NULL) {
+        if (owner != NULL) {
+            snprintf(response, sizeof(response), "error: port %d is already forwarded to program%s\n",
+                     program->port, owner->program_id);
+        } else {
+            snprintf(response, sizeof(response), "error: invalid port %s in base_config_%s.cfg\n",
+                     program->root_process_arg, program_id);
+        }
+        config_destroy(&cfg);
+        free(program);
+        finish_request(request, response);
+        return;
+    }
+
+    if (pipe2(status_pipe, O_CLOEXEC) == -1) {
+        perror("pipe2");
+        config_destroy(&cfg);
+        free(program);
+        finish_request(request, "error: out of resources\n");
+        return;
+    }
 
-    // Read the file
-    if (!config_read_file(&cfg, config_path)) {
-        fprintf(stderr, "Error reading config file %s:%d - %s\n",
-                config_error_file(&cfg),
-                config_error_line(&cfg),
-                config_error_text(&cfg));
+    // Fork once; the child is the jailor of this sandbox
+    request->phase_ns = monotonic_nsec();
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        close(status_pipe[0]);
+        close(status_pipe[1]);
         config_destroy(&cfg);
-        return -1;
+        free(program);
+        finish_request(request, "error: out of resources\n");
+        return;
+    } else if (pid == 0) {
+        // Child process. Configer runs here: the full config goes to jailor as an in-memory manifest
+        unsigned char *manifest;
+        size_t manifest_size;
+        char built;
+
+        int restore = strcmp(request->command, "receive") == 0;
+
+        close_loop_fds(restore ? request : NULL);
+        close(status_pipe[0]);
+        if (restore) {
+            char images_dir[PATH_MAX];
+            int page_port;
+
+            // The manifest is built before the source starts dumping, so it is not part of the downtime.
+            // The connection is ours until the images are in; sdeamon answers on it once we report.
+            if (configer_build_manifest(&cfg, CONFIG_DIR, &manifest, &manifest_size) != 0) {
+                exit(EXIT_FAILURE);
+            }
+            config_destroy(&cfg);
+            record_span(program_id, "configer", request->phase_ns);
+            fcntl(request->fd, F_SETFL, 0);
+            if (receive_images(request->fd, program_id, images_dir, sizeof(images_dir), &page_port) != 0) {
+                exit(EXIT_FAILURE);
+            }
+            record_span(program_id, "receive", request->phase_ns);
+            // Post-copy: the connection stays open for the page fault summary once all pages are in
+            if (page_port > 0) {
+                if (postcopy_start(request->fd, program_id, images_dir, page_port) != 0) {
+                    exit(EXIT_FAILURE);
+                }
+            } else {
+                close(request->fd);
+            }
+            // The status byte is sent once the sandbox runs again; its images go with the next receive
+            exit(jailor_restore_manifest(manifest, manifest_size, images_dir, page_port > 0, status_pipe[1]));
+        }
+        built = configer_build_manifest(&cfg, CONFIG_DIR, &manifest, &manifest_size) == 0;
+        config_destroy(&cfg);
+        record_span(program_id, "configer", request->phase_ns);
+        if (write(status_pipe[1], &built, 1) != 1 || !built) {
+            exit(EXIT_FAILURE);
+        }
+        close(status_pipe[1]);
+        // Jailor takes a pre-warmed sandbox from the pool if one is running
+        exit(jailor_run_manifest(manifest, manifest_size, JAILOR_POOL_SOCKET));
+    }
+
+    // Parent process. Set the group here too, in case a stop comes before the child runs.
+    setpgid(pid, pid);
+    close(status_pipe[1]);
+    config_destroy(&cfg);
+
+    program->child_pid = pid;
+    program->started_ns = request->phase_ns;
+    program->pidfd = pidfd_open_pid(pid);
+    check_error(program->pidfd, "pidfd_open");
+    program->state = PROGRAM_STARTING;
+    watch_fd(program->pidfd, &program->watch, WATCH_JAILOR, program);
+    add_program(program);
+
+    request->program = program;
+    request->status_fd = status_pipe[0];
+    request->state = REQUEST_CONFIGER;
+    watch_fd(request->status_fd, &request->status_watch, WATCH_STATUS, request);
+}
+
+// The jailor child built its manifest (or failed to): forward the port of the sandbox
+void handle_configer_status(struct Request *request) {
+    struct ProgramData *program = request->program;
+    char built = 0;
+    char response[512];
+
+    if (read(request->status_fd, &built, 1) != 1) {
+        built = 0;
+    }
+    unwatch_fd(request->status_fd);
+    request->status_fd = -1;
+
+    if (!built) {
+        if (strcmp(request->command, "receive") == 0) {
+            snprintf(response, sizeof(response), "error: restore of program%s failed\n", request->program_id);
+        } else {
+            snprintf(response, sizeof(response), "error: invalid base_config_%s.cfg\n", request->program_id);
+        }
+        finish_request(request, response);
+        if (program->pidfd == -1) {
+            remove_program(program->program_id);
+        } else {
+            program->state = PROGRAM_FAILED;
+        }
+        return;
+    }
+
+    request->phase_ns = monotonic_nsec();
+    queue_nat_change(request);
+}
+
+// Stop command: SIGTERM the jailor child, have it SIGKILL the sandbox if it is still there after
+// STOP_GRACE_MS, and remove its port forwarding once its pidfd reports the exit
+void stop_program(struct Request *request) {
+    struct ProgramData *program = find_program(request->program_id);
+    char response[512];
+
+    if (program == NULL || program->state == PROGRAM_FAILED) {
+        snprintf(response, sizeof(response), "error: program%s not found\n", request->program_id);
+        finish_request(request, response);
+        return;
+    }
+    if (program->state != PROGRAM_RUNNING && program->state != PROGRAM_EXITED) {
+        snprintf(response, sizeof(response), "error: program%s is busy\n", request->program_id);
+        finish_request(request, response);
+        return;
+    }
+
+    request->program = program;
+    request->state = REQUEST_STOPPING;
+    program->stop_request = request;
+    if (program->state == PROGRAM_EXITED) {
+        // The sandbox already exited on its own; only its port forwarding is left
+        program->state = PROGRAM_STOPPING;
+        handle_jailor_exit(program);
+        return;
+    }
+    program->state = PROGRAM_STOPPING;
+
+    check_error(pidfd_send(program->pidfd, SIGTERM), "pidfd_send_signal");
+    arm_stop_deadline(request);
+}
+
+// Give the jailor child of a stopping program STOP_GRACE_MS to exit before it is killed
+void arm_stop_deadline(struct Request *request) {
+    struct itimerspec grace;
+
+    memset(&grace, 0, sizeof(grace));
+    grace.it_value.tv_sec = STOP_GRACE_MS / 1000;
+    grace.it_value.tv_nsec = (STOP_GRACE_MS % 1000) * 1000000L;
+    request->deadline_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    check_error(request->deadline_fd, "timerfd_create");
+    check_error(timerfd_settime(request->deadline_fd, 0, &grace, NULL), "timerfd_settime");
+    watch_fd(request->deadline_fd, &request->deadline_watch, WATCH_DEADLINE, request);
+}
+
+// Migrate command: fork a migration child that pre-dumps the sandbox while it runs, freezes
+// it for the final dump and has the sdeamon at dest restore it. Post-copy skips or cuts the
+// pre-dumps short and serves the memory after the restore instead. Once the migration is
+// done, the jailor child here exits like on a stop and the port forwarding goes with it.
+void migrate_program(struct Request *request) {
+    struct ProgramData *program = find_program(request->program_id);
+    char response[512];
+    int report_pipe[2];
+
+    if (program == NULL || program->state == PROGRAM_FAILED) {
+        snprintf(response, sizeof(response), "error: program%s not found\n", request->program_id);
+        finish_request(request, response);
+        return;
+    }
+    if (program->state != PROGRAM_RUNNING) {
+        snprintf(response, sizeof(response), "error: program%s is %s\n", request->program_id,
+                 program->state == PROGRAM_EXITED ? "not running" : "busy");
+        finish_request(request, response);
+        return;
+    }
+
+    if (pipe2(report_pipe, O_CLOEXEC) == -1) {
+        perror("pipe2");
+        finish_request(request, "error: out of resources\n");
+        return;
+    }
+
+    request->phase_ns = monotonic_nsec();
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        close(report_pipe[0]);
+        close(report_pipe[1]);
+        finish_request(request, "error: out of resources\n");
+        return;
+    } else if (pid == 0) {
+        // Child process: talks to CRIU and the destination, which both block
+        struct MigrateReport report;
+        char line[1024];
+
+        close_loop_fds(NULL);
+        close(report_pipe[0]);
+        if (migrate_sandbox(request->program_id, program->child_pid, request->dest, PORT, request->mode, &report) == 0) {
+            memcpy(line, "ok ", 3);
+            migrate_report_format(&report, line + 3, sizeof(line) - 3);
+        } else {
+            snprintf(line, sizeof(line), "error %d %s", report.dumped, report.error);
+        }
+        exit(write(report_pipe[1], line, strlen(line)) > 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    close(report_pipe[1]);
+    program->state = PROGRAM_MIGRATING;
+    request->program = program;
+    request->state = REQUEST_MIGRATING;
+    // The report is read from the pipe once the child has exited; it fits in the pipe buffer
+    request->status_fd = report_pipe[0];
+    request->migration_pidfd = pidfd_open_pid(pid);
+    check_error(request->migration_pidfd, "pidfd_open");
+    watch_fd(request->migration_pidfd, &request->status_watch, WATCH_MIGRATION, request);
+}
+
+// The migration child exited. On success the sandbox runs at the destination and its jailor
+// child here exits after the teardown; a failure before the final dump leaves it running.
+void handle_migration_status(struct Request *request) {
+    struct ProgramData *program = request->program;
+    siginfo_t info;
+    char line[1024];
+    char response[1536];
+    int dumped = 0, offset = 0;
+    ssize_t n;
+
+    reap_child(request->migration_pidfd, &info);
+    request->migration_pidfd = -1;
+    // Its write end is closed now, so this returns at once with the report or nothing
+    n = read(request->status_fd, line, sizeof(line) - 1);
+    line[n > 0 ? n : 0] = '\0';
+    close(request->status_fd);
+    request->status_fd = -1;
+    record_span(request->program_id, "migrate", request->phase_ns);
+
+    if (strncmp(line, "ok ", 3) == 0) {
+        snprintf(request->report, sizeof(request->report), "%s", line + 3);
+        request->state = REQUEST_STOPPING;
+        program->state = PROGRAM_STOPPING;
+        program->stop_request = request;
+        if (program->pidfd == -1) {
+            handle_jailor_exit(program);
+        } else {
+            arm_stop_deadline(request);
+        }
+        return;
+    }
+
+    if (sscanf(line, "error %d %n", &dumped, &offset) < 1 || offset == 0) {
+        char reason[64];
+
+        describe_exit(&info, reason, sizeof(reason));
+        snprintf(line, sizeof(line), "migration child %s", reason);
+        offset = 0;
+    }
+    if (dumped) {
+        snprintf(response, sizeof(response), "error: migration of program%s failed after its final dump, "
+                 "the sandbox is gone: %s\n", request->program_id, line + offset);
+    } else {
+        snprintf(response, sizeof(response), "error: migration of program%s failed: %s\n",
+                 request->program_id, line + offset);
+    }
+    // The sandbox may have exited meanwhile; its jailor child is reaped as usual
+    program->state = program->pidfd != -1 ? PROGRAM_RUNNING : PROGRAM_EXITED;
+    finish_request(request, response);
+}
+
+// The grace period of a stop is over and the sandbox still runs: kill it. Jailor SIGKILLs
+// only its sandbox on JAILOR_KILL_SIGNAL, then reaps it and tears the rootfs and cgroup down.
+void handle_stop_deadline(struct Request *request) {
+    struct ProgramData *program = request->program;
+
+    if (request->deadline_fd == -1) {
+        return;
+    }
+    unwatch_fd(request->deadline_fd);
+    request->deadline_fd = -1;
+
+    if (program->pidfd != -1) {
+        fprintf(stderr, "sdeamon: program%s ignored SIGTERM for %d ms, sending SIGKILL\n",
+                program->program_id, STOP_GRACE_MS);
+        request->escalated = 1;
+        pidfd_send(program->pidfd, JAILOR_KILL_SIGNAL);
+    }
+}
+
+// Queue the NAT map change of a request: start and receive add its port, stop and migrate delete it
+void queue_nat_change(struct Request *request) {
+    request->state = REQUEST_NAT;
+    request->nat_next = NULL;
+    *nat_waiting_tail = request;
+    nat_waiting_tail = &request->nat_next;
+}
+
+void put_nat_change(NlBatch *batch, struct Request *request) {
+    if (strcmp(request->command, "start") == 0 || strcmp(request->command, "receive") == 0) {
+        nat_map_add(batch, request->program->port, request->program->veth_sandbox_ip);
+    } else {
+        nat_map_del(batch, request->program->port);
+    }
+}
+
+// Apply the NAT map changes of every waiting request, NAT_BATCH_MAX per transaction
+void flush_nat_changes(void) {
+    NlBatch batch;
+
+    while (nat_waiting != NULL) {
+        struct Request *chunk = nat_waiting;
+        struct Request *request, *next;
+        int count = 0;
+        int failed;
+
+        nat_batch_begin(&batch);
+        for (request = chunk; request != NULL && count < NAT_BATCH_MAX; request = request->nat_next, count++) {
+            put_nat_change(&batch, request);
+        }
+        nat_waiting = request;
+        if (nat_waiting == NULL) {
+            nat_waiting_tail = &nat_waiting;
+        }
+        failed = nat_batch_commit(&batch) != 0;
+
+        for (request = chunk; count-- > 0; request = next) {
+            int applied = !failed;
+
+            next = request->nat_next;
+            if (failed) {
+                // One bad change aborts the whole transaction: apply each on its own to find it
+                nat_batch_begin(&batch);
+                put_nat_change(&batch, request);
+                applied = nat_batch_commit(&batch) == 0;
+                if (!applied) {
+                    fprintf(stderr, "sdeamon: NAT map change for program%s (port %d): %s\n",
+                            request->program_id, request->program->port, strerror(errno));
+                }
+            }
+            complete_nat_change(request, applied);
+        }
+    }
+}
+
+// Finish a request once its NAT map change was applied or refused
+void complete_nat_change(struct Request *request, int applied) {
+    struct ProgramData *program = request->program;
+    char response[1024];
+
+    if (strcmp(request->command, "start") == 0 || strcmp(request->command, "receive") == 0) {
+        int restored = strcmp(request->command, "receive") == 0;
+
+        record_span(request->program_id, "nat", request->phase_ns);
+        // The sandbox may have exited while its port was being forwarded
+        program->state = program->pidfd != -1 ? PROGRAM_RUNNING : PROGRAM_EXITED;
+        program->forwarded = applied;
+        if (!applied) {
+            snprintf(response, sizeof(response), "error: port forwarding of program%s failed\n", request->program_id);
+        } else if (restored) {
+            snprintf(response, sizeof(response), "success: program%s restored\n", request->program_id);
+        } else {
+            snprintf(response, sizeof(response), "success: the program%s has run\n", request->program_id);
+        }
+        record_span(request->program_id, restored ? "receive_total" : "start_total", request->request_ns);
+        finish_request(request, response);
+    } else if (strcmp(request->command, "migrate") == 0) {
+        record_span(request->program_id, "migrate_total", request->request_ns);
+        snprintf(response, sizeof(response), "success: program%s migrated to %s (%s)\n",
+                 request->program_id, request->dest, request->report);
+        remove_program(request->program_id);
+        finish_request(request, response);
+    } else {
+        record_span(request->program_id, "stop_total", request->request_ns);
+        snprintf(response, sizeof(response), "success: program%s terminated (%s, stopped in %.3f ms%s)\n",
+                 request->program_id, program->exit_reason, (monotonic_nsec() - request->request_ns) / 1e6,
+                 request->escalated ? " after SIGKILL" : "");
+        remove_program(request->program_id);
+        finish_request(request, response);
+    }
+}
+
+// A jailor child exited: reap it and record why, and remove the port forwarding of its
+// sandbox if a stop waits for it
+void handle_jailor_exit(struct ProgramData *program) {
+    struct Request *request = program->stop_request;
+    siginfo_t info;
+
+    if (program->pidfd != -1) {
+        reap_child(program->pidfd, &info);
+        program->pidfd = -1;
+        program->exited_ns = monotonic_nsec();
+        describe_exit(&info, program->exit_reason, sizeof(program->exit_reason));
+        printf("sdeamon: program%s %s after %.3f s\n", program->program_id, program->exit_reason,
+               (program->exited_ns - program->started_ns) / 1e9);
+    }
+
+    if (program->state == PROGRAM_FAILED) {
+        remove_program(program->program_id);
+    } else if (program->state == PROGRAM_RUNNING) {
+        program->state = PROGRAM_EXITED;
+    } else if (program->state == PROGRAM_STOPPING && request != NULL) {
+        program->stop_request = NULL;
+        if (request->deadline_fd != -1) {
+            unwatch_fd(request->deadline_fd);
+            request->deadline_fd = -1;
+        }
+        if (program->forwarded) {
+            queue_nat_change(request);
+        } else {
+            complete_nat_change(request, 1);
+        }
+    }
+}
+
+// Send state, pid, uptime and exit reason of every sandbox to the client
+void send_status(int fd) {
+    static const char *state_names[] = { "starting", "running", "exited", "stopping", "failed", "migrating" };
+    unsigned long long now = monotonic_nsec();
+    char *response = NULL;
+    size_t response_len = 0;
+    FILE *out = open_memstream(&response, &response_len);
+
+    if (out == NULL) {
+        perror("open_memstream");
+        return;
     }
+    fprintf(out, "%-12s %-9s %8s %12s  %s\n", "program", "state", "pid", "uptime_s", "exit");
+    for (struct ProgramData *program = program_list; program != NULL; program = program->next) {
+        unsigned long long end = program->exited_ns ? program->exited_ns : now;
+        fprintf(out, "%-12s %-9s %8d %12.3f  %s\n", program->program_id, state_names[program->state],
+                (int)program->child_pid, (end - program->started_ns) / 1e9,
+                program->exit_reason[0] ? program->exit_reason : "-");
+    }
+    fclose(out);
+
+    for (size_t sent = 0; sent < response_len; ) {
+        ssize_t n = send(fd, response + sent, response_len - sent, MSG_NOSIGNAL);
+        if (n <= 0) break;
+        sent += n;
+    }
+    free(response);
+}
+
+// In a jailor or migration child: close what belongs to the event loop, so a client sees its
+// connection close when sdeamon answers rather than when this sandbox exits. keep (may be
+// NULL) is the request whose connection the child still reads.
+void close_loop_fds(struct Request *keep) {
+    close(epoll_fd);
+    close(listen_fd);
+    close(nat_fd());
+    for (struct Request *request = request_list; request != NULL; request = request->next) {
+        if (request != keep) close(request->fd);
+        if (request->status_fd != -1) close(request->status_fd);
+        if (request->deadline_fd != -1) close(request->deadline_fd);
+        if (request->migration_pidfd != -1) close(request->migration_pidfd);
+    }
+    for (struct ProgramData *program = program_list; program != NULL; program = program->next) {
+        if (program->pidfd != -1) close(program->pidfd);
+    }
+}
+
+// Extract what sdeamon itself needs from a parsed base config
+int parse_config_file(const config_t *cfg, struct ProgramData *program) {
+    config_setting_t *setting;
+    const char *str;
+    int result = 0;
 
     // Extract root_process_args
-    setting = config_lookup(&cfg, "root_process_args");
+    setting = config_lookup(cfg, "root_process_args");
     if (setting != NULL) {
         const char *arg = config_setting_get_string_elem(setting, 0);
         if (arg != NULL) {
@@ -306,7 +1033,7 @@ int parse_config_file(const char *config_path, struct ProgramData *program) {
     }
 
     // Extract veth_ip_pair.host
-    if (config_lookup_string(&cfg, "veth_ip_pair.host", &str)) {
+    if (config_lookup_string(cfg, "veth_ip_pair.host", &str)) {
         strcpy(program->veth_host_ip, str);
     } else {
         fprintf(stderr, "No 'veth_ip_pair.host' setting in configuration file.\n");
@@ -314,26 +1041,16 @@ int parse_config_file(const char *config_path, struct ProgramData *program) {
     }
 
     // Extract veth_ip_pair.sandbox
-    if (config_lookup_string(&cfg, "veth_ip_pair.sandbox", &str)) {
+    if (config_lookup_string(cfg, "veth_ip_pair.sandbox", &str)) {
         strcpy(program->veth_sandbox_ip, str);
     } else {
         fprintf(stderr, "No 'veth_ip_pair.sandbox' setting in configuration file.\n");
         result = -1;
     }
 
-    // Clean up
-    config_destroy(&cfg);
     return result;
 }
 
-// Utility function for error checking
-void check_error(int ret, const char *msg) {
-    if (ret == -1) {
-        perror(msg);
-        exit(EXIT_FAILURE);
-    }
-}
-
 char* get_ip_address(const char *interface) {
     int fd;
     struct ifreq ifr;
@@ -365,3 +1082,110 @@ char* get_ip_address(const char *interface) {
     close(fd);
     return ip_address;
 }
+
+unsigned long long monotonic_nsec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+}
+
+// Append one phase to the span log, in the same JSON line format jailor writes
+void record_span(const char *program_id, const char *phase, unsigned long long start_ns) {
+    FILE *fp = fopen(SPAN_LOG_PATH, "a");
+    if (fp == NULL) {
+        perror("fopen span log");
+        return;
+    }
+    fprintf(fp, "{\"sandbox\":%d,\"phase\":\"%s\",\"start_ns\":%llu,\"dur_ns\":%llu}\n",
+            atoi(program_id), phase, start_ns, monotonic_nsec() - start_ns);
+    fclose(fp);
+}
+
+int compare_durations(const void *a, const void *b) {
+    unsigned long long x = *(const unsigned long long *)a;
+    unsigned long long y = *(const unsigned long long *)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of sorted durations
+unsigned long long percentile(const struct PhaseStats *stats, int p) {
+    int rank = (stats->count * p + 99) / 100;
+    return stats->durations[rank > 0 ? rank - 1 : 0];
+}
+
+// Aggregate the span log per phase and send count, p50 and p99 to the client
+void send_stats(int fd) {
+    struct PhaseStats *phases = NULL;
+    int phase_count = 0;
+    char line[512];
+    char *response = NULL;
+    size_t response_len = 0;
+    FILE *out;
+    FILE *fp = fopen(SPAN_LOG_PATH, "r");
+
+    if (fp == NULL) {
+        char *msg = "error: no startup spans recorded yet\n";
+        send(fd, msg, strlen(msg), 0);
+        return;
+    }
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        int sandbox;
+        char phase[64];
+        unsigned long long start_ns, dur_ns;
+        struct PhaseStats *stats = NULL;
+
+        if (sscanf(line, "{\"sandbox\":%d,\"phase\":\"%63[^\"]\",\"start_ns\":%llu,\"dur_ns\":%llu}",
+                   &sandbox, phase, &start_ns, &dur_ns) != 4) {
+            continue;
+        }
+        for (int i = 0; i < phase_count; i++) {
+            if (strcmp(phases[i].phase, phase) == 0) {
+                stats = &phases[i];
+                break;
+            }
+        }
+        if (stats == NULL) {
+            struct PhaseStats *grown = realloc(phases, sizeof(struct PhaseStats) * (phase_count + 1));
+            if (grown == NULL) break;
+            phases = grown;
+            stats = &phases[phase_count++];
+            memset(stats, 0, sizeof(*stats));
+            strcpy(stats->phase, phase);
+        }
+        if (stats->count == stats->capacity) {
+            int capacity = stats->capacity ? stats->capacity * 2 : 64;
+            unsigned long long *grown = realloc(stats->durations, sizeof(unsigned long long) * capacity);
+            if (grown == NULL) break;
+            stats->durations = grown;
+            stats->capacity = capacity;
+        }
+        stats->durations[stats->count++] = dur_ns;
+    }
+    fclose(fp);
+
+    out = open_memstream(&response, &response_len);
+    if (out == NULL) {
+        perror("open_memstream");
+    } else {
+        fprintf(out, "%-20s %8s %12s %12s\n", "phase", "count", "p50_ms", "p99_ms");
+        for (int i = 0; i < phase_count; i++) {
+            qsort(phases[i].durations, phases[i].count, sizeof(unsigned long long), compare_durations);
+            fprintf(out, "%-20s %8d %12.3f %12.3f\n", phases[i].phase, phases[i].count,
+                    percentile(&phases[i], 50) / 1e6, percentile(&phases[i], 99) / 1e6);
+        }
+        fclose(out);
+
+        for (size_t sent = 0; sent < response_len; ) {
+            ssize_t n = send(fd, response + sent, response_len - sent, 0);
+            if (n <= 0) break;
+            sent += n;
+        }
+        free(response);
+    }
+
+    for (int i = 0; i < phase_count; i++) {
+        free(phases[i].durations);
+    }
+    free(phases);
+}